@@ -0,0 +1,749 @@
+// YCSB-style end-to-end benchmark: loads records through the full engine,
+// then runs one of the core workloads A-F against them from several
+// threads, recording per-operation latency histograms.
+//
+//   bin/bench --workload a --records 1000000 --ops 1000000 --threads 4
+//             --dist zipfian --value-size 100:1000 --json out.json
+//
+// The engine keeps its files under segments/ of the working directory, so
+// the benchmark runs inside --dir (bench-data by default) and empties its
+// segments/ first.
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/async.h"
+#include "../lib/iter.h"
+#include "../lib/lsm.h"
+
+#define ZIPF_THETA 0.99
+#define SCAN_MAX 100
+#define VALUE_POOL (1 << 20)
+
+typedef enum {
+  OP_READ,
+  OP_UPDATE,
+  OP_INSERT,
+  OP_SCAN,
+  OP_RMW,  // read-modify-write
+  OP_COUNT
+} OpType;
+
+static const char *op_names[OP_COUNT] = { "read", "update", "insert", "scan", "rmw" };
+
+typedef enum {
+  DIST_UNIFORM,
+  DIST_ZIPFIAN,
+  DIST_LATEST
+} KeyDist;
+
+static const char *dist_names[] = { "uniform", "zipfian", "latest" };
+
+// Operation mix of the YCSB core workloads, in percent.
+typedef struct {
+  char name;
+  int mix[OP_COUNT];
+  KeyDist dist;
+} Workload;
+
+static const Workload workloads[] = {
+  { 'a', { 50, 50, 0, 0, 0 }, DIST_ZIPFIAN },   // update heavy
+  { 'b', { 95, 5, 0, 0, 0 }, DIST_ZIPFIAN },    // read mostly
+  { 'c', { 100, 0, 0, 0, 0 }, DIST_ZIPFIAN },   // read only
+  { 'd', { 95, 0, 5, 0, 0 }, DIST_LATEST },     // read latest
+  { 'e', { 0, 0, 5, 95, 0 }, DIST_ZIPFIAN },    // short ranges
+  { 'f', { 50, 0, 0, 0, 50 }, DIST_ZIPFIAN },   // read-modify-write
+};
+
+typedef struct {
+  const Workload *workload;
+  KeyDist dist;
+  long records;
+  long ops;
+  int threads;
+  int value_min;
+  int value_max;
+  const char *dir;
+  const char *json;
+  LSMOptions opts;
+  int pool_entries;  // memtable nodes
+  int async_depth;   // reads in flight per thread through lsm_get_async, 0 for lsm_get
+} BenchConfig;
+
+// Latencies in the engine's own buckets, see stats_bucket.
+typedef struct {
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t n;
+  uint64_t sum;
+  uint64_t max;
+} Histogram;
+
+// Gray et al.'s generator over [0, n), item 0 the most popular.
+typedef struct {
+  long n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+  double half_pow_theta;
+} Zipf;
+
+typedef struct {
+  uint64_t ops;
+  uint64_t failed;
+  uint64_t bytes_written;  // keys and values handed to the engine
+  uint64_t bytes_read;     // keys and values handed back
+  Histogram hist[OP_COUNT];
+} ThreadStats;
+
+typedef struct {
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+} IoCounters;
+
+typedef struct {
+  double seconds;
+  uint64_t ops;
+  IoCounters io;
+  ThreadStats total;
+} PhaseResult;
+
+typedef struct {
+  const BenchConfig *cfg;
+  LSM *l;
+  Zipf *zipf;
+  const char *value_pool;
+  atomic_long *next_record;  // records inserted so far
+  long begin, end;           // load: the records this thread writes
+  long ops;
+  uint64_t rng;
+  ThreadStats stats;
+  LSMAsync *async;           // run: reads go through it when set
+} Worker;
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t next_rand(uint64_t *s) {
+  uint64_t x = *s;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *s = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+static inline double next_double(uint64_t *s) {
+  return (double)(next_rand(s) >> 11) * 0x1.0p-53;
+}
+
+// Spreads record numbers over the key space so inserts do not arrive in
+// key order and popular records do not cluster.
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDull;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline Key record_key(char *buf, long record) {
+  return key_from_long(buf, (long)(mix64((uint64_t)record) >> 1));
+}
+
+static void hist_record(Histogram *h, uint64_t ns) {
+  h->counts[stats_bucket(ns)]++;
+  h->n++;
+  h->sum += ns;
+  if (ns > h->max) h->max = ns;
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src) {
+  for (int i = 0; i < STATS_BUCKETS; i++) dst->counts[i] += src->counts[i];
+  dst->n += src->n;
+  dst->sum += src->sum;
+  if (src->max > dst->max) dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p) {
+  if (h->n == 0) return 0;
+  uint64_t rank = (uint64_t)ceil(p / 100.0 * (double)h->n);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) return stats_bucket_value(i) < h->max ? stats_bucket_value(i) : h->max;
+  }
+  return h->max;
+}
+
+static void zipf_init(Zipf *z, long n, double theta) {
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1.0 / (1.0 - theta);
+  double zeta2 = 1.0 + pow(0.5, theta);
+  z->zetan = 0;
+  for (long i = 1; i <= n; i++) z->zetan += 1.0 / pow((double)i, theta);
+  z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+  z->half_pow_theta = 1.0 + pow(0.5, theta);
+}
+
+static long zipf_next(const Zipf *z, uint64_t *rng) {
+  double u = next_double(rng);
+  double uz = u * z->zetan;
+  if (uz < 1.0) return 0;
+  if (uz < z->half_pow_theta) return 1;
+  long v = (long)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+  return v < z->n ? v : z->n - 1;
+}
+
+// A record that exists, picked by the configured distribution.
+static long pick_record(Worker *w) {
+  long inserted = atomic_load(w->next_record);
+  switch (w->cfg->dist) {
+  case DIST_UNIFORM:
+    return (long)(next_rand(&w->rng) % (uint64_t)inserted);
+  case DIST_ZIPFIAN:
+    // Scrambled so the hot records are not just the first ones loaded.
+    return (long)(mix64((uint64_t)zipf_next(w->zipf, &w->rng)) % (uint64_t)inserted);
+  case DIST_LATEST: {
+    long back = zipf_next(w->zipf, &w->rng);
+    return back < inserted ? inserted - 1 - back : 0;
+  }
+  }
+  return 0;
+}
+
+// Values are slices of a shared random pool, about as compressible as
+// YCSB's random strings.
+static const char *pick_value(Worker *w, int *length) {
+  const BenchConfig *cfg = w->cfg;
+  int span = cfg->value_max - cfg->value_min + 1;
+  *length = cfg->value_min + (int)(next_rand(&w->rng) % (uint64_t)span);
+  size_t off = next_rand(&w->rng) % (size_t)(VALUE_POOL - cfg->value_max);
+  return w->value_pool + off;
+}
+
+static bool do_write(Worker *w, long record) {
+  int length;
+  const char *value = pick_value(w, &length);
+  char key[KEY_LONG_SIZE];
+  w->stats.bytes_written += KEY_LONG_SIZE + (size_t)length;
+  return lsm_put(w->l, record_key(key, record), value, length);
+}
+
+static bool do_read(Worker *w, long record) {
+  char *value = NULL;
+  int length = 0;
+  char key[KEY_LONG_SIZE];
+  int rc = lsm_get(w->l, record_key(key, record), &value, &length);
+  if (rc == 1) {
+    w->stats.bytes_read += KEY_LONG_SIZE + (size_t)length;
+    free(value);
+  }
+  return rc == 1;
+}
+
+typedef struct {
+  Worker *w;
+  uint64_t t0;
+} AsyncRead;
+
+// Latency of an async read runs from submit to its callback.
+static void async_read_done(void *arg, Key key, int result, char *value, int length) {
+  (void)key;
+  AsyncRead *r = (AsyncRead *)arg;
+  Worker *w = r->w;
+  hist_record(&w->stats.hist[OP_READ], now_ns() - r->t0);
+  if (result == 1) {
+    w->stats.bytes_read += KEY_LONG_SIZE + (size_t)length;
+    free(value);
+  } else {
+    w->stats.failed++;
+  }
+  free(r);
+}
+
+static bool submit_read(Worker *w, long record) {
+  AsyncRead *r = malloc(sizeof(AsyncRead));
+  if (!r) return false;
+  r->w = w;
+  r->t0 = now_ns();
+  char key[KEY_LONG_SIZE];
+  if (lsm_get_async(w->async, record_key(key, record), async_read_done, r) == 0) return true;
+  free(r);
+  return false;
+}
+
+static bool do_scan(Worker *w, long record) {
+  int len = 1 + (int)(next_rand(&w->rng) % SCAN_MAX);
+  LSMIter it;
+  if (lsm_iter_init(w->l, &it) != 0) return false;
+  if (w->async) lsm_async_iter(w->async, &it);
+  char key[KEY_LONG_SIZE];
+  lsm_iter_seek(&it, record_key(key, record));
+  for (int i = 0; i < len && lsm_iter_valid(&it); i++, lsm_iter_next(&it)) {
+    int length;
+    lsm_iter_value(&it, &length);
+    w->stats.bytes_read += KEY_LONG_SIZE + (size_t)(length > 0 ? length : 0);
+  }
+  bool ok = !it.err;
+  lsm_iter_close(&it);
+  return ok;
+}
+
+static OpType pick_op(Worker *w) {
+  int r = (int)(next_rand(&w->rng) % 100);
+  for (int op = 0; op < OP_COUNT; op++) {
+    r -= w->cfg->workload->mix[op];
+    if (r < 0) return (OpType)op;
+  }
+  return OP_READ;
+}
+
+static void *load_main(void *arg) {
+  Worker *w = (Worker *)arg;
+  for (long r = w->begin; r < w->end; r++) {
+    uint64_t t0 = now_ns();
+    bool ok = do_write(w, r);
+    hist_record(&w->stats.hist[OP_INSERT], now_ns() - t0);
+    w->stats.ops++;
+    if (!ok) w->stats.failed++;
+  }
+  return NULL;
+}
+
+static void *run_main(void *arg) {
+  Worker *w = (Worker *)arg;
+  LSMAsync async;
+  if (w->cfg->async_depth > 0 && lsm_async_init(w->l, &async, w->cfg->async_depth) == 0) w->async = &async;
+  for (long i = 0; i < w->ops; i++) {
+    OpType op = pick_op(w);
+    if (op == OP_READ && w->async) {
+      // Recorded by the callback; a full queue makes submit wait.
+      w->stats.ops++;
+      if (!submit_read(w, pick_record(w))) w->stats.failed++;
+      lsm_async_poll(w->async, 0);
+      continue;
+    }
+    uint64_t t0 = now_ns();
+    bool ok;
+    switch (op) {
+    case OP_UPDATE:
+      ok = do_write(w, pick_record(w));
+      break;
+    case OP_INSERT:
+      // Counted before it lands, so a read of the newest record can miss.
+      ok = do_write(w, atomic_fetch_add(w->next_record, 1));
+      break;
+    case OP_SCAN:
+      ok = do_scan(w, pick_record(w));
+      break;
+    case OP_RMW: {
+      long r = pick_record(w);
+      ok = do_read(w, r) && do_write(w, r);
+      break;
+    }
+    default:
+      ok = do_read(w, pick_record(w));
+      break;
+    }
+    hist_record(&w->stats.hist[op], now_ns() - t0);
+    w->stats.ops++;
+    if (!ok) w->stats.failed++;
+  }
+  if (w->async) lsm_async_close(w->async);
+  w->async = NULL;
+  return NULL;
+}
+
+// Bytes this process made the block layer read and write. Zero where the
+// kernel does not keep I/O accounting.
+static IoCounters io_counters(void) {
+  IoCounters c = { 0, 0 };
+  FILE *f = fopen("/proc/self/io", "r");
+  if (!f) return c;
+  char line[128];
+  unsigned long long v;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "read_bytes: %llu", &v) == 1) c.read_bytes = v;
+    else if (sscanf(line, "write_bytes: %llu", &v) == 1) c.write_bytes = v;
+  }
+  fclose(f);
+  return c;
+}
+
+// Files under segments/: tables, logs and the manifest.
+static uint64_t disk_usage(void) {
+  DIR *d = opendir("segments");
+  if (!d) return 0;
+  uint64_t total = 0;
+  struct dirent *e;
+  char path[512];
+  struct stat st;
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "segments/%s", e->d_name);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) total += (uint64_t)st.st_size;
+  }
+  closedir(d);
+  return total;
+}
+
+static int prepare_dir(const char *dir) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    perror("mkdir bench dir");
+    return -1;
+  }
+  if (chdir(dir) != 0) {
+    perror("chdir bench dir");
+    return -1;
+  }
+  DIR *d = opendir("segments");
+  if (!d) return 0;
+  struct dirent *e;
+  char path[512];
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "segments/%s", e->d_name);
+    unlink(path);
+  }
+  closedir(d);
+  return 0;
+}
+
+// Runs fn on cfg->threads workers, items split evenly between them.
+static void run_phase(const BenchConfig *cfg, Worker *base, void *(*fn)(void *), long items,
+                      PhaseResult *out) {
+  Worker *workers = calloc((size_t)cfg->threads, sizeof(Worker));
+  pthread_t *th = calloc((size_t)cfg->threads, sizeof(pthread_t));
+  if (!workers || !th) {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+
+  IoCounters io0 = io_counters();
+  uint64_t t0 = now_ns();
+  long per = items / cfg->threads;
+  for (int i = 0; i < cfg->threads; i++) {
+    workers[i] = *base;
+    workers[i].rng = mix64((uint64_t)i + 1 + (uint64_t)t0);
+    workers[i].begin = per * i;
+    workers[i].end = i == cfg->threads - 1 ? items : per * (i + 1);
+    workers[i].ops = workers[i].end - workers[i].begin;
+    pthread_create(&th[i], NULL, fn, &workers[i]);
+  }
+  for (int i = 0; i < cfg->threads; i++) pthread_join(th[i], NULL);
+  out->seconds = (double)(now_ns() - t0) / 1e9;
+  IoCounters io1 = io_counters();
+  out->io.read_bytes = io1.read_bytes - io0.read_bytes;
+  out->io.write_bytes = io1.write_bytes - io0.write_bytes;
+
+  memset(&out->total, 0, sizeof(out->total));
+  for (int i = 0; i < cfg->threads; i++) {
+    ThreadStats *s = &workers[i].stats;
+    out->total.ops += s->ops;
+    out->total.failed += s->failed;
+    out->total.bytes_written += s->bytes_written;
+    out->total.bytes_read += s->bytes_read;
+    for (int op = 0; op < OP_COUNT; op++) hist_merge(&out->total.hist[op], &s->hist[op]);
+  }
+  out->ops = out->total.ops;
+  free(th);
+  free(workers);
+}
+
+static void print_phase(FILE *f, const char *name, const PhaseResult *r) {
+  fprintf(f, "%s: %llu ops in %.3f s (%.0f ops/s), %llu failed\n", name, (unsigned long long)r->ops,
+         r->seconds, r->seconds > 0 ? (double)r->ops / r->seconds : 0.0,
+         (unsigned long long)r->total.failed);
+  for (int op = 0; op < OP_COUNT; op++) {
+    const Histogram *h = &r->total.hist[op];
+    if (h->n == 0) continue;
+    fprintf(f, "  %-6s %10llu ops  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us\n",
+           op_names[op], (unsigned long long)h->n, hist_percentile(h, 50) / 1e3,
+           hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+  }
+  fprintf(f, "  user bytes written %llu, read %llu; disk bytes written %llu, read %llu\n",
+         (unsigned long long)r->total.bytes_written, (unsigned long long)r->total.bytes_read,
+         (unsigned long long)r->io.write_bytes, (unsigned long long)r->io.read_bytes);
+}
+
+static void json_phase(FILE *f, const char *name, const PhaseResult *r) {
+  fprintf(f, "  \"%s\": {\n", name);
+  fprintf(f, "    \"seconds\": %.6f,\n    \"ops\": %llu,\n    \"failed\": %llu,\n", r->seconds,
+          (unsigned long long)r->ops, (unsigned long long)r->total.failed);
+  fprintf(f, "    \"ops_per_sec\": %.1f,\n", r->seconds > 0 ? (double)r->ops / r->seconds : 0.0);
+  fprintf(f, "    \"user_bytes_written\": %llu,\n    \"user_bytes_read\": %llu,\n",
+          (unsigned long long)r->total.bytes_written, (unsigned long long)r->total.bytes_read);
+  fprintf(f, "    \"disk_bytes_written\": %llu,\n    \"disk_bytes_read\": %llu,\n",
+          (unsigned long long)r->io.write_bytes, (unsigned long long)r->io.read_bytes);
+  fprintf(f, "    \"operations\": {");
+  bool first = true;
+  for (int op = 0; op < OP_COUNT; op++) {
+    const Histogram *h = &r->total.hist[op];
+    if (h->n == 0) continue;
+    fprintf(f, "%s\n      \"%s\": { \"count\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+               "\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f }",
+            first ? "" : ",", op_names[op], (unsigned long long)h->n, (double)h->sum / (double)h->n / 1e3,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+            h->max / 1e3);
+    first = false;
+  }
+  fprintf(f, "\n    }\n  }");
+}
+
+static void write_json(FILE *f, const BenchConfig *cfg, const PhaseResult *load, const PhaseResult *run,
+                       uint64_t logical, uint64_t disk, const LSMStats *engine) {
+  fprintf(f, "{\n  \"config\": {\n");
+  fprintf(f, "    \"workload\": \"%c\",\n    \"distribution\": \"%s\",\n", cfg->workload->name,
+          dist_names[cfg->dist]);
+  fprintf(f, "    \"records\": %ld,\n    \"ops\": %ld,\n    \"threads\": %d,\n", cfg->records, cfg->ops,
+          cfg->threads);
+  fprintf(f, "    \"value_min\": %d,\n    \"value_max\": %d,\n", cfg->value_min, cfg->value_max);
+  fprintf(f, "    \"memtable_entries\": %d,\n    \"memtable_bytes\": %ld,\n", cfg->pool_entries,
+          cfg->opts.memtable_bytes);
+  fprintf(f, "    \"codec\": \"%s\",\n    \"flush_threads\": %d,\n    \"async_depth\": %d,\n    \"direct_writes\": %s,\n",
+          codec_name(cfg->opts.codec), cfg->opts.flush_threads, cfg->async_depth,
+          cfg->opts.direct_writes ? "true" : "false");
+  fprintf(f, "    \"vlog_threshold\": %d\n  },\n", cfg->opts.vlog_threshold);
+  json_phase(f, "load", load);
+  fprintf(f, ",\n");
+  json_phase(f, "run", run);
+  fprintf(f, ",\n  \"space\": { \"logical_bytes\": %llu, \"disk_bytes\": %llu, \"amplification\": %.3f },\n",
+          (unsigned long long)logical, (unsigned long long)disk,
+          logical > 0 ? (double)disk / (double)logical : 0.0);
+  fprintf(f, "  \"engine\": ");
+  stats_dump(engine, f, true);
+  fprintf(f, "}\n");
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --workload a|b|c|d|e|f    YCSB core workload (a)\n"
+          "  --dist uniform|zipfian|latest  key distribution (the workload's)\n"
+          "  --records N               records loaded before the run (100000)\n"
+          "  --ops N                   operations in the run (100000)\n"
+          "  --threads N               client threads (1)\n"
+          "  --value-size MIN[:MAX]    value bytes, uniform in the range (100)\n"
+          "  --memtable rbtree|skiplist|btree\n"
+          "  --memtable-entries N      memtable node pool (65536)\n"
+          "  --memtable-mb N           memtable value budget (8)\n"
+          "  --codec none|zlib|lz4|zstd\n"
+          "  --flush-threads N         frame compressors per flush, 0 inline (2)\n"
+          "  --direct                  write segments with O_DIRECT\n"
+          "  --vlog-threshold N        values of N bytes or more go to the value log, 0 inline (0)\n"
+          "  --async-depth N           reads in flight per thread via io_uring, 0 blocking (0)\n"
+          "  --sync always|interval|never  WAL sync policy (interval)\n"
+          "  --stats-dump MS           engine stats to stderr this often\n"
+          "  --dir PATH                working directory (bench-data)\n"
+          "  --json PATH               also write the results as JSON, - for stdout\n",
+          prog);
+}
+
+static int parse_args(int argc, char **argv, BenchConfig *cfg) {
+  static const struct option longopts[] = {
+    { "workload", required_argument, NULL, 'w' },
+    { "dist", required_argument, NULL, 'd' },
+    { "records", required_argument, NULL, 'r' },
+    { "ops", required_argument, NULL, 'o' },
+    { "threads", required_argument, NULL, 't' },
+    { "value-size", required_argument, NULL, 'v' },
+    { "memtable", required_argument, NULL, 'm' },
+    { "memtable-entries", required_argument, NULL, 'e' },
+    { "memtable-mb", required_argument, NULL, 'b' },
+    { "codec", required_argument, NULL, 'c' },
+    { "flush-threads", required_argument, NULL, 'F' },
+    { "async-depth", required_argument, NULL, 'A' },
+    { "direct", no_argument, NULL, 'O' },
+    { "vlog-threshold", required_argument, NULL, 'V' },
+    { "sync", required_argument, NULL, 's' },
+    { "stats-dump", required_argument, NULL, 'S' },
+    { "dir", required_argument, NULL, 'D' },
+    { "json", required_argument, NULL, 'j' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->workload = &workloads[0];
+  cfg->dist = (KeyDist)-1;
+  cfg->records = 100000;
+  cfg->ops = 100000;
+  cfg->threads = 1;
+  cfg->value_min = cfg->value_max = 100;
+  cfg->dir = "bench-data";
+  cfg->pool_entries = 65536;
+  lsm_options_default(&cfg->opts);
+  cfg->opts.memtable_bytes = 8L << 20;
+  cfg->opts.wal_sync = WAL_SYNC_INTERVAL;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+    switch (c) {
+    case 'w': {
+      cfg->workload = NULL;
+      for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        if (tolower((unsigned char)optarg[0]) == workloads[i].name) cfg->workload = &workloads[i];
+      if (!cfg->workload || optarg[1] != '\0') return -1;
+      break;
+    }
+    case 'd':
+      if (strcmp(optarg, "uniform") == 0) cfg->dist = DIST_UNIFORM;
+      else if (strcmp(optarg, "zipfian") == 0) cfg->dist = DIST_ZIPFIAN;
+      else if (strcmp(optarg, "latest") == 0) cfg->dist = DIST_LATEST;
+      else return -1;
+      break;
+    case 'r': cfg->records = atol(optarg); break;
+    case 'o': cfg->ops = atol(optarg); break;
+    case 't': cfg->threads = atoi(optarg); break;
+    case 'v':
+      if (sscanf(optarg, "%d:%d", &cfg->value_min, &cfg->value_max) == 1) cfg->value_max = cfg->value_min;
+      break;
+    case 'm':
+      if (strcmp(optarg, "rbtree") == 0) cfg->opts.memtable = MEMTABLE_RBTREE;
+      else if (strcmp(optarg, "skiplist") == 0) cfg->opts.memtable = MEMTABLE_SKIPLIST;
+      else if (strcmp(optarg, "btree") == 0) cfg->opts.memtable = MEMTABLE_BTREE;
+      else return -1;
+      break;
+    case 'e': cfg->pool_entries = atoi(optarg); break;
+    case 'b': cfg->opts.memtable_bytes = atol(optarg) << 20; break;
+    case 'c': {
+      bool found = false;
+      for (Codec k = CODEC_NONE; k <= CODEC_ZSTD; k++) {
+        if (strcmp(optarg, codec_name(k)) != 0) continue;
+        if (!codec_supported(k)) {
+          fprintf(stderr, "bench: codec %s is not built in\n", optarg);
+          return -1;
+        }
+        cfg->opts.codec = k;
+        found = true;
+      }
+      if (!found) return -1;
+      break;
+    }
+    case 's':
+      if (strcmp(optarg, "always") == 0) cfg->opts.wal_sync = WAL_SYNC_ALWAYS;
+      else if (strcmp(optarg, "interval") == 0) cfg->opts.wal_sync = WAL_SYNC_INTERVAL;
+      else if (strcmp(optarg, "never") == 0) cfg->opts.wal_sync = WAL_SYNC_NEVER;
+      else return -1;
+      break;
+    case 'F': cfg->opts.flush_threads = atoi(optarg); break;
+    case 'A': cfg->async_depth = atoi(optarg); break;
+    case 'O': cfg->opts.direct_writes = true; break;
+    case 'V': cfg->opts.vlog_threshold = atoi(optarg); break;
+    case 'S': cfg->opts.stats_dump_interval_ms = atoi(optarg); break;
+    case 'D': cfg->dir = optarg; break;
+    case 'j': cfg->json = optarg; break;
+    default: return -1;
+    }
+  }
+  if (optind != argc) return -1;
+  if ((int)cfg->dist < 0) cfg->dist = cfg->workload->dist;
+  if (cfg->records < 1 || cfg->ops < 0 || cfg->threads < 1 || cfg->pool_entries < 16 ||
+      cfg->value_min < 1 || cfg->value_max < cfg->value_min || cfg->value_max > VALUE_POOL / 2 ||
+      cfg->opts.vlog_threshold < 0)
+    return -1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  BenchConfig cfg;
+  if (parse_args(argc, argv, &cfg) != 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  // Resolved before the chdir so a relative path means the caller's. JSON
+  // on stdout moves the summary to stderr.
+  FILE *json = NULL;
+  FILE *text = stdout;
+  if (cfg.json) {
+    json = strcmp(cfg.json, "-") == 0 ? stdout : fopen(cfg.json, "w");
+    if (!json) {
+      perror("open json output");
+      return 1;
+    }
+    if (json == stdout) text = stderr;
+  }
+  if (prepare_dir(cfg.dir) != 0) return 1;
+
+  void *nodes = calloc(1, mt_pool_bytes(cfg.opts.memtable, cfg.pool_entries));
+  Value *values = calloc((size_t)cfg.pool_entries, sizeof(Value));
+  char *value_pool = malloc(VALUE_POOL);
+  LSM *l = malloc(sizeof(LSM));
+  if (!nodes || !values || !value_pool || !l) {
+    fprintf(stderr, "bench: out of memory\n");
+    return 1;
+  }
+  uint64_t seed = 0x5EEDull;
+  for (int i = 0; i < VALUE_POOL; i++) value_pool[i] = (char)(' ' + next_rand(&seed) % 95);
+
+  if (lsm_init(l, &cfg.opts, nodes, values, cfg.pool_entries, true) != 0) {
+    fprintf(stderr, "bench: lsm_init failed\n");
+    return 1;
+  }
+
+  Zipf zipf;
+  zipf_init(&zipf, cfg.records, ZIPF_THETA);
+  atomic_long next_record = cfg.records;
+  Worker base = { .cfg = &cfg, .l = l, .zipf = &zipf, .value_pool = value_pool, .next_record = &next_record };
+
+  fprintf(text, "workload %c, %s keys, %ld records, %ld ops, %d threads, values %d-%d bytes\n",
+         cfg.workload->name, dist_names[cfg.dist], cfg.records, cfg.ops, cfg.threads, cfg.value_min,
+         cfg.value_max);
+  PhaseResult *load = calloc(1, sizeof(PhaseResult));
+  PhaseResult *run = calloc(1, sizeof(PhaseResult));
+  if (!load || !run) {
+    fprintf(stderr, "bench: out of memory\n");
+    return 1;
+  }
+  run_phase(&cfg, &base, load_main, cfg.records, load);
+  lsm_wait_compactions(l);
+  print_phase(text, "load", load);
+  run_phase(&cfg, &base, run_main, cfg.ops, run);
+  lsm_wait_compactions(l);
+  print_phase(text, "run", run);
+
+  // Live data against what the files take once compactions settle.
+  uint64_t logical = (uint64_t)atomic_load(&next_record) *
+                     (KEY_LONG_SIZE + (uint64_t)(cfg.value_min + cfg.value_max) / 2);
+  uint64_t disk = disk_usage();
+  fprintf(text, "space: %llu logical bytes, %llu on disk, amplification %.3f\n", (unsigned long long)logical,
+         (unsigned long long)disk, logical > 0 ? (double)disk / (double)logical : 0.0);
+  // The engine's own view of both phases.
+  LSMStats engine;
+  lsm_stats_snapshot(l, &engine);
+  fprintf(text, "engine: write amp %.2f, read amp %.2f, frames per get %.2f, bloom false positives %.2f%%\n",
+          engine.write_amp, engine.read_amp, engine.frames_per_get, 100.0 * engine.bloom_false_positive_rate);
+  if (json) {
+    write_json(json, &cfg, load, run, logical, disk, &engine);
+    if (json != stdout) fclose(json);
+  }
+
+  lsm_close(l);
+  free(run);
+  free(load);
+  free(l);
+  free(value_pool);
+  free(values);
+  free(nodes);
+  return 0;
+}
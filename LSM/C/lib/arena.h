@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_CHUNK_SIZE (1u << 20)
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t cap;
+  atomic_size_t used;  // may run past cap, the tail then goes unused
+  uint8_t data[];
+} ArenaChunk;
+
+// Bump allocator for memtable values. Allocations are a fetch_add on the
+// current chunk, safe from any number of threads; nothing is freed on its
+// own, arena_reset drops everything at once. Requests over a quarter chunk
+// get a chunk of their own so they do not cut the current one short.
+typedef struct {
+  _Atomic(ArenaChunk *) head;
+  ArenaChunk *spare;     // one standard chunk kept across resets
+  size_t chunk_size;
+  atomic_size_t footprint;  // bytes of all chunks held
+  pthread_mutex_t grow;
+} Arena;
+
+
+void arena_init(Arena *a, size_t chunk_size);
+void *arena_alloc(Arena *a, size_t n);
+size_t arena_footprint(Arena *a);
+void arena_reset(Arena *a);
+void arena_destroy(Arena *a);
+
+
+#endif
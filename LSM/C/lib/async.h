@@ -0,0 +1,50 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "iter.h"
+#include "lsm.h"
+#include "sstable.h"
+#include "uring.h"
+
+// Frames a ring buffer holds; larger ones are read synchronously.
+#define ASYNC_SLOT_BYTES (BLOCK_SIZE + 4096)
+// Buffers kept over the lookup depth for iterator read-ahead.
+#define ASYNC_AHEAD_SLOTS 16
+
+// result is what lsm_get would return for key; value is the callback's to
+// free when it is 1, key only lives for the call.
+typedef void (*LSMGetCallback)(void *arg, Key key, int result, char *value, int length);
+
+typedef struct AsyncGet AsyncGet;
+
+// Lookups that keep up to depth segment reads in flight on one io_uring
+// instead of blocking on each. Owned by one thread: lsm_get_async queues a
+// lookup and returns, and callbacks run on that thread from
+// lsm_async_poll. Where io_uring cannot be set up the frames are read
+// synchronously at submit, and the callbacks still come from poll.
+typedef struct {
+  LSM *l;
+  ReadRing ring;
+  bool has_ring;
+  AsyncGet *gets;
+  int depth;
+  AsyncGet *free_gets;
+  AsyncGet *done_head;  // finished, callback not run yet
+  AsyncGet *done_tail;
+  int pending;          // submitted and not yet called back
+  Version *swept;       // referenced, the ring's files were last checked against it
+} LSMAsync;
+
+
+int lsm_async_init(LSM *l, LSMAsync *a, int depth);
+int lsm_get_async(LSMAsync *a, Key key, LSMGetCallback cb, void *arg);
+int lsm_async_poll(LSMAsync *a, int min);
+int lsm_async_multi_get(LSMAsync *a, int n, const Key *keys, char **values, int *lengths, int *results);
+void lsm_async_iter(LSMAsync *a, LSMIter *it);
+void lsm_async_close(LSMAsync *a);
+
+
+#endif
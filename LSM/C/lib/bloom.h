@@ -5,14 +5,34 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "key.h"
+
+// Blocked filters map every key to one 32-byte block and set one bit in
+// each of its eight 32-bit words, so a probe touches a single cache line.
+#define BLOOM_BLOCK_BYTES 32
+#define BLOOM_BLOCK_WORDS 8
+// Filter size per key a flush asks for, whatever the key length.
+#define BLOOM_BYTES_PER_KEY 8
+
+// Stored next to k in a table's bloom block, values must never change.
+typedef enum {
+  BLOOM_CLASSIC = 0,  // k probes spread over the whole array
+  BLOOM_BLOCKED = 1
+} BloomLayout;
+
 typedef struct {
   uint8_t *bitmasks;
   size_t nbytes;
   uint32_t k;
+  BloomLayout layout;
+  bool long_keys;  // built over the numeric keys of a table from before byte keys
 }Bloom;
 
 void bloom_init(Bloom *b, uint8_t *bitmasks, size_t nbytes, uint32_t k);
-void bloom_put(Bloom *b,long key);
-bool bloom_has(Bloom *b,long key);
+void bloom_init_blocked(Bloom *b, uint8_t *bitmasks, size_t nbytes);
+uint8_t *bloom_alloc(size_t nbytes);
+void bloom_put(Bloom *b, Key key);
+bool bloom_has(Bloom *b, Key key);
+void bloom_has_many(Bloom *b, const Key *keys, int n, bool *out);
 
 #endif
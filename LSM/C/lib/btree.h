@@ -0,0 +1,61 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "key.h"
+#include "value.h"
+
+// Keys per node. Each key's first 8 bytes are kept as a number beside it;
+// in bytewise order a node's 16 heads fill two cache lines and are
+// compared four at a time with AVX2 where the CPU has it, four 256-bit
+// compares for the keys below the search key and four for those above, so
+// only ties read the keys. The node as a whole is 512 bytes: the keys are
+// pointers with lengths and take twice the room of the heads, but a search
+// only touches them for ties, so the node is sized by its heads rather
+// than squeezed into one cache line.
+#define BT_ORDER 16
+#define BT_MAX_DEPTH 16
+
+typedef struct {
+  int64_t heads[BT_ORDER];    // key_head with the sign bit flipped
+  Key keys[BT_ORDER];         // sorted, the first n are valid
+  int slots[BT_ORDER + 1];    // inner: n + 1 children; leaf: value slots
+  int n;
+  int next;                   // leaf: right sibling, 0 at the end
+  bool leaf;
+} __attribute__((aligned(64))) BTNode;  // 512 bytes, eight cache lines
+
+// A B+tree over a caller-provided pool, see bt_pool_bytes. Entries keep
+// their Value in a slot of the parallel values array, as RBTree does;
+// a tombstone is a slot with length -1. Keys are never removed.
+typedef struct {
+  BTNode *nodes;   // node 0 unused
+  const Comparator *cmp;  // NULL orders bytewise
+  Arena *keys;            // new keys are copied here; NULL keeps the caller's
+  int node_cap;
+  int next_node;
+  Value *values;   // slot 0 unused
+  int size;
+  int next_free;
+  int length;
+  int root;
+  long replaced_bytes;  // value bytes overwritten or deleted so far
+} BTree;
+
+
+size_t bt_pool_bytes(int size);
+void bt_init(BTree *t, void *pool, Value *values, int size);
+bool bt_is_full(BTree *t);
+bool bt_put(BTree *t, Key key, const char *value, int length);
+int bt_find(BTree *t, Key key);
+void bt_first(BTree *t, int *node, int *pos);
+void bt_seek(BTree *t, Key key, int *node, int *pos);
+void bt_next(BTree *t, int *node, int *pos);
+void bt_reset(BTree *t);
+
+
+#endif
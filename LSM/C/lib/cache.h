@@ -0,0 +1,63 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_SHARDS 16
+
+// One inflated frame, keyed by (segment id, frame offset). A handle
+// returned by lookup or insert is pinned: data stays valid and the entry is
+// not freed until block_cache_release, even if it is evicted meanwhile.
+typedef struct CacheHandle {
+  unsigned long long segment_id;
+  long offset;
+  uint8_t *data;
+  uint32_t len;
+
+  int refs;          // pins, plus one while the cache holds it
+  bool referenced;   // CLOCK bit, set on every hit
+  struct CacheHandle *hnext;
+  struct CacheHandle *prev;
+  struct CacheHandle *next;
+} CacheHandle;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CacheHandle **buckets;
+  size_t nbuckets;
+  size_t count;
+  CacheHandle *hand;  // CLOCK ring of resident entries, hand at the oldest
+  size_t used;
+  size_t capacity;
+  uint64_t hits;
+  uint64_t misses;
+} CacheShard;
+
+// Frames hash to one of CACHE_SHARDS independently locked shards, each
+// evicting with CLOCK once its share of the byte capacity is used up.
+typedef struct {
+  CacheShard shards[CACHE_SHARDS];
+} BlockCache;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  size_t used;
+  size_t entries;
+} CacheStats;
+
+
+int block_cache_init(BlockCache *c, size_t capacity);
+CacheHandle *block_cache_lookup(BlockCache *c, unsigned long long segment_id, long offset);
+CacheHandle *block_cache_insert(BlockCache *c, unsigned long long segment_id, long offset,
+                                uint8_t *data, uint32_t len);
+void block_cache_release(BlockCache *c, CacheHandle *h);
+void block_cache_erase_segment(BlockCache *c, unsigned long long segment_id);
+void block_cache_stats(BlockCache *c, CacheStats *out);
+void block_cache_destroy(BlockCache *c);
+
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Stored in every frame header, values must never change.
+typedef enum {
+  CODEC_NONE = 0,
+  CODEC_ZLIB = 1,
+  CODEC_LZ4  = 2,  // built with LSM_HAVE_LZ4
+  CODEC_ZSTD = 3   // built with LSM_HAVE_ZSTD
+} Codec;
+
+
+bool codec_supported(Codec c);
+const char *codec_name(Codec c);
+size_t codec_bound(Codec c, size_t len);
+long codec_compress(Codec c, int level, const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+int codec_decompress(Codec c, const uint8_t *src, size_t len, uint8_t *dst, size_t ulen);
+uint8_t *codec_scratch(size_t len);
+
+
+#endif
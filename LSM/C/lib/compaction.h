@@ -0,0 +1,44 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lsm.h"
+
+// A contiguous run of the current version (oldest to newest) merged into one
+// segment under a fresh id; a run of one rewrites a segment to move its
+// values out of garbage-heavy value log files. It takes the run's place in
+// the next version, and the manifest keeps that order through the newest
+// sequence number it holds. A move only puts the run at out_level.
+typedef struct {
+  bool move;
+  SSTable *inputs;       // snapshot of the run, the engine still owns them; NULL for a move
+  unsigned long long *ids;
+  int count;
+  unsigned long long out_id;
+  int out_level;
+  bool bottommost;       // nothing older than the run, tombstones can go
+  size_t bloom_bytes;
+  Codec codec;
+  int codec_level;
+  bool direct;           // write the output with O_DIRECT
+  const Comparator *cmp; // the engine's key order
+  Stats *stats;          // the engine's, or NULL
+  // Values move to value log file out_id when they are at least
+  // vlog_threshold bytes and inline, or sit in one of gc_files.
+  int vlog_threshold;
+  unsigned long long *gc_files;
+  int n_gc_files;
+} CompactionJob;
+
+
+bool compaction_pick(LSM *l, CompactionJob *job);
+int compaction_run(CompactionJob *job, SSTable *out, Bloom *bloom);
+int compaction_install(LSM *l, CompactionJob *job, SSTable *out, Bloom *bloom);
+int compaction_move(LSM *l, CompactionJob *job);
+void compaction_job_free(CompactionJob *job);
+void *compaction_main(void *arg);
+
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Threads reading shared structures without a lock announce the global
+// epoch in their slot while they do. Something unlinked at stamp s (see
+// epoch_advance) may be freed once no slot announces an epoch <= s.
+#define EPOCH_SLOTS 128
+
+
+int epoch_enter(void);
+void epoch_exit(int slot);
+uint64_t epoch_advance(void);
+bool epoch_safe(uint64_t stamp);
+
+
+#endif
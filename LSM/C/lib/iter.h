@@ -0,0 +1,77 @@
+#ifndef ITER_H
+#define ITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lsm.h"
+#include "memtable.h"
+#include "sstable.h"
+
+#define ITER_BATCH 64
+
+// A memtable entry referenced by a batch; the bytes stay in the memtable,
+// which the iterator keeps from being reset.
+typedef struct {
+  Key key;
+  int32_t length;  // -1 for a tombstone
+  const char *value;
+} IterEntry;
+
+// One input of the merge: the memtable or a segment cursor. A skiplist is
+// walked in place; a tree still taking writes is read ITER_BATCH entries at
+// a time under mt_lock.
+typedef struct {
+  MtIter mi;
+  IterEntry *batch;  // trees only
+  int n_batch;
+  int pos;
+  bool more;         // the tree has entries past the batch
+
+  SSTableCursor cursor;
+  bool is_table;
+
+  bool valid;
+  Key key;
+  int32_t length;
+  const char *value;
+} IterSource;
+
+// An ordered view of the engine as of lsm_iter_init. It pins the segment
+// version and the memtable then current, and reads the memtable as of the
+// newest write it held, so flushes, compactions and writes that run while
+// it is open do not change what it returns. A memtable it pins is not
+// reused until it closes; writes go on in another meanwhile.
+typedef struct {
+  LSM *l;
+  Version *v;
+  Memtable *mt;
+  uint64_t seq;
+  IterSource *srcs;  // newest first
+  int n_srcs;
+  int *heap;
+  int heap_len;
+  const Comparator *cmp;
+
+  bool valid;
+  bool err;
+  Key key;
+  int length;  // SST_VALUE_REF until lsm_iter_value reads the value in
+  const char *value;
+  const SSTable *value_sst;  // the table whose ref value is
+  char *resolved;            // value read from the value log
+} LSMIter;
+
+
+int lsm_iter_init(LSM *l, LSMIter *it);
+void lsm_iter_seek(LSMIter *it, Key key);
+void lsm_iter_seek_to_first(LSMIter *it);
+void lsm_iter_next(LSMIter *it);
+bool lsm_iter_valid(LSMIter *it);
+Key lsm_iter_key(LSMIter *it);
+const char *lsm_iter_value(LSMIter *it, int *length);
+void lsm_iter_close(LSMIter *it);
+
+
+#endif
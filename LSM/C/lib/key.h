@@ -0,0 +1,79 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Longest key the engine takes; frames store key lengths in 16 bits.
+#define KEY_MAX_SIZE 1024
+
+// A byte string, borrowed: whoever hands one over keeps data alive for the
+// duration of the call, anything kept longer is copied.
+typedef struct {
+  const char *data;
+  uint32_t len;
+} Key;
+
+// Orders keys. compare returns 0 only for identical bytes, so equality,
+// hashing and the filters stay bytewise whatever the order. The name is
+// recorded with the data; a store only opens with the order it was made with.
+typedef struct {
+  const char *name;
+  int (*compare)(Key a, Key b);
+} Comparator;
+
+#define KEY_BYTEWISE_NAME "bytewise"
+
+// A long as 8 big-endian bytes with the sign bit flipped, which sort
+// bytewise like the numbers do. Tables and logs from before byte keys are
+// read back through it.
+#define KEY_LONG_SIZE 8
+
+static inline int key_compare_bytes(Key a, Key b) {
+  uint32_t n = a.len < b.len ? a.len : b.len;
+  int c = n ? memcmp(a.data, b.data, n) : 0;
+  if (c != 0) return c;
+  return a.len < b.len ? -1 : a.len > b.len;
+}
+
+// NULL is the bytewise order, which takes no indirect call.
+static inline int key_compare(const Comparator *cmp, Key a, Key b) {
+  return cmp ? cmp->compare(a, b) : key_compare_bytes(a, b);
+}
+
+static inline bool key_equal(Key a, Key b) {
+  return a.len == b.len && (a.len == 0 || memcmp(a.data, b.data, a.len) == 0);
+}
+
+// Length of the prefix a and b share.
+static inline uint32_t key_shared(Key a, Key b) {
+  uint32_t n = a.len < b.len ? a.len : b.len;
+  uint32_t i = 0;
+  while (i < n && a.data[i] == b.data[i]) i++;
+  return i;
+}
+
+// The first 8 bytes as a big-endian number, zero padded. Heads order like
+// the keys bytewise, only equal heads need the keys themselves.
+static inline uint64_t key_head(Key k) {
+  uint8_t b[8] = { 0 };
+  if (k.len) memcpy(b, k.data, k.len < 8 ? k.len : 8);
+  uint64_t h = 0;
+  for (int i = 0; i < 8; i++) h = h << 8 | b[i];
+  return h;
+}
+
+extern const Comparator key_bytewise;
+
+int key_dup(Key *dst, Key src);
+void key_free(Key *k);
+Key key_from_long(char *buf, long k);
+long key_to_long(Key k);
+
+// key_from_long into a buffer that lives to the end of the enclosing block.
+#define KEY_LONG(k) key_from_long((char[KEY_LONG_SIZE]){ 0 }, (k))
+
+
+#endif
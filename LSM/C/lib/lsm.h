@@ -1,22 +1,131 @@
 #ifndef LSM_H
 #define LSM_H
 
+#include <pthread.h>
+
 #include "bloom.h"
+#include "cache.h"
+#include "manifest.h"
 #include "memtable.h"
 #include "sstable.h"
+#include "stats.h"
+#include "version.h"
+#include "vlog.h"
+#include "wal.h"
+
+typedef enum {
+  COMPACTION_NONE,
+  COMPACTION_LEVELED,     // L0 merges into L1, each level ratio times the one above
+  COMPACTION_SIZE_TIERED  // runs of similar-sized segments merge together
+} CompactionStyle;
+
+typedef struct {
+  WalSyncPolicy wal_sync;
+  int wal_sync_interval_ms;
+
+  CompactionStyle compaction;
+  int l0_compaction_trigger;
+  long level_base_bytes;
+  int level_ratio;
+  int tier_min_width;
+
+  size_t block_cache_bytes;  // inflated frames kept for point lookups, 0 disables
+  bool mmap_reads;           // read segments through a mapping instead of pread
+
+  Codec codec;               // for new segments, existing ones keep theirs
+  int codec_level;           // 0 is the codec's default
+
+  MemtableKind memtable;     // the nodes passed to lsm_init must match
+  long memtable_bytes;       // key and value bytes, dead ones included, before a switch; 0 for none
+  int flush_threads;         // compress a flush's frames on this many threads, 0 inline
+  bool direct_writes;        // flushes and compactions write segments with O_DIRECT
 
+  const Comparator *comparator;  // key order, NULL for bytewise; fixed once the store exists
+
+  // Values of at least vlog_threshold bytes are written to the value log
+  // when flushed and compacted, and segments point at them; 0 keeps every
+  // value inline. A value log file gets its live values moved on by
+  // compactions once vlog_gc_ratio of it is garbage, 0 never.
+  int vlog_threshold;
+  double vlog_gc_ratio;
+
+  bool collect_stats;        // see lsm_stats_snapshot
+  int stats_dump_interval_ms;  // print a snapshot to stderr this often, 0 never
+  bool stats_dump_json;      // as one line of JSON instead of text
+} LSMOptions;
+
+// Writers, flushes and compactions serialize on lock. Point lookups do not
+// take it: they share mt_lock to read the memtables and walk the current
+// segment version inside an epoch. Writers to a concurrent memtable only
+// hold lock to order themselves and then insert sharing mt_lock.
 typedef struct {
-  Bloom *blooms;
-  SSTable *tables;
+  VersionSet versions;
+  BlockCache cache;
+  BlockCache *block_cache;  // &cache, or NULL when disabled
 
-  Memtable m;
+  // Writes go to mem; a full mem becomes imm and is flushed by the flush
+  // thread while an idle one takes writes. Each has its own log. Changing
+  // which is which, resetting one or writing to a memtable that is not
+  // mt_concurrent also holds mt_lock exclusively. A flushed memtable an
+  // iterator still pins idles once it is closed; a switch with none idle
+  // allocates another.
+  Memtable mts[2];
+  Memtable *mem;
+  Memtable *imm;
+  Memtable *idle[2];
+  int n_idle;
+  int memtable_size;  // nodes in each pool
+  Wal wals[2];
+  Wal *wal;
+  Wal *imm_wal;
+  unsigned long long log_number;  // of wal, imm_wal is one less
+  uint64_t imm_last_seq;          // newest write in imm
+  void *spare_nodes;
+  Value *spare_values;
   unsigned long long next_segment_id;
+  Manifest manifest;  // live segments, edited under the lock
+  ValueLog vlog;      // files the segments of any version point into
+
+  LSMOptions opts;
+  const Comparator *cmp;  // opts.comparator, NULL when bytewise
+  pthread_mutex_t lock;
+  pthread_rwlock_t mt_lock;
+  uint64_t last_seq;
+
+  pthread_t flusher;
+  pthread_cond_t flush_cond;
+  bool has_flusher;
+  bool flush_failed;  // the last try at flushing imm, which is still set
+
+  Stats *stats;  // NULL unless opts.collect_stats
+  pthread_t stats_dumper;
+  pthread_cond_t stats_cond;
+  bool has_stats_dumper;
+
+  pthread_t compactor;
+  pthread_cond_t compact_cond;
+  bool has_compactor;
+  bool compacting;
+  bool compaction_failed;
+  atomic_bool write_failed;  // see write_record
+  bool replay_failed;        // see replay_record
+  bool stopping;
 } LSM;
 
 
-void lsm_init(LSM* l, RBNode* nodes, Value *values, int size, bool owns_values);
+void lsm_options_default(LSMOptions *o);
+int lsm_init(LSM* l, const LSMOptions *opts, void *nodes, Value *values, int size, bool owns_values);
+bool lsm_put(LSM *l, Key key, const char *value, int length);
+bool lsm_delete(LSM *l, Key key);
+int lsm_get(LSM *l, Key key, char **value, int *length);
+int lsm_multi_get(LSM *l, int n, const Key *keys, char **values, int *lengths, int *results);
+void lsm_wait_compactions(LSM *l);
+void lsm_cache_stats(LSM *l, CacheStats *out);
+void lsm_stats_snapshot(LSM *l, LSMStats *out);
+void lsm_close(LSM *l);
+int flush(LSM *l);
+void lsm_unpin_memtable(LSM *l, Memtable *m);
 
 
 #endif
 
-
@@ -0,0 +1,78 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sstable.h"
+
+#define MANIFEST_FILE "segments/MANIFEST"
+#define MANIFEST_TMP_FILE "segments/MANIFEST.tmp"
+#define MANIFEST_MAGIC_V1 0x31464E4D4D534D4Cull  // "LMSMMNF1"
+#define MANIFEST_MAGIC 0x32464E4D4D534D4Cull     // "LMSMMNF2"
+#define MANIFEST_NAME_MAX 64
+// Appended bytes beyond the last snapshot before the file is rewritten.
+#define MANIFEST_ROLL_BYTES (1L << 20)
+
+// File: uint64 magic | uint32 n | comparator name[n] | records. The first
+// record is a snapshot of every live segment, the rest are edits applied
+// in order.
+// Record: crc32 | uint32 len | payload, the crc covers len and payload.
+// Payload: uint64 next_segment_id | uint64 last_seq | uint32 n_removed |
+// uint32 n_added | n_removed x uint64 id | n_added x table.
+// Table: uint64 id | uint32 level | uint16 min length | uint16 max length |
+// uint64 largest_seq | min key | max key, 0xffff for a length unknown.
+// MANIFEST_MAGIC_V1 files have no name, their keys are numbers and their
+// tables are id | level | pad | int64 min | int64 max | largest_seq; they
+// are read as bytewise with key_from_long keys and rewritten on open.
+// A record that is cut short or fails its crc ends the replay, it is what
+// a crash in the middle of an append leaves behind.
+
+// What the manifest remembers of a live segment. Keys in an edit are
+// borrowed, the manifest keeps copies; data NULL when unknown.
+typedef struct {
+  unsigned long long id;
+  int level;
+  Key min_key;
+  Key max_key;
+  uint64_t largest_seq;  // newest write it holds, orders tables oldest first
+} ManifestTable;
+
+// One atomic change: removals are applied before additions, and adding a
+// live id replaces what was known about it.
+typedef struct {
+  const unsigned long long *removed;
+  int n_removed;
+  const ManifestTable *added;
+  int n_added;
+  unsigned long long next_segment_id;
+  uint64_t last_seq;
+} VersionEdit;
+
+typedef struct {
+  int fd;
+  long size;           // bytes in the current file
+  long snapshot_size;  // of the snapshot it starts with
+  long roll_bytes;
+  bool broken;         // a failed append may have left a torn tail
+
+  // The live set as of the last edit, written out on roll-over.
+  ManifestTable *tables;
+  int n_tables;
+  int cap;
+  unsigned long long next_segment_id;
+  uint64_t last_seq;
+  char comparator[MANIFEST_NAME_MAX];  // the key order everything was written in
+} Manifest;
+
+
+int manifest_open(Manifest *m, const char *comparator, bool *found);
+int manifest_apply(Manifest *m, const VersionEdit *e);
+int manifest_roll(Manifest *m);
+void manifest_describe(ManifestTable *out, const SSTable *sst);
+void manifest_close(Manifest *m);
+int manifest_sync_dir(void);
+
+
+#endif
@@ -1,30 +1,107 @@
 #ifndef MEMTABLE_H
 #define MEMTABLE_H
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arena.h"
+#include "btree.h"
 #include "rbtree.h"
+#include "skiplist.h"
 
 #define MT_BUF_CAP (1u << 16)
 
-typedef struct {
-  RBTree t;
+typedef enum {
+  MT_ABSENT,
+  MT_FOUND,
+  MT_DELETED
+} MtResult;
 
-  uint8_t  buf[MT_BUF_CAP];
-  size_t   buf_len;
-  int total_size;
-} Memtable;
+typedef enum {
+  MEMTABLE_RBTREE,   // one writer at a time, overwrites in place
+  MEMTABLE_SKIPLIST, // lock-free, writers insert side by side
+  MEMTABLE_BTREE     // one writer at a time, wide nodes for faster lookups
+} MemtableKind;
 
+// What a key of a tree memtable held before a write made while an
+// iterator was reading it: a value, a tombstone or no entry at all.
+typedef struct MtUndo {
+  Key key;
+  const char *value;
+  int length;            // -1 for a tombstone
+  bool absent;
+  uint64_t seq;          // of the write that changed it
+  struct MtUndo *next;   // same bucket, newest first
+} MtUndo;
 
-void mt_init(Memtable* m, RBNode* nodes, Value *values, int size, bool owns_values);
-Value* mt_get(Memtable *m,long key);
-bool mt_put(Memtable *m, long key, const char *value, int length);
-bool mt_delete(Memtable *m, long key);
+// The index is picked at mt_init and lives in a pool of
+// mt_pool_bytes(kind, size) bytes plus a parallel Value pool, both owned by
+// the caller. Keys are always copied into the arena; with owns_values the
+// values are too and all of it is dropped at once on reset, otherwise
+// values point at the caller's bytes. cmp orders the keys, NULL bytewise.
+typedef struct {
+  MemtableKind kind;
+  union {
+    RBTree t;
+    SkipList s;
+    BTree b;
+  };
+  bool owns_values;
+  const Comparator *cmp;
+  int reserved;      // writes admitted by mt_reserve, skiplist only
+  long max_bytes;    // mt_is_full past this many key and value bytes, 0 for no limit
+  Arena arena;
 
+  uint8_t  buf[MT_BUF_CAP];  // frame buffer the flush writer fills
+  atomic_long total_size;    // key and value bytes held, live or not
+  atomic_long dead_size;     // of those, overwritten or deleted since
 
-#endif
+  // Iterators reading the memtable, counted by the engine under its lock.
+  // While there are any, tree writes keep what they replace in undo.
+  int pins;
+  MtUndo **undo;
+  size_t undo_cap;   // buckets, a power of two
+  size_t n_undo;
+} Memtable;
+
+// Walks the live entries in key order, one per key and newest first. The
+// memtable must not be reset while it is in use. Opened at a seq, it shows
+// the memtable as it was then: later skiplist versions are skipped and
+// tree entries later writes changed come from undo.
+typedef struct {
+  Memtable *m;
+  RBIter rb;
+  int node;      // skiplist or B+tree position, 0 past the end
+  int pos;       // entry within the B+tree leaf
+  uint64_t seq;  // UINT64_MAX sees every write
+} MtIter;
 
 
+size_t mt_pool_bytes(MemtableKind kind, int size);
+void mt_init(Memtable* m, MemtableKind kind, void *nodes, Value *values, int size, bool owns_values,
+             const Comparator *cmp);
+bool mt_concurrent(const Memtable *m);
+int mt_count(Memtable *m);
+Value* mt_get(Memtable *m, Key key);
+MtResult mt_lookup(Memtable *m, Key key, Value **value);
+bool mt_is_full(Memtable *m);
+bool mt_reserve(Memtable *m);
+bool mt_put(Memtable *m, uint64_t seq, Key key, const char *value, int length);
+bool mt_delete(Memtable *m, uint64_t seq, Key key);
+void mt_reset(Memtable *m);
+void mt_destroy(Memtable *m);
+void mt_pin(Memtable *m);
+bool mt_unpin(Memtable *m);
 
+void mt_iter_first(MtIter *it, Memtable *m);
+void mt_iter_seek(MtIter *it, Memtable *m, Key key);
+void mt_iter_first_at(MtIter *it, Memtable *m, uint64_t seq);
+void mt_iter_seek_at(MtIter *it, Memtable *m, Key key, uint64_t seq);
+bool mt_iter_valid(MtIter *it);
+void mt_iter_next(MtIter *it);
+Key mt_iter_key(MtIter *it);
+int mt_iter_value(MtIter *it, const char **value);
 
+
+#endif
@@ -2,13 +2,17 @@
 #define RB_TREE_TREE_H
 #include <stdbool.h>
 
+#include "arena.h"
+#include "key.h"
+#include "value.h"
+
 typedef enum Color {
   RED,
   BLACK
 }Color ;
 
 typedef struct {
-  long key;
+  Key key;
   
   int left_idx;
   int right_idx;
@@ -17,29 +21,44 @@ typedef struct {
   bool tombstone;
 } RBNode;
 
-typedef struct {
-  const char *value;
-  int length;
-} Value;
-
 typedef struct {
   RBNode *nodes;
   Value *values;
+  const Comparator *cmp;  // NULL orders bytewise
+  Arena *keys;            // new keys are copied here; NULL keeps the caller's
 
   bool owns_values;
+  long replaced_bytes;  // value bytes overwritten or deleted so far
   int root_idx;
   int next_free;
   int length;
   int size;
 } RBTree;
 
+// In-order walk from a seek point. Holds the pending ancestors, the top is
+// the current node; the tree must not change while it is in use.
+#define RB_ITER_DEPTH 64
+
+typedef struct {
+  RBTree *t;
+  int stack[RB_ITER_DEPTH];
+  int sp;
+} RBIter;
+
 
 void rb_tree_init(RBTree* t, RBNode* nodes, Value *values, int size, bool owns_values);
-bool rb_tree_put(RBTree* t, long key, const char *value, int length);
-Value *rb_tree_get(RBTree* t, long key);
-bool rb_tree_delete(RBTree* t, long key);
+bool rb_tree_put(RBTree* t, Key key, const char *value, int length);
+Value *rb_tree_get(RBTree* t, Key key);
+int rb_tree_find(RBTree* t, Key key);
+bool rb_tree_delete(RBTree* t, Key key);
 void rb_tree_reset(RBTree* t);
 
+void rb_iter_first(RBIter *it, RBTree *t);
+void rb_iter_seek(RBIter *it, RBTree *t, Key key);
+bool rb_iter_valid(RBIter *it);
+int rb_iter_node(RBIter *it);
+void rb_iter_next(RBIter *it);
+
 
 #endif
 
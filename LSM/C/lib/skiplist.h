@@ -0,0 +1,48 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "key.h"
+#include "value.h"
+
+// Towers grow with probability 1/4 per level, enough for 4^12 entries.
+#define SL_MAX_HEIGHT 12
+
+// Nodes live in a caller-provided pool like RBNode and link by index, 0
+// ends a level. Nothing is ever unlinked: an overwrite or a delete adds a
+// node with a newer seq, ordered before the older ones of its key.
+typedef struct {
+  Key key;
+  uint64_t seq;
+  int height;
+  _Atomic int next[SL_MAX_HEIGHT];
+} SLNode;
+
+// Any number of threads may insert at once, lookups never wait. Only
+// sl_reset needs the list to itself.
+typedef struct {
+  SLNode *nodes;   // nodes[0] is the head
+  Value *values;   // values[i] belongs to nodes[i], the caller owns the bytes
+  const Comparator *cmp;  // NULL orders bytewise
+  Arena *keys;            // keys are copied here; NULL keeps the caller's
+
+  atomic_int next_free;
+  atomic_int length;
+  int size;
+} SkipList;
+
+
+void sl_init(SkipList *s, SLNode *nodes, Value *values, int size);
+bool sl_put(SkipList *s, uint64_t seq, Key key, const char *value, int length, int *shadowed);
+int sl_find(SkipList *s, Key key);
+int sl_seek(SkipList *s, Key key);
+int sl_next_key(SkipList *s, int idx);
+int sl_visible(SkipList *s, int idx, uint64_t seq);
+void sl_reset(SkipList *s);
+
+
+#endif
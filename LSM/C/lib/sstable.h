@@ -3,23 +3,237 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "codec.h"
+#include "key.h"
+#include "stats.h"
+#include "uring.h"
 
 #define SEGMENT_FILE_FMT "segments/segment_%lld.log"
-#define SEGMENT_FILE_INDEX_FMT "segments/segment_index_%lld.ser"
-#define SEGMENT_FILE_COUNT "segments/segment_count"
+#define SEGMENT_FILE_INDEX_FMT "segments/segment_index_%lld.ser"  // legacy tables only
+#define SEGMENT_FILE_COUNT "segments/segment_count"  // legacy, see MANIFEST_FILE
+
+#define FRAME_MAGIC 0x4C534D31u     // "LSM1", always zlib
+#define FRAME_MAGIC_V2 0x4C534D32u  // "LSM2", carries a codec id
+#define BLOCK_SIZE ( 1 << 16 )
 
-#define FRAME_MAGIC 0x4C534D31u  // "LSM1"
+// Frame: magic | codec | ulen | clen | data, entries never straddle frames.
+// LSM1 frames have no codec field. A frame that does not shrink is stored
+// with CODEC_NONE whatever the table's codec.
+// Entry: uint16 shared | uint16 unshared | int32 len | key suffix | value,
+// len is -1 for a tombstone and SST_VALUE_REF for a value kept in the
+// value log, whose VLOG_REF_SIZE ref (see vlog.h) stands in for it. The
+// key is the first shared bytes of the previous entry's key followed by
+// the unshared suffix.
+// Data: entries | uint32 restarts[n] | uint32 n when the codec field has
+// FRAME_HAS_RESTARTS. restarts[] holds the offset of every
+// FRAME_RESTART_INTERVAL-th entry, which shares nothing, so a lookup
+// binary searches them and scans at most that many entries.
+// Frames without FRAME_PREFIX_KEYS hold int64 key | int32 len | value
+// entries and are rewritten in the form above when inflated.
+#define FRAME_HEADER_SIZE (3 * sizeof(uint32_t))
+#define FRAME_HEADER_V2_SIZE (4 * sizeof(uint32_t))
+#define FRAME_CODEC_MASK 0xffu
+#define FRAME_HAS_RESTARTS (1u << 8)
+#define FRAME_PREFIX_KEYS (1u << 9)
+#define FRAME_RESTART_INTERVAL 16
+#define FRAME_MAX_RESTARTS (BLOCK_SIZE / (ENTRY_HEADER_SIZE * FRAME_RESTART_INTERVAL) + 1)
+#define ENTRY_HEADER_SIZE (2 * sizeof(uint16_t) + sizeof(int32_t))
+#define LEGACY_ENTRY_HEADER_SIZE (sizeof(int64_t) + sizeof(int32_t))
+#define SST_VALUE_REF (-2)
+#define VLOG_REF_SIZE (2 * sizeof(uint64_t) + sizeof(uint32_t))
+
+// Table v3: frames | index block | bloom block | properties block | footer.
+// Index: uint64 n | n x (uint16 shared | uint16 unshared | int64 offset |
+// key suffix), keys prefix-compressed against the one before.
+// Bloom: uint32 k | uint32 BloomLayout | uint64 nbytes | bits.
+// Properties: the counters of SSTableProps, 8 bytes each | uint16 min
+// length | uint16 max length | uint32 n | min key | max key | n x (uint64
+// value log file | uint64 record bytes the table points at in it).
+// v2 tables hold numeric keys: index pairs of int64 key and offset, the
+// properties as 7 u64 with the keys in place; they are read as
+// key_from_long keys.
+// Footer: offset and size of each block, version, crc32 of the three
+// blocks and the footer up to the crc, magic. Tables without the footer
+// are the legacy layout with the index in SEGMENT_FILE_INDEX_FMT.
+#define SST_FOOTER_MAGIC 0x3230545353534D4Cull  // "LMSSST02"
+#define SST_FOOTER_SIZE 64
+#define SST_VERSION 3
 
 typedef struct {
-  long *keys;
-  long *offsets;
+  unsigned long long file;
+  uint64_t bytes;
+} SSTableVlogUse;
+
+// min_key, max_key and vlogs are owned copies, data NULL while unknown.
+typedef struct {
+  uint64_t entries;
+  uint64_t tombstones;
+  Key min_key;
+  Key max_key;
+  uint64_t raw_bytes;   // inflated frame data
+  uint64_t data_bytes;  // frames as stored
+  uint64_t frames;
+  SSTableVlogUse *vlogs;  // the value log files its refs point into
+  uint32_t n_vlogs;
+} SSTableProps;
+
+typedef enum {
+  SST_ABSENT,
+  SST_FOUND,
+  SST_DELETED,
+  SST_ERROR,
+  SST_PENDING   // see sstable_get_begin
+} SSTResult;
+
+// The stored extent of the frame a lookup has to read.
+typedef struct {
+  int frame;
+  long offset;
+  long size;
+} SSTFrameRead;
+
+typedef struct ValueLog ValueLog;
+
+// Every frame is indexed under a key between the last key of the frame
+// before and its own first key, the shortest such prefix of the first key
+// in bytewise order.
+typedef struct {
+  char *key_pool;     // the index keys back to back
+  uint32_t *key_offs; // key i is key_pool[key_offs[i], key_offs[i + 1])
+  uint32_t pool_len;
+  uint32_t pool_cap;
+  long *offsets;  // file offset of every frame
   int length;
-}SSTable;
+  int capacity;
+  // The index keys' heads again in Eytzinger order, search_heads[1] the
+  // root and the children of i at 2i and 2i + 1, built once the table is
+  // complete. search_slots[i] is the position of search_heads[i] in the
+  // index. Heads are taken after head_skip bytes, the prefix all index keys
+  // share.
+  uint64_t *search_heads;
+  int *search_slots;
+  uint32_t head_skip;
+  const Comparator *cmp;  // key order, NULL bytewise
+
+  unsigned long long id;
+  int fd;
+  long size;      // end of the last frame
+  int level;
+  uint64_t largest_seq;  // newest write it holds, kept in the manifest
+  SSTableProps props;
+  BlockCache *cache;  // point lookups go through it when set
+  Stats *stats;       // counts frames read and written when set
+  const uint8_t *map; // read-only mapping of the whole file, or NULL
+  ValueLog *vlog;     // attached to the files in props.vlogs, or NULL
+} SSTable;
+
+typedef struct FramePipeline FramePipeline;
+
+// Direct writes go out in whole blocks of SST_DIRECT_ALIGN bytes, staged
+// in an aligned buffer of SST_DIRECT_BUF.
+#define SST_DIRECT_ALIGN 4096
+#define SST_DIRECT_BUF (1 << 20)
+
+// Builds a segment frame by frame. Frames are cut at BLOCK_SIZE and at
+// entry boundaries; an entry larger than buf gets a frame of its own.
+typedef struct {
+  FILE *segment;
+  SSTable *sst;
+  Bloom *bloom;
+
+  uint8_t *buf;
+  size_t buf_len;
+  size_t buf_cap;
+  long offset;     // where the next frame starts
+  char first_key[KEY_MAX_SIZE];  // index key of the frame being built in buf
+  uint32_t first_len;
+  char last_key[KEY_MAX_SIZE];   // key of the last entry added
+  uint32_t last_len;
+  uint32_t vlog_last;  // props.vlogs slot of the last ref added
+  int n_entries;   // in the frame being built
+  int n_restarts;
+  uint32_t restarts[FRAME_MAX_RESTARTS];
+  Codec codec;
+  int level;
+  char seg_path[256];
+  FramePipeline *pipe;  // see sstable_writer_parallel, NULL when frames are written inline
+
+  // See sstable_writer_direct: the file is written through fd from dbuf
+  // instead of through segment.
+  bool direct;
+  int fd;
+  uint8_t *dbuf;
+  size_t dbuf_len;
+  long dbuf_at;    // file offset of dbuf[0]
+} SSTableWriter;
+
+// Walks a segment in key order, inflating one frame at a time.
+typedef struct {
+  SSTable *sst;
+  int frame;       // next frame to load
+  const uint8_t *buf;
+  uint8_t *owned;  // buf when it is not borrowed from the mapping
+  uint32_t buf_len;  // end of the entries, the restart array follows
+  uint32_t frame_len;
+  size_t pos;
+  char key_buf[KEY_MAX_SIZE];
+  uint32_t key_len;
+
+  // With a ring the next frame is read into one of its buffers while this
+  // one is consumed; without one the kernel is only advised.
+  ReadRing *ring;
+  ReadOp ahead;
+  int ahead_frame;  // frame being read into ahead.buf, -1 for none
+  bool ahead_done;
+
+  bool valid;
+  bool err;
+  Key key;         // in key_buf, until the next move
+  int32_t length;  // -1 for a tombstone, SST_VALUE_REF for a ref
+  const char *value;
+} SSTableCursor;
+
+
+// Bytes an entry stores after its key.
+static inline uint32_t entry_value_size(int32_t len) {
+  if (len == SST_VALUE_REF) return VLOG_REF_SIZE;
+  return len > 0 ? (uint32_t)len : 0;
+}
+
+static inline Key sstable_key(const SSTable *sst, int i) {
+  return (Key){ sst->key_pool + sst->key_offs[i], sst->key_offs[i + 1] - sst->key_offs[i] };
+}
+
+void sstable_init(SSTable *sst, unsigned long long id);
+int sstable_open(SSTable *sst, Bloom *bloom);
+int sstable_map(SSTable *sst);
+SSTResult sstable_get(SSTable *sst, Key key, char **value, int *length);
+SSTResult sstable_get_begin(SSTable *sst, Key key, SSTFrameRead *f, char **value, int *length);
+SSTResult sstable_get_end(SSTable *sst, const SSTFrameRead *f, const uint8_t *stored, Key key,
+                          char **value, int *length);
+void sstable_get_many(SSTable *sst, int n, const Key *keys, SSTResult *results, char **values, int *lengths);
+bool sstable_add(SSTable *sst, Key key, long offset);
+void sstable_close(SSTable *sst);
 
+int sstable_writer_open(SSTableWriter *w, SSTable *sst, Bloom *bloom, uint8_t *buf, size_t buf_cap,
+                        const char *seg_path, Codec codec, int level);
+int sstable_writer_parallel(SSTableWriter *w, int threads);
+int sstable_writer_direct(SSTableWriter *w, uint64_t expected);
+int sstable_writer_add(SSTableWriter *w, Key key, const char *value, int32_t length);
+int sstable_writer_finish(SSTableWriter *w);
+void sstable_writer_abort(SSTableWriter *w);
 
-void sstable_init(SSTable *sst, long *keys, long *offsets);
-const char* sstable_get(SSTable *sst, FILE* segment, long key);
-bool sstable_add(SSTable *sst, FILE* segment_idx, long key, long offset, int idx);
+void sstable_cursor_open(SSTableCursor *c, SSTable *sst);
+void sstable_cursor_init(SSTableCursor *c, SSTable *sst);
+bool sstable_cursor_next(SSTableCursor *c);
+bool sstable_cursor_seek_first(SSTableCursor *c);
+bool sstable_cursor_seek(SSTableCursor *c, Key key);
+void sstable_cursor_close(SSTableCursor *c);
 
 
 #endif
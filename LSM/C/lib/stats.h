@@ -0,0 +1,117 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cache.h"
+
+// Threads are spread over the shards round-robin, so a counter bump only
+// contends with the threads that share a shard.
+#define STATS_SHARDS 16
+
+// Latency buckets: exact below 2 * STATS_SUB ns, then STATS_SUB buckets
+// per power of two, about 6% apart.
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (2 * STATS_SUB + 60 * STATS_SUB)
+
+typedef enum {
+  STAT_GETS,
+  STAT_PUTS,
+  STAT_DELETES,
+  STAT_USER_BYTES_WRITTEN,   // keys and values handed to lsm_put/lsm_delete
+  STAT_USER_BYTES_READ,      // keys and values handed back by lookups
+  STAT_WAL_BYTES,            // log records appended
+  STAT_MEMTABLE_HITS,        // lookups answered by mem or imm
+  STAT_BLOOM_NEGATIVES,      // segments a filter ruled out
+  STAT_BLOOM_TRUE_POSITIVES,
+  STAT_BLOOM_FALSE_POSITIVES,
+  STAT_FRAMES_READ,          // read from a segment, cache misses only
+  STAT_FRAME_BYTES_READ,     // as stored
+  STAT_FRAMES_INFLATED,      // copied out or decompressed
+  STAT_FRAME_BYTES_INFLATED,
+  STAT_FRAME_RAW_BYTES,      // frame data handed to the writer's codec
+  STAT_FRAME_BYTES_WRITTEN,  // frames as stored
+  STAT_FLUSHES,
+  STAT_FLUSH_BYTES,          // segment files written by flushes
+  STAT_COMPACTIONS,
+  STAT_COMPACTION_BYTES_READ,
+  STAT_COMPACTION_BYTES_WRITTEN,
+  STAT_VLOG_BYTES_WRITTEN,   // value log records, by flushes and compactions
+  STAT_VLOG_BYTES_READ,
+  STAT_VLOG_GC_BYTES,        // records moved out of garbage-heavy files
+  STAT_COUNTERS
+} StatCounter;
+
+typedef enum {
+  STAT_HIST_GET,
+  STAT_HIST_PUT,    // puts and deletes
+  STAT_HIST_FLUSH,
+  STAT_HIST_COMPACTION,
+  STAT_HISTS
+} StatHist;
+
+typedef struct {
+  _Atomic uint64_t counters[STAT_COUNTERS];
+  _Atomic uint64_t buckets[STAT_HISTS][STATS_BUCKETS];
+  _Atomic uint64_t sum_ns[STAT_HISTS];
+  _Atomic uint64_t max_ns[STAT_HISTS];
+} __attribute__((aligned(64))) StatsShard;
+
+// Relaxed adds into the calling thread's shard; readers sum the shards, so
+// a snapshot taken while threads run may be off by the updates in flight.
+typedef struct {
+  StatsShard shards[STATS_SHARDS];
+} Stats;
+
+typedef struct {
+  uint64_t count;
+  uint64_t mean_ns;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+} LatencySummary;
+
+typedef struct {
+  uint64_t counters[STAT_COUNTERS];
+  LatencySummary latency[STAT_HISTS];
+  CacheStats cache;
+
+  // Gauges at the time of the snapshot.
+  int memtable_entries;
+  long memtable_bytes;       // value bytes in mem, live or not
+  long memtable_dead_bytes;
+  long memtable_limit;       // 0 for none
+  bool flush_pending;        // imm still waiting to be written
+  int segments;
+  uint64_t segment_bytes;
+  int max_level;
+  int vlog_files;
+  uint64_t vlog_bytes;
+
+  // Derived from the counters.
+  double write_amp;          // log, segment and value log bytes per user byte written
+  double read_amp;           // segment and value log bytes read per user byte read
+  double frames_per_get;
+  double bloom_false_positive_rate;
+} LSMStats;
+
+
+Stats *stats_new(void);
+void stats_free(Stats *s);
+uint64_t stats_now_ns(void);
+int stats_bucket(uint64_t ns);
+uint64_t stats_bucket_value(int b);
+void stats_add(Stats *s, StatCounter c, uint64_t n);
+void stats_record(Stats *s, StatHist h, uint64_t ns);
+void stats_collect(Stats *s, LSMStats *out);
+const char *stats_counter_name(StatCounter c);
+const char *stats_hist_name(StatHist h);
+void stats_dump(const LSMStats *st, FILE *f, bool json);
+
+
+#endif
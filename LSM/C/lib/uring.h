@@ -0,0 +1,71 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Descriptors up to this number can be registered with the ring; reads on
+// higher ones pass the descriptor with every request.
+#define RING_FILES 1024
+
+// One read in flight. buf is the pool slot the data lands in; done runs
+// from ring_reap with res set to the bytes read or -errno.
+typedef struct ReadOp {
+  void (*done)(struct ReadOp *op);
+  void *arg;
+  uint8_t *buf;
+  int slot;
+  int res;
+} ReadOp;
+
+// An io_uring instance driven through the raw system calls, with a pool
+// of fixed read buffers and a table of registered segment descriptors.
+// Not thread safe: each thread that reads through a ring owns one.
+typedef struct {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  void *cq_map;
+  size_t sq_map_len;
+  size_t cq_map_len;
+  size_t sqes_len;
+  unsigned to_submit;  // queued, not yet handed to the kernel
+  unsigned inflight;
+
+  uint8_t *pool;
+  size_t slot_bytes;
+  int n_slots;
+  int *free_slots;
+  int n_free;
+  bool fixed_bufs;     // the pool is registered, reads use READ_FIXED
+
+  // Segment id + 1 registered at each descriptor's slot, 0 for none.
+  // Segment files never change, so a slot whose descriptor was closed and
+  // reopened on the same segment still reads the right data. A registered
+  // file stays open until its slot is cleared with ring_unregister.
+  unsigned long long *file_ids;
+  bool fixed_files;
+} ReadRing;
+
+
+int ring_init(ReadRing *r, int n_slots, size_t slot_bytes);
+void ring_close(ReadRing *r);
+int ring_slot_get(ReadRing *r, ReadOp *op);
+void ring_slot_put(ReadRing *r, ReadOp *op);
+void ring_unregister(ReadRing *r, int fd);
+int ring_read(ReadRing *r, ReadOp *op, int fd, unsigned long long id, long offset, size_t len);
+int ring_submit(ReadRing *r);
+int ring_reap(ReadRing *r, unsigned min);
+
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+// The value slot of a memtable entry, kept in a pool parallel to the
+// nodes. length is -1 for a tombstone.
+typedef struct {
+  const char *value;
+  int length;
+} Value;
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef VERSION_H
+#define VERSION_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "bloom.h"
+#include "sstable.h"
+
+// A segment and its filter, shared by every version that lists it and
+// closed when the last of them goes. One a trivial move put at another
+// level shares base's table and filter and holds a ref on it instead.
+typedef struct Segment {
+  SSTable sst;
+  Bloom bloom;
+  atomic_int refs;
+  struct Segment *base;  // NULL unless moved
+} Segment;
+
+// An immutable list of segments, oldest to newest. Flushes and compactions
+// publish a new one instead of editing the current one, so readers walk
+// whatever version they loaded without taking the engine lock.
+typedef struct Version {
+  Segment **segs;
+  int n_segs;
+  int cap;
+  atomic_int refs;  // one while current or retired, plus pins
+  uint64_t retired_at;
+  struct Version *next_retired;
+} Version;
+
+// Edited only with the engine lock held; read by anyone.
+typedef struct {
+  _Atomic(Version *) current;
+  Version *retired;  // swapped out, waiting for readers to leave their epochs
+} VersionSet;
+
+static inline SSTable *version_table(Version *v, int i) {
+  return &v->segs[i]->sst;
+}
+
+static inline Bloom *version_bloom(Version *v, int i) {
+  return &v->segs[i]->bloom;
+}
+
+
+Segment *segment_new(const SSTable *sst, const Bloom *bloom);
+Version *version_new(int cap);
+int version_push(Version *v, Segment *s);
+Version *version_splice(Version *v, int first, int count, Segment *s);
+Version *version_move(Version *v, int first, int count, int level);
+void version_ref(Version *v);
+void version_unref(Version *v);
+
+void versions_init(VersionSet *vs, Version *v);
+Version *versions_current(VersionSet *vs);
+void versions_install(VersionSet *vs, Version *v);
+void versions_destroy(VersionSet *vs);
+
+
+#endif
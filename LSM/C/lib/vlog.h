@@ -0,0 +1,76 @@
+#ifndef VLOG_H
+#define VLOG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sstable.h"
+#include "stats.h"
+#include "version.h"
+
+#define VLOG_FILE_FMT "segments/vlog_%llu.log"
+
+// Value log: large values written once, to an append-only file of their
+// own, while the segments hold a VLOG_REF_SIZE pointer in their place.
+// Record: uint32 length | uint32 crc32 of the value | value.
+// Ref: uint64 file | uint64 offset of the record | uint32 length.
+// A file is written by one flush or compaction and named after its
+// segment id; it is never appended to afterwards.
+#define VLOG_RECORD_HEADER (2 * sizeof(uint32_t))
+
+typedef struct {
+  unsigned long long file;
+  uint64_t offset;
+  uint32_t length;
+} VlogRef;
+
+typedef struct {
+  unsigned long long id;
+  int fd;
+  uint64_t size;
+  int refs;  // segments that point into it
+} VlogFile;
+
+// The open files. Segments attach to the files their properties list
+// when they go live and detach when closed; the last one to detach from
+// a file deletes it, its values are all shadowed or rewritten elsewhere.
+struct ValueLog {
+  pthread_mutex_t mu;
+  VlogFile *files;
+  int n_files;
+  int cap;
+  bool keep_files;  // set while loading and closing: detaching deletes nothing
+  Stats *stats;
+};
+
+// Appends the records of one flush or compaction, created on the first.
+typedef struct {
+  FILE *f;
+  unsigned long long id;
+  uint64_t offset;
+  Stats *stats;
+} VlogWriter;
+
+
+void vlog_encode_ref(char *dst, VlogRef ref);
+VlogRef vlog_decode_ref(const char *src);
+
+int vlog_init(ValueLog *vl, Stats *stats);
+void vlog_destroy(ValueLog *vl);
+int vlog_attach(ValueLog *vl, SSTable *sst);
+void vlog_detach(SSTable *sst);
+int vlog_read(const SSTable *sst, const char *ref, char **value, int *length);
+uint64_t vlog_total_bytes(ValueLog *vl, int *files);
+int vlog_collectable(ValueLog *vl, Version *v, double ratio, unsigned long long **ids);
+bool vlog_refers(const SSTable *sst, const unsigned long long *ids, int n);
+void vlog_remove(unsigned long long id);
+
+void vlog_writer_init(VlogWriter *w, unsigned long long id, Stats *stats);
+int vlog_append(VlogWriter *w, const char *value, int length, char *ref);
+int vlog_writer_finish(VlogWriter *w);
+void vlog_writer_abort(VlogWriter *w);
+
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "key.h"
+
+#define WAL_FILE_FMT "segments/wal_%lld.log"
+
+typedef enum {
+  WAL_SYNC_ALWAYS,   // every commit waits for a (shared) fdatasync
+  WAL_SYNC_INTERVAL, // write on commit, fdatasync every sync_interval_ms
+  WAL_SYNC_NEVER     // write on commit, leave syncing to the kernel
+} WalSyncPolicy;
+
+typedef enum {
+  WAL_PUT = 1,
+  WAL_DELETE = 2
+} WalOp;
+
+// Record layout: crc32 | body_len | seq | op | uint16 key_len | key | len |
+// value. The crc covers everything after itself, len is -1 for deletes.
+// Logs from before byte keys hold an int64 key and no key_len, their op
+// lacks WAL_BYTE_KEY; they replay as key_from_long keys.
+#define WAL_BYTE_KEY 0x10
+
+// key only lives for the call, value as long as replay_buf.
+typedef void (*WalReplayFn)(void *arg, WalOp op, uint64_t seq, Key key, const char *value, int length);
+
+typedef struct {
+  int fd;
+  WalSyncPolicy policy;
+  int sync_interval_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t syncer;
+  bool has_syncer;
+  bool stop;
+
+  // Records accumulate in buf while a leader writes wbuf, then they swap.
+  uint8_t *buf;
+  size_t buf_len;
+  size_t buf_cap;
+  uint8_t *wbuf;
+  size_t wbuf_cap;
+
+  // Logical byte positions, monotonic across truncations.
+  uint64_t appended;
+  uint64_t written;
+  uint64_t synced;
+  bool leader;
+  int err;
+
+  // Keeps replayed values alive until the memtable holding them is flushed.
+  uint8_t *replay_buf;
+} Wal;
+
+
+int wal_open(Wal *w, const char *path, WalSyncPolicy policy, int sync_interval_ms);
+uint64_t wal_append(Wal *w, WalOp op, uint64_t seq, Key key, const char *value, int length);
+size_t wal_record_size(WalOp op, uint32_t key_len, int length);
+int wal_commit(Wal *w, uint64_t lsn);
+int wal_replay(Wal *w, WalReplayFn fn, void *arg);
+int wal_truncate(Wal *w);
+int wal_reopen(Wal *w, const char *path);
+void wal_close(Wal *w);
+
+
+#endif
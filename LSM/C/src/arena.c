@@ -0,0 +1,100 @@
+#include <stdlib.h>
+
+#include "../lib/arena.h"
+
+static ArenaChunk *chunk_new(size_t cap) {
+  ArenaChunk *c = malloc(sizeof(ArenaChunk) + cap);
+  if (!c) return NULL;
+  c->next = NULL;
+  c->cap = cap;
+  atomic_init(&c->used, 0);
+  return c;
+}
+
+void arena_init(Arena *a, size_t chunk_size) {
+  atomic_init(&a->head, NULL);
+  a->spare = NULL;
+  a->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+  atomic_init(&a->footprint, 0);
+  pthread_mutex_init(&a->grow, NULL);
+}
+
+// Links an oversized request's chunk behind the current one, which keeps
+// serving the small ones.
+static void *alloc_dedicated(Arena *a, size_t n) {
+  ArenaChunk *c = chunk_new(n);
+  if (!c) return NULL;
+  atomic_store_explicit(&c->used, n, memory_order_relaxed);
+  atomic_fetch_add(&a->footprint, sizeof(ArenaChunk) + n);
+
+  pthread_mutex_lock(&a->grow);
+  ArenaChunk *head = atomic_load(&a->head);
+  if (head) {
+    c->next = head->next;
+    head->next = c;
+  } else {
+    atomic_store(&a->head, c);
+  }
+  pthread_mutex_unlock(&a->grow);
+  return c->data;
+}
+
+void *arena_alloc(Arena *a, size_t n) {
+  if (n > a->chunk_size / 4) return alloc_dedicated(a, n);
+
+  for (;;) {
+    ArenaChunk *c = atomic_load_explicit(&a->head, memory_order_acquire);
+    if (c) {
+      size_t off = atomic_fetch_add_explicit(&c->used, n, memory_order_relaxed);
+      if (off + n <= c->cap) return c->data + off;
+    }
+
+    // Whoever finds the chunk full first replaces it; the rest retry.
+    pthread_mutex_lock(&a->grow);
+    if (atomic_load(&a->head) == c) {
+      ArenaChunk *fresh = a->spare;
+      a->spare = NULL;
+      if (!fresh) {
+        fresh = chunk_new(a->chunk_size);
+        if (fresh) atomic_fetch_add(&a->footprint, sizeof(ArenaChunk) + a->chunk_size);
+      }
+      if (!fresh) {
+        pthread_mutex_unlock(&a->grow);
+        return NULL;
+      }
+      atomic_store_explicit(&fresh->used, 0, memory_order_relaxed);
+      fresh->next = c;
+      atomic_store_explicit(&a->head, fresh, memory_order_release);
+    }
+    pthread_mutex_unlock(&a->grow);
+  }
+}
+
+size_t arena_footprint(Arena *a) {
+  return atomic_load(&a->footprint);
+}
+
+// Nothing may still use the memory. Keeps one standard chunk so a recycled
+// memtable does not go back to malloc for its first values.
+void arena_reset(Arena *a) {
+  ArenaChunk *c = atomic_exchange(&a->head, NULL);
+  while (c) {
+    ArenaChunk *next = c->next;
+    if (!a->spare && c->cap == a->chunk_size) {
+      c->next = NULL;
+      a->spare = c;
+    } else {
+      atomic_fetch_sub(&a->footprint, sizeof(ArenaChunk) + c->cap);
+      free(c);
+    }
+    c = next;
+  }
+}
+
+void arena_destroy(Arena *a) {
+  arena_reset(a);
+  if (a->spare) atomic_fetch_sub(&a->footprint, sizeof(ArenaChunk) + a->spare->cap);
+  free(a->spare);
+  a->spare = NULL;
+  pthread_mutex_destroy(&a->grow);
+}
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/async.h"
+#include "../lib/epoch.h"
+
+// A lookup in flight. It walks the segments of the version it pinned from
+// newest to oldest like lsm_get, and parks whenever a frame has to come
+// off the disk. A lookup that needs a frame another one is already
+// reading waits on that read instead of issuing its own.
+struct AsyncGet {
+  ReadOp io;          // first, ring completions point here
+  LSMAsync *a;
+  Version *ver;
+  int seg;            // segment being looked at
+  SSTFrameRead f;
+  bool reading;       // io is in flight for f
+  AsyncGet *followers;
+
+  char key_buf[KEY_MAX_SIZE];
+  Key key;            // in key_buf
+  LSMGetCallback cb;
+  void *arg;
+  uint64_t start;
+  uint64_t negatives;
+  uint64_t true_positives;
+  uint64_t false_positives;
+
+  int result;
+  char *value;
+  int length;
+  AsyncGet *next;     // in the free, done or followers list
+};
+
+static void step(AsyncGet *g);
+
+// The current version, referenced so it outlives the epoch it was read in.
+static Version *pin_version(LSM *l) {
+  int slot = epoch_enter();
+  if (slot < 0) pthread_mutex_lock(&l->lock);
+  Version *v = versions_current(&l->versions);
+  version_ref(v);
+  if (slot < 0) pthread_mutex_unlock(&l->lock);
+  else epoch_exit(slot);
+  return v;
+}
+
+static void finish(AsyncGet *g, int result) {
+  LSMAsync *a = g->a;
+  Stats *st = a->l->stats;
+  g->result = result;
+  if (g->ver) version_unref(g->ver);
+  g->ver = NULL;
+
+  if (st) {
+    stats_add(st, STAT_GETS, 1);
+    stats_add(st, STAT_BLOOM_NEGATIVES, g->negatives);
+    stats_add(st, STAT_BLOOM_TRUE_POSITIVES, g->true_positives);
+    stats_add(st, STAT_BLOOM_FALSE_POSITIVES, g->false_positives);
+    if (result == 1) stats_add(st, STAT_USER_BYTES_READ, g->key.len + (uint64_t)(g->length > 0 ? g->length : 0));
+    stats_record(st, STAT_HIST_GET, stats_now_ns() - g->start);
+  }
+
+  g->next = NULL;
+  if (a->done_tail) a->done_tail->next = g;
+  else a->done_head = g;
+  a->done_tail = g;
+}
+
+// Settles the lookup on what the current segment said; false when it does
+// not hold the key and the walk goes on.
+static bool resolve(AsyncGet *g, SSTResult r) {
+  if (r == SST_ABSENT) {
+    g->false_positives++;
+    return false;
+  }
+  g->true_positives++;
+  finish(g, r == SST_FOUND ? 1 : (r == SST_DELETED ? 0 : -1));
+  return true;
+}
+
+// Takes the frame another lookup here already has in flight, or starts
+// reading it. -1 when it cannot go through the ring.
+static int start_read(AsyncGet *g, SSTable *sst) {
+  LSMAsync *a = g->a;
+  if (!a->has_ring) return -1;
+  for (int i = 0; i < a->depth; i++) {
+    AsyncGet *o = &a->gets[i];
+    if (!o->reading || o->f.offset != g->f.offset || version_table(o->ver, o->seg)->id != sst->id) continue;
+    g->next = o->followers;
+    o->followers = g;
+    return 0;
+  }
+
+  if (ring_slot_get(&a->ring, &g->io) != 0) return -1;
+  if (ring_read(&a->ring, &g->io, sst->fd, sst->id, g->f.offset, (size_t)g->f.size) != 0) {
+    ring_slot_put(&a->ring, &g->io);
+    return -1;
+  }
+  g->reading = true;
+  return 0;
+}
+
+static void step(AsyncGet *g) {
+  for (; g->seg >= 0; g->seg--) {
+    if (!bloom_has(version_bloom(g->ver, g->seg), g->key)) {
+      g->negatives++;
+      continue;
+    }
+    SSTable *sst = version_table(g->ver, g->seg);
+    SSTResult r = sstable_get_begin(sst, g->key, &g->f, &g->value, &g->length);
+    if (r == SST_PENDING) {
+      if (start_read(g, sst) == 0) return;
+      r = sstable_get(sst, g->key, &g->value, &g->length);
+    }
+    if (resolve(g, r)) return;
+  }
+  finish(g, 0);
+}
+
+// A follower looks in the cache the leader just filled first, so the frame
+// is inflated once when there is a cache.
+static void read_done(ReadOp *op) {
+  AsyncGet *g = (AsyncGet *)op;
+  LSMAsync *a = g->a;
+  g->reading = false;
+  bool ok = op->res == g->f.size;
+
+  SSTable *sst = version_table(g->ver, g->seg);
+  SSTResult r = ok ? sstable_get_end(sst, &g->f, op->buf, g->key, &g->value, &g->length) : SST_ERROR;
+  AsyncGet *fl = g->followers;
+  g->followers = NULL;
+  while (fl) {
+    AsyncGet *next = fl->next;
+    SSTable *fs = version_table(fl->ver, fl->seg);
+    SSTResult fr = SST_ERROR;
+    if (ok) {
+      fr = sstable_get_begin(fs, fl->key, &fl->f, &fl->value, &fl->length);
+      if (fr == SST_PENDING) fr = sstable_get_end(fs, &fl->f, op->buf, fl->key, &fl->value, &fl->length);
+    }
+    if (!resolve(fl, fr)) {
+      fl->seg--;
+      step(fl);
+    }
+    fl = next;
+  }
+  ring_slot_put(&a->ring, op);
+
+  if (!resolve(g, r)) {
+    g->seg--;
+    step(g);
+  }
+}
+
+// Up to depth lookups in flight. Returns 0 and runs synchronously when
+// io_uring is not available.
+int lsm_async_init(LSM *l, LSMAsync *a, int depth) {
+  memset(a, 0, sizeof(*a));
+  if (depth < 1) return -1;
+  a->l = l;
+  a->depth = depth;
+  a->gets = calloc((size_t)depth, sizeof(AsyncGet));
+  if (!a->gets) return -1;
+  for (int i = depth - 1; i >= 0; i--) {
+    a->gets[i].a = a;
+    a->gets[i].io.done = read_done;
+    a->gets[i].io.slot = -1;
+    a->gets[i].next = a->free_gets;
+    a->free_gets = &a->gets[i];
+  }
+  a->has_ring = ring_init(&a->ring, depth + ASYNC_AHEAD_SLOTS, ASYNC_SLOT_BYTES) == 0;
+  if (!a->has_ring) fprintf(stderr, "io_uring unavailable, async lookups read synchronously\n");
+  return 0;
+}
+
+// Queues a lookup of key; cb runs from a later lsm_async_poll. With depth
+// lookups already pending it first polls until one is called back. Returns
+// -1 if that fails or key is longer than KEY_MAX_SIZE.
+int lsm_get_async(LSMAsync *a, Key key, LSMGetCallback cb, void *arg) {
+  if (key.len > KEY_MAX_SIZE) return -1;
+  while (!a->free_gets)
+    if (lsm_async_poll(a, 1) < 0) return -1;
+
+  AsyncGet *g = a->free_gets;
+  a->free_gets = g->next;
+  LSM *l = a->l;
+  if (key.len) memcpy(g->key_buf, key.data, key.len);
+  g->key = (Key){ g->key_buf, key.len };
+  g->cb = cb;
+  g->arg = arg;
+  g->start = l->stats ? stats_now_ns() : 0;
+  g->negatives = g->true_positives = g->false_positives = 0;
+  g->value = NULL;
+  g->length = 0;
+  g->ver = NULL;
+  a->pending++;
+
+  pthread_rwlock_rdlock(&l->mt_lock);
+  Value *v;
+  MtResult mr = mt_lookup(l->mem, g->key, &v);
+  if (mr == MT_ABSENT && l->imm) mr = mt_lookup(l->imm, g->key, &v);
+  int rc = 0;
+  if (mr == MT_FOUND) {
+    g->value = malloc(v->length > 0 ? (size_t)v->length : 1);
+    if (g->value) {
+      if (v->length > 0) memcpy(g->value, v->value, (size_t)v->length);
+      g->length = v->length;
+      rc = 1;
+    } else {
+      rc = -1;
+    }
+  }
+  pthread_rwlock_unlock(&l->mt_lock);
+
+  if (mr != MT_ABSENT) {
+    stats_add(l->stats, STAT_MEMTABLE_HITS, 1);
+    finish(g, rc);
+    return 0;
+  }
+  g->ver = pin_version(l);
+  g->seg = g->ver->n_segs - 1;
+  step(g);
+  if (a->has_ring) ring_submit(&a->ring);
+  return 0;
+}
+
+// Clears the ring's registrations of segments a compaction dropped, which
+// would otherwise keep their deleted files open. Runs once per version,
+// while no read is in flight.
+static void sweep_files(LSMAsync *a) {
+  ReadRing *r = &a->ring;
+  if (!a->has_ring || !r->fixed_files || r->inflight > 0) return;
+  Version *v = pin_version(a->l);
+  if (v == a->swept) {
+    version_unref(v);
+    return;
+  }
+  bool keep[RING_FILES] = { false };
+  for (int i = 0; i < v->n_segs; i++) {
+    SSTable *sst = version_table(v, i);
+    if (sst->fd >= 0 && sst->fd < RING_FILES && r->file_ids[sst->fd] == sst->id + 1) keep[sst->fd] = true;
+  }
+  for (int fd = 0; fd < RING_FILES; fd++)
+    if (r->file_ids[fd] != 0 && !keep[fd]) ring_unregister(r, fd);
+  if (a->swept) version_unref(a->swept);
+  a->swept = v;
+}
+
+// Runs the callbacks of finished lookups, waiting for reads until at least
+// min have run or nothing is pending. Returns how many ran, -1 if the ring
+// failed.
+int lsm_async_poll(LSMAsync *a, int min) {
+  int ran = 0;
+  char key_buf[KEY_MAX_SIZE];
+  sweep_files(a);
+  for (;;) {
+    while (a->done_head) {
+      AsyncGet *g = a->done_head;
+      a->done_head = g->next;
+      if (!a->done_head) a->done_tail = NULL;
+      Key key = { key_buf, g->key.len };
+      if (key.len) memcpy(key_buf, g->key.data, key.len);
+      int result = g->result, length = g->length;
+      char *value = result == 1 ? g->value : NULL;
+      LSMGetCallback cb = g->cb;
+      void *arg = g->arg;
+      // Free before the callback, which may submit again.
+      g->next = a->free_gets;
+      a->free_gets = g;
+      a->pending--;
+      cb(arg, key, result, value, length);
+      ran++;
+    }
+    if (ran >= min || a->pending == 0) return ran;
+    if (!a->has_ring || ring_reap(&a->ring, 1) < 0) return -1;
+  }
+}
+
+typedef struct {
+  char **values;
+  int *lengths;
+  int *results;
+  int remaining;
+} MultiGet;
+
+typedef struct {
+  MultiGet *m;
+  int idx;
+} MultiGetSlot;
+
+static void multi_get_done(void *arg, Key key, int result, char *value, int length) {
+  (void)key;
+  MultiGetSlot *s = (MultiGetSlot *)arg;
+  s->m->results[s->idx] = result;
+  if (result == 1) {
+    s->m->values[s->idx] = value;
+    s->m->lengths[s->idx] = length;
+  }
+  s->m->remaining--;
+}
+
+// lsm_multi_get through the ring: every key is submitted before any is
+// waited for, so the batch's frame reads are in flight together. Callbacks
+// of lookups submitted earlier may run meanwhile.
+int lsm_async_multi_get(LSMAsync *a, int n, const Key *keys, char **values, int *lengths, int *results) {
+  if (n <= 0) return 0;
+  MultiGetSlot *slots = malloc(sizeof(MultiGetSlot) * (size_t)n);
+  if (!slots) return -1;
+  MultiGet m = { values, lengths, results, n };
+  int rc = 0;
+  for (int i = 0; i < n && rc == 0; i++) {
+    slots[i].m = &m;
+    slots[i].idx = i;
+    rc = lsm_get_async(a, keys[i], multi_get_done, &slots[i]);
+    if (rc != 0) {
+      for (int j = i; j < n; j++) results[j] = -1;
+      m.remaining -= n - i;
+    }
+  }
+  while (m.remaining > 0)
+    if (lsm_async_poll(a, 1) < 0) {
+      rc = -1;
+      break;
+    }
+  free(slots);
+  return rc;
+}
+
+// Reads ahead of its segment cursors through a's ring from now on. The
+// iterator must be closed before a, on a's thread.
+void lsm_async_iter(LSMAsync *a, LSMIter *it) {
+  if (!a->has_ring) return;
+  for (int i = 0; i < it->n_srcs; i++)
+    if (it->srcs[i].is_table) it->srcs[i].cursor.ring = &a->ring;
+}
+
+// Calls back every pending lookup first.
+void lsm_async_close(LSMAsync *a) {
+  while (a->pending > 0)
+    if (lsm_async_poll(a, a->pending) < 0) break;
+  if (a->has_ring) ring_close(&a->ring);
+  if (a->swept) version_unref(a->swept);
+  free(a->gets);
+  memset(a, 0, sizeof(*a));
+}
@@ -1,9 +1,25 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BLOOM_AVX2 1
+#endif
 
 #include "../lib/bloom.h"
 
+// Keys probed ahead of the one being tested in bloom_has_many.
+#define BLOOM_BATCH 16
+
+// Odd multipliers picking one bit per word from the low hash half.
+static const uint32_t salts[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+    0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+
 static inline uint64_t mix64(uint64_t x) {
     x += 0x9e3779b97f4a7c15ULL;
     x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
@@ -11,6 +27,25 @@ static inline uint64_t mix64(uint64_t x) {
     return x ^ (x >> 31);
 }
 
+// The key folded to 64 bits for mix64: eight bytes at a time, then the
+// tail and the length. Older filters hashed the number itself.
+static inline uint64_t key_bits(const Bloom *b, Key key) {
+    if (b->long_keys) return (uint64_t)key_to_long(key);
+    uint64_t x = key.len;
+    uint32_t i = 0;
+    for (; i + 8 <= key.len; i += 8) {
+        uint64_t w;
+        memcpy(&w, key.data + i, 8);
+        x = mix64(x ^ w);
+    }
+    if (i < key.len) {
+        uint64_t w = 0;
+        memcpy(&w, key.data + i, key.len - i);
+        x = mix64(x ^ w);
+    }
+    return x;
+}
+
 static inline void set_bit(uint8_t *bits, size_t pos) {
     bits[pos >> 3] |= (uint8_t)(1u << (pos & 7));
 }
@@ -19,9 +54,58 @@ static inline bool get_bit(const uint8_t *bits, size_t pos) {
     return (bits[pos >> 3] & (uint8_t)(1u << (pos & 7))) != 0;
 }
 
-void bloom_put(Bloom *b, long key) {
+// High half picks the block without a division, low half the bits.
+static inline uint32_t *block_of(const Bloom *b, uint64_t h) {
+    uint64_t nblocks = b->nbytes / BLOOM_BLOCK_BYTES;
+    uint64_t idx = ((h >> 32) * nblocks) >> 32;
+    return (uint32_t *)(b->bitmasks + idx * BLOOM_BLOCK_BYTES);
+}
+
+static inline uint32_t word_mask(uint32_t h, int i) {
+    return 1u << ((h * salts[i]) >> 27);
+}
+
+#ifdef BLOOM_AVX2
+// All eight words tested with one compare: ~block & mask must be zero.
+__attribute__((target("avx2")))
+static bool block_has_avx2(const uint32_t *block, uint32_t h) {
+    __m256i salt = _mm256_loadu_si256((const __m256i *)salts);
+    __m256i shift = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int)h), salt), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), shift);
+    __m256i bits = _mm256_loadu_si256((const __m256i *)block);
+    return _mm256_testc_si256(bits, mask);
+}
+#endif
+
+static inline bool block_has(const uint32_t *block, uint32_t h) {
+#ifdef BLOOM_AVX2
+    if (__builtin_cpu_supports("avx2")) return block_has_avx2(block, h);
+#endif
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        uint32_t w;
+        memcpy(&w, block + i, sizeof(w));
+        if (!(w & word_mask(h, i))) return false;
+    }
+    return true;
+}
+
+void bloom_put(Bloom *b, Key key) {
+    if (b->nbytes == 0) return;
+
+    if (b->layout == BLOOM_BLOCKED) {
+        uint64_t h = mix64(key_bits(b, key));
+        uint32_t *block = block_of(b, h);
+        for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+            uint32_t w;
+            memcpy(&w, block + i, sizeof(w));
+            w |= word_mask((uint32_t)h, i);
+            memcpy(block + i, &w, sizeof(w));
+        }
+        return;
+    }
+
     size_t m = b->nbytes * 8u;
-    uint64_t x = (uint64_t)key;
+    uint64_t x = key_bits(b, key);
 
     uint64_t h1 = mix64(x);
     uint64_t h2 = mix64(x ^ 0xD6E8FEB86659FD93ULL);
@@ -32,9 +116,17 @@ void bloom_put(Bloom *b, long key) {
     }
 }
 
-bool bloom_has(Bloom *b, long key) {
+bool bloom_has(Bloom *b, Key key) {
+    // An empty filter has seen nothing it could rule out.
+    if (b->nbytes == 0) return true;
+
+    if (b->layout == BLOOM_BLOCKED) {
+        uint64_t h = mix64(key_bits(b, key));
+        return block_has(block_of(b, h), (uint32_t)h);
+    }
+
     size_t m = b->nbytes * 8u;
-    uint64_t x = (uint64_t)key;
+    uint64_t x = key_bits(b, key);
 
     uint64_t h1 = mix64(x);
     uint64_t h2 = mix64(x ^ 0xD6E8FEB86659FD93ULL);
@@ -46,8 +138,49 @@ bool bloom_has(Bloom *b, long key) {
     return true;
 }
 
+// Hashes a batch first and prefetches every block, so the misses of
+// neighbouring keys overlap instead of being paid one after another.
+void bloom_has_many(Bloom *b, const Key *keys, int n, bool *out) {
+    if (b->nbytes == 0 || b->layout != BLOOM_BLOCKED) {
+        for (int i = 0; i < n; i++) out[i] = bloom_has(b, keys[i]);
+        return;
+    }
+
+    uint64_t h[BLOOM_BATCH];
+    for (int base = 0; base < n; base += BLOOM_BATCH) {
+        int m = n - base < BLOOM_BATCH ? n - base : BLOOM_BATCH;
+        for (int i = 0; i < m; i++) {
+            h[i] = mix64(key_bits(b, keys[base + i]));
+            __builtin_prefetch(block_of(b, h[i]), 0, 1);
+        }
+        for (int i = 0; i < m; i++) out[base + i] = block_has(block_of(b, h[i]), (uint32_t)h[i]);
+    }
+}
+
 void bloom_init(Bloom *b, uint8_t *bitmasks, size_t nbytes, uint32_t k){
   b->bitmasks = bitmasks;
   b->nbytes = nbytes;
   b->k = k;
+  b->layout = BLOOM_CLASSIC;
+  b->long_keys = false;
+}
+
+// Uses whole blocks only; less than one block leaves the filter empty.
+void bloom_init_blocked(Bloom *b, uint8_t *bitmasks, size_t nbytes){
+  nbytes -= nbytes % BLOOM_BLOCK_BYTES;
+  b->bitmasks = bitmasks;
+  b->nbytes = bitmasks ? nbytes : 0;
+  b->k = BLOOM_BLOCK_WORDS;
+  b->layout = BLOOM_BLOCKED;
+  b->long_keys = false;
+}
+
+// Zeroed and cache-line aligned so no block straddles two lines. Release
+// with free().
+uint8_t *bloom_alloc(size_t nbytes){
+  if (nbytes == 0) return NULL;
+  size_t cap = (nbytes + 63) & ~(size_t)63;
+  uint8_t *p = aligned_alloc(64, cap);
+  if (p) memset(p, 0, cap);
+  return p;
 }
@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BTREE_AVX2 1
+#endif
+
+#include "../lib/btree.h"
+
+#define BT_HALF (BT_ORDER / 2)
+
+// Leaves are at least half full and inner nodes have at least BT_HALF + 1
+// children, so n entries need under n / 7 nodes plus one per level.
+static int node_count(int size) {
+  return size / (BT_HALF - 1) + BT_MAX_DEPTH + 2;
+}
+
+// With room to align the pool, which need not come from an aligned
+// allocation.
+size_t bt_pool_bytes(int size) {
+  return (size_t)node_count(size) * sizeof(BTNode) + _Alignof(BTNode);
+}
+
+static inline int64_t head_of(Key key) {
+  return (int64_t)(key_head(key) ^ (1ull << 63));
+}
+
+#ifdef BTREE_AVX2
+// Bit i set when heads[i] < head, or heads[i] > head with greater.
+__attribute__((target("avx2")))
+static unsigned compare_avx2(const int64_t *heads, int64_t head, bool greater) {
+  __m256i k = _mm256_set1_epi64x(head);
+  unsigned mask = 0;
+  for (int i = 0; i < BT_ORDER; i += 4) {
+    __m256i v = _mm256_load_si256((const __m256i *)(heads + i));
+    __m256i c = greater ? _mm256_cmpgt_epi64(v, k) : _mm256_cmpgt_epi64(k, v);
+    mask |= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(c)) << i;
+  }
+  return mask;
+}
+#endif
+
+// Keys of x below key (or at or below it with inclusive). Heads order the
+// keys bytewise, so only the run of heads equal to key's needs the keys.
+static inline int count_keys(const BTree *t, const BTNode *x, Key key, bool inclusive) {
+  int limit = inclusive ? 1 : 0;
+  int i = 0;
+  if (t->cmp != NULL) {
+    while (i < x->n && t->cmp->compare(x->keys[i], key) < limit) i++;
+    return i;
+  }
+  int64_t head = head_of(key);
+  int end = x->n;
+#ifdef BTREE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    unsigned live = (1u << x->n) - 1;
+    i = __builtin_popcount(compare_avx2(x->heads, head, false) & live);
+    end = x->n - __builtin_popcount(compare_avx2(x->heads, head, true) & live);
+  }
+#endif
+  while (i < end && x->heads[i] < head) i++;
+  while (i < end && key_compare_bytes(x->keys[i], key) < limit) i++;
+  return i;
+}
+
+// Where key goes in a leaf.
+static inline int count_less(const BTree *t, const BTNode *x, Key key) {
+  return count_keys(t, x, key, false);
+}
+
+// The child of an inner node to descend into, since each separator is the
+// smallest key of the child on its right.
+static inline int count_not_greater(const BTree *t, const BTNode *x, Key key) {
+  return count_keys(t, x, key, true);
+}
+
+static int new_node(BTree *t, bool leaf) {
+  int idx = t->next_node++;
+  BTNode *x = &t->nodes[idx];
+  x->n = 0;
+  x->next = 0;
+  x->leaf = leaf;
+  return idx;
+}
+
+void bt_init(BTree *t, void *pool, Value *values, int size) {
+  uintptr_t p = ((uintptr_t)pool + _Alignof(BTNode) - 1) & ~(uintptr_t)(_Alignof(BTNode) - 1);
+  t->nodes = (BTNode *)p;
+  t->node_cap = node_count(size);
+  t->values = values;
+  t->size = size;
+  t->cmp = NULL;
+  t->keys = NULL;
+  bt_reset(t);
+}
+
+void bt_reset(BTree *t) {
+  t->next_node = 1;
+  t->next_free = 1;
+  t->length = 0;
+  t->replaced_bytes = 0;
+  t->root = new_node(t, true);
+}
+
+// Room for one more entry: a value slot and a split on every level.
+bool bt_is_full(BTree *t) {
+  return t->next_free >= t->size - 1 || t->next_node + BT_MAX_DEPTH + 1 > t->node_cap;
+}
+
+// Descends to key's leaf, recording the nodes passed and the child taken.
+static int descend(BTree *t, Key key, int *path, int *child, int *depth) {
+  int x = t->root;
+  *depth = 0;
+  while (!t->nodes[x].leaf) {
+    int c = count_not_greater(t, &t->nodes[x], key);
+    if (path) {
+      path[*depth] = x;
+      child[*depth] = c;
+    }
+    (*depth)++;
+    x = t->nodes[x].slots[c];
+  }
+  return x;
+}
+
+int bt_find(BTree *t, Key key) {
+  int depth;
+  BTNode *x = &t->nodes[descend(t, key, NULL, NULL, &depth)];
+  int pos = count_less(t, x, key);
+  return pos < x->n && key_equal(x->keys[pos], key) ? x->slots[pos] : 0;
+}
+
+// Copies n keys into x from index at on, with their heads.
+static void set_keys(BTNode *x, int at, const Key *keys, int n) {
+  for (int i = 0; i < n; i++) {
+    x->keys[at + i] = keys[i];
+    x->heads[at + i] = head_of(keys[i]);
+  }
+}
+
+// Opens a gap at i for one more key.
+static void shift_keys(BTNode *x, int i) {
+  memmove(&x->keys[i + 1], &x->keys[i], sizeof(Key) * (size_t)(x->n - i));
+  memmove(&x->heads[i + 1], &x->heads[i], sizeof(int64_t) * (size_t)(x->n - i));
+}
+
+// Puts (key, right) after child c of inner node x, splitting it if full.
+// Returns the new right sibling and sets *up to the key moving up, or 0.
+static int insert_inner(BTree *t, int xi, int c, Key key, int right, Key *up) {
+  BTNode *x = &t->nodes[xi];
+  if (x->n < BT_ORDER) {
+    shift_keys(x, c);
+    memmove(&x->slots[c + 2], &x->slots[c + 1], sizeof(int) * (size_t)(x->n - c));
+    set_keys(x, c, &key, 1);
+    x->slots[c + 1] = right;
+    x->n++;
+    return 0;
+  }
+
+  Key keys[BT_ORDER + 1];
+  int children[BT_ORDER + 2];
+  memcpy(keys, x->keys, sizeof(Key) * (size_t)c);
+  keys[c] = key;
+  memcpy(&keys[c + 1], &x->keys[c], sizeof(Key) * (size_t)(BT_ORDER - c));
+  memcpy(children, x->slots, sizeof(int) * (size_t)(c + 1));
+  children[c + 1] = right;
+  memcpy(&children[c + 2], &x->slots[c + 1], sizeof(int) * (size_t)(BT_ORDER - c));
+
+  // BT_HALF keys stay, the next one moves up, the rest go right.
+  int ri = new_node(t, false);
+  BTNode *r = &t->nodes[ri];
+  x = &t->nodes[xi];
+  x->n = BT_HALF;
+  set_keys(x, 0, keys, BT_HALF);
+  memcpy(x->slots, children, sizeof(int) * (BT_HALF + 1));
+  *up = keys[BT_HALF];
+  r->n = BT_ORDER - BT_HALF;
+  set_keys(r, 0, &keys[BT_HALF + 1], r->n);
+  memcpy(r->slots, &children[BT_HALF + 1], sizeof(int) * (size_t)(r->n + 1));
+  return ri;
+}
+
+// Same for a leaf; the separator is the right half's first key.
+static int insert_leaf(BTree *t, int xi, int pos, Key key, int slot, Key *up) {
+  BTNode *x = &t->nodes[xi];
+  if (x->n < BT_ORDER) {
+    shift_keys(x, pos);
+    memmove(&x->slots[pos + 1], &x->slots[pos], sizeof(int) * (size_t)(x->n - pos));
+    set_keys(x, pos, &key, 1);
+    x->slots[pos] = slot;
+    x->n++;
+    return 0;
+  }
+
+  Key keys[BT_ORDER + 1];
+  int slots[BT_ORDER + 1];
+  memcpy(keys, x->keys, sizeof(Key) * (size_t)pos);
+  keys[pos] = key;
+  memcpy(&keys[pos + 1], &x->keys[pos], sizeof(Key) * (size_t)(BT_ORDER - pos));
+  memcpy(slots, x->slots, sizeof(int) * (size_t)pos);
+  slots[pos] = slot;
+  memcpy(&slots[pos + 1], &x->slots[pos], sizeof(int) * (size_t)(BT_ORDER - pos));
+
+  int ri = new_node(t, true);
+  BTNode *r = &t->nodes[ri];
+  x = &t->nodes[xi];
+  x->n = BT_HALF;
+  set_keys(x, 0, keys, BT_HALF);
+  memcpy(x->slots, slots, sizeof(int) * BT_HALF);
+  r->n = BT_ORDER + 1 - BT_HALF;
+  set_keys(r, 0, &keys[BT_HALF], r->n);
+  memcpy(r->slots, &slots[BT_HALF], sizeof(int) * (size_t)r->n);
+  r->next = x->next;
+  x->next = ri;
+  *up = r->keys[0];
+  return ri;
+}
+
+// length is -1 for a tombstone. Overwrites in place; returns false only
+// when a new key does not fit or cannot be copied.
+bool bt_put(BTree *t, Key key, const char *value, int length) {
+  int path[BT_MAX_DEPTH], child[BT_MAX_DEPTH], depth;
+  int leaf = descend(t, key, path, child, &depth);
+  BTNode *x = &t->nodes[leaf];
+  int pos = count_less(t, x, key);
+  if (pos < x->n && key_equal(x->keys[pos], key)) {
+    Value *v = &t->values[x->slots[pos]];
+    if (v->length > 0) t->replaced_bytes += v->length;
+    v->value = value;
+    v->length = length;
+    return true;
+  }
+  if (bt_is_full(t)) return false;
+
+  if (t->keys != NULL && key.len > 0) {
+    char *copy = arena_alloc(t->keys, key.len);
+    if (!copy) return false;
+    memcpy(copy, key.data, key.len);
+    key.data = copy;
+  }
+  int slot = t->next_free++;
+  t->values[slot].value = value;
+  t->values[slot].length = length;
+  t->length++;
+
+  Key up;
+  int right = insert_leaf(t, leaf, pos, key, slot, &up);
+  while (right != 0 && depth > 0) {
+    depth--;
+    right = insert_inner(t, path[depth], child[depth], up, right, &up);
+  }
+  if (right != 0) {
+    int root = new_node(t, false);
+    BTNode *r = &t->nodes[root];
+    r->n = 1;
+    set_keys(r, 0, &up, 1);
+    r->slots[0] = t->root;
+    r->slots[1] = right;
+    t->root = root;
+  }
+  return true;
+}
+
+// Position of the smallest key; *node is 0 when the tree is empty.
+void bt_first(BTree *t, int *node, int *pos) {
+  int x = t->root;
+  while (!t->nodes[x].leaf) x = t->nodes[x].slots[0];
+  *node = x;
+  *pos = -1;
+  bt_next(t, node, pos);
+}
+
+// Position of the first key at or after key; *node is 0 past the end.
+void bt_seek(BTree *t, Key key, int *node, int *pos) {
+  int depth;
+  *node = descend(t, key, NULL, NULL, &depth);
+  *pos = count_less(t, &t->nodes[*node], key);
+  if (*pos == t->nodes[*node].n) bt_next(t, node, pos);
+}
+
+void bt_next(BTree *t, int *node, int *pos) {
+  if (++*pos < t->nodes[*node].n) return;
+  *node = t->nodes[*node].next;
+  *pos = 0;
+}
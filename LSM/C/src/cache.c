@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/cache.h"
+
+static uint64_t cache_hash(unsigned long long segment_id, long offset) {
+  uint64_t h = (uint64_t)segment_id * 0x9E3779B97F4A7C15ull;
+  h ^= (uint64_t)offset * 0xC2B2AE3D27D4EB4Full;
+  return h ^ (h >> 29);
+}
+
+static CacheShard *shard_of(BlockCache *c, uint64_t hash) {
+  return &c->shards[hash % CACHE_SHARDS];
+}
+
+static CacheHandle **bucket_of(CacheShard *s, uint64_t hash) {
+  return &s->buckets[(hash / CACHE_SHARDS) & (s->nbuckets - 1)];
+}
+
+int block_cache_init(BlockCache *c, size_t capacity) {
+  memset(c, 0, sizeof(*c));
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *s = &c->shards[i];
+    s->nbuckets = 64;
+    s->buckets = calloc(s->nbuckets, sizeof(CacheHandle *));
+    if (!s->buckets) {
+      block_cache_destroy(c);
+      return -1;
+    }
+    s->capacity = capacity / CACHE_SHARDS;
+    pthread_mutex_init(&s->lock, NULL);
+  }
+  return 0;
+}
+
+static void unref(CacheHandle *h) {
+  if (--h->refs > 0) return;
+  free(h->data);
+  free(h);
+}
+
+static void grow_buckets(CacheShard *s) {
+  size_t n = s->nbuckets * 2;
+  CacheHandle **buckets = calloc(n, sizeof(CacheHandle *));
+  if (!buckets) return;  // longer chains, still correct
+
+  CacheHandle **old = s->buckets;
+  size_t old_n = s->nbuckets;
+  s->buckets = buckets;
+  s->nbuckets = n;
+  for (size_t i = 0; i < old_n; i++) {
+    CacheHandle *h = old[i];
+    while (h) {
+      CacheHandle *next = h->hnext;
+      CacheHandle **b = bucket_of(s, cache_hash(h->segment_id, h->offset));
+      h->hnext = *b;
+      *b = h;
+      h = next;
+    }
+  }
+  free(old);
+}
+
+// Drops h from the index and the ring; the cache's own reference goes with it.
+static void remove_entry(CacheShard *s, CacheHandle *h) {
+  CacheHandle **p = bucket_of(s, cache_hash(h->segment_id, h->offset));
+  while (*p != h) p = &(*p)->hnext;
+  *p = h->hnext;
+
+  if (h->next == h) {
+    s->hand = NULL;
+  } else {
+    if (s->hand == h) s->hand = h->next;
+    h->prev->next = h->next;
+    h->next->prev = h->prev;
+  }
+  s->used -= h->len;
+  s->count--;
+  unref(h);
+}
+
+// CLOCK: a referenced entry gets a second chance, pinned ones are skipped.
+// If everything is pinned the shard stays over capacity until releases.
+static void evict(CacheShard *s) {
+  size_t budget = 2 * s->count + 1;
+  while (s->used > s->capacity && s->hand && budget-- > 0) {
+    CacheHandle *h = s->hand;
+    if (h->refs > 1 || h->referenced) {
+      h->referenced = false;
+      s->hand = h->next;
+      continue;
+    }
+    remove_entry(s, h);
+  }
+}
+
+CacheHandle *block_cache_lookup(BlockCache *c, unsigned long long segment_id, long offset) {
+  uint64_t hash = cache_hash(segment_id, offset);
+  CacheShard *s = shard_of(c, hash);
+
+  pthread_mutex_lock(&s->lock);
+  CacheHandle *h = *bucket_of(s, hash);
+  while (h && (h->segment_id != segment_id || h->offset != offset)) h = h->hnext;
+  if (h) {
+    h->refs++;
+    h->referenced = true;
+    s->hits++;
+  } else {
+    s->misses++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return h;
+}
+
+// Takes ownership of data. If another reader cached the same frame first,
+// data is dropped and the resident copy is returned instead.
+CacheHandle *block_cache_insert(BlockCache *c, unsigned long long segment_id, long offset,
+                                uint8_t *data, uint32_t len) {
+  uint64_t hash = cache_hash(segment_id, offset);
+  CacheShard *s = shard_of(c, hash);
+
+  CacheHandle *n = calloc(1, sizeof(*n));
+  if (!n) {
+    free(data);
+    return NULL;
+  }
+  n->segment_id = segment_id;
+  n->offset = offset;
+  n->data = data;
+  n->len = len;
+  n->refs = 1;
+
+  // A frame larger than the whole shard is handed out uncached.
+  if (len > s->capacity) return n;
+
+  pthread_mutex_lock(&s->lock);
+  CacheHandle **b = bucket_of(s, hash);
+  CacheHandle *h = *b;
+  while (h && (h->segment_id != segment_id || h->offset != offset)) h = h->hnext;
+  if (h) {
+    h->refs++;
+    pthread_mutex_unlock(&s->lock);
+    free(n->data);
+    free(n);
+    return h;
+  }
+
+  n->refs++;
+  n->hnext = *b;
+  *b = n;
+  if (s->hand) {
+    // Just behind the hand, the last entry it will reach.
+    n->next = s->hand;
+    n->prev = s->hand->prev;
+    n->prev->next = n;
+    s->hand->prev = n;
+  } else {
+    n->next = n->prev = n;
+    s->hand = n;
+  }
+  s->used += len;
+  s->count++;
+  evict(s);
+  if (s->count > s->nbuckets) grow_buckets(s);
+  pthread_mutex_unlock(&s->lock);
+  return n;
+}
+
+void block_cache_release(BlockCache *c, CacheHandle *h) {
+  if (!h) return;
+  CacheShard *s = shard_of(c, cache_hash(h->segment_id, h->offset));
+  pthread_mutex_lock(&s->lock);
+  unref(h);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Frames of a replaced or removed segment can never be hit again; this
+// hands their memory back without waiting for the clock to reach them.
+void block_cache_erase_segment(BlockCache *c, unsigned long long segment_id) {
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *s = &c->shards[i];
+    pthread_mutex_lock(&s->lock);
+    for (size_t b = 0; b < s->nbuckets; b++) {
+      CacheHandle *h = s->buckets[b];
+      while (h) {
+        CacheHandle *next = h->hnext;
+        if (h->segment_id == segment_id) remove_entry(s, h);
+        h = next;
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+void block_cache_stats(BlockCache *c, CacheStats *out) {
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *s = &c->shards[i];
+    pthread_mutex_lock(&s->lock);
+    out->hits += s->hits;
+    out->misses += s->misses;
+    out->used += s->used;
+    out->entries += s->count;
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+// Every handle must have been released.
+void block_cache_destroy(BlockCache *c) {
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *s = &c->shards[i];
+    if (!s->buckets) continue;
+    for (size_t b = 0; b < s->nbuckets; b++) {
+      CacheHandle *h = s->buckets[b];
+      while (h) {
+        CacheHandle *next = h->hnext;
+        remove_entry(s, h);
+        h = next;
+      }
+    }
+    free(s->buckets);
+    s->buckets = NULL;
+    pthread_mutex_destroy(&s->lock);
+  }
+}
@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef LSM_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef LSM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "../lib/codec.h"
+
+// Per-thread state reused across frames: one growable buffer plus the
+// zstd contexts, all released when the thread exits.
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+#ifdef LSM_HAVE_ZSTD
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+#endif
+} Scratch;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *p) {
+  Scratch *s = (Scratch *)p;
+  free(s->buf);
+#ifdef LSM_HAVE_ZSTD
+  ZSTD_freeCCtx(s->cctx);
+  ZSTD_freeDCtx(s->dctx);
+#endif
+  free(s);
+}
+
+static void scratch_key_init(void) {
+  pthread_key_create(&scratch_key, scratch_free);
+}
+
+static Scratch *scratch_get(void) {
+  pthread_once(&scratch_once, scratch_key_init);
+  Scratch *s = pthread_getspecific(scratch_key);
+  if (s) return s;
+
+  s = calloc(1, sizeof(*s));
+  if (!s) return NULL;
+  if (pthread_setspecific(scratch_key, s) != 0) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+// The calling thread's buffer, grown to at least len. Valid until the next
+// call from the same thread.
+uint8_t *codec_scratch(size_t len) {
+  Scratch *s = scratch_get();
+  if (!s) return NULL;
+  if (s->cap < len) {
+    size_t cap = s->cap ? s->cap : 4096;
+    while (cap < len) cap *= 2;
+    uint8_t *buf = realloc(s->buf, cap);
+    if (!buf) return NULL;
+    s->buf = buf;
+    s->cap = cap;
+  }
+  return s->buf;
+}
+
+bool codec_supported(Codec c) {
+  switch (c) {
+  case CODEC_NONE:
+  case CODEC_ZLIB:
+    return true;
+#ifdef LSM_HAVE_LZ4
+  case CODEC_LZ4:
+    return true;
+#endif
+#ifdef LSM_HAVE_ZSTD
+  case CODEC_ZSTD:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+const char *codec_name(Codec c) {
+  switch (c) {
+  case CODEC_NONE: return "none";
+  case CODEC_ZLIB: return "zlib";
+  case CODEC_LZ4:  return "lz4";
+  case CODEC_ZSTD: return "zstd";
+  }
+  return "unknown";
+}
+
+size_t codec_bound(Codec c, size_t len) {
+  switch (c) {
+  case CODEC_ZLIB:
+    return compressBound((uLong)len);
+#ifdef LSM_HAVE_LZ4
+  case CODEC_LZ4:
+    return (size_t)LZ4_compressBound((int)len);
+#endif
+#ifdef LSM_HAVE_ZSTD
+  case CODEC_ZSTD:
+    return ZSTD_compressBound(len);
+#endif
+  default:
+    return len;
+  }
+}
+
+// Returns the compressed length, or -1. level 0 picks the codec's default.
+long codec_compress(Codec c, int level, const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  switch (c) {
+  case CODEC_NONE:
+    if (len > cap) return -1;
+    memcpy(dst, src, len);
+    return (long)len;
+
+  case CODEC_ZLIB: {
+    uLongf dst_len = (uLongf)cap;
+    int zlevel = level ? level : Z_DEFAULT_COMPRESSION;
+    if (compress2(dst, &dst_len, src, (uLong)len, zlevel) != Z_OK) return -1;
+    return (long)dst_len;
+  }
+
+#ifdef LSM_HAVE_LZ4
+  case CODEC_LZ4: {
+    // For LZ4 the level is the acceleration: higher is faster and larger.
+    int n = LZ4_compress_fast((const char *)src, (char *)dst, (int)len, (int)cap, level > 0 ? level : 1);
+    return n > 0 ? (long)n : -1;
+  }
+#endif
+
+#ifdef LSM_HAVE_ZSTD
+  case CODEC_ZSTD: {
+    Scratch *s = scratch_get();
+    if (!s) return -1;
+    if (!s->cctx && !(s->cctx = ZSTD_createCCtx())) return -1;
+    size_t n = ZSTD_compressCCtx(s->cctx, dst, cap, src, len, level);
+    return ZSTD_isError(n) ? -1 : (long)n;
+  }
+#endif
+
+  default:
+    return -1;
+  }
+}
+
+// Inflates exactly ulen bytes into dst. Returns 0, or -1 on a corrupt frame
+// or a codec this build does not have.
+int codec_decompress(Codec c, const uint8_t *src, size_t len, uint8_t *dst, size_t ulen) {
+  switch (c) {
+  case CODEC_NONE:
+    if (len != ulen) return -1;
+    memcpy(dst, src, len);
+    return 0;
+
+  case CODEC_ZLIB: {
+    uLongf dst_len = (uLongf)ulen;
+    if (uncompress(dst, &dst_len, src, (uLong)len) != Z_OK) return -1;
+    return dst_len == ulen ? 0 : -1;
+  }
+
+#ifdef LSM_HAVE_LZ4
+  case CODEC_LZ4: {
+    int n = LZ4_decompress_safe((const char *)src, (char *)dst, (int)len, (int)ulen);
+    return n == (int)ulen ? 0 : -1;
+  }
+#endif
+
+#ifdef LSM_HAVE_ZSTD
+  case CODEC_ZSTD: {
+    Scratch *s = scratch_get();
+    if (!s) return -1;
+    if (!s->dctx && !(s->dctx = ZSTD_createDCtx())) return -1;
+    size_t n = ZSTD_decompressDCtx(s->dctx, dst, ulen, src, len);
+    return !ZSTD_isError(n) && n == ulen ? 0 : -1;
+  }
+#endif
+
+  default:
+    return -1;
+  }
+}
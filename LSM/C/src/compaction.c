@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../lib/compaction.h"
+#include "../lib/lsm.h"
+#include "../lib/manifest.h"
+#include "../lib/sstable.h"
+#include "../lib/version.h"
+#include "../lib/vlog.h"
+
+// A level whose budget is exceeded merges into the one below it, or, with
+// nothing below to merge with, moves down as it is.
+static bool pick_leveled(LSM *l, Version *v, int *first, int *out_level, bool *move) {
+  int l0 = 0;
+  int max_level = 0;
+  for (int i = 0; i < v->n_segs; i++) {
+    if (version_table(v, i)->level == 0) l0++;
+    if (version_table(v, i)->level > max_level) max_level = version_table(v, i)->level;
+  }
+
+  // Levels only get older going down, so every level is a contiguous
+  // stretch of the version and a level plus the one below it is too.
+  if (l0 >= l->opts.l0_compaction_trigger) {
+    int i = v->n_segs;
+    while (i > 0 && version_table(v, i-1)->level <= 1) i--;
+    *first = i;
+    *out_level = 1;
+    return v->n_segs - i > 1;
+  }
+
+  long budget = l->opts.level_base_bytes;
+  for (int level = 1; level <= max_level; level++, budget *= l->opts.level_ratio) {
+    long bytes = 0;
+    int start = -1;
+    for (int i = 0; i < v->n_segs; i++) {
+      if (version_table(v, i)->level != level) continue;
+      bytes += version_table(v, i)->size;
+      if (start < 0) start = i;
+    }
+    if (start < 0 || bytes <= budget) continue;
+
+    *move = start == 0 || version_table(v, start-1)->level != level + 1;
+    while (start > 0 && version_table(v, start-1)->level == level + 1) start--;
+    *first = start;
+    *out_level = level + 1;
+    return true;
+  }
+  return false;
+}
+
+// The oldest run of at least tier_min_width segments whose sizes are
+// within a factor of two of each other.
+static bool pick_size_tiered(LSM *l, Version *v, int *first, int *count) {
+  int width = l->opts.tier_min_width;
+  for (int s = 0; s + width <= v->n_segs; s++) {
+    long lo = version_table(v, s)->size;
+    long hi = lo;
+    int e = s + 1;
+    while (e < v->n_segs) {
+      long size = version_table(v, e)->size;
+      long nlo = size < lo ? size : lo;
+      long nhi = size > hi ? size : hi;
+      if (nhi > 2 * nlo) break;
+      lo = nlo;
+      hi = nhi;
+      e++;
+    }
+    if (e - s >= width) {
+      *first = s;
+      *count = e - s;
+      return true;
+    }
+  }
+  return false;
+}
+
+// With no merge due, the oldest segment pointing into one of the gc files
+// is rewritten on its own, in place. Each rewrite leaves one segment fewer
+// pointing into them, and once none does they are deleted.
+static bool pick_vlog_gc(Version *v, const unsigned long long *gc, int n_gc, int *first, int *out_level) {
+  for (int i = 0; i < v->n_segs && n_gc > 0; i++) {
+    if (!vlog_refers(version_table(v, i), gc, n_gc)) continue;
+    *first = i;
+    *out_level = version_table(v, i)->level;
+    return true;
+  }
+  return false;
+}
+
+// Called with l->lock held. With job == NULL only reports whether there is
+// work, changing nothing.
+bool compaction_pick(LSM *l, CompactionJob *job) {
+  int first = 0;
+  int count = 0;
+  int out_level = 0;
+  bool move = false;
+  Version *v = versions_current(&l->versions);
+
+  if (l->opts.compaction == COMPACTION_LEVELED) {
+    if (pick_leveled(l, v, &first, &out_level, &move)) {
+      count = v->n_segs - first;
+      // Leave L0 segments flushed after the run alone when merging deeper levels.
+      if (out_level > 1) {
+        int end = first;
+        while (end < v->n_segs && version_table(v, end)->level >= out_level - 1) end++;
+        count = end - first;
+      }
+    }
+  } else if (l->opts.compaction == COMPACTION_SIZE_TIERED) {
+    if (!pick_size_tiered(l, v, &first, &count)) count = 0;
+  } else {
+    return false;
+  }
+
+  unsigned long long *gc;
+  int n_gc = vlog_collectable(&l->vlog, v, l->opts.vlog_gc_ratio, &gc);
+  if (n_gc < 0) return false;
+  if (count < 1 && pick_vlog_gc(v, gc, n_gc, &first, &out_level)) count = 1;
+  if (count < 1 || !job) {
+    free(gc);
+    return count >= 1;
+  }
+
+  memset(job, 0, sizeof(*job));
+  job->move = move;
+  job->ids = malloc(sizeof(unsigned long long) * (size_t)count);
+  if (!move) job->inputs = malloc(sizeof(SSTable) * (size_t)count);
+  if (!job->ids || (!move && !job->inputs)) {
+    free(job->inputs);
+    free(job->ids);
+    free(gc);
+    return false;
+  }
+
+  job->count = count;
+  job->out_level = out_level;
+  if (move) {
+    for (int i = 0; i < count; i++) job->ids[i] = version_table(v, first + i)->id;
+    free(gc);
+    return true;
+  }
+  job->out_id = l->next_segment_id++;
+  job->bottommost = first == 0;
+  job->bloom_bytes = 0;
+  job->codec = l->opts.codec;
+  job->codec_level = l->opts.codec_level;
+  job->direct = l->opts.direct_writes;
+  job->cmp = l->cmp;
+  job->stats = l->stats;
+  job->vlog_threshold = l->opts.vlog_threshold;
+  job->gc_files = gc;
+  job->n_gc_files = n_gc;
+  for (int i = 0; i < count; i++) {
+    job->inputs[i] = *version_table(v, first + i);
+    // Counted as compaction input rather than as frames read for lookups.
+    job->inputs[i].stats = NULL;
+    job->ids[i] = version_table(v, first + i)->id;
+    // Unfiltered inputs make the output unfiltered as well.
+    if (job->bloom_bytes != (size_t)-1) {
+      if (version_bloom(v, first + i)->nbytes == 0) job->bloom_bytes = (size_t)-1;
+      else job->bloom_bytes += version_bloom(v, first + i)->nbytes;
+    }
+  }
+  if (job->bloom_bytes == (size_t)-1) job->bloom_bytes = 0;
+  return true;
+}
+
+typedef struct {
+  SSTableCursor *cursors;
+  int *heap;
+  int len;
+  const Comparator *cmp;
+} MergeHeap;
+
+// Smallest key on top; on equal keys the newer input (higher index) wins.
+static bool heap_less(MergeHeap *h, int a, int b) {
+  int c = key_compare(h->cmp, h->cursors[a].key, h->cursors[b].key);
+  if (c != 0) return c < 0;
+  return a > b;
+}
+
+static void heap_sift_down(MergeHeap *h, int i) {
+  for (;;) {
+    int l = 2 * i + 1;
+    int r = l + 1;
+    int m = i;
+    if (l < h->len && heap_less(h, h->heap[l], h->heap[m])) m = l;
+    if (r < h->len && heap_less(h, h->heap[r], h->heap[m])) m = r;
+    if (m == i) return;
+    int tmp = h->heap[i];
+    h->heap[i] = h->heap[m];
+    h->heap[m] = tmp;
+    i = m;
+  }
+}
+
+static void heap_sift_up(MergeHeap *h, int i) {
+  while (i > 0) {
+    int p = (i - 1) / 2;
+    if (!heap_less(h, h->heap[i], h->heap[p])) return;
+    int tmp = h->heap[i];
+    h->heap[i] = h->heap[p];
+    h->heap[p] = tmp;
+    i = p;
+  }
+}
+
+static bool collected(const CompactionJob *job, unsigned long long file) {
+  for (int i = 0; i < job->n_gc_files; i++)
+    if (job->gc_files[i] == file) return true;
+  return false;
+}
+
+// Adds the newest version of a key to the output, moving its value to vw
+// when it sits in a file being collected or is inline but large enough to
+// be separated, e.g. written before the threshold was set.
+static int add_entry(CompactionJob *job, SSTableWriter *w, VlogWriter *vw, SSTableCursor *c) {
+  const char *value = c->value;
+  int32_t len = c->length;
+  char *moved = NULL;
+  if (len == SST_VALUE_REF && collected(job, vlog_decode_ref(value).file)) {
+    int n;
+    if (vlog_read(c->sst, value, &moved, &n) != 0) return -1;
+    stats_add(job->stats, STAT_VLOG_GC_BYTES, VLOG_RECORD_HEADER + (uint64_t)n);
+    value = moved;
+    len = n;
+  }
+
+  char ref[VLOG_REF_SIZE];
+  int rc = 0;
+  if (job->vlog_threshold > 0 && len >= job->vlog_threshold) {
+    rc = vlog_append(vw, value, len, ref);
+    value = ref;
+    len = SST_VALUE_REF;
+  }
+  if (rc == 0) rc = sstable_writer_add(w, c->key, value, len);
+  free(moved);
+  return rc;
+}
+
+// Runs without the engine lock: inputs are immutable and their
+// descriptors stay open until compaction_install swaps them out. The
+// output is not live until its manifest edit is.
+int compaction_run(CompactionJob *job, SSTable *out, Bloom *bloom) {
+  unsigned long long id = job->out_id;
+  char seg_path[256];
+  snprintf(seg_path, sizeof(seg_path), SEGMENT_FILE_FMT, id);
+
+  uint64_t start = job->stats ? stats_now_ns() : 0;
+  sstable_init(out, id);
+  out->level = job->out_level;
+  out->stats = job->stats;
+  out->cmp = job->cmp;
+  for (int i = 0; i < job->count; i++)
+    if (job->inputs[i].largest_seq > out->largest_seq) out->largest_seq = job->inputs[i].largest_seq;
+  uint8_t *bitmasks = bloom_alloc(job->bloom_bytes);
+  bloom_init_blocked(bloom, bitmasks, job->bloom_bytes);
+
+  uint8_t *buf = malloc(BLOCK_SIZE);
+  SSTableCursor *cursors = malloc(sizeof(SSTableCursor) * (size_t)job->count);
+  int *heap = malloc(sizeof(int) * (size_t)job->count);
+  SSTableWriter w;
+  if (!buf || !cursors || !heap ||
+      sstable_writer_open(&w, out, bloom, buf, BLOCK_SIZE, seg_path,
+                          job->codec, job->codec_level) != 0) {
+    free(buf);
+    free(cursors);
+    free(heap);
+    free(bitmasks);
+    return -1;
+  }
+  if (job->direct) {
+    uint64_t expected = job->bloom_bytes;
+    for (int i = 0; i < job->count; i++) expected += (uint64_t)job->inputs[i].size;
+    if (sstable_writer_direct(&w, expected) != 0)
+      fprintf(stderr, "compaction: O_DIRECT unavailable, writing through the page cache\n");
+  }
+
+  VlogWriter vw;
+  vlog_writer_init(&vw, id, job->stats);
+  MergeHeap h = { .cursors = cursors, .heap = heap, .len = 0, .cmp = job->cmp };
+  int rc = 0;
+  for (int i = 0; i < job->count; i++) {
+    sstable_cursor_init(&cursors[i], &job->inputs[i]);
+    if (cursors[i].err) rc = -1;
+    if (cursors[i].valid) {
+      heap[h.len++] = i;
+      heap_sift_up(&h, h.len - 1);
+    }
+  }
+
+  bool have_last = false;
+  char last[KEY_MAX_SIZE];
+  uint32_t last_len = 0;
+  while (rc == 0 && h.len > 0) {
+    int top = heap[0];
+    SSTableCursor *c = &cursors[top];
+
+    // The first time a key comes off the heap it is the newest version.
+    if (!have_last || !key_equal(c->key, (Key){ last, last_len })) {
+      have_last = true;
+      memcpy(last, c->key.data, c->key.len);
+      last_len = c->key.len;
+      bool drop = c->length == -1 && job->bottommost;
+      if (!drop && add_entry(job, &w, &vw, c) != 0) {
+        rc = -1;
+        break;
+      }
+    }
+
+    if (sstable_cursor_next(c)) {
+      heap_sift_down(&h, 0);
+    } else {
+      if (c->err) rc = -1;
+      heap[0] = heap[--h.len];
+      heap_sift_down(&h, 0);
+    }
+  }
+
+  for (int i = 0; i < job->count; i++) sstable_cursor_close(&cursors[i]);
+  free(cursors);
+  free(heap);
+
+  if (rc == 0) rc = vlog_writer_finish(&vw);
+  if (rc == 0) rc = sstable_writer_finish(&w);
+  // Both files must be found again once the manifest names the output.
+  if (rc == 0 && manifest_sync_dir() != 0) {
+    perror("fsync segments");
+    rc = -1;
+  }
+  free(buf);
+  if (rc != 0) {
+    fprintf(stderr, "compaction into segment %llu failed\n", id);
+    vlog_writer_abort(&vw);
+    sstable_writer_abort(&w);
+    sstable_close(out);
+    free(bitmasks);
+    bloom->bitmasks = NULL;
+    return -1;
+  }
+  if (job->stats) {
+    uint64_t read = 0;
+    for (int i = 0; i < job->count; i++) read += (uint64_t)job->inputs[i].size;
+    stats_add(job->stats, STAT_COMPACTIONS, 1);
+    stats_add(job->stats, STAT_COMPACTION_BYTES_READ, read);
+    stats_add(job->stats, STAT_COMPACTION_BYTES_WRITTEN, (uint64_t)out->size);
+    stats_record(job->stats, STAT_HIST_COMPACTION, stats_now_ns() - start);
+  }
+  return 0;
+}
+
+// Where the job's run starts in v, or -1 if it is no longer there.
+static int find_run(Version *v, const CompactionJob *job) {
+  int first = -1;
+  for (int i = 0; i < v->n_segs; i++) {
+    if (version_table(v, i)->id == job->ids[0]) {
+      first = i;
+      break;
+    }
+  }
+  if (first < 0 || first + job->count > v->n_segs ||
+      version_table(v, first + job->count - 1)->id != job->ids[job->count - 1]) {
+    fprintf(stderr, "compaction: input run changed under the job\n");
+    return -1;
+  }
+  return first;
+}
+
+// Called with l->lock held. A trivial move publishes the run at its new
+// level in a version of its own, once the manifest has it there.
+int compaction_move(LSM *l, CompactionJob *job) {
+  Version *v = versions_current(&l->versions);
+  int first = find_run(v, job);
+  if (first < 0) return -1;
+  Version *nv = version_move(v, first, job->count, job->out_level);
+  ManifestTable *added = malloc(sizeof(ManifestTable) * (size_t)job->count);
+  if (!nv || !added) {
+    if (nv) version_unref(nv);
+    free(added);
+    return -1;
+  }
+  for (int i = 0; i < job->count; i++) manifest_describe(&added[i], version_table(nv, first + i));
+  VersionEdit e = {
+    .added = added, .n_added = job->count,
+    .next_segment_id = l->next_segment_id, .last_seq = l->last_seq,
+  };
+  int rc = manifest_apply(&l->manifest, &e);
+  free(added);
+  if (rc != 0) {
+    fprintf(stderr, "compaction: level change not recorded\n");
+    version_unref(nv);
+    return -1;
+  }
+  versions_install(&l->versions, nv);
+  return 0;
+}
+
+// Called with l->lock held. The inputs leave the engine with the version
+// that replaces them; each is closed once no version lists it, which is
+// after every reader that could have loaded the old one has left.
+int compaction_install(LSM *l, CompactionJob *job, SSTable *out, Bloom *bloom) {
+  char out_seg[256], seg[256], idx[256];
+  snprintf(out_seg, sizeof(out_seg), SEGMENT_FILE_FMT, out->id);
+
+  Version *v = versions_current(&l->versions);
+  int first = find_run(v, job);
+  if (first < 0) goto fail;
+
+  out->cache = l->block_cache;
+  if (l->opts.mmap_reads) sstable_map(out);
+  if (vlog_attach(&l->vlog, out) != 0) goto fail;
+  Segment *s = segment_new(out, bloom);
+  if (!s) goto fail;
+  Version *nv = version_splice(v, first, job->count, s);
+  if (!nv) {
+    free(s);
+    goto fail;
+  }
+
+  // One edit swaps the inputs for the output; their files go after it.
+  ManifestTable t;
+  manifest_describe(&t, out);
+  VersionEdit e = {
+    .removed = job->ids, .n_removed = job->count,
+    .added = &t, .n_added = 1,
+    .next_segment_id = l->next_segment_id, .last_seq = l->last_seq,
+  };
+  if (manifest_apply(&l->manifest, &e) != 0) {
+    unlink(out_seg);
+    vlog_remove(out->id);
+    version_unref(nv);
+    return -1;
+  }
+  versions_install(&l->versions, nv);
+
+  // Readers still inside an input keep the open descriptor or mapping. The
+  // value log files only the inputs pointed into go once they are closed.
+  for (int i = 0; i < job->count; i++) {
+    // Legacy inputs leave an index file behind, the output has none.
+    snprintf(idx, sizeof(idx), SEGMENT_FILE_INDEX_FMT, job->ids[i]);
+    unlink(idx);
+    snprintf(seg, sizeof(seg), SEGMENT_FILE_FMT, job->ids[i]);
+    unlink(seg);
+  }
+  return 0;
+
+fail:
+  unlink(out_seg);
+  vlog_remove(out->id);
+  sstable_close(out);
+  free(bloom->bitmasks);
+  return -1;
+}
+
+void compaction_job_free(CompactionJob *job) {
+  free(job->inputs);
+  free(job->ids);
+  free(job->gc_files);
+  job->inputs = NULL;
+  job->ids = NULL;
+  job->gc_files = NULL;
+}
+
+void *compaction_main(void *arg) {
+  LSM *l = (LSM *)arg;
+
+  pthread_mutex_lock(&l->lock);
+  while (!l->stopping) {
+    CompactionJob job;
+    if (l->compaction_failed || !compaction_pick(l, &job)) {
+      pthread_cond_wait(&l->compact_cond, &l->lock);
+      continue;
+    }
+    if (job.move) {
+      l->compaction_failed = compaction_move(l, &job) != 0;
+      compaction_job_free(&job);
+      pthread_cond_broadcast(&l->compact_cond);
+      continue;
+    }
+
+    l->compacting = true;
+    pthread_mutex_unlock(&l->lock);
+
+    SSTable out;
+    Bloom bloom;
+    int rc = compaction_run(&job, &out, &bloom);
+
+    pthread_mutex_lock(&l->lock);
+    if (rc == 0) rc = compaction_install(l, &job, &out, &bloom);
+    compaction_job_free(&job);
+    l->compacting = false;
+    // Retried after the next flush rather than in a tight loop.
+    l->compaction_failed = rc != 0;
+    pthread_cond_broadcast(&l->compact_cond);
+  }
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
@@ -0,0 +1,79 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "../lib/epoch.h"
+
+// One per reader thread, on its own cache line so announcing an epoch
+// never bounces a line another reader is using.
+typedef struct {
+  _Atomic uint64_t epoch;  // 0 while outside
+  atomic_bool used;
+  int depth;               // touched by the owner only, for nested sections
+} __attribute__((aligned(64))) EpochSlot;
+
+static EpochSlot slots[EPOCH_SLOTS];
+static _Atomic uint64_t global_epoch = 1;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+static void slot_release(void *p) {
+  EpochSlot *s = &slots[(intptr_t)p - 1];
+  atomic_store(&s->epoch, 0);
+  s->depth = 0;
+  atomic_store(&s->used, false);
+}
+
+static void slot_key_init(void) {
+  pthread_key_create(&slot_key, slot_release);
+}
+
+// The calling thread's slot, claimed on first use and given back when the
+// thread exits.
+static int claim_slot(void) {
+  pthread_once(&slot_once, slot_key_init);
+  void *p = pthread_getspecific(slot_key);
+  if (p) return (int)((intptr_t)p - 1);
+
+  for (int i = 0; i < EPOCH_SLOTS; i++) {
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&slots[i].used, &expected, true)) continue;
+    if (pthread_setspecific(slot_key, (void *)(intptr_t)(i + 1)) != 0) {
+      atomic_store(&slots[i].used, false);
+      return -1;
+    }
+    return i;
+  }
+  return -1;
+}
+
+// Returns the slot to pass to epoch_exit, or -1 when every slot is taken
+// and the caller has to fall back to a lock.
+int epoch_enter(void) {
+  int i = claim_slot();
+  if (i < 0) return -1;
+  EpochSlot *s = &slots[i];
+  // Sequentially consistent: the announcement is ordered before every
+  // load the caller makes inside the section.
+  if (s->depth++ == 0) atomic_store(&s->epoch, atomic_load(&global_epoch));
+  return i;
+}
+
+void epoch_exit(int slot) {
+  EpochSlot *s = &slots[slot];
+  if (--s->depth == 0) atomic_store(&s->epoch, 0);
+}
+
+// Called after unlinking something: returns the stamp to pass to
+// epoch_safe. Readers entering from now on cannot reach it.
+uint64_t epoch_advance(void) {
+  return atomic_fetch_add(&global_epoch, 1);
+}
+
+bool epoch_safe(uint64_t stamp) {
+  for (int i = 0; i < EPOCH_SLOTS; i++) {
+    uint64_t e = atomic_load(&slots[i].epoch);
+    if (e != 0 && e <= stamp) return false;
+  }
+  return true;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/iter.h"
+#include "../lib/memtable.h"
+#include "../lib/vlog.h"
+
+// Called with mt_lock shared. Refs the next ITER_BATCH entries of the tree
+// from key on, from its first when key is NULL; after steps over key
+// itself, the last one of the batch before.
+static void fill_batch(LSMIter *it, IterSource *s, const Key *key, bool after) {
+  MtIter mi;
+  if (key) mt_iter_seek_at(&mi, it->mt, *key, it->seq);
+  else mt_iter_first_at(&mi, it->mt, it->seq);
+  if (after && mt_iter_valid(&mi) && key_equal(mt_iter_key(&mi), *key)) mt_iter_next(&mi);
+  int n = 0;
+  for (; n < ITER_BATCH && mt_iter_valid(&mi); n++, mt_iter_next(&mi)) {
+    IterEntry *e = &s->batch[n];
+    e->key = mt_iter_key(&mi);
+    e->length = mt_iter_value(&mi, &e->value);
+  }
+  s->n_batch = n;
+  s->pos = 0;
+  s->more = mt_iter_valid(&mi);
+}
+
+static void load_batch(LSMIter *it, IterSource *s, const Key *key, bool after) {
+  pthread_rwlock_rdlock(&it->l->mt_lock);
+  fill_batch(it, s, key, after);
+  pthread_rwlock_unlock(&it->l->mt_lock);
+}
+
+static void source_load(IterSource *s) {
+  if (s->is_table) {
+    s->valid = s->cursor.valid;
+    s->key = s->cursor.key;
+    s->length = s->cursor.length;
+    s->value = s->cursor.value;
+    return;
+  }
+  if (s->batch) {
+    s->valid = s->pos < s->n_batch;
+    if (!s->valid) return;
+    IterEntry *e = &s->batch[s->pos];
+    s->key = e->key;
+    s->length = e->length;
+    s->value = e->value;
+    return;
+  }
+  s->valid = mt_iter_valid(&s->mi);
+  if (!s->valid) return;
+  s->key = mt_iter_key(&s->mi);
+  s->length = mt_iter_value(&s->mi, &s->value);
+}
+
+static void source_seek(LSMIter *it, IterSource *s, Key key) {
+  if (s->is_table) sstable_cursor_seek(&s->cursor, key);
+  else if (s->batch) load_batch(it, s, &key, false);
+  else mt_iter_seek_at(&s->mi, it->mt, key, it->seq);
+  source_load(s);
+}
+
+static void source_seek_first(LSMIter *it, IterSource *s) {
+  if (s->is_table) sstable_cursor_seek_first(&s->cursor);
+  else if (s->batch) load_batch(it, s, NULL, false);
+  else mt_iter_first_at(&s->mi, it->mt, it->seq);
+  source_load(s);
+}
+
+static void source_next(LSMIter *it, IterSource *s) {
+  if (s->is_table) {
+    sstable_cursor_next(&s->cursor);
+  } else if (s->batch) {
+    if (++s->pos == s->n_batch && s->more) {
+      Key last = s->batch[s->n_batch - 1].key;
+      load_batch(it, s, &last, true);
+    }
+  } else {
+    mt_iter_next(&s->mi);
+  }
+  source_load(s);
+}
+
+// Smallest key on top; on equal keys the newer source (lower index) wins.
+static bool heap_less(LSMIter *it, int a, int b) {
+  int c = key_compare(it->cmp, it->srcs[a].key, it->srcs[b].key);
+  if (c != 0) return c < 0;
+  return a < b;
+}
+
+static void heap_sift_down(LSMIter *it, int i) {
+  for (;;) {
+    int l = 2 * i + 1;
+    int r = l + 1;
+    int m = i;
+    if (l < it->heap_len && heap_less(it, it->heap[l], it->heap[m])) m = l;
+    if (r < it->heap_len && heap_less(it, it->heap[r], it->heap[m])) m = r;
+    if (m == i) return;
+    int tmp = it->heap[i];
+    it->heap[i] = it->heap[m];
+    it->heap[m] = tmp;
+    i = m;
+  }
+}
+
+static void heap_sift_up(LSMIter *it, int i) {
+  while (i > 0) {
+    int p = (i - 1) / 2;
+    if (!heap_less(it, it->heap[i], it->heap[p])) return;
+    int tmp = it->heap[i];
+    it->heap[i] = it->heap[p];
+    it->heap[p] = tmp;
+    i = p;
+  }
+}
+
+static void heap_push(LSMIter *it, int src) {
+  it->heap[it->heap_len++] = src;
+  heap_sift_up(it, it->heap_len - 1);
+}
+
+static int heap_pop(LSMIter *it) {
+  int top = it->heap[0];
+  it->heap[0] = it->heap[--it->heap_len];
+  heap_sift_down(it, 0);
+  return top;
+}
+
+static bool source_failed(IterSource *s) {
+  return s->is_table && s->cursor.err;
+}
+
+// Advances a source and puts it back on the heap if it has more.
+static void advance(LSMIter *it, int src) {
+  source_next(it, &it->srcs[src]);
+  if (it->srcs[src].valid) heap_push(it, src);
+  else if (source_failed(&it->srcs[src])) it->err = true;
+}
+
+// Makes the heap top the next visible entry: older versions of its key are
+// skipped and tombstones are stepped over. The winning source stays where
+// it is so the value it points at remains valid.
+static void settle(LSMIter *it) {
+  free(it->resolved);
+  it->resolved = NULL;
+  for (;;) {
+    if (it->err || it->heap_len == 0) {
+      it->valid = false;
+      return;
+    }
+
+    int cur = heap_pop(it);
+    IterSource *s = &it->srcs[cur];
+    while (it->heap_len > 0 && key_equal(it->srcs[it->heap[0]].key, s->key)) advance(it, heap_pop(it));
+
+    if (s->length == -1) {
+      advance(it, cur);
+      continue;
+    }
+
+    heap_push(it, cur);
+    it->valid = true;
+    it->key = s->key;
+    it->length = s->length;
+    it->value = s->value;
+    it->value_sst = s->is_table ? s->cursor.sst : NULL;
+    return;
+  }
+}
+
+// Nothing is copied: the memtable and the segments are read in place,
+// and the engine lock is only held to pin them.
+int lsm_iter_init(LSM *l, LSMIter *it) {
+  memset(it, 0, sizeof(*it));
+  it->l = l;
+  it->cmp = l->cmp;
+
+  // A memtable being flushed is in the version once the flush is done, so
+  // there is only mem to pin. Taking mt_lock exclusively lets skiplist
+  // writes that already have their seq finish going in.
+  pthread_mutex_lock(&l->lock);
+  while (l->imm) pthread_cond_wait(&l->flush_cond, &l->lock);
+  it->v = versions_current(&l->versions);
+  version_ref(it->v);
+  it->mt = l->mem;
+  mt_pin(it->mt);
+  it->seq = l->last_seq;
+  if (mt_concurrent(it->mt)) {
+    pthread_rwlock_wrlock(&l->mt_lock);
+    pthread_rwlock_unlock(&l->mt_lock);
+  }
+  pthread_mutex_unlock(&l->lock);
+
+  Version *v = it->v;
+  int cap = 1 + v->n_segs;
+  it->srcs = calloc((size_t)cap, sizeof(IterSource));
+  it->heap = malloc(sizeof(int) * (size_t)cap);
+  if (!it->srcs || !it->heap ||
+      (!mt_concurrent(it->mt) && !(it->srcs[0].batch = malloc(sizeof(IterEntry) * ITER_BATCH)))) {
+    fprintf(stderr, "lsm_iter_init: out of memory\n");
+    lsm_iter_close(it);
+    return -1;
+  }
+  it->n_srcs = 1;
+  for (int i = v->n_segs - 1; i >= 0; i--) {
+    IterSource *s = &it->srcs[it->n_srcs++];
+    s->is_table = true;
+    sstable_cursor_open(&s->cursor, version_table(v, i));
+  }
+  return 0;
+}
+
+// Only frames the scan reaches are read and inflated; each cursor asks the
+// kernel for the following frame while it works through the current one.
+// A NULL key seeks to the first entry.
+static void seek(LSMIter *it, const Key *key) {
+  it->heap_len = 0;
+  it->err = false;
+  for (int i = 0; i < it->n_srcs; i++) {
+    if (key) source_seek(it, &it->srcs[i], *key);
+    else source_seek_first(it, &it->srcs[i]);
+    if (it->srcs[i].valid) heap_push(it, i);
+    else if (source_failed(&it->srcs[i])) it->err = true;
+  }
+  settle(it);
+}
+
+void lsm_iter_seek(LSMIter *it, Key key) {
+  seek(it, &key);
+}
+
+void lsm_iter_seek_to_first(LSMIter *it) {
+  seek(it, NULL);
+}
+
+void lsm_iter_next(LSMIter *it) {
+  if (!it->valid) return;
+  advance(it, heap_pop(it));
+  settle(it);
+}
+
+bool lsm_iter_valid(LSMIter *it) {
+  return it->valid;
+}
+
+// Valid until the iterator moves.
+Key lsm_iter_key(LSMIter *it) {
+  return it->key;
+}
+
+// Valid until the iterator moves. A value kept in the value log is only
+// read on the first call, so scans over keys alone never touch it; NULL
+// with *length -1 when that read fails.
+const char *lsm_iter_value(LSMIter *it, int *length) {
+  if (it->length == SST_VALUE_REF) {
+    if (vlog_read(it->value_sst, it->value, &it->resolved, &it->length) != 0) {
+      *length = -1;
+      return NULL;
+    }
+    it->value = it->resolved;
+  }
+  *length = it->length;
+  return it->value;
+}
+
+void lsm_iter_close(LSMIter *it) {
+  for (int i = 0; i < it->n_srcs; i++) {
+    IterSource *s = &it->srcs[i];
+    if (s->is_table) sstable_cursor_close(&s->cursor);
+  }
+  if (it->srcs) free(it->srcs[0].batch);
+  free(it->srcs);
+  free(it->heap);
+  free(it->resolved);
+  if (it->v) version_unref(it->v);
+
+  // A memtable flushed while pinned is reset by the last iterator to let
+  // go of it.
+  if (it->mt) lsm_unpin_memtable(it->l, it->mt);
+  memset(it, 0, sizeof(*it));
+}
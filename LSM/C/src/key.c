@@ -0,0 +1,37 @@
+#include <stdlib.h>
+
+#include "../lib/key.h"
+
+const Comparator key_bytewise = { KEY_BYTEWISE_NAME, key_compare_bytes };
+
+// A malloc'd copy of src in *dst, whose data is never NULL even when src
+// is empty. Release with key_free.
+int key_dup(Key *dst, Key src) {
+  char *data = malloc(src.len ? src.len : 1);
+  if (!data) return -1;
+  if (src.len) memcpy(data, src.data, src.len);
+  dst->data = data;
+  dst->len = src.len;
+  return 0;
+}
+
+void key_free(Key *k) {
+  free((void *)k->data);
+  k->data = NULL;
+  k->len = 0;
+}
+
+Key key_from_long(char *buf, long k) {
+  uint64_t u = (uint64_t)k ^ (1ull << 63);
+  for (int i = KEY_LONG_SIZE - 1; i >= 0; i--) {
+    buf[i] = (char)(u & 0xff);
+    u >>= 8;
+  }
+  return (Key){ buf, KEY_LONG_SIZE };
+}
+
+// Keys of any other length read as 0.
+long key_to_long(Key k) {
+  if (k.len != KEY_LONG_SIZE) return 0;
+  return (long)(key_head(k) ^ (1ull << 63));
+}
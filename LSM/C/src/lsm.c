@@ -1,16 +1,24 @@
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np
+
+#include <dirent.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <zlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "../lib/compaction.h"
+#include "../lib/epoch.h"
 #include "../lib/lsm.h"
 #include "../lib/memtable.h"
 #include "../lib/sstable.h"
 #include "../lib/rbtree.h"
-
-#define BLOCK_SIZE ( 1 << 16 )
+#include "../lib/vlog.h"
+#include "../lib/wal.h"
 
 static uint64_t load_segment_count(void) {
   FILE *f = fopen(SEGMENT_FILE_COUNT, "rb");
@@ -28,175 +36,1078 @@ static uint64_t load_segment_count(void) {
   return n;
 }
 
-static int store_segment_count(uint64_t next_id) {
-  FILE *f = fopen(SEGMENT_FILE_COUNT, "wb");
-  if (!f) return -1;
+// Writes m out as segment id, values of opts.vlog_threshold bytes or more
+// to value log file id. Touches nothing shared with writers or readers, so
+// the flush thread runs it without the engine lock.
+static int write_memtable(LSM *l, Memtable *m, uint64_t id, SSTable *sst, Bloom *b) {
+  char seg_path[256];
+  snprintf(seg_path, sizeof(seg_path), SEGMENT_FILE_FMT, (unsigned long long)id);
 
-  size_t w = fwrite(&next_id, sizeof(next_id), 1, f);
-  int ok = (w == 1 && fflush(f) == 0);
-  fclose(f);
+  sstable_init(sst, id);
+  sst->stats = l->stats;
+  sst->cmp = l->cmp;
+  size_t nbytes = (size_t)mt_count(m) * BLOOM_BYTES_PER_KEY;
+  uint8_t *bitmasks = bloom_alloc(nbytes);
+  bloom_init_blocked(b, bitmasks, nbytes);
 
-  return ok ? 0 : -1;
-}
+  SSTableWriter w;
+  if (sstable_writer_open(&w, sst, b, m->buf, MT_BUF_CAP, seg_path,
+                          l->opts.codec, l->opts.codec_level) != 0) {
+    free(bitmasks);
+    return -1;
+  }
+  // Either fallback writes the same segment, only slower or through the
+  // page cache. Entries and values bound the frames; the filter is as sized.
+  uint64_t expected = (uint64_t)mt_count(m) * ENTRY_HEADER_SIZE + (uint64_t)atomic_load(&m->total_size) + nbytes;
+  if (l->opts.direct_writes && sstable_writer_direct(&w, expected) != 0)
+    fprintf(stderr, "flush: O_DIRECT unavailable, writing through the page cache\n");
+  if (l->opts.flush_threads > 0 && sstable_writer_parallel(&w, l->opts.flush_threads) != 0)
+    fprintf(stderr, "flush: compressing frames inline\n");
 
-static int write_frame_compressed(FILE *f, const uint8_t *src, uint32_t src_len) {
-  // Worst-case bound for zlib
-  uLongf dst_cap = compressBound((uLong)src_len);
-  uint8_t *dst = (uint8_t *)malloc(dst_cap);
-  if (!dst) return -1;
+  VlogWriter vw;
+  vlog_writer_init(&vw, id, l->stats);
+  int rc = 0;
+  MtIter it;
+  for (mt_iter_first(&it, m); mt_iter_valid(&it); mt_iter_next(&it)) {
+    const char *value;
+    int32_t len = mt_iter_value(&it, &value);
 
-  uLongf dst_len = dst_cap;
-  int zrc = compress(dst, &dst_len, src, (uLong)src_len);
-  if (zrc != Z_OK) {
-    free(dst);
+    if (len > 0 && !value) { fprintf(stderr, "flush: NULL value with len>0\n"); rc = -1; break; }
+    char ref[VLOG_REF_SIZE];
+    if (l->opts.vlog_threshold > 0 && len >= l->opts.vlog_threshold) {
+      if (vlog_append(&vw, value, len, ref) != 0) { rc = -1; break; }
+      value = ref;
+      len = SST_VALUE_REF;
+    }
+    if (sstable_writer_add(&w, mt_iter_key(&it), value, len) != 0) { perror("sstable_writer_add"); rc = -1; break; }
+  }
+
+  if (rc == 0) rc = vlog_writer_finish(&vw);
+  if (rc == 0) rc = sstable_writer_finish(&w);
+  // Both files must be found again once the manifest names the segment.
+  if (rc == 0 && manifest_sync_dir() != 0) {
+    perror("fsync segments");
+    rc = -1;
+  }
+  if (rc != 0) {
+    vlog_writer_abort(&vw);
+    sstable_writer_abort(&w);
+    sstable_close(sst);
+    free(bitmasks);
     return -1;
   }
+  return 0;
+}
 
-  uint32_t magic = FRAME_MAGIC;
-  uint32_t ulen  = src_len;
-  uint32_t clen  = (uint32_t)dst_len;
+// Called with l->lock held once the segment is on stable storage; takes
+// over sst and b. The segment is live once its manifest edit is and its
+// version is published. If either fails it is closed and its file goes.
+static int install_segment(LSM *l, SSTable *sst, Bloom *b) {
+  sst->cache = l->block_cache;
+  sst->stats = l->stats;
+  // Without a mapping reads fall back to pread.
+  if (l->opts.mmap_reads) sstable_map(sst);
 
-  if (fwrite(&magic, sizeof(magic), 1, f) != 1) { free(dst); return -1; }
-  if (fwrite(&ulen,  sizeof(ulen),  1, f) != 1) { free(dst); return -1; }
-  if (fwrite(&clen,  sizeof(clen),  1, f) != 1) { free(dst); return -1; }
-  if (fwrite(dst, 1, clen, f) != clen)          { free(dst); return -1; }
+  ManifestTable t;
+  manifest_describe(&t, sst);
+  VersionEdit e = {
+    .added = &t, .n_added = 1,
+    .next_segment_id = l->next_segment_id, .last_seq = l->last_seq,
+  };
+  Version *cur = versions_current(&l->versions);
+  Segment *seg = vlog_attach(&l->vlog, sst) == 0 ? segment_new(sst, b) : NULL;
+  Version *v = seg ? version_splice(cur, cur->n_segs, 0, seg) : NULL;
+  if (!v || manifest_apply(&l->manifest, &e) != 0) {
+    char path[256];
+    snprintf(path, sizeof(path), SEGMENT_FILE_FMT, sst->id);
+    unlink(path);
+    vlog_remove(sst->id);
+    if (v) {
+      version_unref(v);
+    } else {
+      sstable_close(sst);
+      free(b->bitmasks);
+      free(seg);
+    }
+    return -1;
+  }
+  versions_install(&l->versions, v);
 
-  free(dst);
+  l->compaction_failed = false;
+  pthread_cond_signal(&l->compact_cond);
   return 0;
 }
 
-static int flush_buf_if_nonempty(Memtable *m, FILE *segment) {
-  if (m->buf_len == 0) return 0;
-  int rc = write_frame_compressed(segment, m->buf, (uint32_t)m->buf_len);
-  if (rc == 0) m->buf_len = 0;
-  return rc;
+static void count_flush(LSM *l, long bytes, uint64_t start) {
+  if (!l->stats) return;
+  stats_add(l->stats, STAT_FLUSHES, 1);
+  stats_add(l->stats, STAT_FLUSH_BYTES, (uint64_t)bytes);
+  stats_record(l->stats, STAT_HIST_FLUSH, stats_now_ns() - start);
 }
 
-static int buf_append(LSM *l, unsigned long long id, FILE *segment, const void *data, size_t n) {
-  Memtable *m = &l->m;
-  const uint8_t *p = (const uint8_t *)data;
+// Synchronous flush of the active memtable, used while recovering before
+// the flush thread exists.
+static int flush_memtable(LSM *l) {
+  if (mt_count(l->mem) == 0) return 0;
 
-  while (n > 0) {
-    size_t space = MT_BUF_CAP - m->buf_len;
-    if (space == 0) {
-      if (flush_buf_if_nonempty(m, segment) != 0) return -1;
-      space = MT_BUF_CAP;
-    }
+  SSTable sst;
+  Bloom b;
+  uint64_t id = l->next_segment_id++;
+  uint64_t start = l->stats ? stats_now_ns() : 0;
+  if (write_memtable(l, l->mem, id, &sst, &b) != 0) return -1;
+  sst.largest_seq = l->last_seq;
+  long bytes = sst.size;
+  if (install_segment(l, &sst, &b) != 0) return -1;
+  count_flush(l, bytes, start);
+  mt_reset(l->mem);
+  return 0;
+}
 
-    size_t take = (n < space) ? n : space;
-    memcpy(m->buf + m->buf_len, p, take);
-    m->buf_len += take;
-    p += take;
-    n -= take;
+// Appends to the first version while lsm_init still has it to itself.
+static int open_segment(LSM *l, unsigned long long id, int level, uint64_t largest_seq) {
+  SSTable sst;
+  Bloom b;
+  sstable_init(&sst, id);
+  sst.level = level;
+  sst.largest_seq = largest_seq;
+  sst.cache = l->block_cache;
+  sst.stats = l->stats;
+  sst.cmp = l->cmp;
+  // Legacy tables come back with an empty filter, which answers "maybe".
+  if (sstable_open(&sst, &b) != 0 || vlog_attach(&l->vlog, &sst) != 0) {
+    fprintf(stderr, "segment %llu: cannot load\n", id);
+    sstable_close(&sst);
+    return -1;
+  }
+  if (l->opts.mmap_reads) sstable_map(&sst);
 
-    if (m->buf_len == MT_BUF_CAP) {
-      if (flush_buf_if_nonempty(m, segment) != 0) return -1;
-    }
+  Segment *seg = segment_new(&sst, &b);
+  if (!seg || version_push(versions_current(&l->versions), seg) != 0) {
+    sstable_close(&sst);
+    free(b.bitmasks);
+    free(seg);
+    return -1;
+  }
+  return 0;
+}
+
+// Every segment holds the writes between its predecessor's newest and its
+// own, so sorting by newest write gives the oldest to newest order of a
+// version. Ids break ties between tables written before sequence numbers
+// were recorded.
+static int cmp_age(const void *a, const void *b) {
+  const ManifestTable *x = (const ManifestTable *)a;
+  const ManifestTable *y = (const ManifestTable *)b;
+  if (x->largest_seq != y->largest_seq) return x->largest_seq < y->largest_seq ? -1 : 1;
+  return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int load_segments(LSM *l) {
+  Manifest *m = &l->manifest;
+  if (m->n_tables > 1) qsort(m->tables, (size_t)m->n_tables, sizeof(ManifestTable), cmp_age);
+  for (int i = 0; i < m->n_tables; i++) {
+    ManifestTable *t = &m->tables[i];
+    if (open_segment(l, t->id, t->level, t->largest_seq) != 0) return -1;
+    if (t->id >= m->next_segment_id) m->next_segment_id = t->id + 1;
   }
+  l->next_segment_id = m->next_segment_id;
+  l->last_seq = m->last_seq;
   return 0;
 }
 
-void flush(LSM *l) {
-  Memtable *m = &l->m;
-  RBTree *t = &m->t;
-  if (t->root_idx == 0 || t->length == 0) return;
+// Files are trusted over the count, which was not written atomically.
+static unsigned long long scan_segment_ids(void) {
+  DIR *d = opendir("segments");
+  if (!d) return 0;
+
+  unsigned long long next = 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    unsigned long long id;
+    int end = 0;
+    if (sscanf(e->d_name, "segment_%llu.log%n", &id, &end) == 1 && end > 0 &&
+        e->d_name[end] == '\0' && id >= next)
+      next = id + 1;
+  }
+  closedir(d);
+  return next;
+}
 
+// Engines from before the manifest only kept the next id. Their segment
+// ids sort by age, so they are numbered in that order and recorded in a
+// first edit.
+static int load_legacy_segments(LSM *l) {
+  l->next_segment_id = load_segment_count();
+  unsigned long long on_disk = scan_segment_ids();
+  if (on_disk > l->next_segment_id) l->next_segment_id = on_disk;
   char path[256];
-  uint64_t id = l->next_segment_id++;
-  snprintf(path, sizeof(path), SEGMENT_FILE_FMT, (unsigned long long)id);
+  for (uint64_t id = 0; id < l->next_segment_id; id++) {
+    snprintf(path, sizeof(path), SEGMENT_FILE_FMT, (unsigned long long)id);
+    if (access(path, F_OK) != 0) continue;
+    Version *v = versions_current(&l->versions);
+    if (open_segment(l, id, 0, (uint64_t)v->n_segs + 1) != 0) return -1;
+  }
+  Version *v = versions_current(&l->versions);
+  l->last_seq = (uint64_t)v->n_segs;
+
+  ManifestTable *added = malloc(sizeof(ManifestTable) * (size_t)(v->n_segs ? v->n_segs : 1));
+  if (!added) return -1;
+  for (int i = 0; i < v->n_segs; i++) manifest_describe(&added[i], version_table(v, i));
+  VersionEdit e = {
+    .added = added, .n_added = v->n_segs,
+    .next_segment_id = l->next_segment_id, .last_seq = l->last_seq,
+  };
+  int rc = manifest_apply(&l->manifest, &e);
+  free(added);
+  if (rc == 0) unlink(SEGMENT_FILE_COUNT);
+  return rc;
+}
 
-  FILE *segment = fopen(path, "wb");
-  if (!segment) {
-    perror("fopen segment");
+static bool is_live(LSM *l, unsigned long long id) {
+  Version *v = versions_current(&l->versions);
+  for (int i = 0; i < v->n_segs; i++)
+    if (version_table(v, i)->id == id) return true;
+  return false;
+}
+
+static bool is_live_vlog(LSM *l, unsigned long long id) {
+  Version *v = versions_current(&l->versions);
+  for (int i = 0; i < v->n_segs; i++)
+    if (vlog_refers(version_table(v, i), &id, 1)) return true;
+  return false;
+}
+
+// Segment files the manifest does not list: the output of a flush or a
+// compaction that crashed before its edit, or inputs whose removal was
+// recorded but not carried out. Likewise value log files no listed
+// segment points into.
+static void remove_orphans(LSM *l) {
+  DIR *d = opendir("segments");
+  if (!d) return;
+
+  char path[512];
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    unsigned long long id;
+    int end = 0;
+    bool live = false;
+    if (sscanf(e->d_name, "vlog_%llu.log%n", &id, &end) == 1 && end > 0 && e->d_name[end] == '\0')
+      live = is_live_vlog(l, id);
+    else if (strncmp(e->d_name, "segment_", 8) != 0)
+      continue;
+    else if (sscanf(e->d_name, "segment_%llu.log%n", &id, &end) == 1 && end > 0 && e->d_name[end] == '\0')
+      live = is_live(l, id);
+    else if (sscanf(e->d_name, "segment_index_%llu.ser%n", &id, &end) == 1 && end > 0 && e->d_name[end] == '\0')
+      live = is_live(l, id);
+    if (live) continue;
+
+    snprintf(path, sizeof(path), "segments/%s", e->d_name);
+    unlink(path);
+  }
+  closedir(d);
+}
+
+// A memtable allocated when no idle one is left, pools and all; mts[]
+// use the caller's and the spare ones.
+typedef struct {
+  Memtable m;
+  void *nodes;
+  Value *values;
+} ExtraMemtable;
+
+static bool builtin_memtable(LSM *l, Memtable *m) {
+  return m == &l->mts[0] || m == &l->mts[1];
+}
+
+static Memtable *new_memtable(LSM *l) {
+  ExtraMemtable *e = malloc(sizeof(*e));
+  if (!e) return NULL;
+  e->nodes = calloc(1, mt_pool_bytes(l->opts.memtable, l->memtable_size));
+  e->values = calloc((size_t)l->memtable_size, sizeof(Value));
+  if (!e->nodes || !e->values) {
+    free(e->nodes);
+    free(e->values);
+    free(e);
+    return NULL;
+  }
+  mt_init(&e->m, l->opts.memtable, e->nodes, e->values, l->memtable_size, l->mts[0].owns_values, l->cmp);
+  e->m.max_bytes = l->opts.memtable_bytes;
+  return &e->m;
+}
+
+static void free_memtable(LSM *l, Memtable *m) {
+  if (builtin_memtable(l, m)) return;
+  ExtraMemtable *e = (ExtraMemtable *)m;
+  mt_destroy(m);
+  free(e->nodes);
+  free(e->values);
+  free(e);
+}
+
+// Called with l->lock held once m is reset and nothing reads it. Both
+// built-in memtables are kept; an extra one only while nothing else idles.
+static void retire_memtable(LSM *l, Memtable *m) {
+  if (l->n_idle > 0 && !builtin_memtable(l, m)) {
+    free_memtable(l, m);
     return;
   }
-  snprintf(path, sizeof(path), SEGMENT_FILE_INDEX_FMT, (unsigned long long)id);
-  FILE *segment_idx = fopen(path, "wb");
-  if (!segment_idx) {
-    perror("fopen segment");
+  if (l->n_idle > 0 && !builtin_memtable(l, l->idle[0])) {
+    free_memtable(l, l->idle[0]);
+    l->n_idle = 0;
+  }
+  l->idle[l->n_idle++] = m;
+}
+
+void lsm_unpin_memtable(LSM *l, Memtable *m) {
+  pthread_mutex_lock(&l->lock);
+  if (mt_unpin(m) && m != l->mem && m != l->imm) {
+    mt_reset(m);
+    retire_memtable(l, m);
+  }
+  pthread_mutex_unlock(&l->lock);
+}
+
+static Wal *other_wal(LSM *l, Wal *w) {
+  return w == &l->wals[0] ? &l->wals[1] : &l->wals[0];
+}
+
+// Called with l->lock held. Hands mem to the flush thread and moves writes
+// to an idle memtable and the spare log. Only waits when the previous flush
+// has not finished yet, and leaves mem in place if that flush failed.
+static void switch_memtable(LSM *l) {
+  while (l->imm && !l->flush_failed) pthread_cond_wait(&l->flush_cond, &l->lock);
+  if (l->imm || mt_count(l->mem) == 0) return;
+
+  Memtable *next = l->n_idle > 0 ? l->idle[--l->n_idle] : new_memtable(l);
+  if (!next) {
+    perror("memtable");
     return;
   }
 
+  // Waits for writers still inserting into a concurrent mem.
+  pthread_rwlock_wrlock(&l->mt_lock);
+  l->imm = l->mem;
+  l->mem = next;
+  pthread_rwlock_unlock(&l->mt_lock);
+  l->imm_wal = l->wal;
+  l->wal = other_wal(l, l->wal);
+  l->log_number++;
+  l->imm_last_seq = l->last_seq;
+  pthread_cond_broadcast(&l->flush_cond);
+}
+
+static void *flush_main(void *arg) {
+  LSM *l = (LSM *)arg;
+  char path[256];
+
+  // A failed flush is retried under the same id, its files are gone.
+  uint64_t id = 0;
+  bool retry = false;
+
+  pthread_mutex_lock(&l->lock);
+  for (;;) {
+    while (!l->imm && !l->stopping) pthread_cond_wait(&l->flush_cond, &l->lock);
+    if (!l->imm) break;
+
+    Memtable *m = l->imm;
+    if (!retry) id = l->next_segment_id++;
+    uint64_t largest_seq = l->imm_last_seq;
+    pthread_mutex_unlock(&l->lock);
+
+    SSTable sst;
+    Bloom b;
+    uint64_t start = l->stats ? stats_now_ns() : 0;
+    int rc = write_memtable(l, m, id, &sst, &b);
+    sst.largest_seq = largest_seq;
+    long bytes = sst.size;
 
-  m->buf_len = 0;
+    pthread_mutex_lock(&l->lock);
+    if (rc == 0 && install_segment(l, &sst, &b) != 0) rc = -1;
+    if (rc == 0) count_flush(l, bytes, start);
+    if (rc != 0) {
+      // Switches and flush() give up until imm is on disk; try again
+      // shortly. When closing, imm_wal still holds it for the next open.
+      fprintf(stderr, "flush of segment %llu failed, retrying\n", (unsigned long long)id);
+      retry = true;
+      l->flush_failed = true;
+      pthread_cond_broadcast(&l->flush_cond);
+      if (l->stopping) break;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait(&l->flush_cond, &l->lock, &ts);
+      continue;
+    }
+    retry = false;
+    l->flush_failed = false;
+
+    // imm's log is covered by the segment now: recycle both. Readers find
+    // its entries in the segment from here on; an iterator still walking it
+    // retires it once done.
+    pthread_rwlock_wrlock(&l->mt_lock);
+    l->imm = NULL;
+    if (m->pins == 0) {
+      mt_reset(m);
+      retire_memtable(l, m);
+    }
+    pthread_rwlock_unlock(&l->mt_lock);
+    snprintf(path, sizeof(path), WAL_FILE_FMT, l->log_number + 1);
+    wal_reopen(l->imm_wal, path);
+    snprintf(path, sizeof(path), WAL_FILE_FMT, l->log_number - 1);
+    unlink(path);
+
+    l->imm_wal = NULL;
+    pthread_cond_broadcast(&l->flush_cond);
+  }
+  pthread_mutex_unlock(&l->lock);
+  return NULL;
+}
 
-  int *stack = (int *)malloc(sizeof(int) * (size_t)(t->length + 1));
-  if (!stack) {
-    perror("malloc stack");
-    fclose(segment);
+// Returns -1 when the flush failed; the flush thread keeps retrying it.
+int flush(LSM *l) {
+  pthread_mutex_lock(&l->lock);
+  switch_memtable(l);
+  while (l->imm && !l->flush_failed) pthread_cond_wait(&l->flush_cond, &l->lock);
+  int rc = l->imm ? -1 : 0;
+  pthread_mutex_unlock(&l->lock);
+  return rc;
+}
+
+static void replay_record(void *arg, WalOp op, uint64_t seq, Key key, const char *value, int length) {
+  LSM *l = (LSM *)arg;
+
+  // Keep the logs intact while replaying: flushing here must not drop
+  // records that have not been applied yet. A record that cannot be
+  // applied fails the recovery, which then leaves every log in place.
+  if (l->replay_failed) return;
+  if (!mt_reserve(l->mem) && (flush_memtable(l) != 0 || !mt_reserve(l->mem))) {
+    l->replay_failed = true;
     return;
   }
-  int index_count = (l->m.total_size / BLOCK_SIZE);
-  long *keys = malloc(sizeof(long) * index_count);
-  long *offsets = malloc(sizeof(long) * index_count);
-  SSTable *sst = &l->tables[id];
-  sstable_init(sst, keys, offsets);
-  size_t nbytes = l->m.t.length * sizeof(long);
-  uint8_t *bitmasks = calloc(nbytes, 1);
-  Bloom *b = &l->blooms[id];
-  bloom_init(b, bitmasks, nbytes, 6);
-
-  int sp = 0;
-  int cur = t->root_idx;
-  uint32_t size = 0;
-  bool is_first = true;
-  long offset = 0;
-  long key;
-  int next_idx = 0;
-
-  while (cur != 0 || sp > 0) {
-    while (cur != 0) {
-      stack[sp++] = cur;
-      cur = t->nodes[cur].left_idx;
+  if (seq > l->last_seq) l->last_seq = seq;
+
+  bool ok = op == WAL_DELETE ? mt_delete(l->mem, seq, key) : mt_put(l->mem, seq, key, value, length);
+  if (!ok) l->replay_failed = true;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int list_logs(unsigned long long **out) {
+  DIR *d = opendir("segments");
+  if (!d) return -1;
+
+  int n = 0, cap = 0;
+  unsigned long long *nums = NULL;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    unsigned long long num;
+    char tail;
+    if (sscanf(e->d_name, "wal_%llu.lo%c", &num, &tail) != 2 || tail != 'g') continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 4;
+      unsigned long long *p = realloc(nums, sizeof(*nums) * (size_t)cap);
+      if (!p) {
+        free(nums);
+        closedir(d);
+        return -1;
+      }
+      nums = p;
+    }
+    nums[n++] = num;
+  }
+  closedir(d);
+
+  if (n > 1) qsort(nums, (size_t)n, sizeof(*nums), cmp_ull);
+  *out = nums;
+  return n;
+}
+
+static long log_size(unsigned long long num) {
+  char path[256];
+  snprintf(path, sizeof(path), WAL_FILE_FMT, num);
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+// Replays every log left behind, oldest first. The newest non-empty one is
+// the active log and keeps taking writes; empty ones after it are spares.
+// Older logs (a crash while imm was being flushed) are folded into a
+// segment and dropped.
+static int recover_logs(LSM *l) {
+  unsigned long long *nums = NULL;
+  int n = list_logs(&nums);
+  if (n < 0) return -1;
+
+  char path[256];
+  int last = n - 1;
+  while (last > 0 && log_size(nums[last]) == 0) last--;
+  for (int i = last + 1; i < n; i++) {
+    snprintf(path, sizeof(path), WAL_FILE_FMT, nums[i]);
+    unlink(path);
+  }
+
+  int rc = 0;
+  Wal *older = last > 0 ? calloc((size_t)last, sizeof(Wal)) : NULL;
+  if (last > 0 && !older) rc = -1;
+  for (int i = 0; i < last && rc == 0; i++) {
+    snprintf(path, sizeof(path), WAL_FILE_FMT, nums[i]);
+    if (wal_open(&older[i], path, WAL_SYNC_NEVER, 0) != 0 ||
+        wal_replay(&older[i], replay_record, l) < 0 || l->replay_failed)
+      rc = -1;
+  }
+
+  l->log_number = last >= 0 ? nums[last] : 0;
+  snprintf(path, sizeof(path), WAL_FILE_FMT, l->log_number);
+  if (rc == 0 && wal_open(l->wal, path, l->opts.wal_sync, l->opts.wal_sync_interval_ms) != 0)
+    rc = -1;
+  if (rc == 0 && (wal_replay(l->wal, replay_record, l) < 0 || l->replay_failed))
+    rc = -1;
+  if (l->replay_failed) fprintf(stderr, "recovery: a logged write could not be applied, logs kept\n");
+
+  if (rc == 0 && last > 0) {
+    rc = flush_memtable(l);
+    if (rc == 0) rc = wal_truncate(l->wal);
+  }
+  for (int i = 0; older && i < last; i++) {
+    if (older[i].fd <= 0) continue;
+    wal_close(&older[i]);
+    if (rc == 0) {
+      snprintf(path, sizeof(path), WAL_FILE_FMT, nums[i]);
+      unlink(path);
+    }
+  }
+  free(older);
+  free(nums);
+  if (rc != 0) return -1;
+
+  snprintf(path, sizeof(path), WAL_FILE_FMT, l->log_number + 1);
+  Wal *spare = other_wal(l, l->wal);
+  if (wal_open(spare, path, l->opts.wal_sync, l->opts.wal_sync_interval_ms) != 0)
+    return -1;
+  return 0;
+}
+
+void lsm_options_default(LSMOptions *o) {
+  o->wal_sync = WAL_SYNC_ALWAYS;
+  o->wal_sync_interval_ms = 10;
+
+  o->compaction = COMPACTION_LEVELED;
+  o->l0_compaction_trigger = 4;
+  o->level_base_bytes = 16L << 20;
+  o->level_ratio = 10;
+  o->tier_min_width = 4;
+
+  o->block_cache_bytes = 32u << 20;
+  o->mmap_reads = true;
+
+  o->codec = CODEC_ZLIB;
+  o->codec_level = 0;
+
+  o->memtable = MEMTABLE_RBTREE;
+  o->memtable_bytes = 64L << 20;
+  o->flush_threads = 2;
+  o->direct_writes = false;
+
+  o->comparator = NULL;
+
+  o->vlog_threshold = 0;
+  o->vlog_gc_ratio = 0.5;
+
+  o->collect_stats = true;
+  o->stats_dump_interval_ms = 0;
+  o->stats_dump_json = false;
+}
+
+// Prints a snapshot every opts.stats_dump_interval_ms until lsm_close.
+static void *stats_dump_main(void *arg) {
+  LSM *l = (LSM *)arg;
+  LSMStats *st = malloc(sizeof(LSMStats));
+  if (!st) return NULL;
+
+  pthread_mutex_lock(&l->lock);
+  while (!l->stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long ns = ts.tv_nsec + (l->opts.stats_dump_interval_ms % 1000) * 1000000L;
+    ts.tv_sec += l->opts.stats_dump_interval_ms / 1000 + ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+    if (pthread_cond_timedwait(&l->stats_cond, &l->lock, &ts) == 0 || l->stopping) continue;
+
+    pthread_mutex_unlock(&l->lock);
+    lsm_stats_snapshot(l, st);
+    stats_dump(st, stderr, l->opts.stats_dump_json);
+    pthread_mutex_lock(&l->lock);
+  }
+  pthread_mutex_unlock(&l->lock);
+  free(st);
+  return NULL;
+}
+
+int lsm_init(LSM *l, const LSMOptions *opts, void *nodes, Value *values, int size, bool owns_values){
+  memset(l, 0, sizeof(*l));
+  atomic_init(&l->write_failed, false);
+  if (opts) l->opts = *opts;
+  else lsm_options_default(&l->opts);
+
+  if (!codec_supported(l->opts.codec)) {
+    fprintf(stderr, "codec %s is not built in\n", codec_name(l->opts.codec));
+    return -1;
+  }
+
+  if (mkdir("segments", 0755) != 0 && errno != EEXIST) {
+    perror("mkdir segments");
+    return -1;
+  }
+
+  // The bytewise order is the default one, spelled NULL so it is inlined.
+  // Checked against the store before anything else is set up.
+  l->cmp = l->opts.comparator == &key_bytewise ? NULL : l->opts.comparator;
+  bool found;
+  if (manifest_open(&l->manifest, l->cmp ? l->cmp->name : KEY_BYTEWISE_NAME, &found) != 0)
+    return -1;
+
+  l->spare_nodes = calloc(1, mt_pool_bytes(l->opts.memtable, size));
+  l->spare_values = calloc((size_t)size, sizeof(Value));
+  if (!l->spare_nodes || !l->spare_values) {
+    free(l->spare_nodes);
+    free(l->spare_values);
+    manifest_close(&l->manifest);
+    return -1;
+  }
+
+  if (l->opts.block_cache_bytes > 0) {
+    if (block_cache_init(&l->cache, l->opts.block_cache_bytes) != 0) return -1;
+    l->block_cache = &l->cache;
+  }
+  if (l->opts.collect_stats && !(l->stats = stats_new())) return -1;
+  if (vlog_init(&l->vlog, l->stats) != 0) return -1;
+
+  Version *v = version_new(0);
+  if (!v) return -1;
+  versions_init(&l->versions, v);
+  if ((found ? load_segments(l) : load_legacy_segments(l)) != 0)
+    return -1;
+  remove_orphans(l);
+  // From here a file goes with the last segment pointing into it.
+  l->vlog.keep_files = false;
+  mt_init(&l->mts[0], l->opts.memtable, nodes, values, size, owns_values, l->cmp);
+  mt_init(&l->mts[1], l->opts.memtable, l->spare_nodes, l->spare_values, size, owns_values, l->cmp);
+  l->mts[0].max_bytes = l->opts.memtable_bytes;
+  l->mts[1].max_bytes = l->opts.memtable_bytes;
+  l->mem = &l->mts[0];
+  l->idle[0] = &l->mts[1];
+  l->n_idle = 1;
+  l->memtable_size = size;
+  l->wal = &l->wals[0];
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  // Lookups must not starve the one writer.
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&l->mt_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_cond_init(&l->compact_cond, NULL);
+  pthread_cond_init(&l->flush_cond, NULL);
+  pthread_cond_init(&l->stats_cond, NULL);
+
+  if (recover_logs(l) != 0)
+    return -1;
+
+  if (pthread_create(&l->flusher, NULL, flush_main, l) != 0) {
+    perror("pthread_create flusher");
+    return -1;
+  }
+  l->has_flusher = true;
+
+  if (l->opts.compaction != COMPACTION_NONE) {
+    if (pthread_create(&l->compactor, NULL, compaction_main, l) != 0) {
+      perror("pthread_create compactor");
+      return -1;
     }
-    cur = stack[--sp];
+    l->has_compactor = true;
+  }
 
-    RBNode *n = &t->nodes[cur];
-    Value  *v = &t->values[cur];
-    if(is_first){
-      key = n->key;
+  if (l->opts.stats_dump_interval_ms > 0) {
+    if (pthread_create(&l->stats_dumper, NULL, stats_dump_main, l) != 0) {
+      perror("pthread_create stats dumper");
+      return -1;
     }
+    l->has_stats_dumper = true;
+  }
+  return 0;
+}
+
+// Called with l->lock held, which it releases. Applies a write that has
+// its sequence number and log record to m: a concurrent memtable takes it
+// alongside other writers, holding mt_lock shared so m cannot become imm
+// halfway; otherwise the write is exclusive like every other change.
+static bool apply_write(LSM *l, Memtable *m, WalOp op, uint64_t seq, Key key, const char *value, int length) {
+  bool ok;
+  if (mt_concurrent(m)) {
+    pthread_rwlock_rdlock(&l->mt_lock);
+    pthread_mutex_unlock(&l->lock);
+    ok = op == WAL_PUT ? mt_put(m, seq, key, value, length) : mt_delete(m, seq, key);
+    pthread_rwlock_unlock(&l->mt_lock);
+    return ok;
+  }
 
-    int32_t len = n->tombstone ? -1 : (int32_t)v->length;
+  pthread_rwlock_wrlock(&l->mt_lock);
+  ok = op == WAL_PUT ? mt_put(m, seq, key, value, length) : mt_delete(m, seq, key);
+  pthread_rwlock_unlock(&l->mt_lock);
+  pthread_mutex_unlock(&l->lock);
+  return ok;
+}
 
-    if (buf_append(l, id, segment, &n->key, sizeof(n->key)) != 0) { perror("buf_append key"); break; }
-    if (buf_append(l, id, segment, &len, sizeof(len)) != 0)       { perror("buf_append len"); break; }
-    if (len > 0) {
-      if (!v->value) { fprintf(stderr, "flush: NULL value with len>0\n"); break; }
-      if (buf_append(l, id, segment, v->value, (size_t)len) != 0) { perror("buf_append val"); break; }
+// Records are appended to the log in sequence order under the engine lock,
+// then applied to the memtable (see apply_write), then the caller waits for
+// its group to reach the log outside of it so concurrent writers share a
+// sync. A record that made it to only one of the two, or to the memtable
+// but not to disk, may be seen now and lost on reopen or the other way
+// round, so every write after it fails until the engine is reopened.
+static bool write_record(LSM *l, WalOp op, Key key, const char *value, int length) {
+  if (key.len > KEY_MAX_SIZE || atomic_load(&l->write_failed)) return false;
+  uint64_t start = l->stats ? stats_now_ns() : 0;
+  pthread_mutex_lock(&l->lock);
+  if (!mt_reserve(l->mem)) {
+    switch_memtable(l);
+    if (!mt_reserve(l->mem)) {
+      pthread_mutex_unlock(&l->lock);
+      return false;
     }
+  }
 
-    size = ftell(segment) - size;
+  Wal *w = l->wal;
+  uint64_t seq = ++l->last_seq;
+  uint64_t lsn = wal_append(w, op, seq, key, value, length);
+  if (lsn == 0) {
+    pthread_mutex_unlock(&l->lock);
+    return false;
+  }
+  bool ok = apply_write(l, l->mem, op, seq, key, value, length);
+  ok = ok && wal_commit(w, lsn) == 0;
+  if (!ok) {
+    fprintf(stderr, "write of seq %llu failed, no more writes until reopened\n", (unsigned long long)seq);
+    atomic_store(&l->write_failed, true);
+  }
+
+  if (l->stats && ok) {
+    stats_add(l->stats, op == WAL_PUT ? STAT_PUTS : STAT_DELETES, 1);
+    stats_add(l->stats, STAT_USER_BYTES_WRITTEN, key.len + (size_t)(length > 0 ? length : 0));
+    stats_add(l->stats, STAT_WAL_BYTES, wal_record_size(op, key.len, length));
+    stats_record(l->stats, STAT_HIST_PUT, stats_now_ns() - start);
+  }
+  return ok;
+}
+
+bool lsm_put(LSM *l, Key key, const char *value, int length) {
+  return write_record(l, WAL_PUT, key, value, length);
+}
+
+bool lsm_delete(LSM *l, Key key) {
+  return write_record(l, WAL_DELETE, key, NULL, -1);
+}
+
+static int copy_value(const char *src, int len, char **value, int *length) {
+  char *copy = malloc(len > 0 ? (size_t)len : 1);
+  if (!copy) return -1;
+  if (len > 0) memcpy(copy, src, (size_t)len);
+  *value = copy;
+  *length = len;
+  return 1;
+}
+
+// The segments a lookup may walk until read_end. Inside an epoch the
+// version cannot be freed under the reader; with no epoch slot left it is
+// pinned under the lock instead.
+static Version *read_begin(LSM *l, int *slot) {
+  *slot = epoch_enter();
+  if (*slot >= 0) return versions_current(&l->versions);
+
+  pthread_mutex_lock(&l->lock);
+  Version *v = versions_current(&l->versions);
+  version_ref(v);
+  pthread_mutex_unlock(&l->lock);
+  return v;
+}
+
+static void read_end(Version *v, int slot) {
+  if (slot >= 0) epoch_exit(slot);
+  else version_unref(v);
+}
+
+// Newest data wins: the memtable, the one being flushed, then segments from
+// newest to oldest. A segment that cannot hold the key costs one filter probe.
+// The memtables are checked before the version is loaded: a flush publishes
+// its segment before it lets go of imm, so an entry is always in one of them.
+// Filter outcomes of one lookup, added to the shared counters once.
+typedef struct {
+  uint64_t negatives;
+  uint64_t true_positives;
+  uint64_t false_positives;
+} BloomTally;
+
+static void count_reads(LSM *l, uint64_t gets, uint64_t memtable_hits, const BloomTally *t,
+                        uint64_t bytes, uint64_t start) {
+  stats_add(l->stats, STAT_GETS, gets);
+  stats_add(l->stats, STAT_MEMTABLE_HITS, memtable_hits);
+  stats_add(l->stats, STAT_BLOOM_NEGATIVES, t->negatives);
+  stats_add(l->stats, STAT_BLOOM_TRUE_POSITIVES, t->true_positives);
+  stats_add(l->stats, STAT_BLOOM_FALSE_POSITIVES, t->false_positives);
+  stats_add(l->stats, STAT_USER_BYTES_READ, bytes);
+  stats_record(l->stats, STAT_HIST_GET, stats_now_ns() - start);
+}
+
+int lsm_get(LSM *l, Key key, char **value, int *length) {
+  if (key.len > KEY_MAX_SIZE) return 0;
+  uint64_t start = l->stats ? stats_now_ns() : 0;
+  BloomTally tally = { 0, 0, 0 };
+  int rc = 0;
+  pthread_rwlock_rdlock(&l->mt_lock);
+  Value *v;
+  MtResult mr = mt_lookup(l->mem, key, &v);
+  if (mr == MT_ABSENT && l->imm) mr = mt_lookup(l->imm, key, &v);
+  if (mr == MT_FOUND) rc = copy_value(v->value, v->length, value, length);
+  pthread_rwlock_unlock(&l->mt_lock);
 
-    if (size >= BLOCK_SIZE){
-      size=0;
-      if(sstable_add(sst, segment_idx, key, offset, next_idx) != true) perror("sstable_append");
-      offset = ftell(segment);
-      key = n->key;
+  if (mr == MT_ABSENT) {
+    int slot;
+    Version *ver = read_begin(l, &slot);
+    for (int i = ver->n_segs - 1; i >= 0; i--) {
+      if (!bloom_has(version_bloom(ver, i), key)) {
+        tally.negatives++;
+        continue;
+      }
+
+      SSTResult r = sstable_get(version_table(ver, i), key, value, length);
+      if (r == SST_ABSENT) {
+        tally.false_positives++;
+        continue;
+      }
+      tally.true_positives++;
+      rc = r == SST_FOUND ? 1 : (r == SST_DELETED ? 0 : -1);
+      break;
     }
+    read_end(ver, slot);
+  }
 
-    cur = n->right_idx;
+  if (l->stats) {
+    uint64_t bytes = rc == 1 ? key.len + (uint64_t)(*length > 0 ? *length : 0) : 0;
+    count_reads(l, 1, mr != MT_ABSENT, &tally, bytes, start);
   }
+  return rc;
+}
+
+typedef struct {
+  Key key;
+  int idx;  // position in the caller's arrays
+} BatchKey;
 
-  free(stack);
+static int cmp_batch(const void *a, const void *b, void *cmp) {
+  const BatchKey *x = (const BatchKey *)a;
+  const BatchKey *y = (const BatchKey *)b;
+  int c = key_compare((const Comparator *)cmp, x->key, y->key);
+  if (c != 0) return c;
+  return x->idx - y->idx;
+}
 
-  if (flush_buf_if_nonempty(m, segment) != 0) {
-    perror("flush_buf_if_nonempty");
-  } else {
-      if(sstable_add(sst, segment_idx, key, offset, next_idx) != true) perror("sstable_append");
+// Looks up n keys at once. results[i] is what lsm_get would return for
+// keys[i], and values[i] is the caller's to free when it is 1. Keys are
+// sorted once; each segment then gets one filter pass over the keys still
+// unresolved and one sstable_get_many over the survivors, so keys sharing
+// a frame share its read and inflate. Returns -1 if out of memory.
+int lsm_multi_get(LSM *l, int n, const Key *keys, char **values, int *lengths, int *results) {
+  if (n <= 0) return 0;
+
+  uint64_t start = l->stats ? stats_now_ns() : 0;
+  BloomTally tally = { 0, 0, 0 };
+  BatchKey *batch = malloc(sizeof(BatchKey) * (size_t)n);
+  Key *pending = malloc(sizeof(Key) * (size_t)n);
+  int *owner = malloc(sizeof(int) * (size_t)n);
+  bool *maybe = malloc(sizeof(bool) * (size_t)n);
+  Key *cand = malloc(sizeof(Key) * (size_t)n);
+  int *cand_at = malloc(sizeof(int) * (size_t)n);
+  SSTResult *res = malloc(sizeof(SSTResult) * (size_t)n);
+  char **vals = malloc(sizeof(char *) * (size_t)n);
+  int *lens = malloc(sizeof(int) * (size_t)n);
+  int rc = batch && pending && owner && maybe && cand && cand_at && res && vals && lens ? 0 : -1;
+  if (rc != 0) goto out;
+
+  for (int i = 0; i < n; i++) {
+    batch[i].key = keys[i];
+    batch[i].idx = i;
   }
+  if (n > 1) qsort_r(batch, (size_t)n, sizeof(BatchKey), cmp_batch, (void *)l->cmp);
 
-  if (fflush(segment) != 0) perror("fflush");
-  fclose(segment);
+  pthread_rwlock_rdlock(&l->mt_lock);
+  int np = 0;
+  for (int s = 0; s < n; s++) {
+    int i = batch[s].idx;
+    results[i] = 0;
+    if (keys[i].len > KEY_MAX_SIZE) continue;
+    Value *v;
+    MtResult mr = mt_lookup(l->mem, keys[i], &v);
+    if (mr == MT_ABSENT && l->imm) mr = mt_lookup(l->imm, keys[i], &v);
+    if (mr == MT_FOUND) {
+      results[i] = copy_value(v->value, v->length, &values[i], &lengths[i]);
+    } else if (mr == MT_ABSENT) {
+      pending[np] = keys[i];
+      owner[np++] = i;
+    }
+  }
+  pthread_rwlock_unlock(&l->mt_lock);
+  uint64_t memtable_hits = (uint64_t)(n - np);
 
-  l->next_segment_id = (id + 1) % (uint64_t)INT64_MAX;
-  if (store_segment_count(l->next_segment_id) != 0) {
-    perror("store_segment_count");
+  int slot;
+  Version *ver = read_begin(l, &slot);
+  for (int t = ver->n_segs - 1; t >= 0 && np > 0; t--) {
+    bloom_has_many(version_bloom(ver, t), pending, np, maybe);
+    int nc = 0;
+    for (int p = 0; p < np; p++) {
+      if (!maybe[p]) continue;
+      cand[nc] = pending[p];
+      cand_at[nc++] = p;
+    }
+    tally.negatives += (uint64_t)(np - nc);
+    if (nc == 0) continue;
+
+    sstable_get_many(version_table(ver, t), nc, cand, res, vals, lens);
+    for (int c = 0; c < nc; c++) {
+      if (res[c] == SST_ABSENT) {
+        tally.false_positives++;
+        continue;
+      }
+      tally.true_positives++;
+      int i = owner[cand_at[c]];
+      results[i] = res[c] == SST_FOUND ? 1 : (res[c] == SST_DELETED ? 0 : -1);
+      if (res[c] == SST_FOUND) {
+        values[i] = vals[c];
+        lengths[i] = lens[c];
+      }
+      owner[cand_at[c]] = -1;
+    }
+
+    // Older segments only see what is still unresolved, still in order.
+    int kept = 0;
+    for (int p = 0; p < np; p++) {
+      if (owner[p] < 0) continue;
+      pending[kept] = pending[p];
+      owner[kept++] = owner[p];
+    }
+    np = kept;
+  }
+  read_end(ver, slot);
+
+  if (l->stats) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++)
+      if (results[i] == 1) bytes += keys[i].len + (uint64_t)(lengths[i] > 0 ? lengths[i] : 0);
+    count_reads(l, (uint64_t)n, memtable_hits, &tally, bytes, start);
   }
+
+out:
+  free(batch);
+  free(pending);
+  free(owner);
+  free(maybe);
+  free(cand);
+  free(cand_at);
+  free(res);
+  free(vals);
+  free(lens);
+  return rc;
 }
 
-void lsm_init(LSM *l, RBNode *nodes, Value *values, int size, bool owns_values){
-  l->next_segment_id = load_segment_count();
-  mt_init(&l->m, nodes, values, size, owns_values);
+void lsm_wait_compactions(LSM *l) {
+  pthread_mutex_lock(&l->lock);
+  while (l->has_compactor && !l->compaction_failed &&
+         (l->compacting || compaction_pick(l, NULL)))
+    pthread_cond_wait(&l->compact_cond, &l->lock);
+  pthread_mutex_unlock(&l->lock);
+}
+
+void lsm_cache_stats(LSM *l, CacheStats *out) {
+  if (l->block_cache) block_cache_stats(l->block_cache, out);
+  else memset(out, 0, sizeof(*out));
+}
+
+// Counters and latencies summed over every thread since lsm_init (all zero
+// without opts.collect_stats), plus the state of the memtables and
+// segments right now. The gauges are read under the lock, the counters
+// without it.
+void lsm_stats_snapshot(LSM *l, LSMStats *out) {
+  memset(out, 0, sizeof(*out));
+  stats_collect(l->stats, out);
+  lsm_cache_stats(l, &out->cache);
+
+  pthread_mutex_lock(&l->lock);
+  pthread_rwlock_rdlock(&l->mt_lock);
+  out->memtable_entries = mt_count(l->mem);
+  out->memtable_bytes = atomic_load(&l->mem->total_size);
+  out->memtable_dead_bytes = atomic_load(&l->mem->dead_size);
+  out->memtable_limit = l->mem->max_bytes;
+  out->flush_pending = l->imm != NULL;
+  pthread_rwlock_unlock(&l->mt_lock);
+
+  Version *v = versions_current(&l->versions);
+  out->segments = v->n_segs;
+  for (int i = 0; i < v->n_segs; i++) {
+    SSTable *sst = version_table(v, i);
+    out->segment_bytes += (uint64_t)sst->size;
+    if (sst->level > out->max_level) out->max_level = sst->level;
+  }
+  out->vlog_bytes = vlog_total_bytes(&l->vlog, &out->vlog_files);
+  pthread_mutex_unlock(&l->lock);
 }
 
+void lsm_close(LSM *l) {
+  pthread_mutex_lock(&l->lock);
+  l->stopping = true;
+  pthread_cond_broadcast(&l->flush_cond);
+  pthread_cond_broadcast(&l->compact_cond);
+  pthread_cond_broadcast(&l->stats_cond);
+  pthread_mutex_unlock(&l->lock);
+
+  if (l->has_flusher) pthread_join(l->flusher, NULL);
+  if (l->has_compactor) pthread_join(l->compactor, NULL);
+  if (l->has_stats_dumper) pthread_join(l->stats_dumper, NULL);
+  l->has_flusher = false;
+  l->has_compactor = false;
+  l->has_stats_dumper = false;
+
+  wal_close(&l->wals[0]);
+  wal_close(&l->wals[1]);
+  // Unflushed entries are safe in the log, only release what the trees own.
+  free_memtable(l, l->mem);
+  if (l->imm) free_memtable(l, l->imm);
+  l->imm = NULL;
+  for (int i = 0; i < l->n_idle; i++) free_memtable(l, l->idle[i]);
+  l->n_idle = 0;
+  mt_destroy(&l->mts[0]);
+  mt_destroy(&l->mts[1]);
+  pthread_cond_destroy(&l->flush_cond);
+  pthread_cond_destroy(&l->compact_cond);
+  pthread_cond_destroy(&l->stats_cond);
+  pthread_mutex_destroy(&l->lock);
+  pthread_rwlock_destroy(&l->mt_lock);
+
+  // Segments erase their cached frames as they go, so before the cache.
+  // Their value log files are still needed by the next lsm_init.
+  l->vlog.keep_files = true;
+  versions_destroy(&l->versions);
+  vlog_destroy(&l->vlog);
+  manifest_close(&l->manifest);
+  if (l->block_cache) block_cache_destroy(l->block_cache);
+  l->block_cache = NULL;
+  free(l->spare_nodes);
+  free(l->spare_values);
+  l->spare_nodes = NULL;
+  l->spare_values = NULL;
+  stats_free(l->stats);
+  l->stats = NULL;
+}
@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../lib/manifest.h"
+
+#define RECORD_HEADER_SIZE (2 * sizeof(uint32_t))
+#define EDIT_HEADER_SIZE (2 * sizeof(uint64_t) + 2 * sizeof(uint32_t))
+#define TABLE_FIXED_SIZE (3 * sizeof(uint64_t) + 2 * sizeof(uint16_t))
+#define TABLE_V1_SIZE (5 * sizeof(uint64_t))
+#define KEY_UNKNOWN 0xffffu
+
+static uint64_t get_u64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static int write_all(int fd, const uint8_t *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
+
+// Makes files created or renamed inside segments/ durable, so a manifest
+// edit naming one never outlives its directory entry.
+int manifest_sync_dir(void) {
+  int fd = open("segments", O_RDONLY);
+  if (fd < 0) return -1;
+  int rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+static uint32_t stored_len(Key k) {
+  return k.data ? k.len : 0;
+}
+
+static uint8_t *put_key(uint8_t *p, Key k) {
+  if (stored_len(k)) memcpy(p, k.data, k.len);
+  return p + stored_len(k);
+}
+
+static uint8_t *encode_record(const VersionEdit *e, size_t *len) {
+  size_t payload = EDIT_HEADER_SIZE + (size_t)e->n_removed * sizeof(uint64_t);
+  for (int i = 0; i < e->n_added; i++)
+    payload += TABLE_FIXED_SIZE + stored_len(e->added[i].min_key) + stored_len(e->added[i].max_key);
+  uint8_t *buf = malloc(RECORD_HEADER_SIZE + payload);
+  if (!buf) return NULL;
+
+  uint8_t *p = buf + RECORD_HEADER_SIZE;
+  put_u64(p, e->next_segment_id);
+  put_u64(p + 8, e->last_seq);
+  put_u32(p + 16, (uint32_t)e->n_removed);
+  put_u32(p + 20, (uint32_t)e->n_added);
+  p += EDIT_HEADER_SIZE;
+  for (int i = 0; i < e->n_removed; i++, p += sizeof(uint64_t)) put_u64(p, e->removed[i]);
+  for (int i = 0; i < e->n_added; i++) {
+    const ManifestTable *t = &e->added[i];
+    put_u64(p, t->id);
+    put_u32(p + 8, (uint32_t)t->level);
+    put_u16(p + 12, t->min_key.data ? (uint16_t)t->min_key.len : KEY_UNKNOWN);
+    put_u16(p + 14, t->max_key.data ? (uint16_t)t->max_key.len : KEY_UNKNOWN);
+    put_u64(p + 16, t->largest_seq);
+    p = put_key(p + TABLE_FIXED_SIZE, t->min_key);
+    p = put_key(p, t->max_key);
+  }
+
+  put_u32(buf + 4, (uint32_t)payload);
+  uLong c = crc32(0L, Z_NULL, 0);
+  c = crc32(c, buf + 4, (uInt)(sizeof(uint32_t) + payload));
+  put_u32(buf, (uint32_t)c);
+  *len = RECORD_HEADER_SIZE + payload;
+  return buf;
+}
+
+static int reserve_tables(Manifest *m, int n) {
+  if (n <= m->cap) return 0;
+  int cap = m->cap ? m->cap : 16;
+  while (cap < n) cap *= 2;
+  ManifestTable *tables = realloc(m->tables, sizeof(ManifestTable) * (size_t)cap);
+  if (!tables) return -1;
+  m->tables = tables;
+  m->cap = cap;
+  return 0;
+}
+
+static int find_table(Manifest *m, unsigned long long id) {
+  for (int i = 0; i < m->n_tables; i++)
+    if (m->tables[i].id == id) return i;
+  return -1;
+}
+
+static void free_table(ManifestTable *t) {
+  key_free(&t->min_key);
+  key_free(&t->max_key);
+}
+
+// Owned copies of e's additions, taken before anything changes so that
+// applying the edit cannot fail halfway.
+static ManifestTable *copy_added(const VersionEdit *e) {
+  ManifestTable *out = malloc(sizeof(ManifestTable) * (size_t)(e->n_added ? e->n_added : 1));
+  if (!out) return NULL;
+  for (int i = 0; i < e->n_added; i++) {
+    const ManifestTable *src = &e->added[i];
+    out[i] = *src;
+    out[i].min_key = out[i].max_key = (Key){ NULL, 0 };
+    if ((src->min_key.data && key_dup(&out[i].min_key, src->min_key) != 0) ||
+        (src->max_key.data && key_dup(&out[i].max_key, src->max_key) != 0)) {
+      for (int j = 0; j <= i; j++) free_table(&out[j]);
+      free(out);
+      return NULL;
+    }
+  }
+  return out;
+}
+
+// Room for the additions must have been reserved; takes the copies.
+static void apply_edit(Manifest *m, const VersionEdit *e, ManifestTable *added) {
+  for (int i = 0; i < e->n_removed; i++) {
+    int idx = find_table(m, e->removed[i]);
+    if (idx < 0) continue;
+    free_table(&m->tables[idx]);
+    m->tables[idx] = m->tables[--m->n_tables];
+  }
+  for (int i = 0; i < e->n_added; i++) {
+    int idx = find_table(m, added[i].id);
+    if (idx < 0) idx = m->n_tables++;
+    else free_table(&m->tables[idx]);
+    m->tables[idx] = added[i];
+  }
+  free(added);
+  if (e->next_segment_id > m->next_segment_id) m->next_segment_id = e->next_segment_id;
+  if (e->last_seq > m->last_seq) m->last_seq = e->last_seq;
+}
+
+// Reads the key of stored length len at *q, advancing it; len is KEY_UNKNOWN
+// for none. False when it runs past end.
+static bool take_key(const uint8_t **q, const uint8_t *end, uint16_t len, Key *out) {
+  if (len == KEY_UNKNOWN) {
+    *out = (Key){ NULL, 0 };
+    return true;
+  }
+  if ((size_t)(end - *q) < len) return false;
+  *out = (Key){ (const char *)*q, len };
+  *q += len;
+  return true;
+}
+
+// Applies one record's payload. Returns 1 if it is malformed, -1 on OOM.
+// keys holds the key_from_long bytes of v1 tables while the edit applies.
+static int replay_payload(Manifest *m, bool v1, const uint8_t *p, size_t len) {
+  if (len < EDIT_HEADER_SIZE) return 1;
+  uint32_t n_removed = get_u32(p + 16);
+  uint32_t n_added = get_u32(p + 20);
+  size_t table_min = v1 ? TABLE_V1_SIZE : TABLE_FIXED_SIZE;
+  if ((len - EDIT_HEADER_SIZE) / sizeof(uint64_t) < n_removed ||
+      (len - EDIT_HEADER_SIZE - (size_t)n_removed * sizeof(uint64_t)) / table_min < n_added)
+    return 1;
+
+  unsigned long long *removed = malloc(sizeof(*removed) * (n_removed ? n_removed : 1));
+  ManifestTable *added = malloc(sizeof(*added) * (n_added ? n_added : 1));
+  char *keys = malloc(2 * KEY_LONG_SIZE * (size_t)(v1 && n_added ? n_added : 1));
+  if (!removed || !added || !keys || reserve_tables(m, m->n_tables + (int)n_added) != 0) {
+    free(removed);
+    free(added);
+    free(keys);
+    return -1;
+  }
+
+  const uint8_t *q = p + EDIT_HEADER_SIZE;
+  const uint8_t *end = p + len;
+  int rc = 0;
+  for (uint32_t i = 0; i < n_removed; i++, q += sizeof(uint64_t)) removed[i] = get_u64(q);
+  for (uint32_t i = 0; i < n_added && rc == 0; i++) {
+    if ((size_t)(end - q) < table_min) {
+      rc = 1;
+      break;
+    }
+    added[i].id = get_u64(q);
+    added[i].level = (int)get_u32(q + 8);
+    if (v1) {
+      added[i].min_key = key_from_long(keys + 2 * KEY_LONG_SIZE * i, (long)get_u64(q + 16));
+      added[i].max_key = key_from_long(keys + 2 * KEY_LONG_SIZE * i + KEY_LONG_SIZE, (long)get_u64(q + 24));
+      added[i].largest_seq = get_u64(q + 32);
+      q += TABLE_V1_SIZE;
+      continue;
+    }
+    uint16_t min_len = get_u16(q + 12);
+    uint16_t max_len = get_u16(q + 14);
+    added[i].largest_seq = get_u64(q + 16);
+    q += TABLE_FIXED_SIZE;
+    if (!take_key(&q, end, min_len, &added[i].min_key) || !take_key(&q, end, max_len, &added[i].max_key))
+      rc = 1;
+  }
+  if (rc == 0 && q != end) rc = 1;
+
+  if (rc == 0) {
+    VersionEdit e = {
+      .removed = removed, .n_removed = (int)n_removed,
+      .added = added, .n_added = (int)n_added,
+      .next_segment_id = get_u64(p), .last_seq = get_u64(p + 8),
+    };
+    ManifestTable *owned = copy_added(&e);
+    if (owned) apply_edit(m, &e, owned);
+    else rc = -1;
+  }
+  free(removed);
+  free(added);
+  free(keys);
+  return rc;
+}
+
+static int replay(Manifest *m, bool v1, const uint8_t *buf, size_t off, size_t n) {
+  while (n - off >= RECORD_HEADER_SIZE) {
+    uint32_t crc = get_u32(buf + off);
+    uint32_t len = get_u32(buf + off + 4);
+    if (len > n - off - RECORD_HEADER_SIZE) break;
+    uLong c = crc32(0L, Z_NULL, 0);
+    c = crc32(c, buf + off + 4, (uInt)(sizeof(uint32_t) + len));
+    if ((uint32_t)c != crc) break;
+
+    int rc = replay_payload(m, v1, buf + off + RECORD_HEADER_SIZE, len);
+    if (rc < 0) return -1;
+    if (rc > 0) break;
+    off += RECORD_HEADER_SIZE + len;
+  }
+  if (off < n) fprintf(stderr, "manifest: ignoring %zu bytes of torn tail\n", n - off);
+  return 0;
+}
+
+// Reads the header: magic and comparator name. Returns the offset of the
+// first record, 0 when the header is bad.
+static size_t read_header(Manifest *m, const uint8_t *buf, size_t n, bool *v1) {
+  if (n < sizeof(uint64_t)) return 0;
+  *v1 = get_u64(buf) == MANIFEST_MAGIC_V1;
+  if (*v1) {
+    snprintf(m->comparator, sizeof(m->comparator), "%s", KEY_BYTEWISE_NAME);
+    return sizeof(uint64_t);
+  }
+  if (get_u64(buf) != MANIFEST_MAGIC || n < sizeof(uint64_t) + sizeof(uint32_t)) return 0;
+  uint32_t name_len = get_u32(buf + sizeof(uint64_t));
+  size_t off = sizeof(uint64_t) + sizeof(uint32_t);
+  if (name_len >= MANIFEST_NAME_MAX || name_len > n - off) return 0;
+  memcpy(m->comparator, buf + off, name_len);
+  m->comparator[name_len] = '\0';
+  return off + name_len;
+}
+
+// Replays MANIFEST_FILE with one read, then rolls it over so the file
+// starts from a single snapshot again. *found is false when there was no
+// manifest yet. Fails when the store was written in another key order
+// than comparator names.
+int manifest_open(Manifest *m, const char *comparator, bool *found) {
+  memset(m, 0, sizeof(*m));
+  m->fd = -1;
+  m->roll_bytes = MANIFEST_ROLL_BYTES;
+  *found = false;
+  if (strlen(comparator) >= MANIFEST_NAME_MAX) {
+    fprintf(stderr, "manifest: comparator name too long\n");
+    return -1;
+  }
+
+  int fd = open(MANIFEST_FILE, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      perror("open manifest");
+      return -1;
+    }
+    snprintf(m->comparator, sizeof(m->comparator), "%s", comparator);
+    return manifest_roll(m);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat manifest");
+    close(fd);
+    return -1;
+  }
+  size_t n = (size_t)st.st_size;
+  uint8_t *buf = malloc(n ? n : 1);
+  size_t got = 0;
+  while (buf && got < n) {
+    ssize_t r = read(fd, buf + got, n - got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    got += (size_t)r;
+  }
+  close(fd);
+
+  int rc = 0;
+  bool v1;
+  size_t off;
+  if (!buf || got != n) {
+    perror("read manifest");
+    rc = -1;
+  } else if ((off = read_header(m, buf, n, &v1)) == 0) {
+    fprintf(stderr, "manifest: bad header\n");
+    rc = -1;
+  } else if (strcmp(m->comparator, comparator) != 0) {
+    fprintf(stderr, "manifest: keys are ordered by %s, not %s\n", m->comparator, comparator);
+    rc = -1;
+  } else {
+    rc = replay(m, v1, buf, off, n);
+  }
+  free(buf);
+  if (rc != 0) {
+    manifest_close(m);
+    return -1;
+  }
+
+  *found = true;
+  return manifest_roll(m);
+}
+
+// Writes the live set to a fresh file and renames it over the manifest,
+// so a crash leaves either the old file or the new one.
+int manifest_roll(Manifest *m) {
+  VersionEdit snap = {
+    .added = m->tables, .n_added = m->n_tables,
+    .next_segment_id = m->next_segment_id, .last_seq = m->last_seq,
+  };
+  size_t len;
+  uint8_t *rec = encode_record(&snap, &len);
+  if (!rec) return -1;
+
+  uint32_t name_len = (uint32_t)strlen(m->comparator);
+  uint8_t magic[sizeof(uint64_t) + sizeof(uint32_t) + MANIFEST_NAME_MAX];
+  put_u64(magic, MANIFEST_MAGIC);
+  put_u32(magic + sizeof(uint64_t), name_len);
+  memcpy(magic + sizeof(uint64_t) + sizeof(uint32_t), m->comparator, name_len);
+  size_t header = sizeof(uint64_t) + sizeof(uint32_t) + name_len;
+  int fd = open(MANIFEST_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write_all(fd, magic, header) != 0 || write_all(fd, rec, len) != 0 ||
+      fsync(fd) != 0 || rename(MANIFEST_TMP_FILE, MANIFEST_FILE) != 0 || manifest_sync_dir() != 0) {
+    perror("manifest roll-over");
+    if (fd >= 0) close(fd);
+    unlink(MANIFEST_TMP_FILE);
+    free(rec);
+    return -1;
+  }
+  free(rec);
+
+  if (m->fd >= 0) close(m->fd);
+  m->fd = fd;
+  m->size = m->snapshot_size = (long)(header + len);
+  m->broken = false;
+  return 0;
+}
+
+// Appends e and syncs it before the live set changes. After a failed
+// append the next edit starts a new file rather than writing past a
+// possibly torn record.
+int manifest_apply(Manifest *m, const VersionEdit *e) {
+  if (reserve_tables(m, m->n_tables + e->n_added) != 0) return -1;
+  if ((m->broken || m->fd < 0) && manifest_roll(m) != 0) return -1;
+
+  size_t len;
+  uint8_t *rec = encode_record(e, &len);
+  ManifestTable *added = copy_added(e);
+  if (!rec || !added) {
+    free(rec);
+    if (added) {
+      for (int i = 0; i < e->n_added; i++) free_table(&added[i]);
+      free(added);
+    }
+    return -1;
+  }
+  if (write_all(m->fd, rec, len) != 0 || fdatasync(m->fd) != 0) {
+    perror("manifest append");
+    m->broken = true;
+    free(rec);
+    for (int i = 0; i < e->n_added; i++) free_table(&added[i]);
+    free(added);
+    return -1;
+  }
+  free(rec);
+  m->size += (long)len;
+  apply_edit(m, e, added);
+
+  // The edit is durable either way; a failed roll-over keeps appending.
+  if (m->size - m->snapshot_size > m->roll_bytes) manifest_roll(m);
+  return 0;
+}
+
+void manifest_describe(ManifestTable *out, const SSTable *sst) {
+  out->id = sst->id;
+  out->level = sst->level;
+  out->min_key = sst->props.min_key;
+  out->max_key = sst->props.max_key;
+  out->largest_seq = sst->largest_seq;
+}
+
+void manifest_close(Manifest *m) {
+  if (m->fd >= 0) close(m->fd);
+  for (int i = 0; i < m->n_tables; i++) free_table(&m->tables[i]);
+  free(m->tables);
+  m->fd = -1;
+  m->tables = NULL;
+  m->n_tables = 0;
+  m->cap = 0;
+}
@@ -1,37 +1,457 @@
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
  
 #include "../lib/rbtree.h"
 #include "../lib/memtable.h"
 
-void mt_init(Memtable *m,RBNode *nodes, Value *values, int size, bool owns_values) {
-  m->total_size = 0;
-  RBTree *t = &m->t;
+size_t mt_pool_bytes(MemtableKind kind, int size) {
+  if (kind == MEMTABLE_BTREE) return bt_pool_bytes(size);
+  return (size_t)size * (kind == MEMTABLE_SKIPLIST ? sizeof(SLNode) : sizeof(RBNode));
+}
+
+void mt_init(Memtable *m, MemtableKind kind, void *nodes, Value *values, int size, bool owns_values,
+             const Comparator *cmp) {
+  m->kind = kind;
+  m->owns_values = owns_values;
+  m->cmp = cmp;
+  m->reserved = 0;
+  m->max_bytes = 0;
+  arena_init(&m->arena, ARENA_CHUNK_SIZE);
+  atomic_init(&m->total_size, 0);
+  atomic_init(&m->dead_size, 0);
+  m->pins = 0;
+  m->undo = NULL;
+  m->undo_cap = 0;
+  m->n_undo = 0;
+  if (kind == MEMTABLE_SKIPLIST) {
+    sl_init(&m->s, (SLNode *)nodes, values, size);
+    m->s.cmp = cmp;
+    m->s.keys = &m->arena;
+  } else if (kind == MEMTABLE_BTREE) {
+    bt_init(&m->b, nodes, values, size);
+    m->b.cmp = cmp;
+    m->b.keys = &m->arena;
+  } else {
+    rb_tree_init(&m->t, (RBNode *)nodes, values, size, false);
+    m->t.cmp = cmp;
+    m->t.keys = &m->arena;
+  }
+}
+
+// Whether mt_put and mt_delete may run concurrently with each other and
+// with lookups. Otherwise the caller keeps writers exclusive.
+bool mt_concurrent(const Memtable *m) {
+  return m->kind == MEMTABLE_SKIPLIST;
+}
+
+// Entries held, counting every version the skiplist keeps.
+int mt_count(Memtable *m) {
+  if (m->kind == MEMTABLE_SKIPLIST) return atomic_load(&m->s.length);
+  if (m->kind == MEMTABLE_BTREE) return m->b.length;
+  return m->t.length;
+}
+
+Value *mt_get(Memtable *m, Key key){
+  Value *v;
+  return mt_lookup(m, key, &v) == MT_FOUND ? v : NULL;
+}
+
+MtResult mt_lookup(Memtable *m, Key key, Value **value){
+  if(m->kind == MEMTABLE_SKIPLIST){
+    int idx = sl_find(&m->s, key);
+    if(idx == 0)
+      return MT_ABSENT;
+    if(m->s.values[idx].length < 0)
+      return MT_DELETED;
+    *value = &m->s.values[idx];
+    return MT_FOUND;
+  }
+  if(m->kind == MEMTABLE_BTREE){
+    int idx = bt_find(&m->b, key);
+    if(idx == 0)
+      return MT_ABSENT;
+    if(m->b.values[idx].length < 0)
+      return MT_DELETED;
+    *value = &m->b.values[idx];
+    return MT_FOUND;
+  }
+
+  int idx = rb_tree_find(&m->t, key);
+  if(idx == 0)
+    return MT_ABSENT;
+  if(m->t.nodes[idx].tombstone)
+    return MT_DELETED;
+  *value = &m->t.values[idx];
+  return MT_FOUND;
+}
+
+bool mt_is_full(Memtable *m){
+  if(m->max_bytes > 0 && atomic_load(&m->total_size) >= m->max_bytes)
+    return true;
+  if(m->kind == MEMTABLE_SKIPLIST){
+    int used = atomic_load(&m->s.next_free);
+    if(m->reserved + 1 > used) used = m->reserved + 1;
+    return used >= m->s.size-1;
+  }
+  if(m->kind == MEMTABLE_BTREE)
+    return bt_is_full(&m->b);
+  return m->t.next_free >= m->t.size-1;
+}
+
+// Admits one write, false once the memtable is full. Called by whoever
+// orders the writes (the engine lock); the skiplist counts the admitted
+// writes so ones still being inserted cannot run it out of nodes.
+bool mt_reserve(Memtable *m){
+  if(mt_is_full(m))
+    return false;
+  if(m->kind == MEMTABLE_SKIPLIST)
+    m->reserved++;
+  return true;
+}
+
+// The bytes to store for a value: a copy in the arena when the memtable
+// owns its values. NULL when out of memory.
+static const char *hold_value(Memtable *m, const char *value, int length){
+  if(!m->owns_values || length <= 0)
+    return length > 0 ? value : NULL;
+  char *copy = arena_alloc(&m->arena, (size_t)length);
+  if(!copy)
+    return NULL;
+  memcpy(copy, value, (size_t)length);
+  return copy;
+}
+
+// Counts what a skiplist write hid: an older version, or itself when a
+// newer one got in first. Each version holds a copy of the key.
+static void account_shadowed(Memtable *m, int shadowed){
+  if(shadowed == 0)
+    return;
+  int len = m->s.values[shadowed].length;
+  atomic_fetch_add(&m->dead_size, (len > 0 ? len : 0) + (long)m->s.nodes[shadowed].key.len);
+}
+
+// The trees overwrite in place; whatever they let go of is dead.
+static long replaced_bytes(Memtable *m){
+  return m->kind == MEMTABLE_BTREE ? m->b.replaced_bytes : m->t.replaced_bytes;
+}
+
+static void account_replaced(Memtable *m, long before){
+  long replaced = replaced_bytes(m) - before;
+  if(replaced > 0)
+    atomic_fetch_add(&m->dead_size, replaced);
+}
+
+// The trees copy a key only for a new node.
+static void account_key(Memtable *m, int count_before, Key key){
+  if(mt_count(m) > count_before)
+    atomic_fetch_add(&m->total_size, key.len);
+}
+
+static size_t undo_hash(Key key){
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(uint32_t i = 0; i < key.len; i++)
+    h = (h ^ (uint8_t)key.data[i]) * 0x100000001b3ULL;
+  return (size_t)(h ^ (h >> 32));
+}
 
-  t->nodes = nodes;
-  t->values = values;
-  t->size = size;
-  t->length = 0;
-  t->next_free = 1;
-  t->root_idx = 1;
-  t->owns_values = owns_values;
+static bool grow_undo(Memtable *m){
+  size_t cap = m->undo_cap ? m->undo_cap * 2 : 64;
+  MtUndo **undo = calloc(cap, sizeof(MtUndo *));
+  if(!undo)
+    return false;
+  // Walked oldest first so each chain stays newest first.
+  for(size_t b = 0; b < m->undo_cap; b++){
+    MtUndo *rev = NULL;
+    for(MtUndo *u = m->undo[b], *next; u; u = next){
+      next = u->next;
+      u->next = rev;
+      rev = u;
+    }
+    for(MtUndo *u = rev, *next; u; u = next){
+      next = u->next;
+      MtUndo **head = &undo[undo_hash(u->key) & (cap - 1)];
+      u->next = *head;
+      *head = u;
+    }
+  }
+  free(m->undo);
+  m->undo = undo;
+  m->undo_cap = cap;
+  return true;
 }
 
+// Drops what the writes made while pinned replaced.
+static void clear_undo(Memtable *m){
+  for(size_t b = 0; b < m->undo_cap; b++){
+    for(MtUndo *u = m->undo[b], *next; u; u = next){
+      next = u->next;
+      free(u);
+    }
+    m->undo[b] = NULL;
+  }
+  m->n_undo = 0;
+}
 
-inline Value *mt_get(Memtable *m, long key){
-  return rb_tree_get(&m->t, key);
+// Called before a tree write of seq to key while an iterator reads the
+// memtable: keeps the key's entry as it is for that iterator.
+static bool save_undo(Memtable *m, uint64_t seq, Key key){
+  if(m->n_undo >= m->undo_cap / 2 && !grow_undo(m))
+    return false;
+  MtUndo *u = malloc(sizeof(MtUndo) + key.len);
+  if(!u)
+    return false;
+  if(key.len)
+    memcpy(u + 1, key.data, key.len);
+  u->key = (Key){ (const char *)(u + 1), key.len };
+  u->seq = seq;
+  u->value = NULL;
+  u->length = -1;
+  int idx = m->kind == MEMTABLE_BTREE ? bt_find(&m->b, key) : rb_tree_find(&m->t, key);
+  u->absent = idx == 0;
+  bool tombstone = m->kind == MEMTABLE_BTREE ? idx != 0 && m->b.values[idx].length < 0
+                                             : idx != 0 && m->t.nodes[idx].tombstone;
+  if(idx != 0 && !tombstone){
+    Value *v = m->kind == MEMTABLE_BTREE ? &m->b.values[idx] : &m->t.values[idx];
+    u->value = v->value;
+    u->length = v->length;
+  }
+  MtUndo **head = &m->undo[undo_hash(key) & (m->undo_cap - 1)];
+  u->next = *head;
+  *head = u;
+  m->n_undo++;
+  return true;
+}
+
+// What key held as of seq if a write since changed it, else NULL. Of the
+// writes after seq the oldest saved that state.
+static const MtUndo *undo_at(Memtable *m, Key key, uint64_t seq){
+  if(m->n_undo == 0)
+    return NULL;
+  const MtUndo *found = NULL;
+  for(const MtUndo *u = m->undo[undo_hash(key) & (m->undo_cap - 1)]; u; u = u->next)
+    if(u->seq > seq && key_equal(u->key, key))
+      found = u;
+  return found;
 }
 
-bool mt_put(Memtable *m, long key, const char *value, int length){
-  if(m->t.next_free >= m->t.size-1)
+// seq orders writes to the same key in the skiplist, the tree applies them
+// in call order. With owns_values the caller keeps its buffer.
+bool mt_put(Memtable *m, uint64_t seq, Key key, const char *value, int length){
+  if(!mt_concurrent(m) && mt_is_full(m))
+    return false;
+
+  const char *held = hold_value(m, value, length);
+  if(length > 0 && !held)
     return false;
+  // Counted up front: bytes copied for a write that then fails stay in the
+  // arena until the reset like any other dead ones.
+  if(length > 0)
+    atomic_fetch_add(&m->total_size, length);
 
-  bool res = rb_tree_put(&m->t,key,value,length);
-  if(res){
-    m->total_size += sizeof(key) + length;
+  if(m->kind == MEMTABLE_SKIPLIST){
+    int shadowed;
+    if(!sl_put(&m->s, seq, key, held, length, &shadowed)){
+      if(length > 0)
+        atomic_fetch_add(&m->dead_size, length);
+      return false;
+    }
+    atomic_fetch_add(&m->total_size, key.len);
+    account_shadowed(m, shadowed);
+    return true;
   }
+
+  if(m->pins > 0 && !save_undo(m, seq, key)){
+    if(length > 0)
+      atomic_fetch_add(&m->dead_size, length);
+    return false;
+  }
+  long before = replaced_bytes(m);
+  int count = mt_count(m);
+  bool res = m->kind == MEMTABLE_BTREE ? bt_put(&m->b, key, held, length)
+                                       : rb_tree_put(&m->t,key,held,length);
+  account_replaced(m, before);
+  account_key(m, count, key);
+  if(!res && length > 0)
+    atomic_fetch_add(&m->dead_size, length);
+  return res;
 }
 
-bool mt_delete(Memtable *m, long key){
+bool mt_delete(Memtable *m, uint64_t seq, Key key){
+  if(m->kind == MEMTABLE_SKIPLIST){
+    // Always a new node: older versions stay visible to running lookups.
+    int shadowed;
+    if(!sl_put(&m->s, seq, key, NULL, -1, &shadowed))
+      return false;
+    atomic_fetch_add(&m->total_size, key.len);
+    account_shadowed(m, shadowed);
+    return true;
+  }
+
+  if(m->pins > 0 && !save_undo(m, seq, key))
+    return false;
+  long before = replaced_bytes(m);
+  int count = mt_count(m);
+  if(m->kind == MEMTABLE_BTREE){
+    // A tombstone in the key's slot, new or overwriting.
+    bool res = bt_put(&m->b, key, NULL, -1);
+    account_replaced(m, before);
+    account_key(m, count, key);
+    return res;
+  }
+
+  bool res = rb_tree_delete(&m->t, key);
+  account_replaced(m, before);
+  if(res)
+    return true;
+
+  // Not in the memtable (or already deleted): the key may still live in a
+  // segment, so record a tombstone that shadows it.
+  if(mt_is_full(m))
+    return false;
+  if(!rb_tree_put(&m->t, key, NULL, -1))
+    return false;
+  account_key(m, count, key);
   return rb_tree_delete(&m->t, key);
 }
+
+// Nothing may still read the memtable.
+void mt_reset(Memtable *m){
+  if(m->kind == MEMTABLE_SKIPLIST)
+    sl_reset(&m->s);
+  else if(m->kind == MEMTABLE_BTREE)
+    bt_reset(&m->b);
+  else
+    rb_tree_reset(&m->t);
+  arena_reset(&m->arena);
+  clear_undo(m);
+  m->reserved = 0;
+  atomic_store(&m->total_size, 0);
+  atomic_store(&m->dead_size, 0);
+}
+
+void mt_destroy(Memtable *m){
+  mt_reset(m);
+  arena_destroy(&m->arena);
+  free(m->undo);
+  m->undo = NULL;
+  m->undo_cap = 0;
+}
+
+void mt_pin(Memtable *m){
+  m->pins++;
+}
+
+// True when that was the last pin; the undo entries go with it.
+bool mt_unpin(Memtable *m){
+  if(--m->pins > 0)
+    return false;
+  clear_undo(m);
+  return true;
+}
+
+static void iter_step(MtIter *it){
+  if(it->m->kind == MEMTABLE_SKIPLIST)
+    it->node = sl_next_key(&it->m->s, it->node);
+  else if(it->m->kind == MEMTABLE_BTREE)
+    bt_next(&it->m->b, &it->node, &it->pos);
+  else
+    rb_iter_next(&it->rb);
+}
+
+// Steps over what did not exist yet as of it->seq: skiplist versions
+// written later, tree keys a later write added.
+static void iter_settle(MtIter *it){
+  Memtable *m = it->m;
+  if(it->seq == UINT64_MAX)
+    return;
+  if(m->kind == MEMTABLE_SKIPLIST){
+    it->node = sl_visible(&m->s, it->node, it->seq);
+    return;
+  }
+  while(mt_iter_valid(it)){
+    const MtUndo *u = undo_at(m, mt_iter_key(it), it->seq);
+    if(!u || !u->absent)
+      return;
+    iter_step(it);
+  }
+}
+
+// The smallest key; under a comparator the empty key need not be it.
+void mt_iter_first(MtIter *it, Memtable *m){
+  mt_iter_first_at(it, m, UINT64_MAX);
+}
+
+void mt_iter_seek(MtIter *it, Memtable *m, Key key){
+  mt_iter_seek_at(it, m, key, UINT64_MAX);
+}
+
+// A tree still taking writes is only read under the lock that keeps them
+// out, the skiplist at any time.
+void mt_iter_first_at(MtIter *it, Memtable *m, uint64_t seq){
+  it->m = m;
+  it->seq = seq;
+  if(m->kind == MEMTABLE_SKIPLIST)
+    it->node = atomic_load_explicit(&m->s.nodes[0].next[0], memory_order_acquire);
+  else if(m->kind == MEMTABLE_BTREE)
+    bt_first(&m->b, &it->node, &it->pos);
+  else
+    rb_iter_first(&it->rb, &m->t);
+  iter_settle(it);
+}
+
+void mt_iter_seek_at(MtIter *it, Memtable *m, Key key, uint64_t seq){
+  it->m = m;
+  it->seq = seq;
+  if(m->kind == MEMTABLE_SKIPLIST)
+    it->node = sl_seek(&m->s, key);
+  else if(m->kind == MEMTABLE_BTREE)
+    bt_seek(&m->b, key, &it->node, &it->pos);
+  else
+    rb_iter_seek(&it->rb, &m->t, key);
+  iter_settle(it);
+}
+
+bool mt_iter_valid(MtIter *it){
+  if(it->m->kind != MEMTABLE_RBTREE)
+    return it->node != 0;
+  return rb_iter_valid(&it->rb);
+}
+
+void mt_iter_next(MtIter *it){
+  iter_step(it);
+  iter_settle(it);
+}
+
+Key mt_iter_key(MtIter *it){
+  if(it->m->kind == MEMTABLE_SKIPLIST)
+    return it->m->s.nodes[it->node].key;
+  if(it->m->kind == MEMTABLE_BTREE)
+    return it->m->b.nodes[it->node].keys[it->pos];
+  return it->m->t.nodes[rb_iter_node(&it->rb)].key;
+}
+
+// Returns the length, -1 for a tombstone.
+int mt_iter_value(MtIter *it, const char **value){
+  Value *v;
+  if(it->m->kind != MEMTABLE_SKIPLIST && it->seq != UINT64_MAX){
+    const MtUndo *u = undo_at(it->m, mt_iter_key(it), it->seq);
+    if(u){
+      *value = u->value;
+      return u->length;
+    }
+  }
+  if(it->m->kind == MEMTABLE_SKIPLIST){
+    v = &it->m->s.values[it->node];
+  } else if(it->m->kind == MEMTABLE_BTREE){
+    v = &it->m->b.values[it->m->b.nodes[it->node].slots[it->pos]];
+  } else {
+    int idx = rb_iter_node(&it->rb);
+    if(it->m->t.nodes[idx].tombstone)
+      return -1;
+    v = &it->m->t.values[idx];
+  }
+  *value = v->value;
+  return v->length;
+}
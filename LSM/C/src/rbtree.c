@@ -6,7 +6,7 @@
 #include "string.h"
 
 static inline RBNode *get_node(RBTree *t, int idx) { return &t->nodes[idx]; }
-static inline void init_node(RBNode *node, long key) {
+static inline void init_node(RBNode *node, Key key) {
   node->left_idx = 0;
   node->right_idx = 0;
   node->parent_idx = 0;
@@ -16,13 +16,17 @@ static inline void init_node(RBNode *node, long key) {
 }
 
 static inline Value *get_value(RBTree *t, int idx) { return &t->values[idx]; }
-static inline void set_value(RBTree *t, int idx, const char *value, int length) {
+static inline void drop_value(RBTree *t, int idx) {
+  if(t->values[idx].length > 0) t->replaced_bytes += t->values[idx].length;
   if(t->owns_values && t->values[idx].value != NULL) free((void *)t->values[idx].value);
+}
+static inline void set_value(RBTree *t, int idx, const char *value, int length) {
+  drop_value(t, idx);
   t->values[idx].value = value;
   t->values[idx].length = length;
 }
 static inline void unset_value(RBTree *t, int idx) {
-  if(t->owns_values && t->values[idx].value != NULL) free((void *)t->values[idx].value);
+  drop_value(t, idx);
   t->values[idx].value = NULL;
   t->values[idx].length = -1;
 }
@@ -35,13 +39,22 @@ static inline int new_node(RBTree *t) {
   return t->next_free++;
 }
 
-static inline int new_key_value_pair(RBTree *t, int parent_idx, long key, const char *value, int length) {
+static inline int new_key_value_pair(RBTree *t, int parent_idx, Key key, const char *value, int length) {
+  if (t->keys != NULL && key.len > 0) {
+    char *copy = arena_alloc(t->keys, key.len);
+    if (!copy)
+      return 0;
+    memcpy(copy, key.data, key.len);
+    key.data = copy;
+  }
   int idx = new_node(t);
   if (idx == 0)
     return 0;
   RBNode *new_node = get_node(t, idx);
   init_node(new_node, key);
-  set_value(t,idx,value,length);
+  // A fresh node, whatever its slot held before is not ours.
+  t->values[idx].value = value;
+  t->values[idx].length = length;
   new_node->parent_idx = parent_idx;
   return idx;
 }
@@ -161,32 +174,55 @@ void rb_tree_init(RBTree *t, RBNode *nodes, Value *values, int size, bool owns_v
   t->length = 0;
   t->next_free = 1;
   t->root_idx = 1;
+  t->replaced_bytes = 0;
   t->owns_values = owns_values;
+  t->cmp = NULL;
+  t->keys = NULL;
+}
+
+int rb_tree_find(RBTree *t, Key key) {
+  if (t->length == 0)
+    return 0;
+
+  int idx = t->root_idx;
+  int c;
+  for (;;) {
+    RBNode *node = get_node(t, idx);
+    c = key_compare(t->cmp, key, node->key);
+    if (c < 0 && node->left_idx != 0)
+      idx = node->left_idx;
+    else if (c > 0 && node->right_idx != 0)
+      idx = node->right_idx;
+    else
+      return c == 0 ? idx : 0;
+  }
 }
 
-Value* rb_tree_get(RBTree *t, long key) {
+Value* rb_tree_get(RBTree *t, Key key) {
   if (t->length == 0)
     return NULL;
 
   int idx = t->root_idx;
   RBNode *node;
+  int c;
   for (;;) {
     node = get_node(t, idx);
-    if (key < node->key && node->left_idx != 0)
+    c = key_compare(t->cmp, key, node->key);
+    if (c < 0 && node->left_idx != 0)
       idx = node->left_idx;
-    else if (key > node->key && node->right_idx != 0)
+    else if (c > 0 && node->right_idx != 0)
       idx = node->right_idx;
     else
       break;
     node = get_node(t, idx);
   }
 
-  if (key != node->key || node->tombstone)
+  if (c != 0 || node->tombstone)
     return NULL;
   return get_value(t, idx);
 }
 
-bool rb_tree_put(RBTree *t, long key, const char *value, int length) {
+bool rb_tree_put(RBTree *t, Key key, const char *value, int length) {
   if (t->length == 0) {
     int idx = new_key_value_pair(t, 0, key, value, length);
     if(idx == 0) return false;
@@ -198,24 +234,28 @@ bool rb_tree_put(RBTree *t, long key, const char *value, int length) {
   RBNode *node;
   for (;;) {
     node = get_node(t, idx);
-    if (key < node->key) {
+    int c = key_compare(t->cmp, key, node->key);
+    if (c < 0) {
       if (node->left_idx == 0) {
         idx = new_key_value_pair(t, idx, key, value, length);
+        if(idx == 0) return false;
         node->left_idx = idx;
         fixInsert(t, idx);
         return true;
       }
 
       idx = node->left_idx;
-    } else if (key > node->key) {
+    } else if (c > 0) {
       if (node->right_idx == 0) {
         idx = new_key_value_pair(t, idx, key, value, length);
+        if(idx == 0) return false;
         node->right_idx = idx;
         fixInsert(t, idx);
         return true;
       }
       idx = node->right_idx;
     } else {
+      node->tombstone = false;
       set_value(t, idx, value, length);
       return true;
     }
@@ -224,23 +264,25 @@ bool rb_tree_put(RBTree *t, long key, const char *value, int length) {
   return false;
 }
 
-bool rb_tree_delete(RBTree *t, long key){
+bool rb_tree_delete(RBTree *t, Key key){
   if(t->length==0) return false;
 
   int idx = t->root_idx;
   RBNode *node;
+  int c;
   for (;;) {
     node = get_node(t, idx);
-    if (key < node->key && node->left_idx != 0)
+    c = key_compare(t->cmp, key, node->key);
+    if (c < 0 && node->left_idx != 0)
       idx = node->left_idx;
-    else if (key > node->key && node->right_idx != 0)
+    else if (c > 0 && node->right_idx != 0)
       idx = node->right_idx;
     else
       break;
     node = get_node(t, idx);
   }
 
-  if (key != node->key || node->tombstone)
+  if (c != 0 || node->tombstone)
     return false;
 
   node->tombstone = true;
@@ -253,6 +295,7 @@ void rb_tree_reset(RBTree *t){
   t->root_idx = 1;
   t->length = 0;
   t->next_free = 1;
+  t->replaced_bytes = 0;
   if(t->owns_values) {
     int size = t->size;
     Value *values = t->values;
@@ -261,6 +304,53 @@ void rb_tree_reset(RBTree *t){
       if(values[i].value != NULL && values[i].length != -1){ 
         free((void *)values[i].value);
       }
+      values[i].value = NULL;
     }
   }
 }
+
+// Positions it on the smallest key.
+void rb_iter_first(RBIter *it, RBTree *t) {
+  it->t = t;
+  it->sp = 0;
+  if (t->length == 0)
+    return;
+
+  for (int idx = t->root_idx; idx != 0; idx = get_node(t, idx)->left_idx)
+    it->stack[it->sp++] = idx;
+}
+
+// Positions it on the first node with a key >= key.
+void rb_iter_seek(RBIter *it, RBTree *t, Key key) {
+  it->t = t;
+  it->sp = 0;
+  if (t->length == 0)
+    return;
+
+  int idx = t->root_idx;
+  while (idx != 0) {
+    RBNode *node = get_node(t, idx);
+    if (key_compare(t->cmp, node->key, key) >= 0) {
+      it->stack[it->sp++] = idx;
+      idx = node->left_idx;
+    } else {
+      idx = node->right_idx;
+    }
+  }
+}
+
+bool rb_iter_valid(RBIter *it) {
+  return it->sp > 0;
+}
+
+int rb_iter_node(RBIter *it) {
+  return it->stack[it->sp - 1];
+}
+
+void rb_iter_next(RBIter *it) {
+  int idx = get_node(it->t, it->stack[--it->sp])->right_idx;
+  while (idx != 0) {
+    it->stack[it->sp++] = idx;
+    idx = get_node(it->t, idx)->left_idx;
+  }
+}
@@ -0,0 +1,138 @@
+#include "../lib/skiplist.h"
+
+// Heights come from the node's pool index, so inserting needs no shared
+// random state.
+static int node_height(int idx) {
+  uint32_t h = (uint32_t)idx * 0x9E3779B1u;
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  int height = 1;
+  while (height < SL_MAX_HEIGHT && (h & 3) == 0) {
+    height++;
+    h >>= 2;
+  }
+  return height;
+}
+
+static inline int next_of(SkipList *s, int idx, int level) {
+  return atomic_load_explicit(&s->nodes[idx].next[level], memory_order_acquire);
+}
+
+// Newest first within a key.
+static inline bool precedes(SkipList *s, const SLNode *n, Key key, uint64_t seq) {
+  int c = key_compare(s->cmp, n->key, key);
+  return c < 0 || (c == 0 && n->seq > seq);
+}
+
+// Last node before (key, seq) and the one after it, on every level.
+static void find(SkipList *s, Key key, uint64_t seq, int *preds, int *succs) {
+  int x = 0;
+  for (int level = SL_MAX_HEIGHT - 1; level >= 0; level--) {
+    int next = next_of(s, x, level);
+    while (next != 0 && precedes(s, &s->nodes[next], key, seq)) {
+      x = next;
+      next = next_of(s, x, level);
+    }
+    preds[level] = x;
+    succs[level] = next;
+  }
+}
+
+void sl_init(SkipList *s, SLNode *nodes, Value *values, int size) {
+  s->nodes = nodes;
+  s->values = values;
+  s->cmp = NULL;
+  s->keys = NULL;
+  s->size = size;
+  for (int level = 0; level < SL_MAX_HEIGHT; level++)
+    atomic_init(&nodes[0].next[level], 0);
+  atomic_init(&s->next_free, 1);
+  atomic_init(&s->length, 0);
+}
+
+// length is -1 for a tombstone. Returns false once the pool is used up or
+// the key cannot be copied.
+// *shadowed is the node this write hid from lookups: the older version of
+// key it went in front of, itself if a newer one was already there, or 0.
+bool sl_put(SkipList *s, uint64_t seq, Key key, const char *value, int length, int *shadowed) {
+  *shadowed = 0;
+  int idx = atomic_fetch_add(&s->next_free, 1);
+  if (idx >= s->size) return false;
+  if (s->keys != NULL && key.len > 0) {
+    char *copy = arena_alloc(s->keys, key.len);
+    if (!copy) return false;
+    memcpy(copy, key.data, key.len);
+    key.data = copy;
+  }
+
+  SLNode *n = &s->nodes[idx];
+  n->key = key;
+  n->seq = seq;
+  n->height = node_height(idx);
+  s->values[idx].value = value;
+  s->values[idx].length = length;
+
+  // Linked bottom-up, each level with one CAS. The release on level 0
+  // publishes the fields above; a lost race only redoes the search.
+  int preds[SL_MAX_HEIGHT], succs[SL_MAX_HEIGHT];
+  find(s, key, seq, preds, succs);
+  for (int level = 0; level < n->height; level++) {
+    for (;;) {
+      int expected = succs[level];
+      atomic_store_explicit(&n->next[level], expected, memory_order_relaxed);
+      if (atomic_compare_exchange_strong_explicit(&s->nodes[preds[level]].next[level], &expected, idx,
+                                                  memory_order_release, memory_order_relaxed))
+        break;
+      find(s, key, seq, preds, succs);
+    }
+    if (level > 0) continue;
+    // Neighbours at the moment of linking; only a node of the same key
+    // can ever come between them and idx later.
+    if (preds[0] != 0 && key_equal(s->nodes[preds[0]].key, key)) *shadowed = idx;
+    else if (succs[0] != 0 && key_equal(s->nodes[succs[0]].key, key)) *shadowed = succs[0];
+  }
+  atomic_fetch_add(&s->length, 1);
+  return true;
+}
+
+// First node at or after key, the newest one of its key; 0 if none.
+int sl_seek(SkipList *s, Key key) {
+  int x = 0;
+  for (int level = SL_MAX_HEIGHT - 1; level >= 0; level--) {
+    int next = next_of(s, x, level);
+    while (next != 0 && key_compare(s->cmp, s->nodes[next].key, key) < 0) {
+      x = next;
+      next = next_of(s, x, level);
+    }
+  }
+  return next_of(s, x, 0);
+}
+
+// The newest node of key, or 0.
+int sl_find(SkipList *s, Key key) {
+  int idx = sl_seek(s, key);
+  return idx != 0 && key_equal(s->nodes[idx].key, key) ? idx : 0;
+}
+
+// Newest node of the next larger key, skipping older versions of idx's.
+int sl_next_key(SkipList *s, int idx) {
+  Key key = s->nodes[idx].key;
+  int next = next_of(s, idx, 0);
+  while (next != 0 && key_equal(s->nodes[next].key, key)) next = next_of(s, next, 0);
+  return next;
+}
+
+// From idx on, the first node written at or before seq: the newest such
+// version of its key, as versions of a key run newest first. 0 if none.
+int sl_visible(SkipList *s, int idx, uint64_t seq) {
+  while (idx != 0 && s->nodes[idx].seq > seq) idx = next_of(s, idx, 0);
+  return idx;
+}
+
+void sl_reset(SkipList *s) {
+  for (int level = 0; level < SL_MAX_HEIGHT; level++)
+    atomic_store(&s->nodes[0].next[level], 0);
+  atomic_store(&s->next_free, 1);
+  atomic_store(&s->length, 0);
+}
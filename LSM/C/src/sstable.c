@@ -1,99 +1,1547 @@
+#define _GNU_SOURCE
 #include "../lib/sstable.h"
+#include "../lib/vlog.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
 #include <zlib.h>
 
 
-void sstable_init(SSTable *sst, long *keys, long *offsets){
-  sst->keys = keys;
-  sst->offsets = offsets;
+void sstable_init(SSTable *sst, unsigned long long id){
+  sst->key_pool = NULL;
+  sst->key_offs = NULL;
+  sst->pool_len = 0;
+  sst->pool_cap = 0;
+  sst->offsets = NULL;
   sst->length = 0;
+  sst->capacity = 0;
+  sst->search_heads = NULL;
+  sst->search_slots = NULL;
+  sst->head_skip = 0;
+  sst->cmp = NULL;
+  sst->id = id;
+  sst->fd = -1;
+  sst->size = 0;
+  sst->level = 0;
+  sst->largest_seq = 0;
+  sst->cache = NULL;
+  sst->stats = NULL;
+  sst->map = NULL;
+  sst->vlog = NULL;
+  // Unknown until a footer says otherwise.
+  memset(&sst->props, 0, sizeof(sst->props));
 }
 
-static const char* segment_get(SSTable *sst, FILE *segment, int idx){
-  long offset = sst->offsets[idx];
-  uint32_t src_len;
-  uint8_t src_buf[src_len];
-  long size;
+static int pread_all(int fd, void *buf, size_t n, long offset){
+  uint8_t *p = (uint8_t *)buf;
+  while(n > 0){
+    ssize_t r = pread(fd, p, n, offset);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) return -1;
+    p += r;
+    n -= (size_t)r;
+    offset += r;
+  }
+  return 0;
+}
+
+static uint64_t get_u64(const uint8_t *p){
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v){
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t get_u16(const uint8_t *p){
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void put_u16(uint8_t *p, uint16_t v){
+  memcpy(p, &v, sizeof(v));
+}
+
+#define PROPS_V2_SIZE (7 * sizeof(uint64_t))
+#define PROPS_FIXED_SIZE (5 * sizeof(uint64_t) + 2 * sizeof(uint16_t) + sizeof(uint32_t))
+
+#define PROPS_VLOG_SIZE (2 * sizeof(uint64_t))
+
+static void free_props(SSTableProps *props){
+  key_free(&props->min_key);
+  key_free(&props->max_key);
+  free(props->vlogs);
+  props->vlogs = NULL;
+  props->n_vlogs = 0;
+}
+
+static size_t props_size(const SSTableProps *props){
+  return PROPS_FIXED_SIZE + props->min_key.len + props->max_key.len + PROPS_VLOG_SIZE * props->n_vlogs;
+}
+
+// Returns the encoded size, props_size.
+static size_t encode_props(uint8_t *p, const SSTableProps *props){
+  put_u64(p, props->entries);
+  put_u64(p + 8, props->tombstones);
+  put_u64(p + 16, props->raw_bytes);
+  put_u64(p + 24, props->data_bytes);
+  put_u64(p + 32, props->frames);
+  put_u16(p + 40, (uint16_t)props->min_key.len);
+  put_u16(p + 42, (uint16_t)props->max_key.len);
+  memcpy(p + 44, &props->n_vlogs, sizeof(uint32_t));
+  size_t n = PROPS_FIXED_SIZE;
+  if(props->min_key.len) memcpy(p + n, props->min_key.data, props->min_key.len);
+  n += props->min_key.len;
+  if(props->max_key.len) memcpy(p + n, props->max_key.data, props->max_key.len);
+  n += props->max_key.len;
+  for(uint32_t i = 0; i < props->n_vlogs; i++, n += PROPS_VLOG_SIZE){
+    put_u64(p + n, props->vlogs[i].file);
+    put_u64(p + n + 8, props->vlogs[i].bytes);
+  }
+  return n;
+}
+
+static int decode_props(const uint8_t *p, size_t len, SSTableProps *props){
+  if(len < PROPS_FIXED_SIZE) return -1;
+  uint16_t min_len = get_u16(p + 40);
+  uint16_t max_len = get_u16(p + 42);
+  uint32_t n_vlogs;
+  memcpy(&n_vlogs, p + 44, sizeof(n_vlogs));
+  // Tables from before the value log wrote n as 0.
+  if(len < PROPS_FIXED_SIZE + min_len + max_len ||
+     len - PROPS_FIXED_SIZE - min_len - max_len != PROPS_VLOG_SIZE * (size_t)n_vlogs)
+    return -1;
+  props->entries = get_u64(p);
+  props->tombstones = get_u64(p + 8);
+  props->raw_bytes = get_u64(p + 16);
+  props->data_bytes = get_u64(p + 24);
+  props->frames = get_u64(p + 32);
+  const char *keys = (const char *)p + PROPS_FIXED_SIZE;
+  if(key_dup(&props->min_key, (Key){ keys, min_len }) != 0) return -1;
+  if(key_dup(&props->max_key, (Key){ keys + min_len, max_len }) != 0) return -1;
+  if(n_vlogs == 0) return 0;
+  props->vlogs = malloc(sizeof(SSTableVlogUse) * n_vlogs);
+  if(!props->vlogs) return -1;
+  props->n_vlogs = n_vlogs;
+  const uint8_t *q = p + PROPS_FIXED_SIZE + min_len + max_len;
+  for(uint32_t i = 0; i < n_vlogs; i++, q += PROPS_VLOG_SIZE){
+    props->vlogs[i].file = get_u64(q);
+    props->vlogs[i].bytes = get_u64(q + 8);
+  }
+  return 0;
+}
+
+static int decode_props_v2(const uint8_t *p, SSTableProps *props){
+  char buf[KEY_LONG_SIZE];
+  props->entries = get_u64(p);
+  props->tombstones = get_u64(p + 8);
+  props->raw_bytes = get_u64(p + 32);
+  props->data_bytes = get_u64(p + 40);
+  props->frames = get_u64(p + 48);
+  if(key_dup(&props->min_key, key_from_long(buf, (long)get_u64(p + 16))) != 0) return -1;
+  if(key_dup(&props->max_key, key_from_long(buf, (long)get_u64(p + 24))) != 0) return -1;
+  return 0;
+}
+
+// In-order walk of the implicit tree, handing out keys ascending.
+static int fill_search_index(SSTable *sst, int i, int pos){
+  if(i > sst->length) return pos;
+  pos = fill_search_index(sst, 2 * i, pos);
+  Key k = sstable_key(sst, pos);
+  sst->search_heads[i] = key_head((Key){ k.data + sst->head_skip, k.len - sst->head_skip });
+  sst->search_slots[i] = pos;
+  return fill_search_index(sst, 2 * i + 1, pos + 1);
+}
+
+// Lays the frame keys out for find_frame. Aligned so the 8 heads of a
+// node's great-grandchildren share one cache line. Sorted bytewise, the
+// first and last key share what all of them do.
+static int build_search_index(SSTable *sst){
+  if(sst->length == 0 || sst->cmp) return 0;
+  size_t bytes = sizeof(uint64_t) * ((size_t)sst->length + 1);
+  bytes = (bytes + 63) & ~(size_t)63;
+  sst->search_heads = aligned_alloc(64, bytes);
+  sst->search_slots = malloc(sizeof(int) * ((size_t)sst->length + 1));
+  if(!sst->search_heads || !sst->search_slots) return -1;
+  sst->head_skip = key_shared(sstable_key(sst, 0), sstable_key(sst, sst->length - 1));
+  fill_search_index(sst, 1, 0);
+  return 0;
+}
+
+// Tables written before the footer existed keep their index in a .ser file
+// and have no filter or properties.
+static int load_legacy_index(SSTable *sst){
+  char path[256];
+  snprintf(path, sizeof(path), SEGMENT_FILE_INDEX_FMT, sst->id);
+
+  FILE *f = fopen(path, "rb");
+  if(!f) return -1;
+
+  long pair[2];
+  char buf[KEY_LONG_SIZE];
+  while(fread(pair, sizeof(long), 2, f) == 2){
+    if(!sstable_add(sst, key_from_long(buf, pair[0]), pair[1])){
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+  return 0;
+}
 
-  if(idx == sst->length-1){
-    unsigned long long file_size;
-    if (fseek(segment, 0, SEEK_END) == 0) { // Move pointer to the end
-      file_size = ftell(segment);
-    } else perror("segment_end_read");
+// Index block of a v3 table.
+static int decode_index(SSTable *sst, const uint8_t *p, uint64_t len){
+  uint64_t n = get_u64(p);
+  uint64_t pos = sizeof(uint64_t);
+  char key[KEY_MAX_SIZE];
+  uint32_t key_len = 0;
+  for(uint64_t i = 0; i < n; i++){
+    if(len - pos < 2 * sizeof(uint16_t) + sizeof(uint64_t)) return -1;
+    uint16_t shared = get_u16(p + pos);
+    uint16_t unshared = get_u16(p + pos + 2);
+    long offset = (long)get_u64(p + pos + 4);
+    pos += 2 * sizeof(uint16_t) + sizeof(uint64_t);
+    if(shared > key_len || shared + unshared > KEY_MAX_SIZE || len - pos < unshared) return -1;
+    memcpy(key + shared, p + pos, unshared);
+    key_len = shared + unshared;
+    pos += unshared;
+    if(!sstable_add(sst, (Key){ key, key_len }, offset)) return -1;
+  }
+  return pos == len ? 0 : -1;
+}
+
+// Index block of a v2 table, numeric keys.
+static int decode_index_v2(SSTable *sst, const uint8_t *p, uint64_t len){
+  uint64_t n = get_u64(p);
+  if(n != (len - sizeof(uint64_t)) / (2 * sizeof(uint64_t))) return -1;
+  char buf[KEY_LONG_SIZE];
+  for(uint64_t i = 0; i < n; i++){
+    const uint8_t *pair = p + sizeof(uint64_t) + i * 2 * sizeof(uint64_t);
+    if(!sstable_add(sst, key_from_long(buf, (long)get_u64(pair)), (long)get_u64(pair + 8))) return -1;
+  }
+  return 0;
+}
+
+// Reads the index, filter and properties with one pread after the footer.
+static int load_metadata(SSTable *sst, Bloom *bloom, const uint8_t *footer, long file_size){
+  uint64_t index_off = get_u64(footer);
+  uint64_t index_len = get_u64(footer + 8);
+  uint64_t bloom_off = get_u64(footer + 16);
+  uint64_t bloom_len = get_u64(footer + 24);
+  uint64_t props_off = get_u64(footer + 32);
+  uint64_t props_len = get_u64(footer + 40);
+  uint32_t version, crc;
+  memcpy(&version, footer + 48, sizeof(version));
+  memcpy(&crc, footer + 52, sizeof(crc));
+
+  uint64_t meta_end = (uint64_t)file_size - SST_FOOTER_SIZE;
+  uint64_t props_min = version == 2 ? PROPS_V2_SIZE : PROPS_FIXED_SIZE;
+  if((version != SST_VERSION && version != 2) || index_len < sizeof(uint64_t) || props_len < props_min ||
+     bloom_len < 16 || index_off > meta_end || bloom_off != index_off + index_len ||
+     props_off != bloom_off + bloom_len || props_off + props_len != meta_end){
+    fprintf(stderr, "segment %llu: bad footer\n", sst->id);
+    return -1;
+  }
+
+  size_t meta_len = (size_t)(meta_end - index_off);
+  uint8_t *meta = malloc(meta_len);
+  if(!meta) return -1;
+  if(pread_all(sst->fd, meta, meta_len, (long)index_off) != 0){
+    perror("pread segment metadata");
+    free(meta);
+    return -1;
+  }
 
-    size = file_size - offset;
-    fseek(segment, (size) * -1, SEEK_CUR);
+  uLong c = crc32(0L, Z_NULL, 0);
+  c = crc32(c, meta, (uInt)meta_len);
+  c = crc32(c, footer, 52);
+  if((uint32_t)c != crc){
+    fprintf(stderr, "segment %llu: metadata checksum mismatch\n", sst->id);
+    free(meta);
+    return -1;
+  }
 
+  int rc = version == 2 ? decode_index_v2(sst, meta, index_len) : decode_index(sst, meta, index_len);
+  if(rc != 0){
+    fprintf(stderr, "segment %llu: bad index\n", sst->id);
+    free(meta);
+    return -1;
+  }
+
+  const uint8_t *p = meta + index_len;
+  uint32_t k, layout;
+  memcpy(&k, p, sizeof(k));
+  memcpy(&layout, p + 4, sizeof(layout));
+  uint64_t nbytes = get_u64(p + 8);
+  if(nbytes != bloom_len - 16 || layout > BLOOM_BLOCKED ||
+     (layout == BLOOM_BLOCKED && nbytes % BLOOM_BLOCK_BYTES != 0)){
+    free(meta);
+    return -1;
+  }
+  uint8_t *bits = bloom_alloc(nbytes);
+  if(nbytes && !bits){
+    free(meta);
+    return -1;
+  }
+  if(nbytes) memcpy(bits, p + 16, nbytes);
+  if(layout == BLOOM_BLOCKED) bloom_init_blocked(bloom, bits, nbytes);
+  else bloom_init(bloom, bits, nbytes, k);
+  bloom->long_keys = version == 2;
+
+  p = meta + index_len + bloom_len;
+  rc = version == 2 ? decode_props_v2(p, &sst->props) : decode_props(p, (size_t)props_len, &sst->props);
+  free(meta);
+  if(rc != 0){
+    fprintf(stderr, "segment %llu: bad properties\n", sst->id);
+    return -1;
+  }
+  sst->size = (long)index_off;
+  return 0;
+}
+
+// Opens table sst->id and loads its index, filter and properties.
+int sstable_open(SSTable *sst, Bloom *bloom){
+  char path[256];
+  snprintf(path, sizeof(path), SEGMENT_FILE_FMT, sst->id);
+  bloom_init(bloom, NULL, 0, 0);
+
+  sst->fd = open(path, O_RDONLY);
+  if(sst->fd < 0){
+    perror("open segment");
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(sst->fd, &st) != 0){
+    perror("fstat segment");
+    return -1;
+  }
+
+  uint8_t footer[SST_FOOTER_SIZE];
+  if(st.st_size >= SST_FOOTER_SIZE &&
+     pread_all(sst->fd, footer, SST_FOOTER_SIZE, (long)st.st_size - SST_FOOTER_SIZE) == 0 &&
+     get_u64(footer + SST_FOOTER_SIZE - sizeof(uint64_t)) == SST_FOOTER_MAGIC){
+    if(load_metadata(sst, bloom, footer, (long)st.st_size) != 0) return -1;
   } else {
-    long next_offset = sst->offsets[idx+1];
-    size = next_offset - offset;
+    sst->size = (long)st.st_size;
+    if(load_legacy_index(sst) != 0) return -1;
+  }
+  return build_search_index(sst);
+}
+
+// Maps the finished segment so frames are inflated straight from the page
+// cache instead of being copied out with pread. Point lookups dominate, so
+// the kernel is told not to read ahead; cursors ask for it while they scan.
+int sstable_map(SSTable *sst){
+  if(sst->map || sst->size == 0) return 0;
 
-    fseek(segment, offset, SEEK_CUR);
+  void *p = mmap(NULL, (size_t)sst->size, PROT_READ, MAP_SHARED, sst->fd, 0);
+  if(p == MAP_FAILED){
+    perror("mmap segment");
+    return -1;
   }
+  madvise(p, (size_t)sst->size, MADV_RANDOM);
+  sst->map = p;
+  return 0;
+}
+
+// Where frame idx sits in the file; false when the index points outside it.
+static bool frame_extent(const SSTable *sst, int idx, long *offset, long *size){
+  *offset = sst->offsets[idx];
+  long end = idx == sst->length-1 ? sst->size : sst->offsets[idx+1];
+  *size = end - *offset;
+  return *size >= (long)FRAME_HEADER_SIZE && end <= sst->size;
+}
 
-  uint8_t buf[size];
-  if(fread(buf,1,size,segment) != size) return NULL;
+static size_t restarts_size(int n){
+  return sizeof(uint32_t) * ((size_t)n + 1);
+}
 
-  uint32_t frame_magic;
-  memcpy(&frame_magic, &buf[0], sizeof(uint32_t));
+// Appends the restart array; sstable_writer_add keeps room for it.
+static size_t encode_restarts(uint8_t *dst, const uint32_t *restarts, int n){
+  uint32_t count = (uint32_t)n;
+  memcpy(dst, restarts, sizeof(uint32_t) * (size_t)n);
+  memcpy(dst + sizeof(uint32_t) * (size_t)n, &count, sizeof(count));
+  return restarts_size(n);
+}
 
-  if(frame_magic != FRAME_MAGIC) perror("frame_magic_mismatch");
+// The first shared bytes of key are the previous entry's.
+static size_t encode_entry(uint8_t *dst, Key key, uint32_t shared, const char *value, int32_t len){
+  uint32_t unshared = key.len - shared;
+  put_u16(dst, (uint16_t)shared);
+  put_u16(dst + 2, (uint16_t)unshared);
+  memcpy(dst + 4, &len, sizeof(len));
+  if(unshared) memcpy(dst + ENTRY_HEADER_SIZE, key.data + shared, unshared);
+  uint32_t vlen = entry_value_size(len);
+  if(vlen) memcpy(dst + ENTRY_HEADER_SIZE + unshared, value, vlen);
+  return ENTRY_HEADER_SIZE + unshared + vlen;
+}
 
-  memcpy(&src_len, &buf[4], sizeof(uint32_t));
-  uncompress(src_buf,(uLongf *)&src_len,buf,size);
+// End of the entries in an inflated frame, 0 if the restart array is bad.
+static uint32_t frame_entries_end(const uint8_t *frame, uint32_t len){
+  uint32_t n;
+  if(len < sizeof(uint32_t)) return 0;
+  memcpy(&n, &frame[len - sizeof(uint32_t)], sizeof(uint32_t));
+  if(n > (len - sizeof(uint32_t)) / sizeof(uint32_t)) return 0;
+  return len - sizeof(uint32_t) * (n + 1);
+}
 
-  long size_idx = 0;
-  while(size_idx < src_len) {
-    long key;
-    memcpy(&key, &buf[size_idx], sizeof(long));
-    size_idx += sizeof(long);
-    long value_len;
-    memcpy(&value_len, &buf[size_idx], sizeof(long));
-    size_idx += sizeof(long);
-    if(key == sst->keys[idx]){
-      if(value_len==-1){
-        return NULL;
-      }
-      const char * value = (const char*)malloc(value_len);
-      memcpy(&value, &buf[size_idx], value_len);
-      return value;
+// Rewrites a frame of numeric-key entries, with or without a restart
+// array, in the prefix form with a restart array of its own. NULL when the
+// frame is corrupt.
+static uint8_t *upgrade_frame(const uint8_t *src, uint32_t len, bool restarts, uint32_t *out_len){
+  uint32_t end = restarts ? frame_entries_end(src, len) : len;
+  if(restarts && end == 0 && len != sizeof(uint32_t)) return NULL;
+  // Entries grow by at most 4 bytes: a new header and the unshared key.
+  uint32_t max_entries = end / LEGACY_ENTRY_HEADER_SIZE;
+  int max_restarts = (int)(max_entries / FRAME_RESTART_INTERVAL) + 1;
+  uint8_t *dst = malloc(end + 4 * (size_t)max_entries + restarts_size(max_restarts));
+  uint32_t *points = malloc(sizeof(uint32_t) * (size_t)max_restarts);
+  if(!dst || !points){
+    free(dst);
+    free(points);
+    return NULL;
+  }
+
+  char key[KEY_LONG_SIZE], prev[KEY_LONG_SIZE];
+  uint32_t pos = 0;
+  size_t out = 0;
+  int n = 0, n_restarts = 0;
+  while(pos + LEGACY_ENTRY_HEADER_SIZE <= end){
+    int64_t k;
+    int32_t vlen;
+    memcpy(&k, &src[pos], sizeof(k));
+    memcpy(&vlen, &src[pos + sizeof(k)], sizeof(vlen));
+    uint32_t v = vlen > 0 ? (uint32_t)vlen : 0;
+    if(v > end - pos - LEGACY_ENTRY_HEADER_SIZE) break;
+    Key cur = key_from_long(key, (long)k);
+    uint32_t shared = 0;
+    if(n % FRAME_RESTART_INTERVAL == 0) points[n_restarts++] = (uint32_t)out;
+    else shared = key_shared((Key){ prev, KEY_LONG_SIZE }, cur);
+    out += encode_entry(dst + out, cur, shared, (const char *)src + pos + LEGACY_ENTRY_HEADER_SIZE, vlen);
+    memcpy(prev, key, KEY_LONG_SIZE);
+    n++;
+    pos += LEGACY_ENTRY_HEADER_SIZE + v;
+  }
+  if(pos != end){
+    free(dst);
+    free(points);
+    return NULL;
+  }
+  out += encode_restarts(dst + out, points, n_restarts);
+  free(points);
+  *out_len = (uint32_t)out;
+  return dst;
+}
+
+// Inflates the size stored bytes of the frame at offset. A raw frame may be
+// borrowed from src when borrow is set, and *owned is then NULL; otherwise
+// it is inflated into *owned, which the caller frees.
+static const uint8_t *inflate_frame(SSTable *sst, long offset, const uint8_t *src, long size, bool borrow,
+                                    uint32_t *out_len, uint8_t **owned){
+  *owned = NULL;
+  uint32_t frame_magic, codec, ulen, clen;
+  size_t header = FRAME_HEADER_SIZE;
+  memcpy(&frame_magic, &src[0], sizeof(uint32_t));
+  if(frame_magic == FRAME_MAGIC_V2 && size >= (long)FRAME_HEADER_V2_SIZE){
+    memcpy(&codec, &src[4], sizeof(uint32_t));
+    memcpy(&ulen, &src[8], sizeof(uint32_t));
+    memcpy(&clen, &src[12], sizeof(uint32_t));
+    header = FRAME_HEADER_V2_SIZE;
+  } else if(frame_magic == FRAME_MAGIC){
+    codec = CODEC_ZLIB;
+    memcpy(&ulen, &src[4], sizeof(uint32_t));
+    memcpy(&clen, &src[8], sizeof(uint32_t));
+  } else {
+    fprintf(stderr, "segment %llu: bad frame at %ld\n", sst->id, offset);
+    return NULL;
+  }
+  if(clen > size - header){
+    fprintf(stderr, "segment %llu: bad frame at %ld\n", sst->id, offset);
+    return NULL;
+  }
+
+  bool restarts = codec & FRAME_HAS_RESTARTS;
+  bool prefix = codec & FRAME_PREFIX_KEYS;
+  codec &= FRAME_CODEC_MASK;
+  stats_add(sst->stats, STAT_FRAMES_READ, 1);
+  stats_add(sst->stats, STAT_FRAME_BYTES_READ, (uint64_t)size);
+  if(codec == CODEC_NONE && borrow && clen == ulen && prefix){
+    *out_len = ulen;
+    return src + header;
+  }
+
+  uint8_t *dst = malloc(ulen ? ulen : 1);
+  if(!dst || codec_decompress((Codec)codec, src + header, clen, dst, ulen) != 0){
+    fprintf(stderr, "segment %llu: corrupt %s frame at %ld\n", sst->id, codec_name((Codec)codec), offset);
+    free(dst);
+    return NULL;
+  }
+  stats_add(sst->stats, STAT_FRAMES_INFLATED, 1);
+  stats_add(sst->stats, STAT_FRAME_BYTES_INFLATED, ulen);
+
+  // Frames from before byte keys, so every frame in memory has one form.
+  if(!prefix){
+    uint8_t *up = upgrade_frame(dst, ulen, restarts, &ulen);
+    free(dst);
+    if(!up){
+      fprintf(stderr, "segment %llu: corrupt frame at %ld\n", sst->id, offset);
+      return NULL;
     }
-    size_idx += value_len;
+    dst = up;
   }
 
-  return NULL;
+  *owned = dst;
+  *out_len = ulen;
+  return dst;
+}
+
+// Reads and inflates frame idx. Raw frames in a mapped segment are
+// borrowed from the mapping and *owned is NULL; otherwise the frame is
+// inflated into *owned, which the caller frees.
+static const uint8_t *segment_read_frame(SSTable *sst, int idx, uint32_t *out_len, uint8_t **owned){
+  *owned = NULL;
+  long offset, size;
+  if(!frame_extent(sst, idx, &offset, &size)) return NULL;
+
+  const uint8_t *src;
+  if(sst->map){
+    src = sst->map + offset;
+  } else {
+    uint8_t *scratch = codec_scratch((size_t)size);
+    if(!scratch) return NULL;
+    if(pread_all(sst->fd, scratch, (size_t)size, offset) != 0){
+      perror("pread segment");
+      return NULL;
+    }
+    src = scratch;
+  }
+  return inflate_frame(sst, offset, src, size, sst->map != NULL, out_len, owned);
+}
+
+// Decodes the entry at pos of a frame whose entries end at end. key holds
+// the previous entry's key, *key_len bytes of it, and gets this one's.
+// Returns the offset of the next entry, 0 when the entry is corrupt.
+static uint32_t decode_entry(const uint8_t *frame, uint32_t end, uint32_t pos, char *key, uint32_t *key_len,
+                             int32_t *length){
+  if(pos > end || end - pos < ENTRY_HEADER_SIZE) return 0;
+  uint16_t shared = get_u16(&frame[pos]);
+  uint16_t unshared = get_u16(&frame[pos + 2]);
+  memcpy(length, &frame[pos + 4], sizeof(int32_t));
+  uint32_t vlen = entry_value_size(*length);
+  pos += ENTRY_HEADER_SIZE;
+  if(shared > *key_len || shared + unshared > KEY_MAX_SIZE || end - pos < unshared ||
+     end - pos - unshared < vlen)
+    return 0;
+  memcpy(key + shared, &frame[pos], unshared);
+  *key_len = shared + unshared;
+  return pos + unshared + vlen;
+}
+
+// Finds the first entry with a key >= key: binary searches the restart
+// points, whose keys are stored whole, then decodes forward from the last
+// one at or below key. Returns 1 with that entry decoded into buf,
+// *buf_len and *length and *next the offset past it; 0 when the frame has
+// no such entry, -1 when it is corrupt.
+static int frame_seek(const Comparator *cmp, const uint8_t *frame, uint32_t len, Key key, char *buf,
+                      uint32_t *buf_len, int32_t *length, uint32_t *next){
+  uint32_t end = frame_entries_end(frame, len);
+  if(end == 0) return 0;
+  uint32_t n = (len - end) / sizeof(uint32_t) - 1;
+  const uint8_t *restarts = frame + end;
+
+  uint32_t pos = 0;
+  uint32_t low = 0;
+  uint32_t high = n;
+  while(low < high){
+    uint32_t mid = low + (high - low) / 2;
+    uint32_t off;
+    memcpy(&off, &restarts[mid * sizeof(uint32_t)], sizeof(uint32_t));
+    if(off > end || end - off < ENTRY_HEADER_SIZE) return -1;
+    uint16_t unshared = get_u16(&frame[off + 2]);
+    if(end - off - ENTRY_HEADER_SIZE < unshared) return -1;
+    Key k = { (const char *)&frame[off + ENTRY_HEADER_SIZE], unshared };
+    if(key_compare(cmp, k, key) <= 0){
+      pos = off;
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  *buf_len = 0;
+  while(pos < end){
+    uint32_t at = decode_entry(frame, end, pos, buf, buf_len, length);
+    if(at == 0) return -1;
+    if(key_compare(cmp, (Key){ buf, *buf_len }, key) >= 0){
+      *next = at;
+      return 1;
+    }
+    pos = at;
+  }
+  return 0;
+}
+
+// Frame idx from the cache, read and cached on a miss. Frames borrowed from
+// the mapping skip the cache, the page cache already holds them. The frame
+// stays valid until release_frame.
+static const uint8_t *acquire_frame(SSTable *sst, int idx, uint32_t *len, CacheHandle **h, uint8_t **owned){
+  *h = NULL;
+  *owned = NULL;
+  if(sst->cache){
+    *h = block_cache_lookup(sst->cache, sst->id, sst->offsets[idx]);
+    if(*h){
+      *len = (*h)->len;
+      return (*h)->data;
+    }
+  }
+
+  const uint8_t *data = segment_read_frame(sst, idx, len, owned);
+  if(!data || !*owned || !sst->cache) return data;
+
+  *h = block_cache_insert(sst->cache, sst->id, sst->offsets[idx], *owned, *len);
+  *owned = NULL;
+  if(!*h) return NULL;
+  *len = (*h)->len;
+  return (*h)->data;
+}
+
+static void release_frame(SSTable *sst, CacheHandle *h, uint8_t *owned){
+  if(h) block_cache_release(sst->cache, h);
+  free(owned);
+}
+
+// Asks the kernel to start reading frame idx.
+static void advise_frame(SSTable *sst, int idx){
+  long off = sst->offsets[idx];
+  long end = idx + 1 < sst->length ? sst->offsets[idx + 1] : sst->size;
+  if(sst->map){
+    long page = sysconf(_SC_PAGESIZE);
+    long start = off / page * page;
+    madvise((void *)(sst->map + start), (size_t)(end - start), MADV_WILLNEED);
+  } else {
+    posix_fadvise(sst->fd, off, end - off, POSIX_FADV_WILLNEED);
+  }
+}
+
+// Looks key up in an inflated frame and copies its value out, from the
+// value log when the frame only holds a ref.
+static SSTResult frame_get(const SSTable *sst, const uint8_t *src, uint32_t src_len, Key key, char **value,
+                           int *length){
+  char buf[KEY_MAX_SIZE];
+  uint32_t buf_len, next;
+  int32_t value_len;
+  int found = frame_seek(sst->cmp, src, src_len, key, buf, &buf_len, &value_len, &next);
+  if(found < 0) return SST_ERROR;
+  if(found == 0 || !key_equal((Key){ buf, buf_len }, key)) return SST_ABSENT;
+  if(value_len == SST_VALUE_REF)
+    return vlog_read(sst, (const char *)&src[next - VLOG_REF_SIZE], value, length) == 0 ? SST_FOUND : SST_ERROR;
+  if(value_len < 0) return SST_DELETED;
+
+  char *copy = malloc(value_len ? (size_t)value_len : 1);
+  if(!copy) return SST_ERROR;
+  memcpy(copy, &src[next - (uint32_t)value_len], (size_t)value_len);
+  *value = copy;
+  *length = value_len;
+  return SST_FOUND;
 }
 
-const char* sstable_get(SSTable *sst, FILE *segment, long key){
-  int low = 0;
-  int high = sst->length-1;
+static SSTResult segment_get(SSTable *sst, int idx, Key key, char **value, int *length){
+  uint32_t src_len;
+  CacheHandle *h;
+  uint8_t *owned;
+  const uint8_t *src = acquire_frame(sst, idx, &src_len, &h, &owned);
+  if(!src) return SST_ERROR;
 
-  while(low<=high){
-    int mid = (low + high) / 2;
-    long temp_key = sst->keys[mid];
+  SSTResult res = frame_get(sst, src, src_len, key, value, length);
+  release_frame(sst, h, owned);
+  return res;
+}
 
-    if(key == temp_key)
-      return segment_get(sst, segment, mid);
-    if(key < temp_key)
-      high = mid-1;
-    if(key > temp_key)
-      low = mid +1;
+// The last frame whose index key is <= key is the only one that can hold
+// it. The descent is branch-free on the heads and fetches the nodes three
+// levels down ahead of time; only equal heads compare the keys. It ends
+// past a leaf; stripping the trailing right turns (the low 1 bits) and the
+// last left turn gives the first key > key, or 0 when there is none.
+// A custom order, or a key without the prefix the heads skip, takes a
+// plain binary search over the keys.
+static int find_frame(SSTable *sst, Key key){
+  int n = sst->length;
+  uint32_t skip = sst->head_skip;
+  if(sst->cmp || key.len < skip || (skip > 0 && memcmp(key.data, sst->key_pool, skip) != 0)){
+    int low = 0, high = n;
+    while(low < high){
+      int mid = low + (high - low) / 2;
+      if(key_compare(sst->cmp, sstable_key(sst, mid), key) <= 0) low = mid + 1;
+      else high = mid;
+    }
+    return low > 0 ? low - 1 : 0;
   }
 
-  return segment_get(sst, segment, ((low+high)/2));
+  uint64_t head = key_head((Key){ key.data + skip, key.len - skip });
+  const uint64_t *t = sst->search_heads;
+  unsigned k = 1;
+  while(k <= (unsigned)n){
+    __builtin_prefetch(t + 8 * k);
+    uint64_t x = t[k];
+    k = 2 * k + (x < head || (x == head && key_compare_bytes(sstable_key(sst, sst->search_slots[k]), key) <= 0));
+  }
+  k >>= __builtin_ffs((int)~k);
+  if(k == 0) return n - 1;
+  int slot = sst->search_slots[k];
+  return slot > 0 ? slot - 1 : 0;
+}
+
+static bool below_max(SSTable *sst, Key key){
+  return !sst->props.max_key.data || key_compare(sst->cmp, key, sst->props.max_key) <= 0;
+}
+
+static bool in_range(SSTable *sst, Key key){
+  return sst->length > 0 && key_compare(sst->cmp, key, sstable_key(sst, 0)) >= 0 && below_max(sst, key);
+}
+
+SSTResult sstable_get(SSTable *sst, Key key, char **value, int *length){
+  if(!in_range(sst, key)) return SST_ABSENT;
+  return segment_get(sst, find_frame(sst, key), key, value, length);
+}
+
+// Lookups that do their own reads. sstable_get_begin answers when the
+// block cache holds the frame and otherwise returns SST_PENDING with the
+// extent to read in *f; sstable_get_end answers from those stored bytes and
+// caches the frame, unless it is one acquire_frame would borrow from the
+// mapping.
+SSTResult sstable_get_begin(SSTable *sst, Key key, SSTFrameRead *f, char **value, int *length){
+  if(!in_range(sst, key)) return SST_ABSENT;
+  f->frame = find_frame(sst, key);
+  if(sst->cache){
+    CacheHandle *h = block_cache_lookup(sst->cache, sst->id, sst->offsets[f->frame]);
+    if(h){
+      SSTResult res = frame_get(sst, h->data, h->len, key, value, length);
+      block_cache_release(sst->cache, h);
+      return res;
+    }
+  }
+  return frame_extent(sst, f->frame, &f->offset, &f->size) ? SST_PENDING : SST_ERROR;
+}
+
+SSTResult sstable_get_end(SSTable *sst, const SSTFrameRead *f, const uint8_t *stored, Key key,
+                          char **value, int *length){
+  uint32_t len;
+  uint8_t *owned;
+  const uint8_t *src = inflate_frame(sst, f->offset, stored, f->size, sst->map != NULL, &len, &owned);
+  if(!src) return SST_ERROR;
+  SSTResult res = frame_get(sst, src, len, key, value, length);
+  if(!owned || !sst->cache){
+    free(owned);
+    return res;
+  }
+  CacheHandle *h = block_cache_insert(sst->cache, sst->id, f->offset, owned, len);
+  if(h) block_cache_release(sst->cache, h);
+  return res;
+}
+
+// keys must be ascending. Each frame is read and inflated once for all
+// the keys that land in it. The frames a batch spans are announced to the
+// kernel up front so their reads overlap instead of queueing one by one.
+void sstable_get_many(SSTable *sst, int n, const Key *keys, SSTResult *results, char **values, int *lengths){
+  int prev = -1;
+  for(int i = 0; i < n; i++){
+    results[i] = SST_ABSENT;
+    if(n == 1 || !in_range(sst, keys[i])) continue;
+    int slot = find_frame(sst, keys[i]);
+    if(slot != prev) advise_frame(sst, slot);
+    prev = slot;
+  }
+
+  int i = 0;
+  while(i < n){
+    if(!in_range(sst, keys[i])){
+      i++;
+      continue;
+    }
+    int slot = find_frame(sst, keys[i]);
+    bool last = slot + 1 >= sst->length;
+    int j = i + 1;
+    while(j < n && (last || key_compare(sst->cmp, keys[j], sstable_key(sst, slot + 1)) < 0) &&
+          below_max(sst, keys[j]))
+      j++;
+
+    uint32_t src_len;
+    CacheHandle *h;
+    uint8_t *owned;
+    const uint8_t *src = acquire_frame(sst, slot, &src_len, &h, &owned);
+    for(int k = i; k < j; k++)
+      results[k] = src ? frame_get(sst, src, src_len, keys[k], &values[k], &lengths[k]) : SST_ERROR;
+    if(src) release_frame(sst, h, owned);
+    i = j;
+  }
 }
 
-bool sstable_add(SSTable *sst, FILE *segment_idx, long key, long offset, int idx){
-  if(fwrite(&key,sizeof(key),1,segment_idx) != 1) return false;
-  if(fwrite(&offset,sizeof(offset),1,segment_idx) != 1) return false;
+bool sstable_add(SSTable *sst, Key key, long offset){
+  if(sst->length == sst->capacity){
+    int cap = sst->capacity ? sst->capacity * 2 : 16;
+    uint32_t *key_offs = realloc(sst->key_offs, sizeof(uint32_t) * ((size_t)cap + 1));
+    if(!key_offs) return false;
+    sst->key_offs = key_offs;
+    long *offsets = realloc(sst->offsets, sizeof(long) * (size_t)cap);
+    if(!offsets) return false;
+    sst->offsets = offsets;
+    sst->capacity = cap;
+  }
+  if(!sst->key_pool || sst->pool_cap - sst->pool_len < key.len){
+    uint32_t cap = sst->pool_cap ? sst->pool_cap : 256;
+    while(cap - sst->pool_len < key.len) cap *= 2;
+    char *pool = realloc(sst->key_pool, cap);
+    if(!pool) return false;
+    sst->key_pool = pool;
+    sst->pool_cap = cap;
+  }
 
-  sst->keys[idx] = key;
-  sst->offsets[idx] = offset;
+  if(key.len) memcpy(sst->key_pool + sst->pool_len, key.data, key.len);
+  sst->key_offs[sst->length] = sst->pool_len;
+  sst->pool_len += key.len;
+  sst->offsets[sst->length] = offset;
   sst->length++;
+  sst->key_offs[sst->length] = sst->pool_len;
+
+  return true;
+}
+
+void sstable_close(SSTable *sst){
+  if(sst->vlog) vlog_detach(sst);
+  if(sst->map) munmap((void *)sst->map, (size_t)sst->size);
+  if(sst->fd >= 0) close(sst->fd);
+  sst->map = NULL;
+  free(sst->key_pool);
+  free(sst->key_offs);
+  free(sst->offsets);
+  free(sst->search_heads);
+  free(sst->search_slots);
+  free_props(&sst->props);
+  sst->fd = -1;
+  sst->key_pool = NULL;
+  sst->key_offs = NULL;
+  sst->pool_len = 0;
+  sst->pool_cap = 0;
+  sst->offsets = NULL;
+  sst->search_heads = NULL;
+  sst->search_slots = NULL;
+  sst->length = 0;
+  sst->capacity = 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t n, long offset) {
+  const uint8_t *p = (const uint8_t *)buf;
+  while (n > 0) {
+    ssize_t r = pwrite(fd, p, n, offset);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    p += r;
+    n -= (size_t)r;
+    offset += r;
+  }
+  return 0;
+}
+
+// Appends n bytes to the segment. Direct writers stage them and write
+// each buffer as it fills.
+static int out_write(SSTableWriter *w, const void *p, size_t n) {
+  if (!w->direct) return fwrite(p, 1, n, w->segment) == n ? 0 : -1;
+  const uint8_t *src = (const uint8_t *)p;
+  while (n > 0) {
+    size_t k = SST_DIRECT_BUF - w->dbuf_len;
+    if (k > n) k = n;
+    memcpy(w->dbuf + w->dbuf_len, src, k);
+    w->dbuf_len += k;
+    src += k;
+    n -= k;
+    if (w->dbuf_len == SST_DIRECT_BUF) {
+      if (pwrite_all(w->fd, w->dbuf, SST_DIRECT_BUF, w->dbuf_at) != 0) return -1;
+      w->dbuf_at += SST_DIRECT_BUF;
+      w->dbuf_len = 0;
+    }
+  }
+  return 0;
+}
+
+// Compresses len bytes of src into dst, which holds cap bytes, and returns
+// the codec the frame is stored with and its stored size in *clen. A frame
+// that does not shrink stays raw in src.
+static int pack_frame(Codec codec, int level, const uint8_t *src, uint32_t len, uint8_t *dst,
+                      size_t cap, uint32_t *clen) {
+  *clen = len;
+  if (codec == CODEC_NONE) return CODEC_NONE;
+  long n = codec_compress(codec, level, src, len, dst, cap);
+  if (n < 0) return -1;
+  if ((uint32_t)n >= len) return CODEC_NONE;
+  *clen = (uint32_t)n;
+  return (int)codec;
+}
+
+// Appends a packed frame at w->offset and indexes it under first_key.
+static int append_frame(SSTableWriter *w, int codec, const uint8_t *data, uint32_t len, uint32_t clen,
+                        Key first_key) {
+  uint32_t header[4] = { FRAME_MAGIC_V2, (uint32_t)codec | FRAME_HAS_RESTARTS | FRAME_PREFIX_KEYS, len, clen };
+  if (out_write(w, header, sizeof(header)) != 0) return -1;
+  if (out_write(w, data, clen) != 0) return -1;
+  if (!sstable_add(w->sst, first_key, w->offset)) return -1;
+  long n = (long)(FRAME_HEADER_V2_SIZE + clen);
+  w->offset += n;
+  w->sst->props.raw_bytes += len;
+  w->sst->props.frames++;
+  stats_add(w->sst->stats, STAT_FRAME_RAW_BYTES, len);
+  stats_add(w->sst->stats, STAT_FRAME_BYTES_WRITTEN, (uint64_t)n);
+  return 0;
+}
+
+// Packs and appends a frame on the calling thread, compressing into its
+// scratch buffer.
+static int emit_frame(SSTableWriter *w, const uint8_t *src, size_t len, Key first_key) {
+  uint8_t *dst = NULL;
+  size_t cap = 0;
+  if (w->codec != CODEC_NONE) {
+    cap = codec_bound(w->codec, len);
+    dst = codec_scratch(cap);
+    if (!dst) return -1;
+  }
+  uint32_t clen;
+  int codec = pack_frame(w->codec, w->level, src, (uint32_t)len, dst, cap, &clen);
+  if (codec < 0) return -1;
+  return append_frame(w, codec, codec == CODEC_NONE ? src : dst, (uint32_t)len, clen, first_key);
+}
+
+// A frame on its way through the pipeline: built in raw by the writer's
+// caller, compressed into out by whichever worker claims it, then appended
+// by the ordered writer, which frees the slot for the caller again.
+typedef struct {
+  uint8_t *raw;
+  uint8_t *big;     // a frame of its own for an entry larger than raw, or NULL
+  uint32_t len;
+  char first_key[KEY_MAX_SIZE];
+  uint32_t first_len;
+  uint8_t *out;
+  size_t out_cap;
+  int codec;        // as stored
+  uint32_t clen;
+  bool packed;
+  bool failed;
+} FrameSlot;
+
+// Frames are numbered in the order they are cut; slot i % n_slots holds
+// frame i. Frames in [written, claimed) are being compressed or wait for
+// the writer, those in [claimed, filled) wait for a worker.
+struct FramePipeline {
+  SSTableWriter *w;
+  pthread_mutex_t mu;
+  pthread_cond_t work;      // a frame to compress, or stopping
+  pthread_cond_t progress;  // a frame was compressed or appended
+  FrameSlot *slots;
+  int n_slots;
+  uint64_t filled;
+  uint64_t claimed;
+  uint64_t written;
+  bool stopping;
+  bool failed;              // an append failed, the segment is lost
+  pthread_t *threads;       // the workers, then the writer
+  int n_threads;
+};
+
+static const uint8_t *slot_data(const FrameSlot *s) {
+  return s->big ? s->big : s->raw;
+}
+
+static int pack_slot(const SSTableWriter *w, FrameSlot *s) {
+  s->clen = s->len;
+  s->codec = CODEC_NONE;
+  if (w->codec == CODEC_NONE) return 0;
+  size_t cap = codec_bound(w->codec, s->len);
+  if (s->out_cap < cap) {
+    uint8_t *out = realloc(s->out, cap);
+    if (!out) return -1;
+    s->out = out;
+    s->out_cap = cap;
+  }
+  s->codec = pack_frame(w->codec, w->level, slot_data(s), s->len, s->out, s->out_cap, &s->clen);
+  return s->codec < 0 ? -1 : 0;
+}
+
+static void *compress_main(void *arg) {
+  FramePipeline *p = (FramePipeline *)arg;
+  pthread_mutex_lock(&p->mu);
+  for (;;) {
+    while (!p->stopping && p->claimed == p->filled) pthread_cond_wait(&p->work, &p->mu);
+    if (p->stopping) break;
+    FrameSlot *s = &p->slots[p->claimed++ % (uint64_t)p->n_slots];
+    pthread_mutex_unlock(&p->mu);
+    int rc = pack_slot(p->w, s);
+    pthread_mutex_lock(&p->mu);
+    s->failed = rc != 0;
+    s->packed = true;
+    pthread_cond_broadcast(&p->progress);
+  }
+  pthread_mutex_unlock(&p->mu);
+  return NULL;
+}
+
+// Appends frames strictly in the order they were cut. After a failure the
+// rest are only retired, so the caller never waits on a slot forever.
+static void *append_main(void *arg) {
+  FramePipeline *p = (FramePipeline *)arg;
+  pthread_mutex_lock(&p->mu);
+  for (;;) {
+    FrameSlot *s = &p->slots[p->written % (uint64_t)p->n_slots];
+    while (!p->stopping && !(p->written < p->filled && s->packed))
+      pthread_cond_wait(&p->progress, &p->mu);
+    if (p->stopping) break;
+    bool skip = p->failed || s->failed;
+    pthread_mutex_unlock(&p->mu);
+    int rc = skip ? -1
+                  : append_frame(p->w, s->codec, s->codec == CODEC_NONE ? slot_data(s) : s->out, s->len,
+                                 s->clen, (Key){ s->first_key, s->first_len });
+    free(s->big);
+    s->big = NULL;
+    pthread_mutex_lock(&p->mu);
+    if (rc != 0) p->failed = true;
+    s->packed = false;
+    p->written++;
+    pthread_cond_broadcast(&p->progress);
+  }
+  pthread_mutex_unlock(&p->mu);
+  return NULL;
+}
+
+// Hands the frame in the current slot, or big when set, to the workers and
+// moves w->buf to the next slot once the writer has freed it. Takes big.
+static int submit_frame(SSTableWriter *w, uint8_t *big, size_t len, Key first_key) {
+  FramePipeline *p = w->pipe;
+  pthread_mutex_lock(&p->mu);
+  FrameSlot *s = &p->slots[p->filled % (uint64_t)p->n_slots];
+  s->big = big;
+  s->len = (uint32_t)len;
+  if (first_key.len) memcpy(s->first_key, first_key.data, first_key.len);
+  s->first_len = first_key.len;
+  p->filled++;
+  pthread_cond_signal(&p->work);
+  while (p->filled - p->written >= (uint64_t)p->n_slots) pthread_cond_wait(&p->progress, &p->mu);
+  w->buf = p->slots[p->filled % (uint64_t)p->n_slots].raw;
+  int rc = p->failed ? -1 : 0;
+  pthread_mutex_unlock(&p->mu);
+  return rc;
+}
+
+static void pipeline_free(FramePipeline *p) {
+  for (int i = 0; i < p->n_slots; i++) {
+    free(p->slots[i].raw);
+    free(p->slots[i].big);
+    free(p->slots[i].out);
+  }
+  free(p->slots);
+  free(p->threads);
+  pthread_cond_destroy(&p->progress);
+  pthread_cond_destroy(&p->work);
+  pthread_mutex_destroy(&p->mu);
+  free(p);
+}
+
+// Joins the threads, after the writer has appended every frame handed over
+// when drain is set, and returns w to writing inline.
+static int pipeline_stop(SSTableWriter *w, bool drain) {
+  FramePipeline *p = w->pipe;
+  pthread_mutex_lock(&p->mu);
+  while (drain && p->written < p->filled) pthread_cond_wait(&p->progress, &p->mu);
+  p->stopping = true;
+  pthread_cond_broadcast(&p->work);
+  pthread_cond_broadcast(&p->progress);
+  pthread_mutex_unlock(&p->mu);
+  for (int i = 0; i < p->n_threads; i++) pthread_join(p->threads[i], NULL);
+
+  int rc = p->failed ? -1 : 0;
+  w->pipe = NULL;
+  w->buf = NULL;
+  pipeline_free(p);
+  return rc;
+}
+
+static int flush_buf_if_nonempty(SSTableWriter *w) {
+  if (w->buf_len == 0) return 0;
+  size_t len = w->buf_len + encode_restarts(w->buf + w->buf_len, w->restarts, w->n_restarts);
+  Key first = { w->first_key, w->first_len };
+  int rc = w->pipe ? submit_frame(w, NULL, len, first) : emit_frame(w, w->buf, len, first);
+  if (rc == 0) {
+    w->buf_len = 0;
+    w->n_entries = 0;
+    w->n_restarts = 0;
+  }
+  return rc;
+}
+
+int sstable_writer_open(SSTableWriter *w, SSTable *sst, Bloom *bloom, uint8_t *buf, size_t buf_cap,
+                        const char *seg_path, Codec codec, int level) {
+  memset(w, 0, sizeof(*w));
+  free_props(&sst->props);
+  memset(&sst->props, 0, sizeof(sst->props));
+  w->sst = sst;
+  w->codec = codec;
+  w->level = level;
+  w->bloom = bloom;
+  w->buf = buf;
+  w->buf_cap = buf_cap;
+  snprintf(w->seg_path, sizeof(w->seg_path), "%s", seg_path);
+
+  w->segment = fopen(seg_path, "wb");
+  if (!w->segment) {
+    perror("fopen segment");
+    return -1;
+  }
+  return 0;
+}
+
+// From here on frames are compressed on threads workers and appended by a
+// writer thread while the caller builds the next ones, in a ring of frame
+// buffers that replaces buf. The segment comes out as it would inline.
+// Must come before the first add; on failure w stays inline.
+int sstable_writer_parallel(SSTableWriter *w, int threads) {
+  if (threads < 1 || w->pipe || w->buf_len > 0) return -1;
+  uint8_t *buf = w->buf;
+  size_t limit = w->buf_cap < BLOCK_SIZE ? w->buf_cap : BLOCK_SIZE;
+  FramePipeline *p = calloc(1, sizeof(FramePipeline));
+  if (!p) return -1;
+  p->w = w;
+  p->n_slots = 2 * threads + 2;
+  p->slots = calloc((size_t)p->n_slots, sizeof(FrameSlot));
+  p->threads = calloc((size_t)threads + 1, sizeof(pthread_t));
+  pthread_mutex_init(&p->mu, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->progress, NULL);
+  bool ok = p->slots && p->threads;
+  for (int i = 0; ok && i < p->n_slots; i++) ok = (p->slots[i].raw = malloc(limit)) != NULL;
+  if (!ok) {
+    if (!p->slots) p->n_slots = 0;
+    pipeline_free(p);
+    return -1;
+  }
+
+  w->pipe = p;
+  w->buf = p->slots[0].raw;
+  for (int i = 0; i <= threads; i++) {
+    void *(*fn)(void *) = i < threads ? compress_main : append_main;
+    if (pthread_create(&p->threads[i], NULL, fn, p) != 0) {
+      perror("pthread_create frame pipeline");
+      pipeline_stop(w, false);
+      w->buf = buf;
+      return -1;
+    }
+    p->n_threads++;
+  }
+  return 0;
+}
+
+// From here on the segment bypasses the page cache: it is reopened with
+// O_DIRECT, expected bytes are allocated up front, and it goes out in
+// aligned blocks with a single fdatasync at the end, so a large write does
+// not evict what readers have cached. Must come before the first add; on
+// failure, e.g. a file system without O_DIRECT, w stays buffered.
+int sstable_writer_direct(SSTableWriter *w, uint64_t expected) {
+  if (w->direct || w->offset > 0 || w->buf_len > 0) return -1;
+  int fd = open(w->seg_path, O_WRONLY | O_DIRECT);
+  if (fd < 0) return -1;
+  uint8_t *dbuf = aligned_alloc(SST_DIRECT_ALIGN, SST_DIRECT_BUF);
+  if (!dbuf) {
+    close(fd);
+    return -1;
+  }
+  // Only a hint: the file is cut to its real length at the end.
+  if (expected > 0) {
+    uint64_t len = (expected + SST_DIRECT_ALIGN - 1) / SST_DIRECT_ALIGN * SST_DIRECT_ALIGN;
+    fallocate(fd, 0, 0, (off_t)len);
+  }
+
+  fclose(w->segment);
+  w->segment = NULL;
+  w->fd = fd;
+  w->dbuf = dbuf;
+  w->dbuf_len = 0;
+  w->dbuf_at = 0;
+  w->direct = true;
+  return 0;
+}
+
+// The key a frame starting with key is indexed under: in bytewise order
+// the shortest prefix of key still above the last key before it, which
+// sorts between the two frames like key itself does.
+static Key index_key(const SSTableWriter *w, Key key) {
+  if (w->sst->props.entries == 0 || w->sst->cmp) return key;
+  uint32_t shared = key_shared((Key){ w->last_key, w->last_len }, key);
+  return shared < key.len ? (Key){ key.data, shared + 1 } : key;
+}
+
+// Adds the record a ref points at to what the table holds of its file.
+static int count_vlog_use(SSTableWriter *w, const char *ref) {
+  SSTableProps *props = &w->sst->props;
+  VlogRef r = vlog_decode_ref(ref);
+  uint64_t bytes = VLOG_RECORD_HEADER + r.length;
+  if (w->vlog_last < props->n_vlogs && props->vlogs[w->vlog_last].file == r.file) {
+    props->vlogs[w->vlog_last].bytes += bytes;
+    return 0;
+  }
+  for (uint32_t i = 0; i < props->n_vlogs; i++) {
+    if (props->vlogs[i].file != r.file) continue;
+    props->vlogs[i].bytes += bytes;
+    w->vlog_last = i;
+    return 0;
+  }
+  SSTableVlogUse *vlogs = realloc(props->vlogs, sizeof(SSTableVlogUse) * (props->n_vlogs + 1));
+  if (!vlogs) return -1;
+  vlogs[props->n_vlogs] = (SSTableVlogUse){ r.file, bytes };
+  props->vlogs = vlogs;
+  w->vlog_last = props->n_vlogs++;
+  return 0;
+}
+
+// Keys must arrive in ascending order and be at most KEY_MAX_SIZE bytes. A
+// len of SST_VALUE_REF stores the VLOG_REF_SIZE ref in value.
+int sstable_writer_add(SSTableWriter *w, Key key, const char *value, int32_t len) {
+  if (key.len > KEY_MAX_SIZE) return -1;
+  size_t n = ENTRY_HEADER_SIZE + key.len + entry_value_size(len);
+  size_t limit = w->buf_cap < BLOCK_SIZE ? w->buf_cap : BLOCK_SIZE;
 
+  if (w->buf_len > 0) {
+    bool restart = w->n_entries % FRAME_RESTART_INTERVAL == 0;
+    int restarts = w->n_restarts + (restart ? 1 : 0);
+    if (w->buf_len + n + restarts_size(restarts) > limit || (size_t)restarts > FRAME_MAX_RESTARTS) {
+      if (flush_buf_if_nonempty(w) != 0) return -1;
+    }
+  }
+  if (w->bloom) bloom_put(w->bloom, key);
+
+  SSTableProps *props = &w->sst->props;
+  Key first = index_key(w, key);
+  if (props->entries == 0 && key_dup(&props->min_key, key) != 0) return -1;
+  props->entries++;
+  if (len == -1) props->tombstones++;
+  if (len == SST_VALUE_REF && count_vlog_use(w, value) != 0) return -1;
+
+  int rc = 0;
+  if (n + restarts_size(1) > limit) {
+    uint8_t *big = (uint8_t *)malloc(n + restarts_size(1));
+    if (!big) return -1;
+    uint32_t start = 0;
+    encode_entry(big, key, 0, value, len);
+    encode_restarts(big + n, &start, 1);
+    if (w->pipe) {
+      rc = submit_frame(w, big, n + restarts_size(1), first);
+    } else {
+      rc = emit_frame(w, big, n + restarts_size(1), first);
+      free(big);
+    }
+  } else {
+    if (w->buf_len == 0) {
+      memcpy(w->first_key, first.data, first.len);
+      w->first_len = first.len;
+    }
+    uint32_t shared = 0;
+    if (w->n_entries % FRAME_RESTART_INTERVAL == 0)
+      w->restarts[w->n_restarts++] = (uint32_t)w->buf_len;
+    else
+      shared = key_shared((Key){ w->last_key, w->last_len }, key);
+    w->n_entries++;
+    w->buf_len += encode_entry(w->buf + w->buf_len, key, shared, value, len);
+  }
+  if (key.len) memcpy(w->last_key, key.data, key.len);
+  w->last_len = key.len;
+  return rc;
+}
+
+static int write_block(SSTableWriter *w, const void *p, size_t n, uLong *crc) {
+  *crc = crc32(*crc, p, (uInt)n);
+  return out_write(w, p, n);
+}
+
+// Index, filter and properties after the last frame, then the footer.
+static int write_metadata(SSTableWriter *w) {
+  SSTable *sst = w->sst;
+  uLong crc = crc32(0L, Z_NULL, 0);
+  uint8_t word[16];
+
+  uint64_t index_off = (uint64_t)w->offset;
+  uint64_t index_len = sizeof(uint64_t);
+  put_u64(word, (uint64_t)sst->length);
+  if (write_block(w, word, sizeof(uint64_t), &crc) != 0) return -1;
+  Key prev = { NULL, 0 };
+  for (int i = 0; i < sst->length; i++) {
+    Key key = sstable_key(sst, i);
+    uint32_t shared = key_shared(prev, key);
+    put_u16(word, (uint16_t)shared);
+    put_u16(word + 2, (uint16_t)(key.len - shared));
+    put_u64(word + 4, (uint64_t)sst->offsets[i]);
+    if (write_block(w, word, 12, &crc) != 0) return -1;
+    if (key.len > shared && write_block(w, key.data + shared, key.len - shared, &crc) != 0) return -1;
+    index_len += 12 + key.len - shared;
+    prev = key;
+  }
+
+  uint64_t bloom_off = index_off + index_len;
+  uint64_t nbytes = w->bloom ? w->bloom->nbytes : 0;
+  uint32_t k = w->bloom ? w->bloom->k : 0;
+  uint32_t layout = w->bloom ? (uint32_t)w->bloom->layout : 0;
+  memcpy(word, &k, sizeof(k));
+  memcpy(word + 4, &layout, sizeof(layout));
+  put_u64(word + 8, nbytes);
+  if (write_block(w, word, 16, &crc) != 0) return -1;
+  if (nbytes && write_block(w, w->bloom->bitmasks, nbytes, &crc) != 0) return -1;
+
+  uint64_t props_off = bloom_off + 16 + nbytes;
+  sst->props.data_bytes = (uint64_t)w->offset;
+  if (sst->props.entries > 0 && key_dup(&sst->props.max_key, (Key){ w->last_key, w->last_len }) != 0) return -1;
+  uint8_t *props = malloc(props_size(&sst->props));
+  if (!props) return -1;
+  size_t props_len = encode_props(props, &sst->props);
+  int rc = write_block(w, props, props_len, &crc);
+  free(props);
+  if (rc != 0) return -1;
+
+  uint8_t footer[SST_FOOTER_SIZE];
+  uint32_t version = SST_VERSION;
+  put_u64(footer, index_off);
+  put_u64(footer + 8, index_len);
+  put_u64(footer + 16, bloom_off);
+  put_u64(footer + 24, 16 + nbytes);
+  put_u64(footer + 32, props_off);
+  put_u64(footer + 40, props_len);
+  memcpy(footer + 48, &version, sizeof(version));
+  crc = crc32(crc, footer, 52);
+  uint32_t c = (uint32_t)crc;
+  memcpy(footer + 52, &c, sizeof(c));
+  put_u64(footer + 56, SST_FOOTER_MAGIC);
+  return out_write(w, footer, SST_FOOTER_SIZE);
+}
+
+// Pads the staged tail to a whole block, writes it, cuts the file back to
+// its real length and makes all of it durable with the one fdatasync.
+static int direct_finish(SSTableWriter *w) {
+  size_t padded = (w->dbuf_len + SST_DIRECT_ALIGN - 1) / SST_DIRECT_ALIGN * SST_DIRECT_ALIGN;
+  long end = w->dbuf_at + (long)w->dbuf_len;
+  memset(w->dbuf + w->dbuf_len, 0, padded - w->dbuf_len);
+  if (padded > 0 && pwrite_all(w->fd, w->dbuf, padded, w->dbuf_at) != 0) return -1;
+  if (ftruncate(w->fd, end) != 0) return -1;
+  return fdatasync(w->fd);
+}
+
+static void direct_release(SSTableWriter *w) {
+  close(w->fd);
+  free(w->dbuf);
+  w->fd = -1;
+  w->dbuf = NULL;
+  w->direct = false;
+}
+
+// Makes the segment durable and leaves sst open for reads on it.
+int sstable_writer_finish(SSTableWriter *w) {
+  int rc = 0;
+  if (flush_buf_if_nonempty(w) != 0) {
+    perror("flush_buf_if_nonempty");
+    rc = -1;
+  }
+  if (w->pipe && pipeline_stop(w, true) != 0) {
+    perror("write segment frames");
+    rc = -1;
+  }
+  if (rc == 0 && write_metadata(w) != 0) {
+    perror("write segment metadata");
+    rc = -1;
+  }
+
+  if (w->direct) {
+    if (rc == 0 && direct_finish(w) != 0) { perror("sync segment"); rc = -1; }
+    direct_release(w);
+  } else {
+    if (fflush(w->segment) != 0 || fsync(fileno(w->segment)) != 0) { perror("fsync segment"); rc = -1; }
+    fclose(w->segment);
+    w->segment = NULL;
+  }
+  if (rc != 0) return -1;
+
+  w->sst->fd = open(w->seg_path, O_RDONLY);
+  if (w->sst->fd < 0) {
+    perror("open segment");
+    return -1;
+  }
+  w->sst->size = w->offset;
+  return build_search_index(w->sst);
+}
+
+void sstable_writer_abort(SSTableWriter *w) {
+  if (w->pipe) pipeline_stop(w, false);
+  if (w->direct) direct_release(w);
+  if (w->segment) fclose(w->segment);
+  w->segment = NULL;
+  unlink(w->seg_path);
+}
+
+// Leaves c unpositioned, nothing is read until the first seek.
+void sstable_cursor_open(SSTableCursor *c, SSTable *sst) {
+  memset(c, 0, sizeof(*c));
+  c->sst = sst;
+  c->ahead_frame = -1;
+}
+
+// A scan of the whole table. The mapping's advice is shared with the point
+// lookups and left alone; read_ahead asks for each next frame instead.
+void sstable_cursor_init(SSTableCursor *c, SSTable *sst) {
+  sstable_cursor_open(c, sst);
+  sstable_cursor_next(c);
+}
+
+static void ahead_done(ReadOp *op) {
+  ((SSTableCursor *)op->arg)->ahead_done = true;
+}
+
+// Waits out the read ahead, if any, and hands back its frame when it is
+// frame idx and read in full.
+static const uint8_t *take_ahead(SSTableCursor *c, int idx, uint32_t *len) {
+  if (!c->ring || c->ahead_frame < 0) return NULL;
+  while (!c->ahead_done) {
+    // The buffer is only safe to reuse once the kernel is done with it.
+    if (ring_reap(c->ring, 1) < 0) {
+      c->ahead_frame = -1;
+      return NULL;
+    }
+  }
+
+  const uint8_t *buf = NULL;
+  long offset, size;
+  if (c->ahead_frame == idx && frame_extent(c->sst, idx, &offset, &size) && c->ahead.res == size)
+    buf = inflate_frame(c->sst, offset, c->ahead.buf, size, false, len, &c->owned);
+  ring_slot_put(c->ring, &c->ahead);
+  c->ahead_frame = -1;
+  return buf;
+}
+
+// Starts on the frame after idx while idx is being consumed: through the
+// ring when there is one and it has a buffer free, else by advising the
+// kernel.
+static void read_ahead(SSTableCursor *c, int idx) {
+  SSTable *sst = c->sst;
+  if (idx + 1 >= sst->length) return;
+  long offset, size;
+  if (!c->ring || c->ahead_frame >= 0 || !frame_extent(sst, idx + 1, &offset, &size) ||
+      ring_slot_get(c->ring, &c->ahead) != 0) {
+    advise_frame(sst, idx + 1);
+    return;
+  }
+  c->ahead.done = ahead_done;
+  c->ahead.arg = c;
+  c->ahead_done = false;
+  if (ring_read(c->ring, &c->ahead, sst->fd, sst->id, offset, (size_t)size) != 0) {
+    ring_slot_put(c->ring, &c->ahead);
+    advise_frame(sst, idx + 1);
+    return;
+  }
+  c->ahead_frame = idx + 1;
+  ring_submit(c->ring);
+}
+
+static int load_frame(SSTableCursor *c, int idx) {
+  uint32_t len;
+  c->buf = take_ahead(c, idx, &len);
+  read_ahead(c, idx);
+  if (!c->buf) c->buf = segment_read_frame(c->sst, idx, &len, &c->owned);
+  c->pos = 0;
+  c->key_len = 0;
+  c->buf_len = c->buf ? frame_entries_end(c->buf, len) : 0;
+  c->frame_len = len;
+  if (!c->buf || (c->buf_len == 0 && len != sizeof(uint32_t))) {
+    c->err = true;
+    c->valid = false;
+    return -1;
+  }
+  return 0;
+}
+
+bool sstable_cursor_next(SSTableCursor *c) {
+  for (;;) {
+    if (c->buf && c->pos < c->buf_len) {
+      uint32_t next = decode_entry(c->buf, c->buf_len, (uint32_t)c->pos, c->key_buf, &c->key_len, &c->length);
+      if (next == 0) {
+        c->err = true;
+        c->valid = false;
+        return false;
+      }
+      c->key = (Key){ c->key_buf, c->key_len };
+      c->value = (const char *)&c->buf[next - entry_value_size(c->length)];
+      c->pos = next;
+      c->valid = true;
+      return true;
+    }
+
+    free(c->owned);
+    c->owned = NULL;
+    c->buf = NULL;
+    if (c->frame >= c->sst->length) {
+      c->valid = false;
+      return false;
+    }
+
+    if (load_frame(c, c->frame++) != 0) return false;
+  }
+}
+
+static void cursor_reset(SSTableCursor *c) {
+  free(c->owned);
+  c->owned = NULL;
+  c->buf = NULL;
+  c->valid = false;
+}
+
+// Positions c on the smallest key.
+bool sstable_cursor_seek_first(SSTableCursor *c) {
+  cursor_reset(c);
+  c->frame = 0;
+  return sstable_cursor_next(c);
+}
+
+// Positions c on the first entry with a key >= key, using the sparse index
+// to pick the frame and its restart points to pick the entry.
+bool sstable_cursor_seek(SSTableCursor *c, Key key) {
+  cursor_reset(c);
+  if (c->sst->length == 0) return false;
+
+  int slot = find_frame(c->sst, key);
+  if (load_frame(c, slot) != 0) return false;
+  c->frame = slot + 1;
+  uint32_t next;
+  int found = frame_seek(c->sst->cmp, c->buf, c->frame_len, key, c->key_buf, &c->key_len, &c->length, &next);
+  if (found < 0) {
+    c->err = true;
+    return false;
+  }
+  if (found == 0) {
+    c->pos = c->buf_len;
+    return sstable_cursor_next(c);
+  }
+  c->key = (Key){ c->key_buf, c->key_len };
+  c->value = (const char *)&c->buf[next - entry_value_size(c->length)];
+  c->pos = next;
+  c->valid = true;
   return true;
 }
+
+void sstable_cursor_close(SSTableCursor *c) {
+  uint32_t len;
+  take_ahead(c, -1, &len);
+  free(c->owned);
+  c->owned = NULL;
+  c->buf = NULL;
+  c->valid = false;
+}
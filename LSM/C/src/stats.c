@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/stats.h"
+
+static const char *counter_names[STAT_COUNTERS] = {
+  "gets", "puts", "deletes", "user_bytes_written", "user_bytes_read", "wal_bytes",
+  "memtable_hits", "bloom_negatives", "bloom_true_positives", "bloom_false_positives",
+  "frames_read", "frame_bytes_read", "frames_inflated", "frame_bytes_inflated",
+  "frame_raw_bytes", "frame_bytes_written", "flushes", "flush_bytes", "compactions",
+  "compaction_bytes_read", "compaction_bytes_written", "vlog_bytes_written", "vlog_bytes_read",
+  "vlog_gc_bytes",
+};
+
+static const char *hist_names[STAT_HISTS] = { "get", "put", "flush", "compaction" };
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static atomic_uint next_shard;
+
+static void shard_key_init(void) {
+  pthread_key_create(&shard_key, NULL);
+}
+
+// The calling thread's shard, handed out round-robin on first use.
+static StatsShard *my_shard(Stats *s) {
+  pthread_once(&shard_once, shard_key_init);
+  void *p = pthread_getspecific(shard_key);
+  if (!p) {
+    p = (void *)(intptr_t)(atomic_fetch_add(&next_shard, 1) % STATS_SHARDS + 1);
+    pthread_setspecific(shard_key, p);
+  }
+  return &s->shards[(intptr_t)p - 1];
+}
+
+// The latency bucket ns falls in, shared with the benchmark's histograms.
+int stats_bucket(uint64_t ns) {
+  if (ns < 2 * STATS_SUB) return (int)ns;
+  int shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+  int b = 2 * STATS_SUB + (shift - 1) * STATS_SUB + (int)((ns >> shift) - STATS_SUB);
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// Midpoint of the values that land in bucket b.
+uint64_t stats_bucket_value(int b) {
+  if (b < 2 * STATS_SUB) return (uint64_t)b;
+  int shift = (b - 2 * STATS_SUB) / STATS_SUB + 1;
+  uint64_t m = (uint64_t)((b - 2 * STATS_SUB) % STATS_SUB + STATS_SUB);
+  return (m << shift) + ((1ull << shift) >> 1);
+}
+
+Stats *stats_new(void) {
+  Stats *s = aligned_alloc(64, sizeof(Stats));
+  if (s) memset(s, 0, sizeof(Stats));
+  return s;
+}
+
+void stats_free(Stats *s) {
+  free(s);
+}
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void stats_add(Stats *s, StatCounter c, uint64_t n) {
+  if (!s || n == 0) return;
+  atomic_fetch_add_explicit(&my_shard(s)->counters[c], n, memory_order_relaxed);
+}
+
+void stats_record(Stats *s, StatHist h, uint64_t ns) {
+  if (!s) return;
+  StatsShard *sh = my_shard(s);
+  atomic_fetch_add_explicit(&sh->buckets[h][stats_bucket(ns)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&sh->sum_ns[h], ns, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&sh->max_ns[h], memory_order_relaxed);
+  while (ns > max &&
+         !atomic_compare_exchange_weak_explicit(&sh->max_ns[h], &max, ns, memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+}
+
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double p) {
+  uint64_t rank = (uint64_t)(p * (double)count);
+  if (rank < 1) rank = 1;
+  if (rank > count) rank = count;
+  uint64_t seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= rank) return stats_bucket_value(b) < max ? stats_bucket_value(b) : max;
+  }
+  return max;
+}
+
+static double ratio(uint64_t a, uint64_t b) {
+  return b > 0 ? (double)a / (double)b : 0.0;
+}
+
+// Sums the shards into out's counters and latencies and derives the
+// amplification figures; the gauges are left to the caller.
+void stats_collect(Stats *s, LSMStats *out) {
+  memset(out->counters, 0, sizeof(out->counters));
+  memset(out->latency, 0, sizeof(out->latency));
+  if (!s) return;
+
+  uint64_t *buckets = calloc(STATS_BUCKETS, sizeof(uint64_t));
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    for (int i = 0; i < STATS_SHARDS; i++)
+      out->counters[c] += atomic_load_explicit(&s->shards[i].counters[c], memory_order_relaxed);
+
+  for (int h = 0; h < STAT_HISTS && buckets; h++) {
+    LatencySummary *l = &out->latency[h];
+    uint64_t sum = 0;
+    memset(buckets, 0, sizeof(uint64_t) * STATS_BUCKETS);
+    for (int i = 0; i < STATS_SHARDS; i++) {
+      StatsShard *sh = &s->shards[i];
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+        uint64_t n = atomic_load_explicit(&sh->buckets[h][b], memory_order_relaxed);
+        buckets[b] += n;
+        l->count += n;
+      }
+      sum += atomic_load_explicit(&sh->sum_ns[h], memory_order_relaxed);
+      uint64_t max = atomic_load_explicit(&sh->max_ns[h], memory_order_relaxed);
+      if (max > l->max_ns) l->max_ns = max;
+    }
+    if (l->count == 0) continue;
+    l->mean_ns = sum / l->count;
+    l->p50_ns = percentile(buckets, l->count, l->max_ns, 0.50);
+    l->p99_ns = percentile(buckets, l->count, l->max_ns, 0.99);
+    l->p999_ns = percentile(buckets, l->count, l->max_ns, 0.999);
+  }
+  free(buckets);
+
+  const uint64_t *c = out->counters;
+  out->write_amp = ratio(c[STAT_WAL_BYTES] + c[STAT_FLUSH_BYTES] + c[STAT_COMPACTION_BYTES_WRITTEN] +
+                         c[STAT_VLOG_BYTES_WRITTEN], c[STAT_USER_BYTES_WRITTEN]);
+  out->read_amp = ratio(c[STAT_FRAME_BYTES_READ] + c[STAT_VLOG_BYTES_READ], c[STAT_USER_BYTES_READ]);
+  out->frames_per_get = ratio(c[STAT_FRAMES_READ], c[STAT_GETS]);
+  out->bloom_false_positive_rate = ratio(c[STAT_BLOOM_FALSE_POSITIVES],
+                                         c[STAT_BLOOM_FALSE_POSITIVES] + c[STAT_BLOOM_NEGATIVES]);
+}
+
+const char *stats_counter_name(StatCounter c) {
+  return c < STAT_COUNTERS ? counter_names[c] : "unknown";
+}
+
+const char *stats_hist_name(StatHist h) {
+  return h < STAT_HISTS ? hist_names[h] : "unknown";
+}
+
+static void dump_text(const LSMStats *st, FILE *f) {
+  fprintf(f, "lsm stats:\n");
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    fprintf(f, "  %-26s %llu\n", counter_names[c], (unsigned long long)st->counters[c]);
+  for (int h = 0; h < STAT_HISTS; h++) {
+    const LatencySummary *l = &st->latency[h];
+    fprintf(f, "  %-10s latency: %llu ops, mean %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+            hist_names[h], (unsigned long long)l->count, l->mean_ns / 1e3, l->p50_ns / 1e3,
+            l->p99_ns / 1e3, l->p999_ns / 1e3, l->max_ns / 1e3);
+  }
+  fprintf(f, "  cache: %llu hits, %llu misses, %zu entries, %zu bytes\n",
+          (unsigned long long)st->cache.hits, (unsigned long long)st->cache.misses, st->cache.entries,
+          st->cache.used);
+  fprintf(f, "  memtable: %d entries, %ld bytes (%ld dead) of %ld, flush %s\n", st->memtable_entries,
+          st->memtable_bytes, st->memtable_dead_bytes, st->memtable_limit,
+          st->flush_pending ? "pending" : "idle");
+  fprintf(f, "  segments: %d, %llu bytes, deepest level %d\n", st->segments,
+          (unsigned long long)st->segment_bytes, st->max_level);
+  fprintf(f, "  value log: %d files, %llu bytes\n", st->vlog_files, (unsigned long long)st->vlog_bytes);
+  fprintf(f, "  write amp %.2f, read amp %.2f, frames per get %.2f, bloom false positives %.2f%%\n",
+          st->write_amp, st->read_amp, st->frames_per_get, 100.0 * st->bloom_false_positive_rate);
+}
+
+static void dump_json(const LSMStats *st, FILE *f) {
+  fprintf(f, "{\"counters\": {");
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    fprintf(f, "%s\"%s\": %llu", c ? ", " : "", counter_names[c], (unsigned long long)st->counters[c]);
+  fprintf(f, "}, \"latency_ns\": {");
+  for (int h = 0; h < STAT_HISTS; h++) {
+    const LatencySummary *l = &st->latency[h];
+    fprintf(f, "%s\"%s\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            h ? ", " : "", hist_names[h], (unsigned long long)l->count, (unsigned long long)l->mean_ns,
+            (unsigned long long)l->p50_ns, (unsigned long long)l->p99_ns, (unsigned long long)l->p999_ns,
+            (unsigned long long)l->max_ns);
+  }
+  fprintf(f, "}, \"cache\": {\"hits\": %llu, \"misses\": %llu, \"entries\": %zu, \"bytes\": %zu}",
+          (unsigned long long)st->cache.hits, (unsigned long long)st->cache.misses, st->cache.entries,
+          st->cache.used);
+  fprintf(f, ", \"memtable\": {\"entries\": %d, \"bytes\": %ld, \"dead_bytes\": %ld, \"limit\": %ld, \"flush_pending\": %s}",
+          st->memtable_entries, st->memtable_bytes, st->memtable_dead_bytes, st->memtable_limit,
+          st->flush_pending ? "true" : "false");
+  fprintf(f, ", \"segments\": {\"count\": %d, \"bytes\": %llu, \"max_level\": %d}", st->segments,
+          (unsigned long long)st->segment_bytes, st->max_level);
+  fprintf(f, ", \"vlog\": {\"files\": %d, \"bytes\": %llu}", st->vlog_files,
+          (unsigned long long)st->vlog_bytes);
+  fprintf(f, ", \"write_amp\": %.4f, \"read_amp\": %.4f, \"frames_per_get\": %.4f, \"bloom_false_positive_rate\": %.6f}\n",
+          st->write_amp, st->read_amp, st->frames_per_get, st->bloom_false_positive_rate);
+}
+
+// One line of JSON, or an indented text block.
+void stats_dump(const LSMStats *st, FILE *f, bool json) {
+  if (json) dump_json(st, f);
+  else dump_text(st, f);
+  fflush(f);
+}
@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../lib/uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void *map_ring(int fd, size_t len, off_t off) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Registration is best effort: without it reads name the descriptor and
+// the buffer address in every request, which works the same, only slower.
+static void register_pool(ReadRing *r) {
+  struct iovec *iov = malloc(sizeof(struct iovec) * (size_t)r->n_slots);
+  if (!iov) return;
+  for (int i = 0; i < r->n_slots; i++) {
+    iov[i].iov_base = r->pool + (size_t)i * r->slot_bytes;
+    iov[i].iov_len = r->slot_bytes;
+  }
+  r->fixed_bufs = sys_register(r->fd, IORING_REGISTER_BUFFERS, iov, (unsigned)r->n_slots) == 0;
+  free(iov);
+}
+
+static void register_files(ReadRing *r) {
+  int *fds = malloc(sizeof(int) * RING_FILES);
+  r->file_ids = calloc(RING_FILES, sizeof(unsigned long long));
+  if (!fds || !r->file_ids) {
+    free(fds);
+    return;
+  }
+  for (int i = 0; i < RING_FILES; i++) fds[i] = -1;
+  r->fixed_files = sys_register(r->fd, IORING_REGISTER_FILES, fds, RING_FILES) == 0;
+  free(fds);
+}
+
+// A ring with n_slots read buffers of slot_bytes each, and room for all of
+// them to be in flight at once.
+int ring_init(ReadRing *r, int n_slots, size_t slot_bytes) {
+  memset(r, 0, sizeof(*r));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = sys_setup((unsigned)n_slots, &p);
+  if (r->fd < 0) return -1;
+
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+  r->sq_map = map_ring(r->fd, r->sq_map_len, IORING_OFF_SQ_RING);
+  r->cq_map = single ? r->sq_map : map_ring(r->fd, r->cq_map_len, IORING_OFF_CQ_RING);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = map_ring(r->fd, r->sqes_len, IORING_OFF_SQES);
+  if (!r->sq_map || !r->cq_map || !r->sqes) {
+    ring_close(r);
+    return -1;
+  }
+
+  uint8_t *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  long page = sysconf(_SC_PAGESIZE);
+  r->slot_bytes = (slot_bytes + (size_t)page - 1) / (size_t)page * (size_t)page;
+  r->n_slots = n_slots;
+  r->pool = aligned_alloc((size_t)page, r->slot_bytes * (size_t)n_slots);
+  r->free_slots = malloc(sizeof(int) * (size_t)n_slots);
+  if (!r->pool || !r->free_slots) {
+    ring_close(r);
+    return -1;
+  }
+  for (int i = 0; i < n_slots; i++) r->free_slots[i] = n_slots - 1 - i;
+  r->n_free = n_slots;
+  register_pool(r);
+  register_files(r);
+  return 0;
+}
+
+// No read may be in flight.
+void ring_close(ReadRing *r) {
+  if (r->sqes) munmap(r->sqes, r->sqes_len);
+  if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+  if (r->sq_map) munmap(r->sq_map, r->sq_map_len);
+  if (r->fd >= 0) close(r->fd);
+  free(r->pool);
+  free(r->free_slots);
+  free(r->file_ids);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+// Hands op a free buffer; -1 when every one is taken.
+int ring_slot_get(ReadRing *r, ReadOp *op) {
+  if (r->n_free == 0) return -1;
+  op->slot = r->free_slots[--r->n_free];
+  op->buf = r->pool + (size_t)op->slot * r->slot_bytes;
+  return 0;
+}
+
+void ring_slot_put(ReadRing *r, ReadOp *op) {
+  r->free_slots[r->n_free++] = op->slot;
+  op->buf = NULL;
+  op->slot = -1;
+}
+
+// The registered slot for a segment's descriptor, -1 to pass it as is.
+static int ring_file(ReadRing *r, int fd, unsigned long long id) {
+  if (!r->fixed_files || fd < 0 || fd >= RING_FILES) return -1;
+  if (r->file_ids[fd] == id + 1) return fd;
+
+  struct io_uring_files_update up;
+  memset(&up, 0, sizeof(up));
+  up.offset = (unsigned)fd;
+  up.fds = (uint64_t)(uintptr_t)&fd;
+  if (sys_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) return -1;
+  r->file_ids[fd] = id + 1;
+  return fd;
+}
+
+// Clears the slot registered at descriptor fd, so the ring no longer keeps
+// that file open. No read of it may be in flight.
+void ring_unregister(ReadRing *r, int fd) {
+  if (!r->fixed_files || fd < 0 || fd >= RING_FILES || r->file_ids[fd] == 0) return;
+  int none = -1;
+  struct io_uring_files_update up;
+  memset(&up, 0, sizeof(up));
+  up.offset = (unsigned)fd;
+  up.fds = (uint64_t)(uintptr_t)&none;
+  if (sys_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1) r->file_ids[fd] = 0;
+}
+
+// Queues a read of len bytes at offset into op's buffer; it starts at the
+// next ring_submit or ring_reap.
+int ring_read(ReadRing *r, ReadOp *op, int fd, unsigned long long id, long offset, size_t len) {
+  if (!op->buf || len > r->slot_bytes) return -1;
+  unsigned tail = *r->sq_tail;
+  if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+    if (ring_submit(r) != 0) return -1;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) return -1;
+  }
+
+  unsigned idx = tail & r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  int file = ring_file(r, fd, id);
+  sqe->opcode = r->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = file >= 0 ? file : fd;
+  if (file >= 0) sqe->flags = IOSQE_FIXED_FILE;
+  sqe->off = (uint64_t)offset;
+  sqe->addr = (uint64_t)(uintptr_t)op->buf;
+  sqe->len = (uint32_t)len;
+  if (r->fixed_bufs) sqe->buf_index = (uint16_t)op->slot;
+  sqe->user_data = (uint64_t)(uintptr_t)op;
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->to_submit++;
+  r->inflight++;
+  return 0;
+}
+
+static int enter(ReadRing *r, unsigned min_complete) {
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    int n = sys_enter(r->fd, r->to_submit, min_complete, flags);
+    if (n >= 0) {
+      r->to_submit -= (unsigned)n;
+      return 0;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("io_uring_enter");
+      return -1;
+    }
+  }
+}
+
+int ring_submit(ReadRing *r) {
+  return r->to_submit ? enter(r, 0) : 0;
+}
+
+// Runs the done callback of every finished read, waiting until at least
+// min have finished or nothing is left in flight. Reads the callbacks
+// queue are submitted before it returns. Returns how many finished.
+int ring_reap(ReadRing *r, unsigned min) {
+  unsigned reaped = 0;
+  for (;;) {
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+      ReadOp *op = (ReadOp *)(uintptr_t)cqe->user_data;
+      op->res = cqe->res;
+      __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+      r->inflight--;
+      reaped++;
+      op->done(op);
+      head = *r->cq_head;
+    }
+    if (reaped >= min || r->inflight == 0) break;
+    if (enter(r, 1) != 0) return -1;
+  }
+  if (ring_submit(r) != 0) return -1;
+  return (int)reaped;
+}
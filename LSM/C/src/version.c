@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/epoch.h"
+#include "../lib/version.h"
+
+// Takes over the table and filter; on failure the caller still owns them.
+Segment *segment_new(const SSTable *sst, const Bloom *bloom) {
+  Segment *s = malloc(sizeof(*s));
+  if (!s) return NULL;
+  s->sst = *sst;
+  s->bloom = *bloom;
+  atomic_init(&s->refs, 0);
+  s->base = NULL;
+  return s;
+}
+
+static void segment_unref(Segment *s) {
+  if (atomic_fetch_sub(&s->refs, 1) != 1) return;
+  if (s->base) {
+    segment_unref(s->base);
+    free(s);
+    return;
+  }
+  // Nothing can look its frames up any more.
+  if (s->sst.cache) block_cache_erase_segment(s->sst.cache, s->sst.id);
+  sstable_close(&s->sst);
+  free(s->bloom.bitmasks);
+  free(s);
+}
+
+Version *version_new(int cap) {
+  Version *v = calloc(1, sizeof(*v));
+  if (!v) return NULL;
+  v->cap = cap > 0 ? cap : 16;
+  v->segs = malloc(sizeof(Segment *) * (size_t)v->cap);
+  if (!v->segs) {
+    free(v);
+    return NULL;
+  }
+  atomic_init(&v->refs, 1);
+  return v;
+}
+
+// Appends s to a version that has not been published yet.
+int version_push(Version *v, Segment *s) {
+  if (v->n_segs == v->cap) {
+    int cap = v->cap * 2;
+    Segment **segs = realloc(v->segs, sizeof(Segment *) * (size_t)cap);
+    if (!segs) return -1;
+    v->segs = segs;
+    v->cap = cap;
+  }
+  atomic_fetch_add(&s->refs, 1);
+  v->segs[v->n_segs++] = s;
+  return 0;
+}
+
+// A copy of v with segs[first, first + count) replaced by s; count 0 at
+// the end appends. v itself is left alone.
+Version *version_splice(Version *v, int first, int count, Segment *s) {
+  Version *out = version_new(v->n_segs - count + 1);
+  if (!out) return NULL;
+  for (int i = 0; i < first; i++) version_push(out, v->segs[i]);
+  version_push(out, s);
+  for (int i = first + count; i < v->n_segs; i++) version_push(out, v->segs[i]);
+  return out;
+}
+
+// v with segments [first, first + count) at level instead, for a trivial
+// move. The tables stay open until no version lists either copy.
+Version *version_move(Version *v, int first, int count, int level) {
+  Version *out = version_new(v->n_segs);
+  if (!out) return NULL;
+  for (int i = 0; i < v->n_segs; i++) {
+    Segment *s = v->segs[i];
+    if (i >= first && i < first + count) {
+      Segment *base = s->base ? s->base : s;
+      if (!(s = segment_new(&base->sst, &base->bloom))) {
+        version_unref(out);
+        return NULL;
+      }
+      s->sst.level = level;
+      s->base = base;
+      atomic_fetch_add(&base->refs, 1);
+    }
+    version_push(out, s);
+  }
+  return out;
+}
+
+void version_ref(Version *v) {
+  atomic_fetch_add(&v->refs, 1);
+}
+
+void version_unref(Version *v) {
+  if (atomic_fetch_sub(&v->refs, 1) != 1) return;
+  for (int i = 0; i < v->n_segs; i++) segment_unref(v->segs[i]);
+  free(v->segs);
+  free(v);
+}
+
+void versions_init(VersionSet *vs, Version *v) {
+  atomic_init(&vs->current, v);
+  vs->retired = NULL;
+}
+
+Version *versions_current(VersionSet *vs) {
+  return atomic_load(&vs->current);
+}
+
+// Publishes v and retires the version it replaces. Retired versions are
+// released once every reader that could have loaded them has left its
+// epoch; a reader that pinned one keeps it until it lets go.
+void versions_install(VersionSet *vs, Version *v) {
+  Version *old = atomic_exchange(&vs->current, v);
+  if (old) {
+    old->retired_at = epoch_advance();
+    old->next_retired = vs->retired;
+    vs->retired = old;
+  }
+
+  Version **p = &vs->retired;
+  while (*p) {
+    Version *r = *p;
+    if (!epoch_safe(r->retired_at)) {
+      p = &r->next_retired;
+      continue;
+    }
+    *p = r->next_retired;
+    version_unref(r);
+  }
+}
+
+// No reader may still be inside.
+void versions_destroy(VersionSet *vs) {
+  while (vs->retired) {
+    Version *r = vs->retired;
+    vs->retired = r->next_retired;
+    version_unref(r);
+  }
+  Version *v = atomic_exchange(&vs->current, NULL);
+  if (v) version_unref(v);
+}
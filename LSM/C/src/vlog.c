@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../lib/vlog.h"
+
+void vlog_encode_ref(char *dst, VlogRef ref) {
+  uint64_t file = ref.file;
+  memcpy(dst, &file, sizeof(file));
+  memcpy(dst + 8, &ref.offset, sizeof(ref.offset));
+  memcpy(dst + 16, &ref.length, sizeof(ref.length));
+}
+
+VlogRef vlog_decode_ref(const char *src) {
+  uint64_t file;
+  VlogRef ref;
+  memcpy(&file, src, sizeof(file));
+  memcpy(&ref.offset, src + 8, sizeof(ref.offset));
+  memcpy(&ref.length, src + 16, sizeof(ref.length));
+  ref.file = file;
+  return ref;
+}
+
+// Files stay on disk until the engine has loaded every segment: one that
+// fails to load must not take a file others still point into with it.
+int vlog_init(ValueLog *vl, Stats *stats) {
+  memset(vl, 0, sizeof(*vl));
+  vl->keep_files = true;
+  vl->stats = stats;
+  return pthread_mutex_init(&vl->mu, NULL) == 0 ? 0 : -1;
+}
+
+// Every segment has detached.
+void vlog_destroy(ValueLog *vl) {
+  for (int i = 0; i < vl->n_files; i++) close(vl->files[i].fd);
+  free(vl->files);
+  vl->files = NULL;
+  vl->n_files = 0;
+  vl->cap = 0;
+  pthread_mutex_destroy(&vl->mu);
+}
+
+static int find_file(ValueLog *vl, unsigned long long id) {
+  for (int i = 0; i < vl->n_files; i++)
+    if (vl->files[i].id == id) return i;
+  return -1;
+}
+
+// Called with vl->mu held. The file comes in with no refs.
+static int open_file(ValueLog *vl, unsigned long long id) {
+  if (vl->n_files == vl->cap) {
+    int cap = vl->cap ? vl->cap * 2 : 8;
+    VlogFile *files = realloc(vl->files, sizeof(VlogFile) * (size_t)cap);
+    if (!files) return -1;
+    vl->files = files;
+    vl->cap = cap;
+  }
+
+  char path[256];
+  snprintf(path, sizeof(path), VLOG_FILE_FMT, id);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("open value log");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  vl->files[vl->n_files] = (VlogFile){ .id = id, .fd = fd, .size = (uint64_t)st.st_size, .refs = 0 };
+  return vl->n_files++;
+}
+
+// Called with vl->mu held once nothing points into file i any more.
+static void drop_file(ValueLog *vl, int i) {
+  close(vl->files[i].fd);
+  if (!vl->keep_files) vlog_remove(vl->files[i].id);
+  vl->files[i] = vl->files[--vl->n_files];
+}
+
+// Takes a ref on every file sst points into, opening those no other
+// segment has yet. Fails when one is missing, attaching to none of them.
+int vlog_attach(ValueLog *vl, SSTable *sst) {
+  const SSTableProps *props = &sst->props;
+  pthread_mutex_lock(&vl->mu);
+  uint32_t n = 0;
+  for (; n < props->n_vlogs; n++) {
+    int i = find_file(vl, props->vlogs[n].file);
+    if (i < 0) i = open_file(vl, props->vlogs[n].file);
+    if (i < 0) break;
+    vl->files[i].refs++;
+  }
+  if (n < props->n_vlogs) {
+    fprintf(stderr, "segment %llu: value log %llu unavailable\n", sst->id, props->vlogs[n].file);
+    bool keep = vl->keep_files;
+    vl->keep_files = true;
+    while (n-- > 0) {
+      int i = find_file(vl, props->vlogs[n].file);
+      if (--vl->files[i].refs == 0) drop_file(vl, i);
+    }
+    vl->keep_files = keep;
+    pthread_mutex_unlock(&vl->mu);
+    return -1;
+  }
+  pthread_mutex_unlock(&vl->mu);
+  sst->vlog = vl;
+  return 0;
+}
+
+void vlog_detach(SSTable *sst) {
+  ValueLog *vl = sst->vlog;
+  pthread_mutex_lock(&vl->mu);
+  for (uint32_t n = 0; n < sst->props.n_vlogs; n++) {
+    int i = find_file(vl, sst->props.vlogs[n].file);
+    if (i >= 0 && --vl->files[i].refs == 0) drop_file(vl, i);
+  }
+  pthread_mutex_unlock(&vl->mu);
+  sst->vlog = NULL;
+}
+
+// Copies out the value ref points at, checked against its crc. sst holds a
+// ref on the file, so its descriptor stays open after the lock is let go.
+int vlog_read(const SSTable *sst, const char *ref, char **value, int *length) {
+  ValueLog *vl = sst->vlog;
+  VlogRef r = vlog_decode_ref(ref);
+  if (!vl) {
+    fprintf(stderr, "segment %llu: value log %llu not attached\n", sst->id, r.file);
+    return -1;
+  }
+  pthread_mutex_lock(&vl->mu);
+  int i = find_file(vl, r.file);
+  int fd = i >= 0 ? vl->files[i].fd : -1;
+  uint64_t size = i >= 0 ? vl->files[i].size : 0;
+  pthread_mutex_unlock(&vl->mu);
+  if (fd < 0 || r.offset > size || size - r.offset < VLOG_RECORD_HEADER + (uint64_t)r.length) {
+    fprintf(stderr, "segment %llu: bad value log ref %llu@%llu\n", sst->id, r.file,
+            (unsigned long long)r.offset);
+    return -1;
+  }
+
+  char *buf = malloc(r.length ? r.length : 1);
+  if (!buf) return -1;
+  uint32_t head[2];
+  struct iovec iov[2] = { { head, VLOG_RECORD_HEADER }, { buf, r.length } };
+  ssize_t n;
+  do {
+    n = preadv(fd, iov, 2, (off_t)r.offset);
+  } while (n < 0 && errno == EINTR);
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)buf, r.length);
+  if (n != (ssize_t)(VLOG_RECORD_HEADER + r.length) || head[0] != r.length || head[1] != (uint32_t)crc) {
+    fprintf(stderr, "value log %llu: corrupt record at %llu\n", r.file, (unsigned long long)r.offset);
+    free(buf);
+    return -1;
+  }
+  stats_add(vl->stats, STAT_VLOG_BYTES_READ, (uint64_t)n);
+  *value = buf;
+  *length = (int)r.length;
+  return 0;
+}
+
+uint64_t vlog_total_bytes(ValueLog *vl, int *files) {
+  uint64_t bytes = 0;
+  pthread_mutex_lock(&vl->mu);
+  for (int i = 0; i < vl->n_files; i++) bytes += vl->files[i].size;
+  *files = vl->n_files;
+  pthread_mutex_unlock(&vl->mu);
+  return bytes;
+}
+
+// Called with the engine lock held. The files v still points into of which
+// at least ratio is garbage: records no segment of v points at any more,
+// shadowed or deleted and then dropped by a compaction. Returns how many
+// ids *ids holds, which the caller frees; -1 when out of memory. A ratio of
+// 0 or less collects nothing.
+int vlog_collectable(ValueLog *vl, Version *v, double ratio, unsigned long long **ids) {
+  *ids = NULL;
+  if (ratio <= 0) return 0;
+
+  pthread_mutex_lock(&vl->mu);
+  uint64_t *live = calloc((size_t)vl->n_files + 1, sizeof(uint64_t));
+  if (!live) {
+    pthread_mutex_unlock(&vl->mu);
+    return -1;
+  }
+  for (int s = 0; s < v->n_segs; s++) {
+    const SSTableProps *props = &version_table(v, s)->props;
+    for (uint32_t n = 0; n < props->n_vlogs; n++) {
+      int i = find_file(vl, props->vlogs[n].file);
+      if (i >= 0) live[i] += props->vlogs[n].bytes;
+    }
+  }
+
+  int count = 0;
+  for (int i = 0; i < vl->n_files; i++) {
+    uint64_t size = vl->files[i].size;
+    if (live[i] == 0 || live[i] >= size || (double)(size - live[i]) < ratio * (double)size) continue;
+    if (!*ids && !(*ids = malloc(sizeof(unsigned long long) * (size_t)vl->n_files))) {
+      count = -1;
+      break;
+    }
+    (*ids)[count++] = vl->files[i].id;
+  }
+  pthread_mutex_unlock(&vl->mu);
+  free(live);
+  return count;
+}
+
+bool vlog_refers(const SSTable *sst, const unsigned long long *ids, int n) {
+  for (uint32_t i = 0; i < sst->props.n_vlogs; i++)
+    for (int j = 0; j < n; j++)
+      if (sst->props.vlogs[i].file == ids[j]) return true;
+  return false;
+}
+
+void vlog_remove(unsigned long long id) {
+  char path[256];
+  snprintf(path, sizeof(path), VLOG_FILE_FMT, id);
+  unlink(path);
+}
+
+void vlog_writer_init(VlogWriter *w, unsigned long long id, Stats *stats) {
+  w->f = NULL;
+  w->id = id;
+  w->offset = 0;
+  w->stats = stats;
+}
+
+// Appends a record and puts the ref to it in ref, VLOG_REF_SIZE bytes.
+int vlog_append(VlogWriter *w, const char *value, int length, char *ref) {
+  if (!w->f) {
+    char path[256];
+    snprintf(path, sizeof(path), VLOG_FILE_FMT, w->id);
+    w->f = fopen(path, "wb");
+    if (!w->f) {
+      perror("fopen value log");
+      return -1;
+    }
+  }
+
+  uint32_t head[2] = { (uint32_t)length, (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)value, (uInt)length) };
+  if (fwrite(head, 1, VLOG_RECORD_HEADER, w->f) != VLOG_RECORD_HEADER ||
+      fwrite(value, 1, (size_t)length, w->f) != (size_t)length) {
+    perror("write value log");
+    return -1;
+  }
+  vlog_encode_ref(ref, (VlogRef){ w->id, w->offset, (uint32_t)length });
+  w->offset += VLOG_RECORD_HEADER + (uint64_t)length;
+  stats_add(w->stats, STAT_VLOG_BYTES_WRITTEN, VLOG_RECORD_HEADER + (uint64_t)length);
+  return 0;
+}
+
+// Makes the records durable; the segment pointing at them must not be
+// before they are.
+int vlog_writer_finish(VlogWriter *w) {
+  if (!w->f) return 0;
+  int rc = fflush(w->f) == 0 && fdatasync(fileno(w->f)) == 0 ? 0 : -1;
+  if (rc != 0) perror("sync value log");
+  fclose(w->f);
+  w->f = NULL;
+  return rc;
+}
+
+// Removes the file, finished or not: nothing points into it yet.
+void vlog_writer_abort(VlogWriter *w) {
+  if (w->f) fclose(w->f);
+  w->f = NULL;
+  vlog_remove(w->id);
+}
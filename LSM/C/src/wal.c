@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../lib/wal.h"
+
+#define WAL_HEADER_SIZE (2 * sizeof(uint32_t))
+#define WAL_BODY_FIXED (sizeof(uint64_t) + sizeof(uint8_t) + sizeof(uint16_t) + sizeof(int32_t))
+#define WAL_LEGACY_BODY_FIXED (sizeof(uint64_t) + sizeof(uint8_t) + sizeof(int64_t) + sizeof(int32_t))
+
+static int write_all(int fd, const uint8_t *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
+
+static int reserve(uint8_t **buf, size_t *cap, size_t need) {
+  if (need <= *cap) return 0;
+  size_t ncap = *cap ? *cap : 4096;
+  while (ncap < need) ncap *= 2;
+  uint8_t *p = realloc(*buf, ncap);
+  if (!p) return -1;
+  *buf = p;
+  *cap = ncap;
+  return 0;
+}
+
+// Called with w->lock held. Drops the lock while writing so other
+// writers can keep appending into the next group.
+static void write_group(Wal *w, bool sync) {
+  w->leader = true;
+
+  uint8_t *data = w->buf;
+  size_t n = w->buf_len;
+  size_t cap = w->buf_cap;
+  w->buf = w->wbuf;
+  w->buf_cap = w->wbuf_cap;
+  w->buf_len = 0;
+  w->wbuf = data;
+  w->wbuf_cap = cap;
+
+  uint64_t end = w->written + n;
+  pthread_mutex_unlock(&w->lock);
+
+  int rc = write_all(w->fd, data, n);
+  if (rc == 0 && sync) rc = fdatasync(w->fd);
+
+  pthread_mutex_lock(&w->lock);
+  if (rc != 0) {
+    perror("wal write");
+    w->err = errno ? errno : EIO;
+  } else {
+    w->written = end;
+    if (sync) w->synced = end;
+  }
+  w->leader = false;
+  pthread_cond_broadcast(&w->cond);
+}
+
+static void *syncer_main(void *arg) {
+  Wal *w = (Wal *)arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += w->sync_interval_ms / 1000;
+    deadline.tv_nsec += (long)(w->sync_interval_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = 0;
+    while (!w->stop && rc != ETIMEDOUT)
+      rc = pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+    if (w->stop) break;
+
+    if (!w->leader && !w->err && (w->buf_len > 0 || w->synced < w->written))
+      write_group(w, true);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+int wal_open(Wal *w, const char *path, WalSyncPolicy policy, int sync_interval_ms) {
+  memset(w, 0, sizeof(*w));
+  w->policy = policy;
+  w->sync_interval_ms = sync_interval_ms > 0 ? sync_interval_ms : 1;
+
+  w->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (w->fd < 0) {
+    perror("open wal");
+    return -1;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  if (policy == WAL_SYNC_INTERVAL) {
+    if (pthread_create(&w->syncer, NULL, syncer_main, w) != 0) {
+      perror("pthread_create wal syncer");
+      close(w->fd);
+      return -1;
+    }
+    w->has_syncer = true;
+  }
+  return 0;
+}
+
+// Bytes wal_append adds to the log for such a record.
+size_t wal_record_size(WalOp op, uint32_t key_len, int length) {
+  uint32_t vlen = (op == WAL_PUT && length > 0) ? (uint32_t)length : 0;
+  return WAL_HEADER_SIZE + WAL_BODY_FIXED + key_len + vlen;
+}
+
+uint64_t wal_append(Wal *w, WalOp op, uint64_t seq, Key key, const char *value, int length) {
+  uint32_t vlen = (op == WAL_PUT && length > 0) ? (uint32_t)length : 0;
+  uint32_t body_len = (uint32_t)WAL_BODY_FIXED + key.len + vlen;
+  size_t rec_len = WAL_HEADER_SIZE + body_len;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->err || reserve(&w->buf, &w->buf_cap, w->buf_len + rec_len) != 0) {
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+  }
+
+  uint8_t *rec = w->buf + w->buf_len;
+  uint8_t *p = rec + WAL_HEADER_SIZE;
+  uint8_t op8 = (uint8_t)op | WAL_BYTE_KEY;
+  uint16_t klen = (uint16_t)key.len;
+  int32_t len32 = op == WAL_DELETE ? -1 : length;
+
+  memcpy(p, &seq, sizeof(seq));       p += sizeof(seq);
+  memcpy(p, &op8, sizeof(op8));       p += sizeof(op8);
+  memcpy(p, &klen, sizeof(klen));     p += sizeof(klen);
+  if (klen > 0) memcpy(p, key.data, klen);
+  p += klen;
+  memcpy(p, &len32, sizeof(len32));   p += sizeof(len32);
+  if (vlen > 0) memcpy(p, value, vlen);
+
+  memcpy(rec + sizeof(uint32_t), &body_len, sizeof(body_len));
+  uint32_t crc = (uint32_t)crc32(0L, rec + sizeof(uint32_t), (uInt)(sizeof(body_len) + body_len));
+  memcpy(rec, &crc, sizeof(crc));
+
+  w->buf_len += rec_len;
+  w->appended += rec_len;
+  uint64_t lsn = w->appended;
+  pthread_mutex_unlock(&w->lock);
+  return lsn;
+}
+
+int wal_commit(Wal *w, uint64_t lsn) {
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    if (w->err) break;
+
+    uint64_t done = w->policy == WAL_SYNC_ALWAYS ? w->synced : w->written;
+    if (done >= lsn) break;
+
+    if (w->leader) {
+      pthread_cond_wait(&w->cond, &w->lock);
+      continue;
+    }
+    write_group(w, w->policy == WAL_SYNC_ALWAYS);
+  }
+  int rc = w->err ? -1 : 0;
+  pthread_mutex_unlock(&w->lock);
+  return rc;
+}
+
+int wal_replay(Wal *w, WalReplayFn fn, void *arg) {
+  struct stat st;
+  if (fstat(w->fd, &st) != 0) {
+    perror("fstat wal");
+    return -1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  free(w->replay_buf);
+  w->replay_buf = NULL;
+  if (size == 0) return 0;
+
+  uint8_t *buf = malloc(size);
+  if (!buf) return -1;
+
+  size_t got = 0;
+  while (got < size) {
+    ssize_t r = pread(w->fd, buf + got, size - got, (off_t)got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      perror("pread wal");
+      free(buf);
+      return -1;
+    }
+    got += (size_t)r;
+  }
+
+  int count = 0;
+  size_t pos = 0;
+  while (pos + WAL_HEADER_SIZE + WAL_BODY_FIXED <= size) {
+    uint32_t crc, body_len;
+    memcpy(&crc, buf + pos, sizeof(crc));
+    memcpy(&body_len, buf + pos + sizeof(crc), sizeof(body_len));
+    if (body_len < WAL_BODY_FIXED || body_len > size - pos - WAL_HEADER_SIZE) break;
+    if ((uint32_t)crc32(0L, buf + pos + sizeof(crc), (uInt)(sizeof(body_len) + body_len)) != crc) break;
+
+    const uint8_t *p = buf + pos + WAL_HEADER_SIZE;
+    uint64_t seq;
+    uint8_t op8;
+    int32_t len32;
+    Key key;
+    char legacy[KEY_LONG_SIZE];
+    memcpy(&seq, p, sizeof(seq));       p += sizeof(seq);
+    memcpy(&op8, p, sizeof(op8));       p += sizeof(op8);
+    if (op8 & WAL_BYTE_KEY) {
+      uint16_t klen;
+      memcpy(&klen, p, sizeof(klen));   p += sizeof(klen);
+      if (klen > body_len - WAL_BODY_FIXED) break;
+      key = (Key){ (const char *)p, klen };
+      p += klen;
+    } else {
+      int64_t key64;
+      if (body_len < WAL_LEGACY_BODY_FIXED) break;
+      memcpy(&key64, p, sizeof(key64)); p += sizeof(key64);
+      key = key_from_long(legacy, (long)key64);
+    }
+    memcpy(&len32, p, sizeof(len32));   p += sizeof(len32);
+
+    fn(arg, (WalOp)(op8 & ~WAL_BYTE_KEY), seq, key, len32 > 0 ? (const char *)p : NULL, len32);
+    pos += WAL_HEADER_SIZE + body_len;
+    count++;
+  }
+
+  // A torn tail from a crash mid-write: drop it so new records follow
+  // the last complete one.
+  if (pos < size && ftruncate(w->fd, (off_t)pos) != 0) perror("ftruncate wal tail");
+
+  w->replay_buf = buf;
+  return count;
+}
+
+int wal_truncate(Wal *w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->leader) pthread_cond_wait(&w->cond, &w->lock);
+
+  // Everything appended so far is covered by the segment the caller just
+  // persisted, so buffered records are dropped along with the file.
+  w->buf_len = 0;
+  int rc = ftruncate(w->fd, 0);
+  if (rc != 0) perror("ftruncate wal");
+  else rc = fdatasync(w->fd);
+
+  w->written = w->appended;
+  w->synced = w->appended;
+  free(w->replay_buf);
+  w->replay_buf = NULL;
+
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  return rc;
+}
+
+// Points the log at a fresh file once everything in the current one is
+// durable elsewhere. Buffered records are dropped like in wal_truncate.
+int wal_reopen(Wal *w, const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("open wal");
+    return -1;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (w->leader) pthread_cond_wait(&w->cond, &w->lock);
+
+  close(w->fd);
+  w->fd = fd;
+  w->buf_len = 0;
+  w->written = w->appended;
+  w->synced = w->appended;
+  free(w->replay_buf);
+  w->replay_buf = NULL;
+
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+void wal_close(Wal *w) {
+  pthread_mutex_lock(&w->lock);
+  w->stop = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  if (w->has_syncer) pthread_join(w->syncer, NULL);
+
+  pthread_mutex_lock(&w->lock);
+  while (w->leader) pthread_cond_wait(&w->cond, &w->lock);
+  if (!w->err && (w->buf_len > 0 || w->synced < w->written))
+    write_group(w, w->policy != WAL_SYNC_NEVER);
+  pthread_mutex_unlock(&w->lock);
+
+  close(w->fd);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w->buf);
+  free(w->wbuf);
+  free(w->replay_buf);
+  w->buf = w->wbuf = w->replay_buf = NULL;
+}
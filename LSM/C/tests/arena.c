@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/arena.h"
+#include "../lib/memtable.h"
+
+#define ARENA_THREADS 4
+#define ARENA_PER_THREAD 20000
+#define SMALL_CHUNK 4096
+
+typedef struct {
+  Arena *a;
+  uint8_t **out;
+  int id;
+} ArenaWriter;
+
+static void *arena_writer_main(void *arg) {
+  ArenaWriter *w = (ArenaWriter *)arg;
+  for (int i = 0; i < ARENA_PER_THREAD; i++) {
+    uint8_t *p = arena_alloc(w->a, 8);
+    assert(p);
+    memset(p, w->id, 8);
+    w->out[i] = p;
+  }
+  return NULL;
+}
+
+// Writes of both kinds: overwrites and deletes turn value bytes dead, the
+// rest stay live, and a reset hands it all back. Keys count once per tree
+// node, once per skiplist version.
+static void check_accounting(MemtableKind kind) {
+  int size = 64;
+  void *nodes = calloc(1, mt_pool_bytes(kind, size));
+  Value *values = calloc((size_t)size, sizeof(Value));
+  Memtable *m = malloc(sizeof(Memtable));
+  assert(nodes && values && m);
+  mt_init(m, kind, nodes, values, size, true, NULL);
+
+  char buf[16] = "0123456789";
+  assert(mt_put(m, 1, KEY_LONG(1), buf, 10) && mt_put(m, 2, KEY_LONG(2), buf, 5));
+  // The memtable keeps its own copy.
+  memset(buf, 'x', sizeof(buf));
+  Value *v = mt_get(m, KEY_LONG(1));
+  assert(v && v->value != buf && memcmp(v->value, "0123456789", 10) == 0);
+  assert(mt_put(m, 3, KEY_LONG(1), buf, 4) && mt_delete(m, 4, KEY_LONG(2)) && mt_delete(m, 5, KEY_LONG(3)));
+  bool versions = kind == MEMTABLE_SKIPLIST;
+  long keys = (versions ? 5 : 3) * KEY_LONG_SIZE;
+  long dead_keys = (versions ? 2 : 0) * KEY_LONG_SIZE;
+  assert(atomic_load(&m->total_size) == 19 + keys && atomic_load(&m->dead_size) == 15 + dead_keys);
+
+  // A byte budget fills the memtable before its nodes run out.
+  m->max_bytes = atomic_load(&m->total_size) + 1;
+  assert(!mt_is_full(m) && mt_put(m, 6, KEY_LONG(4), buf, 1) && mt_is_full(m));
+  mt_reset(m);
+  assert(atomic_load(&m->total_size) == 0 && atomic_load(&m->dead_size) == 0 && !mt_is_full(m));
+  assert(mt_get(m, KEY_LONG(1)) == NULL && mt_put(m, 7, KEY_LONG(1), "y", 2));
+  assert(strcmp(mt_get(m, KEY_LONG(1))->value, "y") == 0);
+
+  mt_destroy(m);
+  free(m);
+  free(values);
+  free(nodes);
+}
+
+int arena_test(void) {
+  Arena a;
+  arena_init(&a, SMALL_CHUNK);
+
+  // Small requests bump through chunks, large ones get their own.
+  uint8_t *p = arena_alloc(&a, 100);
+  uint8_t *q = arena_alloc(&a, 100);
+  assert(p && q && q == p + 100);
+  uint8_t *big = arena_alloc(&a, SMALL_CHUNK * 2);
+  assert(big);
+  memset(big, 1, SMALL_CHUNK * 2);
+  assert(arena_alloc(&a, 100) == q + 100);
+  for (int i = 0; i < 100; i++) assert(arena_alloc(&a, 1000));
+  size_t footprint = arena_footprint(&a);
+  assert(footprint >= SMALL_CHUNK * 2 + 100 * 1000);
+
+  // A reset keeps one chunk to start over with.
+  arena_reset(&a);
+  assert(arena_footprint(&a) > 0 && arena_footprint(&a) < SMALL_CHUNK * 2);
+  assert(arena_alloc(&a, 10));
+
+  // Concurrent allocations never overlap.
+  arena_reset(&a);
+  pthread_t th[ARENA_THREADS];
+  ArenaWriter args[ARENA_THREADS];
+  uint8_t **out = malloc(sizeof(uint8_t *) * ARENA_THREADS * ARENA_PER_THREAD);
+  assert(out);
+  for (int i = 0; i < ARENA_THREADS; i++) {
+    args[i] = (ArenaWriter){ .a = &a, .out = out + i * ARENA_PER_THREAD, .id = i + 1 };
+    pthread_create(&th[i], NULL, arena_writer_main, &args[i]);
+  }
+  for (int i = 0; i < ARENA_THREADS; i++) pthread_join(th[i], NULL);
+  for (int i = 0; i < ARENA_THREADS; i++)
+    for (int j = 0; j < ARENA_PER_THREAD; j++)
+      for (int b = 0; b < 8; b++) assert(out[i * ARENA_PER_THREAD + j][b] == i + 1);
+  free(out);
+  arena_destroy(&a);
+  assert(arena_footprint(&a) == 0);
+
+  check_accounting(MEMTABLE_RBTREE);
+  check_accounting(MEMTABLE_SKIPLIST);
+  check_accounting(MEMTABLE_BTREE);
+  puts("arena: bump allocation, reset, concurrent allocation and memtable accounting ok");
+  return 0;
+}
@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/arena.h"
+#include "../lib/btree.h"
+
+#define BT_KEYS 5000
+#define BT_OPS 40000
+#define BT_POOL (BT_KEYS + 4)
+
+extern const char *payloads[4];  // in memtable.c
+
+// Spread over the whole range so the comparisons see both signs.
+static long key_of(int k) {
+  return (long)(k - BT_KEYS / 2) * (LONG_MAX / BT_KEYS);
+}
+
+static uint32_t next_rand(uint32_t *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+int btree_test(void) {
+  void *pool = malloc(bt_pool_bytes(BT_POOL));
+  Value *values = calloc(BT_POOL, sizeof(Value));
+  assert(pool && values);
+
+  BTree t;
+  Arena keys;
+  arena_init(&keys, 4096);
+  bt_init(&t, pool, values, BT_POOL);
+  t.keys = &keys;
+  assert(((uintptr_t)t.nodes & 63) == 0);
+
+  // -2 never written, -1 tombstone, else the payload index.
+  int want[BT_KEYS];
+  for (int k = 0; k < BT_KEYS; k++) want[k] = -2;
+  long replaced = 0;
+  uint32_t s = 0x5EED;
+  for (int i = 0; i < BT_OPS; i++) {
+    int k = (int)(next_rand(&s) % BT_KEYS);
+    int p = (int)(next_rand(&s) % 5);
+    if (want[k] >= 0) replaced += want[k] + 1;
+    if (p == 4) {
+      assert(bt_put(&t, KEY_LONG(key_of(k)), NULL, -1));
+      want[k] = -1;
+    } else {
+      assert(bt_put(&t, KEY_LONG(key_of(k)), payloads[p], p + 1));
+      want[k] = p;
+    }
+  }
+  assert(t.replaced_bytes == replaced);
+
+  int written = 0;
+  for (int k = 0; k < BT_KEYS; k++) {
+    int idx = bt_find(&t, KEY_LONG(key_of(k)));
+    if (want[k] == -2) {
+      assert(idx == 0);
+      continue;
+    }
+    written++;
+    assert(idx != 0);
+    if (want[k] == -1) assert(values[idx].length == -1);
+    else assert(values[idx].value == payloads[want[k]] && values[idx].length == want[k] + 1);
+  }
+  assert(t.length == written && t.root != 1);
+
+  // The extremes sort at the ends, and a full walk yields every key in order.
+  assert(bt_put(&t, KEY_LONG(LONG_MIN), "lo", 3) && bt_put(&t, KEY_LONG(LONG_MAX), "hi", 3));
+  int node, pos, n = 0;
+  long prev = 0;
+  for (bt_first(&t, &node, &pos); node != 0; bt_next(&t, &node, &pos), n++) {
+    long key = key_to_long(t.nodes[node].keys[pos]);
+    if (n == 0) assert(key == LONG_MIN);
+    else assert(key > prev);
+    prev = key;
+  }
+  assert(n == written + 2 && prev == LONG_MAX);
+
+  // Seeks land on the next key up, or past the end.
+  int k = BT_KEYS / 3;
+  while (want[k] == -2) k++;
+  bt_seek(&t, KEY_LONG(key_of(k) - 1), &node, &pos);
+  assert(node != 0 && key_to_long(t.nodes[node].keys[pos]) == key_of(k));
+  bt_seek(&t, KEY_LONG(LONG_MAX), &node, &pos);
+  assert(node != 0 && key_to_long(t.nodes[node].keys[pos]) == LONG_MAX);
+  bt_next(&t, &node, &pos);
+  assert(node == 0);
+
+  // Keys sharing their first eight bytes tie on the heads and are told
+  // apart by the bytes after; a shorter key sorts before its extensions.
+  bt_reset(&t);
+  arena_reset(&keys);
+  char buf[32];
+  for (int i = 0; i < BT_KEYS; i++) {
+    int k = (int)(next_rand(&s) % BT_KEYS);
+    int len = snprintf(buf, sizeof(buf), "account/%d", k);
+    assert(bt_put(&t, (Key){ buf, (uint32_t)len }, payloads[0], 1));
+  }
+  assert(bt_put(&t, (Key){ "account", 7 }, payloads[1], 2));
+  Key last = { NULL, 0 };
+  n = 0;
+  for (bt_first(&t, &node, &pos); node != 0; bt_next(&t, &node, &pos), n++) {
+    Key key = t.nodes[node].keys[pos];
+    assert(n == 0 ? key_equal(key, (Key){ "account", 7 }) : key_compare_bytes(last, key) < 0);
+    assert(bt_find(&t, key) != 0);
+    last = key;
+  }
+  assert(n == t.length);
+  bt_seek(&t, (Key){ "account/2", 9 }, &node, &pos);
+  assert(node != 0 && key_compare_bytes(t.nodes[node].keys[pos], (Key){ "account/2", 9 }) >= 0);
+  assert(bt_find(&t, (Key){ "account/", 8 }) == 0);
+
+  // Ascending keys split only the rightmost path; the pool still suffices.
+  bt_reset(&t);
+  arena_reset(&keys);
+  assert(t.length == 0 && bt_find(&t, KEY_LONG(key_of(0))) == 0);
+  int added = 0;
+  while (!bt_is_full(&t)) {
+    assert(bt_put(&t, KEY_LONG(added), payloads[0], 1));
+    added++;
+  }
+  assert(added >= BT_POOL - 2);
+  for (int i = 0; i < added; i++) assert(bt_find(&t, KEY_LONG(i)) != 0);
+  assert(!bt_put(&t, KEY_LONG(added), payloads[0], 1) && bt_put(&t, KEY_LONG(0), payloads[1], 2));
+
+  arena_destroy(&keys);
+  free(values);
+  free(pool);
+  puts("btree: random writes, tombstones, ordered scans and splits ok");
+  return 0;
+}
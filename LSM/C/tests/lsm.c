@@ -0,0 +1,1309 @@
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../lib/async.h"
+#include "../lib/iter.h"
+#include "../lib/lsm.h"
+#include "../lib/manifest.h"
+#include "../lib/vlog.h"
+
+#define POOL     1024
+#define N_KEYS   600
+#define N_WRITERS 4
+#define N_PER_WRITER 500
+
+static char payloads[N_KEYS][32];
+
+static void clean_segments(void) {
+  mkdir("segments", 0755);
+  DIR *d = opendir("segments");
+  if (!d) return;
+
+  struct dirent *e;
+  char path[512];
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "segments/%s", e->d_name);
+    unlink(path);
+  }
+  closedir(d);
+}
+
+static long file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Every log the engine keeps, active and spare.
+static long wal_bytes(void) {
+  DIR *d = opendir("segments");
+  if (!d) return -1;
+
+  long total = 0;
+  struct dirent *e;
+  char path[512];
+  while ((e = readdir(d)) != NULL) {
+    if (strncmp(e->d_name, "wal_", 4) != 0) continue;
+    snprintf(path, sizeof(path), "segments/%s", e->d_name);
+    total += file_size(path);
+  }
+  closedir(d);
+  return total;
+}
+
+// Keys for ids, backed by buf of n * KEY_LONG_SIZE bytes.
+static void to_keys(Key *keys, char *buf, const long *ids, int n) {
+  for (int i = 0; i < n; i++) keys[i] = key_from_long(buf + (size_t)i * KEY_LONG_SIZE, ids[i]);
+}
+
+// The segments a reader would walk right now.
+static Version *live(LSM *l) {
+  return versions_current(&l->versions);
+}
+
+static void test_wal_recovery(RBNode *nodes, Value *values) {
+  clean_segments();
+
+  LSM l;
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  for (int i = 0; i < 100; i++) {
+    snprintf(payloads[i], sizeof(payloads[i]), "v%d", i);
+    assert(lsm_put(&l, KEY_LONG(i), payloads[i], (int)strlen(payloads[i]) + 1));
+  }
+  for (int i = 0; i < 10; i++) assert(lsm_delete(&l, KEY_LONG(i)));
+  assert(lsm_delete(&l, KEY_LONG(5000)));
+  // No flush: everything must come back from the log.
+  lsm_close(&l);
+
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  for (int i = 0; i < 10; i++) assert(mt_get(l.mem, KEY_LONG(i)) == NULL);
+  for (int i = 10; i < 100; i++) {
+    Value *v = mt_get(l.mem, KEY_LONG(i));
+    assert(v && strcmp(v->value, payloads[i]) == 0);
+  }
+  assert(l.last_seq == 111);
+  lsm_close(&l);
+}
+
+static void test_flush_truncates(RBNode *nodes, Value *values) {
+  clean_segments();
+
+  LSM l;
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  for (int i = 0; i < N_KEYS; i++) {
+    snprintf(payloads[i], sizeof(payloads[i]), "value-%d", i);
+    assert(lsm_put(&l, KEY_LONG(i), payloads[i], (int)strlen(payloads[i]) + 1));
+  }
+  long before = wal_bytes();
+  flush(&l);
+  assert(wal_bytes() == 0 && before > 0);
+  assert(mt_count(l.mem) == 0 && l.imm == NULL);
+  assert(live(&l)->n_segs == 1);
+  lsm_close(&l);
+}
+
+// A flush that cannot write its segment fails flush() rather than hanging
+// it, lsm_close still returns, and the log brings the writes back.
+static void test_flush_failure(RBNode *nodes, Value *values) {
+  clean_segments();
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+
+  LSM l;
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  for (int i = 0; i < N_KEYS; i++) {
+    snprintf(payloads[i], sizeof(payloads[i]), "f%d", i);
+    assert(lsm_put(&l, KEY_LONG(i), payloads[i], (int)strlen(payloads[i]) + 1));
+  }
+  // The open logs and manifest move along, new segment files cannot be made.
+  assert(rename("segments", "segments.off") == 0);
+  assert(flush(&l) == -1 && l.imm != NULL);
+  lsm_close(&l);
+  assert(rename("segments.off", "segments") == 0);
+
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  for (int i = 0; i < N_KEYS; i++) {
+    char *got;
+    int len;
+    assert(lsm_get(&l, KEY_LONG(i), &got, &len) == 1 && strcmp(got, payloads[i]) == 0);
+    free(got);
+  }
+  assert(flush(&l) == 0);
+  lsm_close(&l);
+}
+
+// Counters follow the calls made, each read path, and flushes.
+static void test_stats(RBNode *nodes, Value *values) {
+  clean_segments();
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+
+  LSMOptions opts;
+  lsm_options_default(&opts);
+  opts.compaction = COMPACTION_NONE;
+  LSM l;
+  assert(lsm_init(&l, &opts, nodes, values, POOL, false) == 0);
+  uint64_t written = 0;
+  for (int i = 0; i < N_KEYS; i++) {
+    snprintf(payloads[i], sizeof(payloads[i]), "s%d", i);
+    int len = (int)strlen(payloads[i]) + 1;
+    assert(lsm_put(&l, KEY_LONG(i), payloads[i], len));
+    written += KEY_LONG_SIZE + (uint64_t)len;
+  }
+  assert(lsm_delete(&l, KEY_LONG(0)));
+  flush(&l);
+  assert(lsm_put(&l, KEY_LONG(N_KEYS), "mem", 4));
+
+  // One hit from the memtable, one from the segment, one the filter or the
+  // frame rules out.
+  char *got;
+  int len;
+  assert(lsm_get(&l, KEY_LONG(N_KEYS), &got, &len) == 1);
+  free(got);
+  assert(lsm_get(&l, KEY_LONG(7), &got, &len) == 1 && strcmp(got, "s7") == 0);
+  free(got);
+  assert(lsm_get(&l, KEY_LONG(-5), &got, &len) == 0);
+  Key keys[2] = { KEY_LONG(8), KEY_LONG(9) };
+  char *vals[2];
+  int lens[2], results[2];
+  assert(lsm_multi_get(&l, 2, keys, vals, lens, results) == 0);
+  free(vals[0]);
+  free(vals[1]);
+
+  LSMStats st;
+  lsm_stats_snapshot(&l, &st);
+  const uint64_t *c = st.counters;
+  assert(c[STAT_PUTS] == N_KEYS + 1 && c[STAT_DELETES] == 1);
+  assert(c[STAT_USER_BYTES_WRITTEN] == written + KEY_LONG_SIZE + KEY_LONG_SIZE + 4);
+  assert(c[STAT_WAL_BYTES] > c[STAT_USER_BYTES_WRITTEN]);
+  assert(c[STAT_GETS] == 5 && c[STAT_MEMTABLE_HITS] == 1);
+  assert(c[STAT_BLOOM_TRUE_POSITIVES] == 3);
+  assert(c[STAT_BLOOM_NEGATIVES] + c[STAT_BLOOM_FALSE_POSITIVES] == 1);
+  assert(c[STAT_USER_BYTES_READ] == 4 * KEY_LONG_SIZE + 4 + 3 + 3 + 3);
+  assert(c[STAT_FRAMES_READ] >= 1 && c[STAT_FRAME_BYTES_READ] > 0);
+  assert(c[STAT_FLUSHES] == 1 && c[STAT_FLUSH_BYTES] == (uint64_t)st.segment_bytes);
+  assert(c[STAT_FRAME_BYTES_WRITTEN] == c[STAT_FLUSH_BYTES] && c[STAT_FRAME_RAW_BYTES] > 0);
+  assert(st.latency[STAT_HIST_GET].count == 4 && st.latency[STAT_HIST_PUT].count == N_KEYS + 2);
+  assert(st.latency[STAT_HIST_FLUSH].count == 1 && st.latency[STAT_HIST_FLUSH].max_ns > 0);
+  const LatencySummary *put = &st.latency[STAT_HIST_PUT];
+  assert(put->p50_ns <= put->p99_ns && put->p99_ns <= put->p999_ns && put->p999_ns <= put->max_ns);
+  assert(st.memtable_entries == 1 && st.memtable_bytes == KEY_LONG_SIZE + 4 && st.segments == 1 && !st.flush_pending);
+  assert(st.write_amp > 1.0 && st.read_amp > 0 && st.frames_per_get > 0);
+
+  char *buf;
+  size_t size;
+  FILE *f = open_memstream(&buf, &size);
+  assert(f);
+  stats_dump(&st, f, true);
+  fclose(f);
+  assert(size > 0 && buf[0] == '{' && strstr(buf, "\"bloom_true_positives\": 3"));
+  free(buf);
+  lsm_close(&l);
+
+  // Off, every counter stays at zero.
+  clean_segments();
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  opts.collect_stats = false;
+  assert(lsm_init(&l, &opts, nodes, values, POOL, false) == 0);
+  assert(lsm_put(&l, KEY_LONG(1), "x", 2) && lsm_get(&l, KEY_LONG(1), &got, &len) == 1);
+  free(got);
+  lsm_stats_snapshot(&l, &st);
+  assert(st.counters[STAT_PUTS] == 0 && st.latency[STAT_HIST_GET].count == 0 && st.memtable_entries == 1);
+  lsm_close(&l);
+}
+
+static void put_range(RBNode *nodes, Value *values, int from, int to) {
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+
+  LSM l;
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  for (int i = from; i < to; i++) {
+    snprintf(payloads[i], sizeof(payloads[i]), "v%d", i);
+    assert(lsm_put(&l, KEY_LONG(i), payloads[i], (int)strlen(payloads[i]) + 1));
+  }
+  lsm_close(&l);
+}
+
+// A crash while imm is being flushed leaves two logs with data behind.
+static void test_recover_imm_log(RBNode *nodes, Value *values) {
+  clean_segments();
+
+  put_range(nodes, values, 0, 50);
+  assert(rename("segments/wal_0.log", "segments/held") == 0);
+  put_range(nodes, values, 50, 100);
+  assert(rename("segments/held", "segments/wal_0.log") == 0);
+
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  LSM l;
+  assert(lsm_init(&l, NULL, nodes, values, POOL, false) == 0);
+  assert(live(&l)->n_segs == 1 && mt_count(l.mem) == 0);
+  assert(wal_bytes() == 0);
+  for (int i = 0; i < 100; i++) {
+    char *v = NULL;
+    int len = 0;
+    assert(lsm_get(&l, KEY_LONG(i), &v, &len) == 1 && strcmp(v, payloads[i]) == 0);
+    free(v);
+  }
+  lsm_close(&l);
+}
+
+static void check_range(LSM *l, int from, int to) {
+  for (int i = from; i < to; i++) {
+    char *v = NULL;
+    int len = 0;
+    assert(lsm_get(l, KEY_LONG(i), &v, &len) == 1 && strcmp(v, payloads[i]) == 0);
+    free(v);
+  }
+}
+
+static void test_manifest(RBNode *nodes, Value *values) {
+  clean_segments();
+
+  LSMOptions opts;
+  lsm_options_default(&opts);
+  opts.compaction = COMPACTION_NONE;
+  LSM l;
+  assert(lsm_init(&l, &opts, nodes, values, POOL, false) == 0);
+  for (int i = 0; i < N_KEYS; i++) {
+    snprintf(payloads[i], sizeof(payloads[i]), "m%d", i);
+    assert(lsm_put(&l, KEY_LONG(i), payloads[i], (int)strlen(payloads[i]) + 1));
+    if (i == N_KEYS / 2) flush(&l);
+  }
+  flush(&l);
+  assert(live(&l)->n_segs == 2 && wal_bytes() == 0);
+  assert(version_table(live(&l), 0)->largest_seq < version_table(live(&l), 1)->largest_seq);
+  unsigned long long next_id = l.next_segment_id;
+  lsm_close(&l);
+  assert(access(SEGMENT_FILE_COUNT, F_OK) != 0);
+
+  // A torn append and files no edit mentions are what a crash leaves.
+  FILE *f = fopen(MANIFEST_FILE, "ab");
+  assert(f && fwrite("torn", 1, 4, f) == 4);
+  fclose(f);
+  f = fopen("segments/segment_99.log", "wb");
+  assert(f);
+  fclose(f);
+
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  assert(lsm_init(&l, &opts, nodes, values, POOL, false) == 0);
+  assert(live(&l)->n_segs == 2 && l.next_segment_id == next_id);
+  // Everything was flushed, the sequence still picks up where it was.
+  assert(l.last_seq == N_KEYS && mt_count(l.mem) == 0);
+  assert(access("segments/segment_99.log", F_OK) != 0);
+  check_range(&l, 0, N_KEYS);
+  lsm_close(&l);
+
+  // Without a manifest the segments are found on disk and recorded.
+  assert(unlink(MANIFEST_FILE) == 0);
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  assert(lsm_init(&l, &opts, nodes, values, POOL, false) == 0);
+  assert(live(&l)->n_segs == 2 && access(MANIFEST_FILE, F_OK) == 0);
+  check_range(&l, 0, N_KEYS);
+  lsm_close(&l);
+
+  // Edits past the roll-over budget start a new file from a snapshot.
+  Manifest m;
+  bool found;
+  assert(manifest_open(&m, KEY_BYTEWISE_NAME, &found) == 0 && found && m.n_tables == 2);
+  m.roll_bytes = 1024;
+  for (int i = 0; i < 200; i++) {
+    ManifestTable t = { .id = 1000 + (unsigned long long)i, .level = 1, .min_key = KEY_LONG(i), .max_key = KEY_LONG(i),
+                        .largest_seq = (uint64_t)N_KEYS + 1 + (uint64_t)i };
+    unsigned long long gone = 999 + (unsigned long long)i;
+    VersionEdit e = { .removed = &gone, .n_removed = 1, .added = &t, .n_added = 1,
+                      .next_segment_id = 1001 + (unsigned long long)i, .last_seq = t.largest_seq };
+    assert(manifest_apply(&m, &e) == 0);
+  }
+  assert(m.size <= m.snapshot_size + m.roll_bytes);
+  assert(file_size(MANIFEST_FILE) == m.size);
+  manifest_close(&m);
+
+  assert(manifest_open(&m, KEY_BYTEWISE_NAME, &found) == 0 && found);
+  assert(m.n_tables == 3 && m.next_segment_id == 1200 && m.last_seq == N_KEYS + 200);
+  bool last = false;
+  for (int i = 0; i < m.n_tables; i++)
+    if (m.tables[i].id == 1199) last = m.tables[i].level == 1 && key_to_long(m.tables[i].max_key) == 199;
+  assert(last);
+  manifest_close(&m);
+}
+
+#define BYTE_USERS 150
+
+static int compare_reversed(Key a, Key b) {
+  return key_compare_bytes(b, a);
+}
+
+static const Comparator reversed = { "test.reversed", compare_reversed };
+
+static Key user_key(char *buf, int user, int field) {
+  int n = snprintf(buf, 64, "user/%06d/%s", user, field ? "name" : "email");
+  return (Key){ buf, (uint32_t)n };
+}
+
+static void put_users(LSM *l) {
+  char k[64], v[64];
+  for (int u = 0; u < BYTE_USERS; u++) {
+    for (int f = 0; f < 2; f++) {
+      int len = snprintf(v, sizeof(v), "%d-%d", u, f) + 1;
+      assert(lsm_put(l, user_key(k, u, f), v, len));
+    }
+    if (u % (BYTE_USERS / 3) == 0) flush(l);
+  }
+}
+
+static void check_users(LSM *l, Key longest) {
+  char k[64], v[64];
+  char *got;
+  int len;
+  for (int u = 0; u < BYTE_USERS; u++) {
+    for (int f = 0; f < 2; f++) {
+      snprintf(v, sizeof(v), "%d-%d", u, f);
+      assert(lsm_get(l, user_key(k, u, f), &got, &len) == 1 && strcmp(got, v) == 0);
+      free(got);
+    }
+  }
+  // Prefixes and extensions of stored keys are keys of their own.
+  assert(lsm_get(l, (Key){ "user/000001/", 12 }, &got, &len) == 0);
+  assert(lsm_get(l, (Key){ "user/000001/names", 17 }, &got, &len) == 0);
+  assert(lsm_get(l, (Key){ "", 0 }, &got, &len) == 1 && strcmp(got, "empty") == 0);
+  free(got);
+  assert(lsm_get(l, longest, &got, &len) == 1 && strcmp(got, "longest") == 0);
+  free(got);
+
+  Key keys[4] = { longest, user_key(k, 7, 1), { "user/", 5 }, { "", 0 } };
+  char *values[4];
+  int lengths[4], results[4];
+  assert(lsm_multi_get(l, 4, keys, values, lengths, results) == 0);
+  assert(results[0] == 1 && results[1] == 1 && results[2] == 0 && results[3] == 1);
+  assert(strcmp(values[1], "7-1") == 0 && strcmp(values[3], "empty") == 0);
+  free(values[0]);
+  free(values[1]);
+  free(values[3]);
+}
+
+// Every key once, in the order the engine was opened with.
+static void check_user_order(LSM *l, bool reverse) {
+  LSMIter it;
+  assert(lsm_iter_init(l, &it) == 0);
+  char prev[KEY_MAX_SIZE];
+  uint32_t prev_len = 0;
+  int n = 0;
+  for (lsm_iter_seek_to_first(&it); lsm_iter_valid(&it); lsm_iter_next(&it), n++) {
+    Key k = lsm_iter_key(&it);
+    if (n > 0) {
+      int c = key_compare_bytes((Key){ prev, prev_len }, k);
+      assert(reverse ? c > 0 : c < 0);
+    }
+    memcpy(prev, k.data, k.len);
+    prev_len = k.len;
+  }
+  assert(n == 2 * BYTE_USERS + 2 && !it.err);
+
+  // A prefix seeks to the first key at or past it in that order.
+  lsm_iter_seek(&it, (Key){ "user/000100/", 12 });
+  assert(lsm_iter_valid(&it));
+  const char *want = reverse ? "user/000099/name" : "user/000100/email";
+  assert(key_equal(lsm_iter_key(&it), (Key){ want, (uint32_t)strlen(want) }));
+  lsm_iter_close(&it);
+}
+
+// Keys of any length up to KEY_MAX_SIZE, most of them sharing long
+// prefixes, through the log, segments, compactions and a reopen, in the
+// bytewise order and in one of the caller's.
+static void test_byte_keys(RBNode *nodes, Value *values) {
+  char *big = malloc(KEY_MAX_SIZE + 1);
+  assert(big);
+  memset(big, 'z', KEY_MAX_SIZE + 1);
+  Key longest = { big, KEY_MAX_SIZE };
+
+  for (int pass = 0; pass < 2; pass++) {
+    clean_segments();
+    memset(nodes, 0, sizeof(RBNode) * POOL);
+    memset(values, 0, sizeof(Value) * POOL);
+
+    LSMOptions opts;
+    lsm_options_default(&opts);
+    opts.comparator = pass ? &reversed : NULL;
+    opts.l0_compaction_trigger = 2;
+    LSM l;
+    assert(lsm_init(&l, &opts, nodes, values, POOL, true) == 0);
+    assert(lsm_put(&l, (Key){ "", 0 }, "empty", 6) && lsm_put(&l, longest, "longest", 8));
+    assert(!lsm_put(&l, (Key){ big, KEY_MAX_SIZE + 1 }, "x", 2));
+    put_users(&l);
+    check_users(&l, longest);
+    check_user_order(&l, pass);
+    lsm_close(&l);
+
+    memset(nodes, 0, sizeof(RBNode) * POOL);
+    memset(values, 0, sizeof(Value) * POOL);
+    assert(lsm_init(&l, &opts, nodes, values, POOL, true) == 0);
+    check_users(&l, longest);
+    flush(&l);
+    lsm_wait_compactions(&l);
+    check_users(&l, longest);
+    check_user_order(&l, pass);
+    lsm_close(&l);
+
+    // The store only opens in the order it was written in.
+    opts.comparator = pass ? NULL : &reversed;
+    assert(lsm_init(&l, &opts, nodes, values, POOL, true) != 0);
+  }
+  free(big);
+}
+
+#define VLOG_KEYS 40
+#define VLOG_VALUE 4096
+
+static void vlog_value(char *buf, long key, int round) {
+  memset(buf, 'a' + (int)(key + round) % 26, VLOG_VALUE);
+  snprintf(buf, VLOG_VALUE, "%ld:%d", key, round);
+}
+
+static bool vlog_exists(unsigned long long id) {
+  char path[256];
+  snprintf(path, sizeof(path), VLOG_FILE_FMT, id);
+  return access(path, F_OK) == 0;
+}
+
+static void put_vlog_round(LSM *l, long from, long to, int round, int *rounds) {
+  char buf[VLOG_VALUE];
+  for (long key = from; key < to; key++) {
+    vlog_value(buf, key, round);
+    assert(lsm_put(l, KEY_LONG(key), buf, VLOG_VALUE));
+    rounds[key] = round;
+  }
+}
+
+static void check_vlog_values(LSM *l, const int *rounds) {
+  char want[VLOG_VALUE];
+  for (long key = 0; key < VLOG_KEYS; key++) {
+    char *v;
+    int len;
+    vlog_value(want, key, rounds[key]);
+    assert(lsm_get(l, KEY_LONG(key), &v, &len) == 1 && len == VLOG_VALUE && memcmp(v, want, VLOG_VALUE) == 0);
+    free(v);
+  }
+  LSMIter it;
+  assert(lsm_iter_init(l, &it) == 0);
+  long key = 0;
+  for (lsm_iter_seek_to_first(&it); lsm_iter_valid(&it); lsm_iter_next(&it), key++) {
+    int len;
+    const char *v = lsm_iter_value(&it, &len);
+    assert(key_to_long(lsm_iter_key(&it)) == key);
+    if (key == VLOG_KEYS) {
+      assert(len == 7 && strcmp(v, "inline") == 0);
+      continue;
+    }
+    vlog_value(want, key, rounds[key]);
+    assert(len == VLOG_VALUE && memcmp(v, want, VLOG_VALUE) == 0);
+  }
+  assert(key == VLOG_KEYS + 1 && !it.err);
+  lsm_iter_close(&it);
+}
+
+// Large values leave the segments for the value log. A file goes once no
+// segment points into it, and one that is mostly garbage has what is still
+// live moved out by a compaction first.
+static void test_value_log(RBNode *nodes, Value *values) {
+  clean_segments();
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+
+  LSMOptions opts;
+  lsm_options_default(&opts);
+  opts.l0_compaction_trigger = 2;
+  opts.vlog_threshold = 1024;
+  LSM l;
+  assert(lsm_init(&l, &opts, nodes, values, POOL, true) == 0);
+  int rounds[VLOG_KEYS];
+  put_vlog_round(&l, 0, VLOG_KEYS, 0, rounds);
+  // Small values stay inline.
+  assert(lsm_put(&l, KEY_LONG(VLOG_KEYS), "inline", 7));
+  unsigned long long first = l.next_segment_id;
+  flush(&l);
+  assert(vlog_exists(first));
+
+  LSMStats st;
+  lsm_stats_snapshot(&l, &st);
+  uint64_t record = VLOG_RECORD_HEADER + VLOG_VALUE;
+  assert(st.counters[STAT_VLOG_BYTES_WRITTEN] == VLOG_KEYS * record);
+  assert(st.vlog_files == 1 && st.vlog_bytes == VLOG_KEYS * record);
+  assert(st.segment_bytes < VLOG_KEYS * VLOG_VALUE / 8);
+  SSTable *sst = version_table(live(&l), 0);
+  assert(sst->props.n_vlogs == 1 && sst->props.vlogs[0].file == first &&
+         sst->props.vlogs[0].bytes == VLOG_KEYS * record);
+  check_vlog_values(&l, rounds);
+
+  // Overwritten in full: the merge keeps no ref into the first file.
+  put_vlog_round(&l, 0, VLOG_KEYS, 1, rounds);
+  unsigned long long second = l.next_segment_id;
+  flush(&l);
+  lsm_wait_compactions(&l);
+  assert(live(&l)->n_segs == 1 && !vlog_exists(first) && vlog_exists(second));
+  check_vlog_values(&l, rounds);
+
+  // Three quarters overwritten: after the merge the second file is mostly
+  // garbage, and a rewrite moves the rest of it on.
+  put_vlog_round(&l, 0, 3 * VLOG_KEYS / 4, 2, rounds);
+  flush(&l);
+  assert(lsm_put(&l, KEY_LONG(VLOG_KEYS), "inline", 7));
+  flush(&l);
+  lsm_wait_compactions(&l);
+  lsm_stats_snapshot(&l, &st);
+  assert(!vlog_exists(second) && st.vlog_files == 2);
+  assert(st.counters[STAT_VLOG_GC_BYTES] == VLOG_KEYS / 4 * record);
+  assert(st.vlog_bytes == VLOG_KEYS * record);
+  check_vlog_values(&l, rounds);
+  lsm_close(&l);
+
+  // Reopened, the files come back; one no segment points into does not.
+  FILE *f = fopen("segments/vlog_999999.log", "wb");
+  assert(f);
+  fclose(f);
+  memset(nodes, 0, sizeof(RBNode) * POOL);
+  memset(values, 0, sizeof(Value) * POOL);
+  assert(lsm_init(&l, &opts, nodes, values, POOL, true) == 0);
+  assert(!vlog_exists(999999));
+  lsm_stats_snapshot(&l, &st);
+  assert(st.vlog_files == 2);
+  check_vlog_values(&l, rounds);
+
+  // Deleted values are garbage too, the file goes with them.
+  for (long key = 0; key < VLOG_KEYS; key++) assert(lsm_delete(&l, KEY_LONG(key)));
+  flush(&l);
+  assert(lsm_put(&l, KEY_LONG(VLOG_KEYS), "inline", 7));
+  flush(&l);
+  lsm_wait_compactions(&l);
+  lsm_stats_snapshot(&l, &st);
+  assert(st.vlog_files == 0 && st.vlog_bytes == 0);
+  lsm_close(&l);
+}
+
+#define SEEK_KEYS 20000
+
+// Even keys only, across many frames, so every seek lands between entries too.
+static void test_cursor_seek(void) {
+  clean_segments();
+
+  SSTable sst;
+  sstable_init(&sst, 0);
+  uint8_t *buf = malloc(BLOCK_SIZE);
+  char seg[256];
+  snprintf(seg, sizeof(seg), SEGMENT_FILE_FMT, 0LL);
+
+  Bloom bloom;
+  uint8_t *bits = bloom_alloc(SEEK_KEYS);
+  bloom_init_blocked(&bloom, bits, SEEK_KEYS);
+
+  SSTableWriter w;
+  assert(sstable_writer_open(&w, &sst, &bloom, buf, BLOCK_SIZE, seg, CODEC_ZLIB, 0) == 0);
+  char v[32];
+  for (long k = 0; k < SEEK_KEYS; k += 2) {
+    int n = snprintf(v, sizeof(v), "val-%ld", k) + 1;
+    assert(sstable_writer_add(&w, KEY_LONG(k), v, k % 10 == 0 ? -1 : n) == 0);
+  }
+  assert(sstable_writer_finish(&w) == 0);
+  assert(sst.length > 1);
+
+  SSTableCursor c;
+  sstable_cursor_init(&c, &sst);
+  for (long k = -5; k < SEEK_KEYS + 5; k += 7) {
+    long want = k < 0 ? 0 : (k + 1) / 2 * 2;
+    bool valid = sstable_cursor_seek(&c, KEY_LONG(k));
+    assert(valid == (want < SEEK_KEYS));
+    if (!valid) continue;
+    assert(key_to_long(c.key) == want);
+    if (want % 10 == 0) {
+      assert(c.length == -1);
+    } else {
+      snprintf(v, sizeof(v), "val-%ld", want);
+      assert(strcmp(c.value, v) == 0);
+    }
+    // Carries on into the following entries, across frame boundaries.
+    for (int i = 1; i <= 3 && want + 2 * i < SEEK_KEYS; i++) {
+      assert(sstable_cursor_next(&c) && key_to_long(c.key) == want + 2 * i);
+    }
+  }
+  assert(!c.err);
+  sstable_cursor_close(&c);
+
+  for (long k = 0; k < SEEK_KEYS; k += 3) {
+    char *got = NULL;
+    int len = 0;
+    SSTResult r = sstable_get(&sst, KEY_LONG(k), &got, &len);
+    if (k % 2) assert(r == SST_ABSENT);
+    else if (k % 10 == 0) assert(r == SST_DELETED);
+    else {
+      snprintf(v, sizeof(v), "val-%ld", k);
+      assert(r == SST_FOUND && strcmp(got, v) == 0);
+      free(got);
+    }
+  }
+  long data_end = sst.size;
+  sstable_close(&sst);
+
+  // Index, filter and properties all come back from the one file.
+  sstable_init(&sst, 0);
+  Bloom loaded;
+  assert(sstable_open(&sst, &loaded) == 0);
+  assert(sst.size == data_end && sst.length > 1);
+  assert(loaded.layout == BLOOM_BLOCKED && loaded.nbytes == SEEK_KEYS);
+  assert(memcmp(loaded.bitmasks, bits, SEEK_KEYS) == 0);
+  for (long k = 0; k < SEEK_KEYS; k += 2) assert(bloom_has(&loaded, KEY_LONG(k)));
+  assert(sst.props.entries == SEEK_KEYS / 2);
+  assert(sst.props.tombstones == (SEEK_KEYS + 9) / 10);
+  assert(key_to_long(sst.props.min_key) == 0 && key_to_long(sst.props.max_key) == SEEK_KEYS - 2);
+  assert(sst.props.frames == (uint64_t)sst.length);
+  char *got = NULL;
+  int len = 0;
+  // The rebuilt index separates the frames: every key is found in its own,
+  // on both sides of every boundary.
+  for (int i = 1; i < sst.length; i++)
+    assert(key_compare_bytes(sstable_key(&sst, i - 1), sstable_key(&sst, i)) < 0);
+  for (long k = 0; k < SEEK_KEYS; k += 2) {
+    assert(sstable_get(&sst, KEY_LONG(k), &got, &len) == (k % 10 == 0 ? SST_DELETED : SST_FOUND));
+    if (k % 10) free(got);
+  }
+  assert(sstable_get(&sst, KEY_LONG(SEEK_KEYS + 100), &got, &len) == SST_ABSENT);
+  sstable_close(&sst);
+  free(loaded.bitmasks);
+
+  // A flipped bit in the index fails the footer checksum.
+  int fd = open(seg, O_RDWR);
+  uint8_t byte;
+  assert(pread(fd, &byte, 1, data_end + 12) == 1);
+  byte ^= 1;
+  assert(pwrite(fd, &byte, 1, data_end + 12) == 1);
+  close(fd);
+  sstable_init(&sst, 0);
+  assert(sstable_open(&sst, &loaded) != 0);
+  sstable_close(&sst);
+
+  free(bits);
+  free(buf);
+}
+
+#define PIPE_KEYS 30000
+
+// Writes the same entries to segment id, inline or through the pipeline,
+// buffered or direct.
+static void write_pipe_segment(SSTable *sst, unsigned long long id, int threads, Codec codec, bool direct) {
+  char seg[256];
+  snprintf(seg, sizeof(seg), SEGMENT_FILE_FMT, id);
+  uint8_t *buf = malloc(BLOCK_SIZE);
+  char *big = malloc(3 * BLOCK_SIZE);
+  memset(big, 'b', 3 * BLOCK_SIZE);
+
+  sstable_init(sst, id);
+  SSTableWriter w;
+  assert(sstable_writer_open(&w, sst, NULL, buf, BLOCK_SIZE, seg, codec, 0) == 0);
+  if (direct) assert(sstable_writer_direct(&w, (uint64_t)PIPE_KEYS * 48) == 0);
+  if (threads > 0) assert(sstable_writer_parallel(&w, threads) == 0);
+  char v[48];
+  for (long k = 0; k < PIPE_KEYS; k++) {
+    // Entries larger than a frame go through in order with the rest.
+    if (k % 9000 == 4500) {
+      assert(sstable_writer_add(&w, KEY_LONG(k), big, 3 * BLOCK_SIZE) == 0);
+      continue;
+    }
+    int n = snprintf(v, sizeof(v), "pipelined-%ld-%ld", k, k * 7919 % 1000) + 1;
+    assert(sstable_writer_add(&w, KEY_LONG(k), v, k % 13 == 0 ? -1 : n) == 0);
+  }
+  assert(sstable_writer_finish(&w) == 0);
+  free(big);
+  free(buf);
+}
+
+static void test_parallel_writer(Codec codec) {
+  clean_segments();
+
+  SSTable inline_sst, piped;
+  write_pipe_segment(&inline_sst, 0, 0, codec, false);
+  write_pipe_segment(&piped, 1, 3, codec, false);
+  assert(piped.length == inline_sst.length && piped.length > 10);
+  assert(piped.size == inline_sst.size);
+  assert(piped.pool_len == inline_sst.pool_len && memcmp(piped.key_pool, inline_sst.key_pool, piped.pool_len) == 0);
+  assert(memcmp(piped.key_offs, inline_sst.key_offs, sizeof(uint32_t) * (size_t)(piped.length + 1)) == 0);
+  assert(memcmp(piped.offsets, inline_sst.offsets, sizeof(long) * (size_t)piped.length) == 0);
+  assert(piped.props.frames == inline_sst.props.frames);
+  char *got_big = NULL;
+  int len_big = 0;
+
+  // Byte for byte the same file, also when written around the page cache:
+  // the padding and the preallocation, too large here, are cut off again.
+  SSTable direct, direct_piped;
+  write_pipe_segment(&direct, 3, 0, codec, true);
+  write_pipe_segment(&direct_piped, 4, 2, codec, true);
+  long n = file_size("segments/segment_0.log");
+  char *a = malloc((size_t)n), *b = malloc((size_t)n);
+  FILE *fa = fopen("segments/segment_0.log", "rb");
+  assert(n > 0 && fread(a, 1, (size_t)n, fa) == (size_t)n);
+  fclose(fa);
+  for (int id = 1; id <= 4; id++) {
+    if (id == 2) continue;
+    char path[64];
+    snprintf(path, sizeof(path), SEGMENT_FILE_FMT, (long long)id);
+    assert(file_size(path) == n);
+    FILE *fb = fopen(path, "rb");
+    assert(fread(b, 1, (size_t)n, fb) == (size_t)n && memcmp(a, b, (size_t)n) == 0);
+    fclose(fb);
+  }
+  free(a);
+  free(b);
+  assert(sstable_get(&direct_piped, KEY_LONG(4500), &got_big, &len_big) == SST_FOUND && len_big == 3 * BLOCK_SIZE);
+  free(got_big);
+  sstable_close(&direct);
+  sstable_close(&direct_piped);
+
+  char *got = NULL;
+  int len = 0;
+  assert(sstable_get(&piped, KEY_LONG(4500), &got, &len) == SST_FOUND && len == 3 * BLOCK_SIZE);
+  free(got);
+  assert(sstable_get(&piped, KEY_LONG(26), &got, &len) == SST_DELETED);
+  assert(sstable_get(&piped, KEY_LONG(PIPE_KEYS - 1), &got, &len) == SST_FOUND);
+  free(got);
+  sstable_close(&inline_sst);
+  sstable_close(&piped);
+
+  // Abandoned part way, the threads still wind down.
+  SSTable sst;
+  sstable_init(&sst, 2);
+  uint8_t *buf = malloc(BLOCK_SIZE);
+  SSTableWriter w;
+  assert(sstable_writer_open(&w, &sst, NULL, buf, BLOCK_SIZE, "segments/segment_2.log", codec, 0) == 0);
+  assert(sstable_writer_parallel(&w, 2) == 0);
+  for (long k = 0; k < PIPE_KEYS; k++) assert(sstable_writer_add(&w, KEY_LONG(k), "abandoned", 10) == 0);
+  sstable_writer_abort(&w);
+  sstable_close(&sst);
+  assert(file_size("segments/segment_2.log") == -1);
+  free(buf);
+}
+
+typedef struct {
+  LSM *l;
+  int id;
+} WriterArg;
+
+static void *writer_main(void *arg) {
+  WriterArg *w = (WriterArg *)arg;
+  for (int i = 0; i < N_PER_WRITER; i++) {
+    long key = (long)w->id * N_PER_WRITER + i;
+    assert(lsm_put(w->l, KEY_LONG(key), "group", 6));
+  }
+  return NULL;
+}
+
+static void test_group_commit(LSMOptions *opts) {
+  clean_segments();
+
+  int size = N_WRITERS * N_PER_WRITER + 2;
+  size_t pool_bytes = mt_pool_bytes(opts->memtable, size);
+  void *nodes = calloc(1, pool_bytes);
+  Value *values = calloc((size_t)size, sizeof(Value));
+
+  LSM l;
+  assert(lsm_init(&l, opts, nodes, values, size, false) == 0);
+
+  pthread_t th[N_WRITERS];
+  WriterArg args[N_WRITERS];
+  for (int i = 0; i < N_WRITERS; i++) {
+    args[i] = (WriterArg){ .l = &l, .id = i };
+    pthread_create(&th[i], NULL, writer_main, &args[i]);
+  }
+  for (int i = 0; i < N_WRITERS; i++) pthread_join(th[i], NULL);
+  lsm_close(&l);
+
+  memset(nodes, 0, pool_bytes);
+  memset(values, 0, sizeof(Value) * (size_t)size);
+  assert(lsm_init(&l, opts, nodes, values, size, false) == 0);
+  assert(mt_count(l.mem) == N_WRITERS * N_PER_WRITER);
+  lsm_close(&l);
+
+  free(values);
+  free(nodes);
+}
+
+#define GET_KEYS 3000
+#define BIG_VALUE (100 * 1024)
+
+static char *make_value(long key, int round, int *len) {
+  int n = (key % 97 == 0) ? BIG_VALUE : 16 + (int)(key % 50);
+  char *v = malloc((size_t)n);
+  memset(v, 'a' + (key + round) % 26, (size_t)n);
+  snprintf(v, (size_t)n, "%ld:%d", key, round);
+  *len = n;
+  return v;
+}
+
+static void check_get(LSM *l, const int *rounds) {
+  for (long key = 0; key < GET_KEYS + 10; key++) {
+    char *v = NULL;
+    int len = 0;
+    int rc = lsm_get(l, KEY_LONG(key), &v, &len);
+    if (key >= GET_KEYS || rounds[key] < 0) {
+      assert(rc == 0);
+      continue;
+    }
+    int want_len;
+    char *want = make_value(key, rounds[key], &want_len);
+    assert(rc == 1 && len == want_len && memcmp(v, want, (size_t)len) == 0);
+    free(want);
+    free(v);
+  }
+}
+
+// The same answers as check_get from one batch, in shuffled order with
+// duplicates and keys past the end mixed in.
+static void check_multi_get(LSM *l, const int *rounds) {
+  int n = GET_KEYS + 110;
+  long *ids = malloc(sizeof(long) * (size_t)n);
+  Key *keys = malloc(sizeof(Key) * (size_t)n);
+  char *key_buf = malloc(KEY_LONG_SIZE * (size_t)n);
+  char **values = calloc((size_t)n, sizeof(char *));
+  int *lengths = malloc(sizeof(int) * (size_t)n);
+  int *results = malloc(sizeof(int) * (size_t)n);
+  assert(ids && keys && key_buf && values && lengths && results);
+  for (int i = 0; i < n; i++) ids[i] = i < GET_KEYS + 10 ? i : (i * 37) % GET_KEYS;
+  uint32_t s = 12345;
+  for (int i = n - 1; i > 0; i--) {
+    s = s * 1103515245u + 12345u;
+    int j = (int)(s % (uint32_t)(i + 1));
+    long tmp = ids[i];
+    ids[i] = ids[j];
+    ids[j] = tmp;
+  }
+  to_keys(keys, key_buf, ids, n);
+
+  assert(lsm_multi_get(l, n, keys, values, lengths, results) == 0);
+  for (int i = 0; i < n; i++) {
+    long key = ids[i];
+    if (key >= GET_KEYS || rounds[key] < 0) {
+      assert(results[i] == 0);
+      continue;
+    }
+    int want_len;
+    char *want = make_value(key, rounds[key], &want_len);
+    assert(results[i] == 1 && lengths[i] == want_len && memcmp(values[i], want, (size_t)want_len) == 0);
+    free(want);
+    free(values[i]);
+  }
+  free(ids);
+  free(keys);
+  free(key_buf);
+  free(values);
+  free(lengths);
+  free(results);
+}
+
+// The iterator must yield exactly the live keys, in order, newest values.
+static void check_iter(LSMIter *it, const int *rounds) {
+  long key = 0;
+  for (lsm_iter_seek_to_first(it); lsm_iter_valid(it); lsm_iter_next(it), key++) {
+    while (key < GET_KEYS && rounds[key] < 0) key++;
+    assert(key < GET_KEYS && key_to_long(lsm_iter_key(it)) == key);
+
+    int len, want_len;
+    const char *v = lsm_iter_value(it, &len);
+    char *want = make_value(key, rounds[key], &want_len);
+    assert(len == want_len && memcmp(v, want, (size_t)len) == 0);
+    free(want);
+  }
+  while (key < GET_KEYS && rounds[key] < 0) key++;
+  assert(key == GET_KEYS && !it->err);
+
+  // Seeks land on the next live key.
+  for (long k = 1; k < GET_KEYS; k += 333) {
+    long want = k;
+    while (want < GET_KEYS && rounds[want] < 0) want++;
+    lsm_iter_seek(it, KEY_LONG(k));
+    assert(lsm_iter_valid(it) == (want < GET_KEYS));
+    if (want < GET_KEYS) assert(key_to_long(lsm_iter_key(it)) == want);
+  }
+  lsm_iter_seek(it, KEY_LONG(GET_KEYS));
+  assert(!lsm_iter_valid(it));
+}
+
+typedef struct {
+  const int *rounds;
+  int called;
+} AsyncCheck;
+
+static void check_async_value(void *arg, Key k, int result, char *value, int length) {
+  AsyncCheck *c = (AsyncCheck *)arg;
+  long key = key_to_long(k);
+  c->called++;
+  if (key >= GET_KEYS || c->rounds[key] < 0) {
+    assert(result == 0);
+    return;
+  }
+  int want_len;
+  char *want = make_value(key, c->rounds[key], &want_len);
+  assert(result == 1 && length == want_len && memcmp(value, want, (size_t)length) == 0);
+  free(want);
+  free(value);
+}
+
+// The same answers again through a ring: single lookups with many reads
+// in flight, a batch, and an iterator reading ahead on it.
+static void check_async(LSM *l, const int *rounds) {
+  LSMAsync a;
+  assert(lsm_async_init(l, &a, 16) == 0);
+  AsyncCheck c = { rounds, 0 };
+  for (long i = 0; i < GET_KEYS + 10; i++) {
+    long key = (i * 7919) % (GET_KEYS + 10);
+    assert(lsm_get_async(&a, KEY_LONG(key), check_async_value, &c) == 0);
+    assert(a.pending <= 16);
+  }
+  while (a.pending > 0) assert(lsm_async_poll(&a, 1) > 0);
+  assert(c.called == GET_KEYS + 10 && lsm_async_poll(&a, 1) == 0);
+
+  int n = GET_KEYS;
+  long *ids = malloc(sizeof(long) * (size_t)n);
+  Key *keys = malloc(sizeof(Key) * (size_t)n);
+  char *key_buf = malloc(KEY_LONG_SIZE * (size_t)n);
+  char **values = calloc((size_t)n, sizeof(char *));
+  int *lengths = malloc(sizeof(int) * (size_t)n);
+  int *results = malloc(sizeof(int) * (size_t)n);
+  for (int i = 0; i < n; i++) ids[i] = n - 1 - i;
+  to_keys(keys, key_buf, ids, n);
+  assert(lsm_async_multi_get(&a, n, keys, values, lengths, results) == 0);
+  for (int i = 0; i < n; i++) {
+    check_async_value(&c, keys[i], results[i], values[i], lengths[i]);
+  }
+  free(ids);
+  free(keys);
+  free(key_buf);
+  free(values);
+  free(lengths);
+  free(results);
+
+  LSMIter it;
+  assert(lsm_iter_init(l, &it) == 0);
+  lsm_async_iter(&a, &it);
+  check_iter(&it, rounds);
+  lsm_iter_close(&it);
+  lsm_async_close(&a);
+}
+
+static void test_get(LSMOptions *opts) {
+  clean_segments();
+
+  size_t pool_bytes = mt_pool_bytes(opts->memtable, POOL);
+  void *nodes = calloc(1, pool_bytes);
+  Value *values = calloc(POOL, sizeof(Value));
+  int rounds[GET_KEYS];
+
+  LSM l;
+  assert(lsm_init(&l, opts, nodes, values, POOL, true) == 0);
+  // Three passes over the key space spread versions over many segments;
+  // every seventh key ends deleted, every fifth is rewritten in the last pass.
+  for (int round = 0; round < 3; round++) {
+    for (long key = 0; key < GET_KEYS; key++) {
+      if (round == 2 && key % 5 != 0) continue;
+      int len;
+      char *v = make_value(key, round, &len);
+      assert(lsm_put(&l, KEY_LONG(key), v, len));
+      free(v);
+      rounds[key] = round;
+    }
+  }
+  for (long key = 0; key < GET_KEYS; key += 7) {
+    assert(lsm_delete(&l, KEY_LONG(key)));
+    rounds[key] = -1;
+  }
+  int flushed = (int)l.next_segment_id;
+  check_get(&l, rounds);
+  check_multi_get(&l, rounds);
+  lsm_wait_compactions(&l);
+  check_get(&l, rounds);
+  check_multi_get(&l, rounds);
+  if (opts->compaction == COMPACTION_NONE) assert(flushed > 3);
+  else assert(live(&l)->n_segs < flushed);
+
+  // An open iterator keeps its snapshot through writes, flushes and
+  // compactions; a new one sees them. The second flush needs another
+  // memtable while the iterator still pins the first.
+  int seen[GET_KEYS];
+  memcpy(seen, rounds, sizeof(seen));
+  LSMIter it;
+  assert(lsm_iter_init(&l, &it) == 0);
+  for (int round = 3; round < 5; round++) {
+    for (long key = 0; key < GET_KEYS; key += 11) {
+      int len;
+      char *v = make_value(key, round, &len);
+      assert(lsm_put(&l, KEY_LONG(key), v, len));
+      free(v);
+      rounds[key] = round;
+    }
+    flush(&l);
+  }
+  lsm_wait_compactions(&l);
+  check_iter(&it, seen);
+  lsm_iter_close(&it);
+  assert(lsm_iter_init(&l, &it) == 0);
+  check_iter(&it, rounds);
+  lsm_iter_close(&it);
+  int n_tables = live(&l)->n_segs;
+  unsigned long long ids[64];
+  int levels[64];
+  assert(n_tables <= 64);
+  for (int i = 0; i < n_tables; i++) {
+    ids[i] = version_table(live(&l), i)->id;
+    levels[i] = version_table(live(&l), i)->level;
+  }
+  uint64_t last_seq = l.last_seq;
+  lsm_close(&l);
+
+  // Reopen: the manifest brings back the same segments in the same order
+  // at the same levels, the tail comes from the log.
+  memset(nodes, 0, pool_bytes);
+  memset(values, 0, sizeof(Value) * POOL);
+  assert(lsm_init(&l, opts, nodes, values, POOL, true) == 0);
+  assert(live(&l)->n_segs == n_tables && l.last_seq == last_seq);
+  for (int i = 0; i < n_tables; i++)
+    assert(version_table(live(&l), i)->id == ids[i] && version_table(live(&l), i)->level == levels[i]);
+  check_get(&l, rounds);
+  check_multi_get(&l, rounds);
+  check_async(&l, rounds);
+  // Hot frames come from the block cache the second time around, unless
+  // they are raw and read straight from the mapping.
+  CacheStats before, after;
+  lsm_cache_stats(&l, &before);
+  check_get(&l, rounds);
+  lsm_cache_stats(&l, &after);
+  if (opts->codec == CODEC_NONE && opts->mmap_reads) assert(after.hits == before.hits);
+  else assert(opts->block_cache_bytes == 0 || after.hits > before.hits);
+  for (int i = 0; i < live(&l)->n_segs; i++) assert((version_table(live(&l), i)->map != NULL) == opts->mmap_reads);
+  // A ring that outlives a compaction lets go of the segments it dropped
+  // at the next poll, rather than keeping their files open.
+  LSMAsync a;
+  assert(lsm_async_init(&l, &a, 16) == 0);
+  AsyncCheck c = { rounds, 0 };
+  for (long key = 0; key < GET_KEYS; key += 3)
+    assert(lsm_get_async(&a, KEY_LONG(key), check_async_value, &c) == 0);
+  while (a.pending > 0) assert(lsm_async_poll(&a, 1) > 0);
+  for (long key = 0; key < GET_KEYS; key += 2) {
+    int len;
+    char *v = make_value(key, 5, &len);
+    assert(lsm_put(&l, KEY_LONG(key), v, len));
+    free(v);
+    rounds[key] = 5;
+  }
+  flush(&l);
+  lsm_wait_compactions(&l);
+  assert(lsm_async_poll(&a, 1) == 0);
+  for (int fd = 0; a.has_ring && fd < RING_FILES; fd++) {
+    if (a.ring.file_ids[fd] == 0) continue;
+    bool found = false;
+    for (int i = 0; i < live(&l)->n_segs; i++)
+      found |= version_table(live(&l), i)->fd == fd && version_table(live(&l), i)->id + 1 == a.ring.file_ids[fd];
+    assert(found);
+  }
+  lsm_async_close(&a);
+  check_get(&l, rounds);
+  lsm_close(&l);
+
+  free(values);
+  free(nodes);
+}
+
+#define READERS 3
+#define READ_KEYS 1500
+#define READ_ROUNDS 4
+
+typedef struct {
+  LSM *l;
+  atomic_int *rounds_done;
+  atomic_bool *stop;
+  int id;
+} ReaderArg;
+
+// A found value must be one the writer put for that key, and no older than
+// the last pass the writer had finished before the lookup started.
+static void check_read(long key, int rc, const char *v, int len, int done) {
+  if (done == 0 && rc == 0) return;
+  assert(rc == 1);
+  long k;
+  int round;
+  assert(sscanf(v, "%ld:%d", &k, &round) == 2 && k == key && round >= done - 1);
+  int want_len;
+  char *want = make_value(key, round, &want_len);
+  assert(len == want_len && memcmp(v, want, (size_t)len) == 0);
+  free(want);
+}
+
+static void *reader_main(void *arg) {
+  ReaderArg *r = (ReaderArg *)arg;
+  uint32_t s = 777u * (uint32_t)(r->id + 1);
+  long ids[16];
+  Key keys[16];
+  char key_buf[16 * KEY_LONG_SIZE];
+  char *values[16];
+  int lengths[16], results[16];
+  while (!atomic_load(r->stop)) {
+    int done = atomic_load(r->rounds_done);
+    s = s * 1103515245u + 12345u;
+    long key = (long)(s % READ_KEYS);
+    if (s & 1) {
+      char *v = NULL;
+      int len = 0;
+      int rc = lsm_get(r->l, KEY_LONG(key), &v, &len);
+      check_read(key, rc, v, len, done);
+      free(v);
+      continue;
+    }
+    for (int i = 0; i < 16; i++) ids[i] = (key + i * 53) % READ_KEYS;
+    to_keys(keys, key_buf, ids, 16);
+    assert(lsm_multi_get(r->l, 16, keys, values, lengths, results) == 0);
+    for (int i = 0; i < 16; i++) {
+      check_read(ids[i], results[i], results[i] == 1 ? values[i] : NULL, lengths[i], done);
+      if (results[i] == 1) free(values[i]);
+    }
+  }
+  return NULL;
+}
+
+// Lookups run alongside writes, flushes and compactions, which swap the
+// memtables and publish new segment versions under them.
+static void test_concurrent_reads(LSMOptions *opts) {
+  clean_segments();
+
+  void *nodes = calloc(1, mt_pool_bytes(opts->memtable, POOL));
+  Value *values = calloc(POOL, sizeof(Value));
+  LSM l;
+  assert(lsm_init(&l, opts, nodes, values, POOL, true) == 0);
+
+  atomic_int rounds_done = 0;
+  atomic_bool stop = false;
+  pthread_t th[READERS];
+  ReaderArg args[READERS];
+  for (int i = 0; i < READERS; i++) {
+    args[i] = (ReaderArg){ .l = &l, .rounds_done = &rounds_done, .stop = &stop, .id = i };
+    pthread_create(&th[i], NULL, reader_main, &args[i]);
+  }
+  for (int round = 0; round < READ_ROUNDS; round++) {
+    for (long key = 0; key < READ_KEYS; key++) {
+      int len;
+      char *v = make_value(key, round, &len);
+      assert(lsm_put(&l, KEY_LONG(key), v, len));
+      free(v);
+    }
+    atomic_store(&rounds_done, round + 1);
+  }
+  lsm_wait_compactions(&l);
+  atomic_store(&stop, true);
+  for (int i = 0; i < READERS; i++) pthread_join(th[i], NULL);
+  lsm_close(&l);
+
+  free(values);
+  free(nodes);
+}
+
+int lsm_test(void) {
+  RBNode *nodes = calloc(POOL, sizeof(RBNode));
+  Value *values = calloc(POOL, sizeof(Value));
+  assert(nodes && values);
+
+  test_wal_recovery(nodes, values);
+  test_flush_truncates(nodes, values);
+  test_flush_failure(nodes, values);
+  test_recover_imm_log(nodes, values);
+  test_manifest(nodes, values);
+  test_stats(nodes, values);
+  test_byte_keys(nodes, values);
+  test_value_log(nodes, values);
+  test_cursor_seek();
+  test_parallel_writer(CODEC_ZLIB);
+  test_parallel_writer(CODEC_NONE);
+
+  LSMOptions opts;
+  lsm_options_default(&opts);
+  opts.compaction = COMPACTION_NONE;
+  test_get(&opts);
+  // Small budgets so the deeper levels get exercised too.
+  opts.compaction = COMPACTION_LEVELED;
+  opts.l0_compaction_trigger = 2;
+  opts.level_base_bytes = 64 << 10;
+  opts.level_ratio = 2;
+  test_get(&opts);
+  // Flushes and compactions write around the page cache.
+  opts.direct_writes = true;
+  test_get(&opts);
+  opts.direct_writes = false;
+  // Raw frames outgrow the budgets, so levels also move down unmerged.
+  opts.codec = CODEC_NONE;
+  test_get(&opts);
+  opts.codec = CODEC_ZLIB;
+  opts.compaction = COMPACTION_SIZE_TIERED;
+  opts.tier_min_width = 2;
+  test_get(&opts);
+  // Raw frames are read in place from the mapping.
+  opts.codec = CODEC_NONE;
+  test_get(&opts);
+  opts.codec = CODEC_ZLIB;
+  // Plain pread, every lookup inflates its frame again; flushes compress
+  // on the flush thread itself.
+  opts.mmap_reads = false;
+  opts.block_cache_bytes = 0;
+  opts.flush_threads = 0;
+  test_get(&opts);
+  // Values of key % 97 == 0 go to the value log, through every read path,
+  // compaction and reopen.
+  lsm_options_default(&opts);
+  opts.compaction = COMPACTION_LEVELED;
+  opts.l0_compaction_trigger = 2;
+  opts.level_base_bytes = 64 << 10;
+  opts.level_ratio = 2;
+  opts.vlog_threshold = 4096;
+  test_get(&opts);
+  opts.compaction = COMPACTION_SIZE_TIERED;
+  opts.mmap_reads = false;
+  opts.block_cache_bytes = 0;
+  test_get(&opts);
+
+  lsm_options_default(&opts);
+  test_group_commit(&opts);
+  opts.wal_sync = WAL_SYNC_INTERVAL;
+  test_group_commit(&opts);
+  opts.wal_sync = WAL_SYNC_NEVER;
+  test_group_commit(&opts);
+  // Writers insert into the skiplist side by side.
+  opts.memtable = MEMTABLE_SKIPLIST;
+  test_group_commit(&opts);
+
+  lsm_options_default(&opts);
+  opts.compaction = COMPACTION_LEVELED;
+  opts.l0_compaction_trigger = 2;
+  opts.level_base_bytes = 64 << 10;
+  opts.level_ratio = 2;
+  test_concurrent_reads(&opts);
+  opts.memtable = MEMTABLE_SKIPLIST;
+  test_concurrent_reads(&opts);
+  test_get(&opts);
+  opts.memtable = MEMTABLE_BTREE;
+  test_concurrent_reads(&opts);
+  test_get(&opts);
+
+  clean_segments();
+  free(values);
+  free(nodes);
+  puts("lsm: wal recovery, flush truncation, group commit, get, multi-get, concurrent reads, async reads, seek, parallel flush, direct writes, manifest, stats, table metadata, byte keys and comparators, value log, iterators, block cache and compaction ok");
+  return 0;
+}
@@ -10,6 +10,16 @@
 #include "../lib/rbtree.h"
 #include "../lib/memtable.h"
 
+int bloom_test(void);
+int cache_test(void);
+int skiplist_test(void);
+int btree_test(void);
+int arena_test(void);
+int lsm_test(void);
+
+// Values the skiplist and B+tree tests store by pointer and check by it.
+const char *payloads[4] = { "a", "bb", "ccc", "dddd" };
+
 #ifndef N_INSERTS
 #define N_INSERTS 1000000
 #endif
@@ -45,29 +55,29 @@ static void make_payload(char *buf, size_t cap, int key, uint32_t r) {
   snprintf(buf, cap, "k=%d r=%08x", key, r);
 }
 
-int main(void) {
-  const int N = (int)N_INSERTS;
+static const char *kind_name(MemtableKind kind) {
+  return kind == MEMTABLE_BTREE ? "btree" : "rbtree";
+}
 
-  RBNode *nodes = calloc((size_t)N + 1, sizeof(RBNode));
-  Value  *vals  = calloc((size_t)N + 1, sizeof(Value));
-  if (!nodes || !vals) {
+// Random inserts, then lookups of keys known to be there.
+static int bench_kind(MemtableKind kind, int N) {
+  void  *nodes = calloc(1, mt_pool_bytes(kind, N + 1));
+  Value *vals  = calloc((size_t)N + 1, sizeof(Value));
+  int *sample_keys = malloc((size_t)N_LOOKUPS * sizeof(int));
+  if (!nodes || !vals || !sample_keys) {
     fprintf(stderr, "OOM allocating pools for %d inserts\n", N);
-    free(nodes); free(vals);
+    free(nodes); free(vals); free(sample_keys);
     return 1;
   }
 
   Memtable m;
-  mt_init(&m, nodes, vals, (size_t)N + 1, false);
+  mt_init(&m, kind, nodes, vals, N + 1, false, NULL);
 
   uint32_t s = (uint32_t)SEED;
   char payload[PAYLOAD_MAX];
 
-  int *sample_keys = malloc((size_t)N_LOOKUPS * sizeof(int));
-  if (!sample_keys) {
-    fprintf(stderr, "OOM allocating sample_keys\n");
-    free(vals); free(nodes);
-    return 1;
-  }
+  int step = N >= (int)N_LOOKUPS ? N / (int)N_LOOKUPS : 1;
+  int samples = N >= (int)N_LOOKUPS ? (int)N_LOOKUPS : N;
 
   uint64_t t0 = now_ns();
 
@@ -75,19 +85,38 @@ int main(void) {
     int key = (int)(rng32(&s) & 0x7fffffff);
 
     make_payload(payload, sizeof(payload), key, rng32(&s));
-    mt_put(&m, key, payload, (int)strlen(payload) + 1);
+    mt_put(&m, (uint64_t)i + 1, KEY_LONG(key), payload, (int)strlen(payload) + 1);
 
-    if (i < (int)N_LOOKUPS) sample_keys[i] = key;
+    // Sampled across the whole run so lookups do not stay in cache.
+    if (i % step == 0 && i / step < (int)N_LOOKUPS) sample_keys[i / step] = key;
   }
 
   uint64_t t1 = now_ns();
   double secs_put = (t1 - t0) / 1e9;
 
-  printf("Inserted %d entries in %.3f s (%.0f ops/s)\n",
-         N, secs_put, N / secs_put);
+  int found = 0;
+  for (int round = 0; round < 50; round++)
+    for (int i = 0; i < samples; i++)
+      found += mt_get(&m, KEY_LONG(sample_keys[i])) != NULL;
+
+  uint64_t t2 = now_ns();
+  double secs_get = (t2 - t1) / 1e9;
+  assert(found == 50 * samples);
+
+  printf("%s: inserted %d entries in %.3f s (%.0f ops/s), %d lookups in %.3f s (%.0f ops/s)\n",
+         kind_name(kind), N, secs_put, N / secs_put, found, secs_get, found / secs_get);
 
   free(sample_keys);
+  mt_destroy(&m);
   free(vals);
   free(nodes);
   return 0;
 }
+
+int main(void) {
+  const int N = (int)N_INSERTS;
+
+  if (bench_kind(MEMTABLE_RBTREE, N) || bench_kind(MEMTABLE_BTREE, N))
+    return 1;
+  return bloom_test() || cache_test() || arena_test() || skiplist_test() || btree_test() || lsm_test();
+}
@@ -40,10 +40,10 @@ static inline long make_key(long i) {
 
 // Build fixed-size, NUL-terminated value strings so rb_tree_put gets stable pointers.
 // We avoid malloc-per-op and snprintf in timed sections.
-static void build_values(char *vals, char *vals_upd, long *keys,
+static void build_values(char *vals, char *vals_upd, Key *keys, char *key_buf,
                          size_t N, size_t stride) {
   for (size_t i = 0; i < N; ++i) {
-    keys[i] = make_key((long)i);
+    keys[i] = key_from_long(key_buf + i * KEY_LONG_SIZE, make_key((long)i));
 
     char *v  = vals     + i * stride;
     char *vu = vals_upd + i * stride;
@@ -73,12 +73,14 @@ int rbtree_test(void) {
   // stride: room for "val_<up to 7 digits>_updated\0" comfortably.
   const size_t STRIDE = 64;
 
-  long *keys = (long *)malloc(sizeof(long) * SIZE);
+  // The tree borrows its keys, they stay here for the whole run.
+  Key *keys = (Key *)malloc(sizeof(Key) * SIZE);
+  char *key_buf = (char *)malloc(KEY_LONG_SIZE * SIZE);
   char *vals = (char *)malloc(STRIDE * SIZE);
   char *vals_upd = (char *)malloc(STRIDE * SIZE);
-  assert(keys && vals && vals_upd);
+  assert(keys && key_buf && vals && vals_upd);
 
-  build_values(vals, vals_upd, keys, SIZE, STRIDE);
+  build_values(vals, vals_upd, keys, key_buf, SIZE, STRIDE);
 
   puts("RBTree performance benchmark (tree-only; allocation excluded)");
   puts("------------------------------------------------------------------");
@@ -156,6 +158,7 @@ int rbtree_test(void) {
 
   free(vals_upd);
   free(vals);
+  free(key_buf);
   free(keys);
 
   free(t);
@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/memtable.h"
+
+#define SL_THREADS 4
+#define SL_PER_THREAD 5000
+#define SL_KEYS 1000
+#define SL_POOL (SL_THREADS * SL_PER_THREAD + 2)
+
+extern const char *payloads[4];  // in memtable.c
+
+typedef struct {
+  Memtable *m;
+  atomic_ullong *seq;
+  int id;
+} SLWriter;
+
+// Every thread writes every key over and over, seq handed out like the
+// engine does: taken in order, applied in whatever order the threads run.
+static void *sl_writer_main(void *arg) {
+  SLWriter *w = (SLWriter *)arg;
+  for (int i = 0; i < SL_PER_THREAD; i++) {
+    long key = (i * 7 + w->id) % SL_KEYS;
+    uint64_t seq = atomic_fetch_add(w->seq, 1) + 1;
+    bool ok = (seq % 5 == 0) ? mt_delete(w->m, seq, KEY_LONG(key))
+                             : mt_put(w->m, seq, KEY_LONG(key), payloads[seq % 4], (int)(seq % 4) + 2);
+    assert(ok);
+  }
+  return NULL;
+}
+
+int skiplist_test(void) {
+  void *nodes = calloc(1, mt_pool_bytes(MEMTABLE_SKIPLIST, SL_POOL));
+  Value *values = calloc(SL_POOL, sizeof(Value));
+  assert(nodes && values);
+
+  Memtable *m = malloc(sizeof(Memtable));
+  assert(m);
+  mt_init(m, MEMTABLE_SKIPLIST, nodes, values, SL_POOL, false, NULL);
+
+  // Newest seq wins whatever the insert order; a delete shadows older puts.
+  Value *v;
+  assert(mt_put(m, 5, KEY_LONG(10), "new", 4) && mt_put(m, 3, KEY_LONG(10), "old", 4));
+  assert(mt_lookup(m, KEY_LONG(10), &v) == MT_FOUND && strcmp(v->value, "new") == 0);
+  assert(mt_delete(m, 7, KEY_LONG(10)) && mt_put(m, 6, KEY_LONG(10), "mid", 4));
+  assert(mt_lookup(m, KEY_LONG(10), &v) == MT_DELETED && mt_get(m, KEY_LONG(10)) == NULL);
+  assert(mt_lookup(m, KEY_LONG(9), &v) == MT_ABSENT && mt_lookup(m, KEY_LONG(11), &v) == MT_ABSENT);
+  assert(mt_put(m, 8, KEY_LONG(12), "x", 2) && mt_put(m, 9, KEY_LONG(8), "y", 2));
+
+  // The iterator yields each key once, newest version, in order.
+  MtIter it;
+  const char *value;
+  long want[] = { 8, 10, 12 };
+  int n = 0;
+  for (mt_iter_first(&it, m); mt_iter_valid(&it); mt_iter_next(&it), n++) {
+    assert(n < 3 && key_to_long(mt_iter_key(&it)) == want[n]);
+    int len = mt_iter_value(&it, &value);
+    assert(want[n] == 10 ? len == -1 : len == 2);
+  }
+  assert(n == 3 && mt_count(m) == 6);
+  mt_iter_seek(&it, m, KEY_LONG(11));
+  assert(mt_iter_valid(&it) && key_to_long(mt_iter_key(&it)) == 12);
+  mt_reset(m);
+  assert(mt_count(m) == 0 && mt_lookup(m, KEY_LONG(10), &v) == MT_ABSENT);
+
+  atomic_ullong seq = 0;
+  pthread_t th[SL_THREADS];
+  SLWriter args[SL_THREADS];
+  for (int i = 0; i < SL_THREADS; i++) {
+    args[i] = (SLWriter){ .m = m, .seq = &seq, .id = i };
+    pthread_create(&th[i], NULL, sl_writer_main, &args[i]);
+  }
+  for (int i = 0; i < SL_THREADS; i++) pthread_join(th[i], NULL);
+  assert(mt_count(m) == SL_THREADS * SL_PER_THREAD && mt_is_full(m));
+
+  // Each key reads back as its highest-seq write, found from the pool.
+  SLNode *sl_nodes = (SLNode *)nodes;
+  uint64_t newest[SL_KEYS] = { 0 };
+  for (int i = 1; i <= SL_THREADS * SL_PER_THREAD; i++) {
+    SLNode *x = &sl_nodes[i];
+    long key = key_to_long(x->key);
+    if (x->seq > newest[key]) newest[key] = x->seq;
+  }
+  long prev = LONG_MIN;
+  int keys = 0;
+  for (mt_iter_first(&it, m); mt_iter_valid(&it); mt_iter_next(&it), keys++) {
+    long key = key_to_long(mt_iter_key(&it));
+    assert(key > prev);
+    prev = key;
+    uint64_t s = newest[key];
+    int len = mt_iter_value(&it, &value);
+    if (s % 5 == 0) assert(len == -1);
+    else assert(len == (int)(s % 4) + 2 && value == payloads[s % 4]);
+  }
+  assert(keys == SL_KEYS);
+
+  mt_destroy(m);
+  free(m);
+  free(values);
+  free(nodes);
+  puts("skiplist: versions, iteration and concurrent writers ok");
+  return 0;
+}